@@ -0,0 +1,153 @@
+/**
+ * @file
+ *
+ * Common setup of the fuzz targets (see fuzz.h).
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/gcrp.h>
+#include <garena/ghl.h>
+#include <garena/private.h>
+#include "fuzz.h"
+
+static unsigned char fuzz_key[GSP_KEYSIZE];
+static unsigned char fuzz_iv[GSP_IVSIZE];
+
+/* behaves like an application that accepts everything */
+static int fuzz_event(ghl_serv_t *serv, int event, void *event_data, void *privdata) {
+  if (event == GHL_EV_CONN_RECV)
+    return ((ghl_conn_recv_t *) event_data)->length;
+  return 0;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  unsigned int i;
+
+  if (garena_init() == -1) {
+    garena_perror("garena_init");
+    exit(-1);
+  }
+  /* the library logs every message, which would slow down the fuzzing */
+  fclose(deb);
+  deb = fopen("/dev/null", "w");
+  for (i = 0; i < GSP_KEYSIZE; i++)
+    fuzz_key[i] = i;
+  for (i = 0; i < GSP_IVSIZE; i++)
+    fuzz_iv[i] = 0xF0 | i;
+  garena_replay_active = 1;
+  return 0;
+}
+
+/*
+ * Creates a server handle, at virtual time FUZZ_T0. If connected is set, the handle is
+ * in the state following a successful login, as member 0 of the fuzz room.
+ */
+ghl_serv_t *fuzz_serv(int connected) {
+  ghl_serv_t *serv;
+  struct in_addr internal_ip;
+  int i;
+
+  garena_set_virtual_clock(1, FUZZ_T0);
+  internal_ip.s_addr = inet_addr("192.168.0.2");
+  serv = ghl_replay_serv(inet_addr("127.0.0.1"), 0, 0, 0, internal_ip, FUZZ_PORT, fuzz_key, fuzz_iv);
+  if (serv == NULL) {
+    garena_perror("ghl_replay_serv");
+    abort();
+  }
+  for (i = 0; i < GHL_EV_NUM; i++)
+    ghl_register_handler(serv, i, fuzz_event, NULL);
+  if (connected) {
+    serv->auth_ok = 1;
+    serv->lookup_ok = 1;
+    serv->connected = 1;
+    ghl_free_timer(serv->servconn_timeout);
+    serv->servconn_timeout = NULL;
+    serv->my_info.user_id = FUZZ_USER_ID(0);
+    strcpy(serv->my_info.name, "fuzz0");
+  }
+  return serv;
+}
+
+/* address of the fuzz room member i */
+void fuzz_member_addr(unsigned int i, struct sockaddr_in *addr) {
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(0x7F000002 + i);
+  addr->sin_port = htons(FUZZ_PORT);
+}
+
+/*
+ * Enters the fuzz room. If joined is set, the member list is received too, so the
+ * room has FUZZ_MEMBERS members. Returns -1 if the server handle was freed.
+ */
+int fuzz_room(ghl_serv_t *serv, int joined) {
+  char buf[sizeof(gcrp_hdr_t) + sizeof(gcrp_memberlist_t) + FUZZ_MEMBERS * sizeof(gcrp_member_t)];
+  gcrp_hdr_t *hdr = (gcrp_hdr_t *) buf;
+  gcrp_memberlist_t *memberlist = (gcrp_memberlist_t *) (buf + sizeof(gcrp_hdr_t));
+  struct sockaddr_in addr;
+  unsigned int i;
+
+  if (ghl_replay_room(serv, FUZZ_ROOM_ID) == NULL) {
+    garena_perror("ghl_replay_room");
+    abort();
+  }
+  if (!joined)
+    return 0;
+  memset(buf, 0, sizeof(buf));
+  hdr->msglen = ghtonl(sizeof(buf) - sizeof(gcrp_hdr_t) + 1);
+  hdr->msgtype = GCRP_MSG_MEMBERS;
+  memberlist->room_id = ghtonl(FUZZ_ROOM_ID);
+  memberlist->num_members = ghtonl(FUZZ_MEMBERS);
+  for (i = 0; i < FUZZ_MEMBERS; i++) {
+    fuzz_member_addr(i, &addr);
+    memberlist->members[i].user_id = ghtonl(FUZZ_USER_ID(i));
+    snprintf(memberlist->members[i].name, sizeof(memberlist->members[i].name), "fuzz%u", i);
+    memberlist->members[i].external_ip = addr.sin_addr;
+    memberlist->members[i].internal_ip = addr.sin_addr;
+    memberlist->members[i].external_port = addr.sin_port;
+    memberlist->members[i].internal_port = addr.sin_port;
+    memberlist->members[i].virtual_suffix = i + 1;
+  }
+  return ghl_input(serv, GHL_PROF_INPUT_GCRP, buf, sizeof(buf), NULL);
+}
+
+/* enables the relay mode, with the relay at FUZZ_RELAY_IP:FUZZ_PORT */
+int fuzz_relay(ghl_serv_t *serv) {
+  return ghl_set_relay(serv, inet_addr(FUZZ_RELAY_IP), FUZZ_PORT);
+}
+
+/*
+ * Moves the virtual time forward, running the timers at their expiration time.
+ * Returns -1 if the server handle was freed by a timer.
+ */
+int fuzz_advance(ghl_serv_t *serv, gtime_t delay) {
+  gtime_t when = garena_now_ms() + delay;
+  gtime_t next;
+
+  while (ghl_next_timer(&next) && gtime_after_eq(when, next)) {
+    if (gtime_after_eq(next, garena_now_ms()))
+      garena_set_virtual_clock(1, next);
+    if (ghl_run_timers(serv, garena_now_ms()) == -1)
+      return -1;
+  }
+  garena_set_virtual_clock(1, when);
+  return 0;
+}
+
+/* runs the timers for FUZZ_DRAIN msec, then frees the server handle (serv is NULL if it was freed already) */
+void fuzz_done(ghl_serv_t *serv) {
+  if ((serv != NULL) && (fuzz_advance(serv, FUZZ_DRAIN) == 0))
+    ghl_free_serv(serv);
+  /* every timer belongs to the server handle, a leftover one would be run by the next input */
+  if (ghl_num_timers() != 0) {
+    fprintf(stderr, "%u timer(s) left after the server handle was freed\n", ghl_num_timers());
+    abort();
+  }
+}
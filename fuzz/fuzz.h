@@ -0,0 +1,50 @@
+/**
+ * @file
+ *
+ * Common setup of the fuzz targets. Each target feeds its input to one of the protocol
+ * input functions (gsp_input(), gcrp_input(), gp2pp_input()), whose handler tables are
+ * wired to the real GHL handlers: the server handle is built like the ones used for
+ * replaying traces (see trace.c), so nothing is sent and the time is virtual.
+ * A new server handle is used for each input, so a crash is always reproducible from
+ * the input alone.
+ *
+ * Built by "./configure --enable-fuzz". With clang, the targets are libFuzzer programs
+ * (add -fsanitize=address,undefined to CFLAGS to catch memory errors, with
+ * -fno-sanitize=alignment,signed-integer-overflow: the wire structures are packed, and
+ * the sequence numbers are compared modulo 2^32), e.g.
+ * "fuzz/fuzz-gp2pp -max_total_time=600 corpus/". With other compilers, they only run the
+ * inputs given on the command line (files or directories), to check a corpus or a crash.
+ */
+
+#ifndef FUZZ_H
+#define FUZZ_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <garena/ghl.h>
+
+/* room joined by fuzz_room() */
+#define FUZZ_ROOM_ID 0x10203
+/* members of the room joined by fuzz_room(), the first one is us */
+#define FUZZ_MEMBERS 4
+/* user ID of the member i, its address is 127.0.0.(2+i):FUZZ_PORT */
+#define FUZZ_USER_ID(i) (0x1000 + (i))
+#define FUZZ_PORT 1513
+/* relay address, see fuzz_relay() */
+#define FUZZ_RELAY_IP "127.0.0.100"
+/* virtual time when a server handle is created */
+#define FUZZ_T0 1000000
+/* virtual time (msec) elapsed by fuzz_done() to run the timers, timeouts included */
+#define FUZZ_DRAIN 10000
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+ghl_serv_t *fuzz_serv(int connected);
+int fuzz_room(ghl_serv_t *serv, int joined);
+int fuzz_relay(ghl_serv_t *serv);
+void fuzz_member_addr(unsigned int i, struct sockaddr_in *addr);
+int fuzz_advance(ghl_serv_t *serv, gtime_t delay);
+void fuzz_done(ghl_serv_t *serv);
+
+#endif
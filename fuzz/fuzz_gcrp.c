@@ -0,0 +1,58 @@
+/**
+ * @file
+ *
+ * fuzz-gcrp: fuzz target for gcrp_input(), with the room handlers of a server handle
+ * that has joined a room of FUZZ_MEMBERS members (see fuzz.h).
+ *
+ * Input: one flags byte, then GCRP messages, each one delimited by the length in its
+ * header (the last one is cut to the end of the input).
+ * Flags: bit 0 set: the member list was not received yet (the join is in progress),
+ * bit 1 set: relay mode enabled.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <garena/garena.h>
+#include <garena/gcrp.h>
+#include <garena/ghl.h>
+#include <garena/private.h>
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *buf;
+  gcrp_hdr_t hdr;
+  size_t length;
+  ghl_serv_t *serv;
+
+  if (size < 1)
+    return 0;
+  serv = fuzz_serv(1);
+  if (fuzz_room(serv, !(data[0] & 1)) == -1)
+    serv = NULL;
+  else if (data[0] & 2)
+    fuzz_relay(serv);
+  data++;
+  size--;
+
+  while ((serv != NULL) && (serv->room != NULL) && (size >= sizeof(gcrp_hdr_t))) {
+    memcpy(&hdr, data, sizeof(hdr));
+    length = (size_t) ghtonl(hdr.msglen) - 1 + sizeof(gcrp_hdr_t);
+    if ((length < sizeof(gcrp_hdr_t)) || (length > size))
+      length = size;
+    if (length > GCRP_MAX_MSGSIZE)
+      length = GCRP_MAX_MSGSIZE;
+    /* exact size copy, so that ASan catches the reads past the end of the message */
+    buf = malloc(length ? length : 1);
+    memcpy(buf, data, length);
+    if (ghl_input(serv, GHL_PROF_INPUT_GCRP, buf, length, NULL) == -1)
+      serv = NULL;
+    free(buf);
+    data += length;
+    size -= length;
+  }
+  fuzz_done(serv);
+  return 0;
+}
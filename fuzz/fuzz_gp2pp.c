@@ -0,0 +1,73 @@
+/**
+ * @file
+ *
+ * fuzz-gp2pp: fuzz target for gp2pp_input(), with the peer to peer handlers of a server
+ * handle that has joined a room of FUZZ_MEMBERS members (see fuzz.h).
+ *
+ * Input: one flags byte, then datagrams, each one preceded by a 4 bytes header:
+ * the sender (0 to FUZZ_MEMBERS - 1: a room member, FUZZ_MEMBERS: the relay, other: an
+ * unknown address), the time elapsed since the previous datagram (in 10 msec units, the
+ * timers expiring in between are run), and the datagram length (2 bytes, little endian).
+ * Flags: bit 0 set: relay mode enabled, bit 1 set: not in a room.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <garena/garena.h>
+#include <garena/gp2pp.h>
+#include <garena/ghl.h>
+#include <garena/private.h>
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *buf;
+  struct sockaddr_in remote;
+  size_t length;
+  ghl_serv_t *serv;
+
+  if (size < 1)
+    return 0;
+  serv = fuzz_serv(1);
+  if (!(data[0] & 2) && (fuzz_room(serv, 1) == -1))
+    serv = NULL;
+  else if (data[0] & 1)
+    fuzz_relay(serv);
+  data++;
+  size--;
+
+  while ((serv != NULL) && (size >= 4)) {
+    if (data[0] < FUZZ_MEMBERS) {
+      fuzz_member_addr(data[0], &remote);
+    } else {
+      memset(&remote, 0, sizeof(remote));
+      remote.sin_family = AF_INET;
+      remote.sin_addr.s_addr = inet_addr((data[0] == FUZZ_MEMBERS) ? FUZZ_RELAY_IP : "10.0.0.1");
+      remote.sin_port = htons(FUZZ_PORT);
+    }
+    if (data[1] && (fuzz_advance(serv, data[1] * 10) == -1)) {
+      serv = NULL;
+      break;
+    }
+    length = data[2] | (data[3] << 8);
+    data += 4;
+    size -= 4;
+    if (length > size)
+      length = size;
+    if (length > GP2PP_MAX_MSGSIZE)
+      length = GP2PP_MAX_MSGSIZE;
+    /* exact size copy, so that ASan catches the reads past the end of the message */
+    buf = malloc(length ? length : 1);
+    memcpy(buf, data, length);
+    if (ghl_input(serv, GHL_PROF_INPUT_GP2PP, buf, length, &remote) == -1)
+      serv = NULL;
+    free(buf);
+    data += length;
+    size -= length;
+  }
+  fuzz_done(serv);
+  return 0;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file
+ *
+ * fuzz-gsp: fuzz target for gsp_input(), with the main server handlers of a server handle
+ * that is logging in. The input is passed twice: as a received frame, to exercise the
+ * framing checks, then as the plaintext of a well-formed frame, encrypted with the
+ * session key, so the fuzzer controls what the handlers see.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <openssl/aes.h>
+#include <garena/garena.h>
+#include <garena/gsp.h>
+#include <garena/ghl.h>
+#include <garena/private.h>
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char buf[GSP_MAX_MSGSIZE];
+  unsigned char plaintext[GSP_MAX_MSGSIZE];
+  unsigned char iv[GSP_IVSIZE];
+  uint32_t *frame_size = (uint32_t *) buf;
+  AES_KEY aeskey;
+  unsigned int length;
+  ghl_serv_t *serv = fuzz_serv(0);
+
+  if (size <= sizeof(buf)) {
+    memcpy(buf, data, size);
+    if (ghl_input(serv, GHL_PROF_INPUT_GSP, buf, size, NULL) == -1)
+      serv = NULL;
+  }
+
+  length = GSP_BLOCK_ROUND(size);
+  if ((serv != NULL) && (size > 0) && (sizeof(uint32_t) + length <= sizeof(buf))) {
+    memset(plaintext, 0, length);
+    memcpy(plaintext, data, size);
+    AES_set_encrypt_key(serv->session_key, GSP_KEYSIZE << 3, &aeskey);
+    memcpy(iv, serv->session_iv, sizeof(iv));
+    AES_cbc_encrypt(plaintext, (unsigned char *) buf + sizeof(uint32_t), length, &aeskey, iv, AES_ENCRYPT);
+    *frame_size = ghtonl(length | 0x01000000);
+    if (ghl_input(serv, GHL_PROF_INPUT_GSP, buf, sizeof(uint32_t) + length, NULL) == -1)
+      serv = NULL;
+  }
+  fuzz_done(serv);
+  return 0;
+}
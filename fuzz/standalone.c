@@ -0,0 +1,78 @@
+/**
+ * @file
+ *
+ * Driver for the fuzz targets when libFuzzer is not available: runs the target on
+ * each input file given on the command line (directories are read recursively).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fuzz.h"
+
+static unsigned long runs = 0;
+
+static int run_path(const char *path) {
+  struct stat st;
+  DIR *dir;
+  struct dirent *ent;
+  char sub[4096];
+  FILE *f;
+  uint8_t *data;
+  size_t size;
+  int r = 0;
+
+  if (stat(path, &st) == -1) {
+    perror(path);
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    if ((dir = opendir(path)) == NULL) {
+      perror(path);
+      return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+      if (ent->d_name[0] == '.')
+        continue;
+      snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+      r |= run_path(sub);
+    }
+    closedir(dir);
+    return r;
+  }
+  data = malloc(st.st_size ? st.st_size : 1);
+  if (data == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    free(data);
+    return -1;
+  }
+  size = fread(data, 1, st.st_size, f);
+  fclose(f);
+  LLVMFuzzerTestOneInput(data, size);
+  free(data);
+  runs++;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int r = 0;
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s file_or_directory...\n", argv[0]);
+    return -1;
+  }
+  LLVMFuzzerInitialize(&argc, &argv);
+  for (i = 1; i < argc; i++)
+    r |= run_path(argv[i]);
+  printf("%lu input(s) executed\n", runs);
+  return r ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file capture.h
+ *
+ * The header for the message capture module: every GSP (decrypted), GCRP and GP2PP
+ * message sent or received by the library is written to a pcapng file, with a comment
+ * naming the message type and its main header fields.
+ */
+
+#ifndef GARENA_CAPTURE_H
+#define GARENA_CAPTURE_H 1
+
+#include <stdint.h>
+#include <garena/garena.h>
+
+/**
+ * Environment variable that starts a capture at garena_init(). Its format is
+ * "path[,snaplen=N][,size=N][,files=N]", see @ref garena_capture_start (the size accepts
+ * the k, M and G suffixes, and files defaults to 2).
+ */
+#define GARENA_CAPTURE_ENV "GARENA_CAPTURE"
+
+/**
+ * Captured protocol: main server (GSP), after decryption
+ */
+#define GARENA_CAPTURE_GSP 0
+/**
+ * Captured protocol: room server (GCRP)
+ */
+#define GARENA_CAPTURE_GCRP 1
+/**
+ * Captured protocol: peer to peer (GP2PP)
+ */
+#define GARENA_CAPTURE_GP2PP 2
+/**
+ * Number of captured protocols. Each one is a pcapng interface, with link type
+ * LINKTYPE_USER0 + protocol.
+ */
+#define GARENA_CAPTURE_NUM 3
+
+/**
+ * Message direction: received
+ */
+#define GARENA_CAPTURE_IN 1
+/**
+ * Message direction: sent
+ */
+#define GARENA_CAPTURE_OUT 2
+
+/**
+ * Size (bytes) of each capture buffer. The library thread only copies the messages
+ * into the buffers, the writer thread formats them.
+ */
+#define GARENA_CAPTURE_BUFSIZE 262144
+/**
+ * Number of capture buffers. When they are all waiting to be written, the new messages
+ * are not captured (and are counted as dropped) rather than slowing down the library.
+ */
+#define GARENA_CAPTURE_BUFFERS 8
+/**
+ * The interval (milliseconds) after which a partially filled buffer is written
+ */
+#define GARENA_CAPTURE_FLUSH 1000
+
+/**
+ * Capture counters (see @ref garena_capture_get_stats)
+ */
+typedef struct {
+  uint64_t msgs; /**< Messages captured */
+  uint64_t bytes; /**< Bytes written, pcapng framing included */
+  uint64_t drops; /**< Messages not captured because all the buffers were full */
+  uint64_t write_errors; /**< Buffers lost because of a write error */
+  unsigned int files; /**< Number of files opened (rotations + 1) */
+} garena_capture_stats_t;
+
+int garena_capture_start(const char *path, unsigned int snaplen, uint64_t max_size, unsigned int max_files);
+void garena_capture_stop(void);
+int garena_capture_get_stats(garena_capture_stats_t *stats);
+
+#endif
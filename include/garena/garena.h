@@ -17,10 +17,18 @@
 
 typedef uint32_t gtime_t;
 
+/*
+ * Compare two gtime_t values, taking care of the wrap-around.
+ */
+#define gtime_after_eq(a, b) ((int32_t)((gtime_t)(a) - (gtime_t)(b)) >= 0)
+
 #define GARENA_NETWORK "192.168.29.0"
 #define FWD_NETWORK "192.168.28.0"
 int garena_init(void);
 void garena_fini(void);
+gtime_t garena_now(void);
+gtime_t garena_now_ms(void);
+uint64_t garena_now_ns(void);
 
 #define DEBUG_LOG "garena.log"
 extern FILE *deb;
@@ -19,9 +19,9 @@
 
 
 /**
- * Default time (in seconds) to wait before join room timeout.
+ * Default time (in milliseconds) to wait before join room timeout.
  */ 
-#define GHL_JOIN_TIMEOUT 600
+#define GHL_JOIN_TIMEOUT 6000
 
 
 /**
@@ -100,15 +100,35 @@
  * The associated event data type is @ref ghl_system_t
  */
 #define GHL_EV_SYSTEM 12
+
+/**
+ * Event received when communication with a room member is established, i.e. when 
+ * the first HELLO reply is received from one of its candidate addresses, or through the 
+ * garena-relay program (see @ref ghl_set_relay). Virtual connections and UDP encapsulated traffic to this member can 
+ * be used from then on. If the member was relayed, the event is received again when direct 
+ * communication works.
+ * The associated event data type is @ref ghl_peer_reachable_t
+ */
+#define GHL_EV_PEER_REACHABLE 13
+
+/**
+ * Event received when a room info reply from the main server changes the user count of some
+ * rooms (including rooms that were not known yet), or when rooms are dropped from the table
+ * because the server did not report them for @ref GHL_ROOMINFO_STALE_TIMEOUT milliseconds
+ * (they are reported with a user count of 0). Only the changed rooms are reported, 
+ * use @ref ghl_roominfo_snapshot to get the whole table.
+ * The associated event data type is @ref ghl_roominfo_ev_t
+ */
+#define GHL_EV_ROOMINFO 14
 /**
  * The number of events.
  */
-#define GHL_EV_NUM 13
+#define GHL_EV_NUM 15
 
 /**
- * The number of seconds to wait for main server connection
+ * The number of milliseconds to wait for main server connection
  */
-#define GHL_SERVCONN_TIMEOUT 600
+#define GHL_SERVCONN_TIMEOUT 6000
 
 /**
  * Failure
@@ -120,9 +140,145 @@
 #define GHL_EV_RES_FAILURE -1
 
 /** 
- * The interval (seconds) between query for room member count
+ * The interval (milliseconds) between query for room member count
+ */
+#define GHL_ROOMINFO_QUERY_INTERVAL 3000
+
+/**
+ * The time (milliseconds) after which a room that the main server stopped reporting
+ * is dropped from the room info table
+ */
+#define GHL_ROOMINFO_STALE_TIMEOUT (10 * GHL_ROOMINFO_QUERY_INTERVAL)
+
+/**
+ * The path MTU (bytes, IP and UDP headers included) assumed for a member before
+ * path MTU discovery proves that larger packets go through.
+ */
+#define GHL_PMTU_BASE 1280
+
+/**
+ * The delay (milliseconds) before the first retry of the reachability check of a new member. 
+ * The delay is doubled after each try.
+ */
+#define GHL_REACH_RTO 100
+
+/**
+ * The number of reachability check tries, after which the periodic HELLO takes over
+ */
+#define GHL_REACH_MAX_TRIES 7
+
+/**
+ * Lower bound (milliseconds) for the HELLO keepalive interval of a member. The interval 
+ * starts at GP2PP_HELLO_INTERVAL, shrinks when a keepalive is not answered (the NAT binding
+ * probably expired) and slowly grows back when keepalives are answered.
+ */
+#define GHL_KEEPALIVE_MIN 5000
+
+/**
+ * Upper bound (milliseconds) for the HELLO keepalive interval of a member
+ */
+#define GHL_KEEPALIVE_MAX 120000
+
+/**
+ * The interval (milliseconds) between registrations with the relay (see @ref ghl_set_relay)
+ */
+#define GHL_RELAY_REGISTER_INTERVAL 15000
+
+/**
+ * The minimum number of members allocated at once in the room member arena. The arena
+ * keeps its peak size until the room is freed.
+ */
+#define GHL_MEMBER_CHUNK 64
+
+/**
+ * @ref ghl_members_select flag: select the members that are playing (VPN enabled)
+ */
+#define GHL_SELECT_VPN 1
+
+/**
+ * @ref ghl_members_select flag: select the members that we can communicate with
+ */
+#define GHL_SELECT_REACHABLE 2
+
+/**
+ * Number of buckets in member RTT histograms. Bucket 0 counts the samples below 2 msec,
+ * bucket i counts the samples in [2^i, 2^(i+1)) msec, the last one counts everything above.
+ */
+#define GHL_RTT_BUCKETS 16
+
+/**
+ * When a member has this many RTT samples, all the counters are halved, so that
+ * the statistics follow the current network conditions.
+ */
+#define GHL_RTT_MAX_SAMPLES 1024
+
+/**
+ * Maximum number of simultaneous clients of the metrics exporter, the oldest client is
+ * dropped to make room for a new one.
+ */
+#define GHL_METRICS_MAX_CLIENTS 4
+
+/**
+ * While a metrics response is being sent, ghl_fill_tv() asks to be called back at least
+ * this often (in milliseconds), for applications that only watch the sockets for reading.
+ */
+#define GHL_METRICS_POLL 10
+
+/**
+ * Number of buckets in profiling histograms (see @ref ghl_prof_enable). Bucket 0 counts the
+ * durations below 2 usec, bucket i counts the durations in [2^i, 2^(i+1)) usec, the last 
+ * one counts everything above (about 8 seconds).
+ */
+#define GHL_PROF_BUCKETS 24
+
+/**
+ * Number of distinct timer functions that get their own profiling histogram, the other 
+ * ones share the last histogram.
+ */
+#define GHL_PROF_TIMER_FUNS 16
+
+/**
+ * Profiling histogram index of the socket inputs: main server (GSP) message
+ */
+#define GHL_PROF_INPUT_GSP 0
+/**
+ * Profiling histogram index of the socket inputs: room server (GCRP) message
+ */
+#define GHL_PROF_INPUT_GCRP 1
+/**
+ * Profiling histogram index of the socket inputs: peer (GP2PP) message
+ */
+#define GHL_PROF_INPUT_GP2PP 2
+/**
+ * Number of socket input profiling histograms
+ */
+#define GHL_PROF_INPUT_NUM 3
+
+/**
+ * When this many keepalive HELLO were sent to a member, the loss counters are halved.
+ */
+#define GHL_HELLO_MAX_SAMPLES 64
+
+/**
+ * Path MTU discovery stops when the search bounds are closer than this (bytes)
  */
-#define GHL_ROOMINFO_QUERY_INTERVAL 300
+#define GHL_PMTU_STEP 16
+
+/**
+ * The number of milliseconds to wait for the answer to a path MTU probe
+ */
+#define GHL_PMTU_PROBE_TIMEOUT 1000
+
+/**
+ * The number of unanswered probes after which a probe size is considered too large
+ */
+#define GHL_PMTU_MAX_PROBES 3
+
+/**
+ * The interval (milliseconds) after which path MTU discovery is run again, to
+ * detect path MTU increases
+ */
+#define GHL_PMTU_RAISE_INTERVAL 600000
 
 /**
  * The type for timer handler functions
@@ -140,7 +296,8 @@ typedef int ghl_timerfun_t(void *privdata);
 typedef struct {
   ghl_timerfun_t *fun; /**< Handler function */
   void *privdata; /**< Private data */
-  int when; /**< When (in seconds after the Epoch) the timer must activate */
+  gtime_t when; /**< When (in milliseconds, see garena_now_ms()) the timer must activate */
+  ilist_node_t node; /**< Node in the timer list, sorted by expiration time */
 } ghl_timer_t;
 
 
@@ -148,6 +305,7 @@ struct ghl_serv_s;
 struct ghl_rh_s;
 struct ghl_member_s;
 struct ghl_ch_s;
+struct ghl_member_chunk_s;
 
 /**
  *
@@ -189,6 +347,130 @@ typedef struct {
 } ghl_myinfo_t;
 
 
+/**
+ * User count of a room, as returned by @ref ghl_roominfo_snapshot
+ */
+typedef struct {
+  unsigned int room_id; /**< Room ID */
+  unsigned int num_users; /**< Number of users in the room */
+} ghl_roominfo_t;
+
+/**
+ * Room info table page: the user count of the 256 rooms sharing a room ID prefix 
+ * (room_id >> 8), indexed by the room ID suffix.
+ */
+typedef struct {
+  unsigned int prefix; /**< Room ID prefix */
+  unsigned int num_known; /**< Number of rooms with a known user count in this page */
+  uint8_t known[256 / 8]; /**< Bitmap of the rooms with a known user count */
+  uint8_t num_users[256]; /**< User count */
+  gtime_t seen[256]; /**< When (see garena_now_ms()) the user count was last reported */
+} ghl_roominfo_page_t;
+
+/**
+ * Room info table: the pages are stored in an array sorted by prefix. Stale rooms are
+ * dropped, and so are the pages left empty.
+ */
+typedef struct {
+  ghl_roominfo_page_t *pages; /**< Pages */
+  unsigned int num_pages; /**< Number of used pages */
+  unsigned int size; /**< Number of allocated pages */
+  unsigned int num_rooms; /**< Number of rooms with a known user count */
+} ghl_roominfo_table_t;
+
+/**
+ * Virtual connection counters (see @ref ghl_conn_get_stats). The server keeps the totals
+ * of all its connections, including the closed ones.
+ */
+typedef struct {
+  uint64_t data_tx; /**< DATA segments sent, including retransmissions */
+  uint64_t data_tx_bytes; /**< Payload bytes sent, including retransmissions */
+  uint64_t data_rx; /**< DATA segments received, including duplicates */
+  uint64_t data_rx_bytes; /**< Payload bytes received, including duplicates */
+  uint64_t retrans_rto; /**< Segments retransmitted after a retransmission timeout */
+  uint64_t retrans_fast; /**< Segments fast-retransmitted */
+  uint64_t acks_tx; /**< ACK messages sent */
+  uint64_t acks_rx; /**< ACK messages received */
+  uint64_t dup_acks; /**< ACK messages that did not advance the cumulative ACK */
+  uint64_t dup_data; /**< DATA segments received more than once */
+  uint64_t out_of_order; /**< DATA segments received ahead of the next expected one */
+  uint64_t rwin_drops; /**< DATA segments dropped because the receive window was full */
+  unsigned int sendq_pkts; /**< Segments not acknowledged yet (snapshot only, zero in the totals) */
+  unsigned int recvq_pkts; /**< Segments not delivered yet (snapshot only, zero in the totals) */
+} __attribute__ ((aligned(64))) ghl_conn_stats_t;
+
+/**
+ * Room counters
+ */
+typedef struct {
+  uint64_t rx_msgs[GCRP_MSG_NUM + 1]; /**< GCRP messages received, by type (the last slot counts the unknown types) */
+  uint64_t rx_bytes[GCRP_MSG_NUM + 1]; /**< GCRP bytes received, by type */
+  uint64_t tx_msgs; /**< GCRP messages sent */
+} __attribute__ ((aligned(64))) ghl_room_stats_t;
+
+/**
+ * Server counters
+ */
+typedef struct {
+  gp2pp_stats_t gp2pp; /**< GP2PP messages and bytes, by type */
+  uint64_t gsp_rx_msgs; /**< GSP messages received */
+  uint64_t gsp_rx_bytes; /**< GSP bytes received */
+  uint64_t gsp_tx_msgs; /**< GSP messages sent */
+  uint64_t timer_fires; /**< Timers fired by ghl_process() calls on this server */
+  uint64_t timer_lag_total; /**< Sum of the timer firing delays (event loop lag), in msec */
+  gtime_t timer_lag_max; /**< Largest timer firing delay, in msec */
+  uint64_t events; /**< Events signaled to the handlers */
+  uint64_t alien_conn; /**< Connection messages dropped because the connection is unknown */
+  uint64_t unknown_user; /**< GP2PP messages dropped because the sender is not in the room */
+  ghl_conn_stats_t conn; /**< Totals of the virtual connection counters */
+} __attribute__ ((aligned(64))) ghl_serv_stats_t;
+
+/**
+ * Statistics snapshot (see @ref ghl_get_stats)
+ */
+typedef struct {
+  ghl_serv_stats_t serv; /**< Server counters */
+  ghl_room_stats_t room; /**< Counters of the current room (zero when not in a room) */
+  unsigned int num_conns; /**< Number of virtual connections */
+  unsigned int sendq_pkts; /**< Segments not acknowledged yet, over all the connections */
+  unsigned int recvq_pkts; /**< Segments not delivered yet, over all the connections */
+} ghl_stats_t;
+
+/**
+ * Duration histogram (see @ref GHL_PROF_BUCKETS)
+ */
+typedef struct {
+  uint64_t count; /**< Number of samples */
+  uint64_t total_ns; /**< Sum of the samples, in nsec */
+  uint64_t max_ns; /**< Largest sample, in nsec */
+  uint32_t hist[GHL_PROF_BUCKETS]; /**< log2 histogram, in usec */
+} ghl_prof_hist_t;
+
+/**
+ * Duration histogram of a timer function
+ */
+typedef struct {
+  ghl_timerfun_t *fun; /**< Timer function, or NULL if the slot is free (the last slot counts the other functions) */
+  const char *name; /**< Name of the function if it is internal to the library, or NULL */
+  ghl_prof_hist_t hist; /**< Durations of the calls */
+} ghl_prof_timer_t;
+
+/**
+ * Event loop profile (see @ref ghl_prof_enable). The socket input durations include the
+ * handlers of the events signaled while processing the message.
+ */
+typedef struct {
+  uint64_t slow_ns; /**< Slow handler warning threshold, in nsec (0 to disable the warnings) */
+  uint64_t slow; /**< Number of handlers, timers or inputs slower than the threshold */
+  ghl_prof_hist_t events[GHL_EV_NUM]; /**< Event handler durations, by event */
+  ghl_prof_timer_t timers[GHL_PROF_TIMER_FUNS]; /**< Timer function durations, by function */
+  ghl_prof_hist_t inputs[GHL_PROF_INPUT_NUM]; /**< Socket input durations (read and dispatch), by protocol */
+  ghl_prof_hist_t process; /**< ghl_process() durations, select() excluded */
+  ghl_prof_hist_t gap; /**< Time between two ghl_process() calls (select() and the application) */
+  ghl_prof_hist_t timer_lag; /**< Delay between the expiration of a timer and its call */
+  uint64_t last_ns; /**< When the last ghl_process() call returned (see @ref garena_now_ns), or 0 */
+} ghl_prof_t;
+
 /**
  * Server handle structure
  */
@@ -211,16 +493,46 @@ typedef struct ghl_serv_s {
   gp2pp_handtab_t *gp2pp_htab; /**< For GP2PP events that needs to be processed by GHL */
   gcrp_handtab_t *gcrp_htab;  /**< For GCRP events that needs to be processed by GHL */
   gsp_handtab_t *gsp_htab; /**< For GSP events that needs to be processed by GHL */
-  ghl_timer_t *hello_timer; /**< Timer to send periodic GP2PP HELLO message to room members */
   ghl_timer_t *conn_retrans_timer; /**< Timer to try retransmission of lost virtual connection segments, and manage virtual connection timeout and cleanup */
   ghl_timer_t *roominfo_timer; /**< Timer to send queries for room usage count */
   ghl_timer_t *servconn_timeout; /**< Timer to handle server connection timeout */
-  ihash_t roominfo; /**< Hashtable (key=room id, value=pointer to integer) to know the room usage count */
+  ghl_roominfo_table_t roominfo; /**< Room usage count */
+  int relay_enabled; /**< Is relay mode enabled? */
+  struct sockaddr_in relay; /**< Relay address, if relay mode is enabled */
+  gp2pp_routes_t *routes; /**< Relay routes of the relayed members */
+  ghl_timer_t *relay_timer; /**< Timer to register periodically with the relay */
   int mtu;
+  ghl_serv_stats_t stats; /**< Counters (see @ref ghl_get_stats) */
+  int metrics_sock; /**< Metrics exporter listening socket, or -1 (see @ref ghl_metrics_listen) */
+  int metrics_clients[GHL_METRICS_MAX_CLIENTS]; /**< Metrics exporter client sockets, or -1 */
+  unsigned int metrics_eoh[GHL_METRICS_MAX_CLIENTS]; /**< Number of matched chars of the request end ("\r\n\r\n") */
+  char *metrics_out[GHL_METRICS_MAX_CLIENTS]; /**< Response being sent, or NULL */
+  unsigned int metrics_out_len[GHL_METRICS_MAX_CLIENTS]; /**< Response length */
+  unsigned int metrics_out_pos[GHL_METRICS_MAX_CLIENTS]; /**< Response bytes already sent */
+  ghl_prof_t *prof; /**< Event loop profile, or NULL if profiling is disabled (see @ref ghl_prof_enable) */
+  struct ghl_trace_s *trace; /**< Input trace, or NULL if not tracing (see @ref ghl_trace_start) */
+  uint64_t rng; /**< Random generator state, recorded by the trace so that a replay draws the same values */
 } ghl_serv_t;
 
 
 
+/**
+ * Columnar copy of the member fields used by room-wide scans (see @ref ghl_members_select). 
+ * Each column is indexed by the member index (@ref ghl_member_t::idx), which is stable
+ * during the member lifetime. The columns are reallocated when the room grows, so don't
+ * keep pointers to them.
+ */
+typedef struct {
+  unsigned int size; /**< Number of slots in each column */
+  struct ghl_member_s **member; /**< Member, or NULL if the slot is free */
+  uint32_t *user_id; /**< User ID */
+  uint8_t *vpn; /**< Is the member playing? */
+  uint8_t *conn_ok; /**< Direct communication state (see @ref ghl_member_t::conn_ok) */
+  struct in_addr *effective_ip; /**< Effective IP */
+  uint16_t *effective_port; /**< Effective port */
+  int *ping; /**< Ping, in msec */
+} ghl_member_cols_t;
+
 /**
  * Room handle structure
  */
@@ -233,8 +545,27 @@ typedef struct ghl_rh_s {
   ghl_timer_t *timeout; /**< Timer to handle room join timeout */
   int joined; /**< Did we fully join the room yet? */
   ihash_t conns; /**< Hashtable(key=conn id, value pointer to @ref ghl_ch_t) to get virtual connections on the VPN associated with this room */
+  struct ghl_member_chunk_s *member_chunks; /**< Member arena: the members are allocated by chunks, released with the room */
+  struct ghl_member_s *free_members; /**< Member arena: list of free member structures */
+  unsigned int num_free_members; /**< Member arena: number of free member structures */
+  ghl_member_cols_t cols; /**< Columnar copy of some member fields, indexed by member index */
+  ghl_room_stats_t stats; /**< Counters (see @ref ghl_get_stats) */
 } ghl_room_t;
 
+/**
+ * Raw RTT and HELLO loss statistics of a member (see @ref ghl_member_get_quality)
+ */
+typedef struct {
+  unsigned int hist[GHL_RTT_BUCKETS]; /**< log2 RTT histogram */
+  unsigned int samples; /**< Number of samples in the histogram */
+  gtime_t min; /**< Minimum RTT (msec) */
+  gtime_t srtt8; /**< Smoothed RTT (msec), times 8 */
+  gtime_t jitter16; /**< Smoothed RTT variation (msec), times 16 */
+  gtime_t last; /**< Last RTT sample (msec) */
+  unsigned int hello_sent; /**< Keepalive HELLO sent */
+  unsigned int hello_lost; /**< Keepalive HELLO that were never answered */
+} ghl_rtt_stats_t;
+
 /**
  * Member structure. 
  */
@@ -254,10 +585,46 @@ typedef struct ghl_member_s {
   uint16_t effective_port; /**< Effective port of the member */
   uint8_t virtual_suffix; /**< Virtual suffix (i.e. the virtual IP of the member is 192.168.29.virtual_suffix)  */
   int conn_ok; /**< Do we have direct bidirectionnal communication with the member? (else VPN communication with the member won't work) */
-  gtime_t echo_ts; /**< Timestamp at when we last sent a HELLO REQ message to this member */
+  gtime_t echo_ts; /**< Timestamp (in msec) at when we last sent a HELLO REQ message to this member */
+  uint32_t echo_id; /**< ID of the HELLO REQ message sent at echo_ts, only its reply gives a RTT sample */
+  uint32_t hello_seq; /**< ID of the last HELLO REQ message (or path MTU probe) sent to this member */
+  unsigned int hello_unanswered; /**< Number of HELLO REQ messages sent since the last reply */
+  int hello_echo; /**< Does the member echo the HELLO IDs (libgarena peer)? Path MTU discovery needs it */
   int ping; /**< Member ping, in msec */
+  struct ghl_rh_s *rh; /**< Room handle */
+  unsigned int pmtu; /**< Path MTU (bytes, IP and UDP headers included) to this member */
+  unsigned int pmtu_lo; /**< Path MTU discovery: the largest size known to go through */
+  unsigned int pmtu_hi; /**< Path MTU discovery: the largest size that may go through */
+  unsigned int pmtu_probe; /**< Size of the path MTU probe in flight, or 0 if none */
+  int pmtu_tries; /**< Number of probes sent for the current probe size */
+  uint32_t pmtu_hello_id; /**< HELLO ID of the path MTU probe in flight, only its reply acknowledges it */
+  ghl_timer_t *pmtu_timer; /**< Timer to handle probe timeout, or to restart path MTU discovery */
+  ghl_timer_t *reach_timer; /**< Timer to retry the reachability check */
+  int reach_tries; /**< Number of reachability check tries so far */
+  gtime_t last_rx; /**< Timestamp (in msec) at when we last received something from this member */
+  gtime_t ka_interval; /**< Current HELLO keepalive interval (in msec) */
+  int ka_outstanding; /**< Is a keepalive HELLO waiting for a reply? */
+  ghl_timer_t *ka_timer; /**< Timer to send the next keepalive HELLO */
+  ghl_rtt_stats_t rtt_stats; /**< RTT and loss statistics */
+  int relayed; /**< Is the traffic with this member going through the relay? */
+  struct ghl_member_s *next_free; /**< Next free member in the room member arena (internal use) */
+  unsigned int idx; /**< Member index in the room columns (see @ref ghl_member_cols_t) */
+  struct ghl_ch_s *conns; /**< List of the virtual connections with this member */
+  unsigned int num_conns; /**< Number of virtual connections with this member */
 } ghl_member_t;
 
+/**
+ * Link quality with a member, as returned by @ref ghl_member_get_quality
+ */
+typedef struct {
+  unsigned int samples; /**< Number of RTT samples the figures are based on */
+  unsigned int min_rtt; /**< Minimum RTT (msec) */
+  unsigned int avg_rtt; /**< Average (smoothed) RTT (msec) */
+  unsigned int p95_rtt; /**< 95th percentile RTT (msec), estimated from the histogram */
+  unsigned int jitter; /**< RTT variation (msec) */
+  unsigned int loss; /**< HELLO loss ratio, in per mille */
+} ghl_quality_t;
+
 /**
  * @ref GHL_EV_ME_JOIN event data structure.
  */
@@ -302,6 +669,24 @@ typedef struct {
   char *text; /**< The text */
 } ghl_system_t;
 
+/**
+ * @ref GHL_EV_PEER_REACHABLE event data structure.
+ */
+
+typedef struct {
+  ghl_room_t *rh; /**< Room handle */
+  ghl_member_t *member; /**< The member that became reachable */
+} ghl_peer_reachable_t;
+
+/**
+ * @ref GHL_EV_ROOMINFO event data structure.
+ */
+
+typedef struct {
+  unsigned int num_rooms; /**< Number of changed rooms */
+  ghl_roominfo_t *rooms; /**< The changed rooms with their new user count, sorted by room ID */
+} ghl_roominfo_ev_t;
+
 /**
  * @ref GHL_EV_TOGGLEVPN event data structure.
  */
@@ -328,15 +713,15 @@ typedef struct {
  */
 typedef struct ghl_ch_s {
   unsigned int conn_id; /**< Connection ID */
-  int ts_base;
+  gtime_t ts_base;
   int snd_una, snd_next, rcv_next, rcv_next_deliver;
-  llist_t sendq;
-  llist_t recvq;
+  ilist_t sendq; /**< Packets not acknowledged yet, sorted by sequence number */
+  ilist_t recvq; /**< Packets not delivered yet, sorted by sequence number */
 #define GHL_CSTATE_ESTABLISHED 2
 #define GHL_CSTATE_CLOSING_IN 3
 #define GHL_CSTATE_CLOSING_OUT 4
   int cstate;
-  int ts_ack;
+  gtime_t ts_ack;
   gtime_t rto;
   gtime_t srtt;
   gtime_t last_xmit;
@@ -346,6 +731,21 @@ typedef struct ghl_ch_s {
   ghl_serv_t *serv; /**< Server handle */
   ghl_member_t *member; /**< The peer */
   int finseq; 
+  unsigned int delack_segs; /**< Number of in-order segments to receive before sending an ACK */
+  gtime_t delack_timeout; /**< Maximum time (msec) an ACK may be delayed */
+  unsigned int ack_pending; /**< Number of received segments not acknowledged yet */
+  int ack_seq; /**< Sequence number of the last received segment, echoed in the next ACK */
+  gtime_t ack_seq_rx; /**< When (msec) the segment ack_seq was received */
+  ghl_timer_t *delack_timer; /**< Timer to send a delayed ACK */
+  int coalesce; /**< Is small-write coalescing enabled? */
+  int corked; /**< Is the connection corked? */
+  gtime_t coalesce_delay; /**< Maximum time (msec) a small write may be held back */
+  char *pending; /**< Coalescing buffer */
+  unsigned int pending_len; /**< Number of bytes held in the coalescing buffer */
+  ghl_timer_t *flush_timer; /**< Timer to flush the coalescing buffer */
+  struct ghl_ch_s *member_next; /**< Next connection in the member connection list */
+  struct ghl_ch_s *member_prev; /**< Previous connection in the member connection list */
+  ghl_conn_stats_t stats; /**< Counters (see @ref ghl_conn_get_stats) */
 } ghl_ch_t;   
 
 /**
@@ -364,6 +764,7 @@ typedef struct {
   unsigned int partial;
   gtime_t first_trans;
   char *payload;
+  ilist_node_t node; /**< Node in the connection send or receive queue */
 } ghl_ch_pkt_t;
 
 /**
@@ -415,6 +816,9 @@ ghl_room_t *ghl_join_room(ghl_serv_t *serv, int room_ip, int room_port, unsigned
 int ghl_leave_room(ghl_room_t *rh);
 
 ghl_member_t *ghl_member_from_id(ghl_room_t *rh, unsigned int user_id);
+int ghl_member_get_quality(ghl_member_t *member, ghl_quality_t *quality);
+int ghl_members_select(ghl_room_t *rh, int flags, ghl_member_t **members, unsigned int max);
+int ghl_set_relay(ghl_serv_t *serv, int relay_ip, int relay_port);
 ghl_member_t *ghl_global_find_member(ghl_serv_t *serv, unsigned int user_id);
 
 int ghl_togglevpn(ghl_room_t *rh, int vpn);
@@ -433,14 +837,28 @@ void* ghl_handler_privdata(ghl_serv_t *serv, int event);
 ghl_room_t *ghl_room_from_id(ghl_serv_t *serv, unsigned int room_id);
 
 ghl_timer_t * ghl_new_timer(int when, ghl_timerfun_t *fun, void *privdata);
+ghl_timer_t * ghl_new_timer_ms(gtime_t when, ghl_timerfun_t *fun, void *privdata);
 void ghl_free_timer(ghl_timer_t *timer);
 
 int ghl_fill_tv(ghl_serv_t *, struct timeval *tv);
 ghl_ch_t *ghl_conn_connect(ghl_serv_t *serv, ghl_member_t *member, int port);
-void ghl_conn_close(ghl_serv_t *serv, ghl_ch_t *ch);
+int ghl_conn_close(ghl_serv_t *serv, ghl_ch_t *ch);
 int ghl_conn_send(ghl_serv_t *serv, ghl_ch_t *ch, char *payload, unsigned int length);
+int ghl_conn_set_delack(ghl_ch_t *ch, unsigned int segs, gtime_t timeout);
+int ghl_conn_set_coalesce(ghl_serv_t *serv, ghl_ch_t *ch, int enable, gtime_t delay);
+int ghl_conn_cork(ghl_serv_t *serv, ghl_ch_t *ch, int cork);
+int ghl_conn_flush(ghl_serv_t *serv, ghl_ch_t *ch);
 ghl_ch_t *ghl_conn_from_id(ghl_room_t *rh, unsigned int conn_id);
-inline unsigned int ghl_max_conn_pkt(ghl_serv_t *serv);
+unsigned int ghl_max_conn_pkt(ghl_serv_t *serv);
+unsigned int ghl_conn_max_pkt(ghl_ch_t *ch);
+int ghl_get_stats(ghl_serv_t *serv, ghl_stats_t *stats);
+int ghl_conn_get_stats(ghl_ch_t *ch, ghl_conn_stats_t *stats);
+int ghl_metrics_listen(ghl_serv_t *serv, int addr, int port);
+void ghl_metrics_stop(ghl_serv_t *serv);
+int ghl_prof_enable(ghl_serv_t *serv, unsigned int slow_us);
+void ghl_prof_disable(ghl_serv_t *serv);
+int ghl_prof_get(ghl_serv_t *serv, ghl_prof_t *prof);
 int ghl_num_members(ghl_serv_t *serv, unsigned int room_id);
+int ghl_roominfo_snapshot(ghl_serv_t *serv, unsigned int first_room_id, ghl_roominfo_t *rooms, unsigned int max);
 
 #endif
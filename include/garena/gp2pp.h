@@ -13,9 +13,11 @@
 #define GP2PP_INIT_SSTHRESH 65536
 #define GP2PP_ALPHA 820
 #define GP2PP_BETA 1536
-#define GP2PP_LBOUND 50
-#define GP2PP_UBOUND 3000
-#define GP2PP_INIT_RTO 200
+
+/* All the time values below are in milliseconds */
+#define GP2PP_LBOUND 200
+#define GP2PP_UBOUND 30000
+#define GP2PP_INIT_RTO 2000
 
 #define GP2PP_PORT 1513
 #define GP2PP_MAX_SENDQ 65536
@@ -24,18 +26,29 @@
 
 #define GP2PP_MAGIC_LOCALIP (inet_addr("127.0.0.1"))
 
-#define GP2PP_HELLO_INTERVAL 3000
+#define GP2PP_HELLO_INTERVAL 30000
 #define GP2PP_CONN_RETRANS_CHECK 50
-#define GP2PP_CONN_TIMEOUT 3000
+#define GP2PP_CONN_TIMEOUT 30000
+#define GP2PP_DELACK_TIMEOUT 40
+#define GP2PP_DELACK_SEGS 2
+#define GP2PP_MAX_ACK_DELAY 500 /* larger ACK timestamps are not a delayed ACK hold time, and are ignored */
+#define GP2PP_COALESCE_DELAY 20
 
 #define GP2PP_MAX_MSGSIZE 8192
 
+#define GP2PP_IMPAIR_ENV "GARENA_IMPAIR"
+#define GP2PP_IMPAIR_REORDER_DELAY 10
+#define GP2PP_IMPAIR_LIMIT 65536
+
 #define GP2PP_MSG_UDP_ENCAP 0x01
 #define GP2PP_MSG_HELLO_REQ 0x02
+#define GP2PP_MSG_ROOMINFO_REQUEST 0x02 /* to the main server, same value as GP2PP_MSG_HELLO_REQ */
+#define GP2PP_MSG_IP_LOOKUP_REQUEST 0x05 /* to the main server */
 #define GP2PP_MSG_IP_LOOKUP_REPLY 0x06
 #define GP2PP_MSG_INITCONN 0x0b
 #define GP2PP_MSG_CONN_PKT 0x0d
 #define GP2PP_MSG_HELLO_REP 0x0F
+#define GP2PP_MSG_RELAY 0x30 /* not part of the garena protocol, only understood by libgarena peers and garena-relay */
 #define GP2PP_MSG_ROOMINFO_REPLY 0x3F
 #define GP2PP_MSG_NUM 0x40
 
@@ -85,17 +98,31 @@ typedef struct gp2pp_udp_encap_s gp2pp_udp_encap_t;
 
 
 struct gp2pp_hello_rep_s {
-  uint32_t mbz;
+  uint32_t hello_id; /* libgarena peers echo the hello_id of the request, garena clients send 0 */
   uint32_t user_id;
 } __attribute__ ((packed));
 typedef struct gp2pp_hello_rep_s gp2pp_hello_rep_t;
 
 struct gp2pp_hello_req_s {
   uint32_t mbz;
-  uint32_t mbz2;
+  uint32_t hello_id; /* set by libgarena peers to match the reply, 0 from garena clients */
 } __attribute__ ((packed));
 typedef struct gp2pp_hello_req_s gp2pp_hello_req_t;
 
+/* 
+ * Relayed message: the GP2PP header (user_id is the sender), this structure, then the 
+ * complete GP2PP message to deliver. With to_id == 0, only registers the sender address
+ * with the relay.
+ */
+struct gp2pp_relay_s {
+  uint32_t to_id;
+  char payload[0];
+} __attribute__ ((packed));
+typedef struct gp2pp_relay_s gp2pp_relay_t;
+
+/* relay route table, owned by the caller and attached to sockets (see gp2pp_set_routes()) */
+typedef struct gp2pp_routes_s gp2pp_routes_t;
+
 struct gp2pp_room_usernum_s {
   uint8_t suffix;
   uint8_t num_users;
@@ -136,6 +163,40 @@ typedef struct  {
   gp2pp_conn_handler_t gp2pp_conn_handlers[GP2PP_CONN_MSG_NUM];
 } gp2pp_handtab_t;
 
+/*
+ * Message counters of a socket (see gp2pp_set_stats()), indexed by message type, the last
+ * slot counts the unknown types. Messages are counted as seen on the wire: a message sent
+ * through a relay is counted as GP2PP_MSG_RELAY.
+ */
+#define GP2PP_STATS_SLOT(type) (((unsigned int) (type) < GP2PP_MSG_NUM) ? (type) : GP2PP_MSG_NUM)
+typedef struct {
+  uint64_t rx_msgs[GP2PP_MSG_NUM + 1];
+  uint64_t rx_bytes[GP2PP_MSG_NUM + 1];
+  uint64_t tx_msgs[GP2PP_MSG_NUM + 1];
+  uint64_t tx_bytes[GP2PP_MSG_NUM + 1];
+  uint64_t tx_errors; /* messages that could not be sent */
+  uint64_t impair_drops; /* messages dropped by the impairment layer */
+} __attribute__ ((aligned(64))) gp2pp_stats_t;
+
+/*
+ * Egress impairment, for testing the connection code on a bad network without tc/root.
+ * Probabilities are in [0, 1], times are in milliseconds. It applies to every GP2PP
+ * message sent to a peer (or relay) by this process.
+ */
+typedef struct {
+  double loss; /* independent loss probability */
+  double burst_enter; /* probability of entering the burst loss state (Gilbert model) */
+  double burst_exit; /* probability of leaving the burst loss state */
+  double reorder; /* probability of holding a message back by reorder_delay */
+  unsigned int reorder_delay;
+  double dup; /* duplication probability */
+  unsigned int delay; /* fixed one-way delay */
+  unsigned int jitter; /* random delay in [0, jitter], added to delay */
+  unsigned int rate; /* bandwidth cap in bytes/s, 0 for none */
+  unsigned int limit; /* bytes queued behind the bandwidth cap before tail drop */
+  unsigned int seed; /* random generator seed, the same seed gives the same decisions */
+} gp2pp_impair_t;
+
 
 
 int gp2pp_read(int sock, char *buf, unsigned int length, struct sockaddr_in *remote);
@@ -145,10 +206,17 @@ int gp2pp_output_conn(int sock, int subtype, char *payload, unsigned int length,
 int gp2pp_input(gp2pp_handtab_t *tab, char *buf, unsigned int length, struct sockaddr_in *remote);
 
 int gp2pp_send_initconn(int sock, int from_ID, unsigned int conn_id, int dport, int sip, struct sockaddr_in *remote);
-int gp2pp_send_hello_reply(int sock, int from_ID, int to_ID, struct sockaddr_in *remote);
-int gp2pp_send_hello_request(int sock, int from_ID, struct sockaddr_in *remote);
+int gp2pp_send_hello_reply(int sock, int from_ID, int to_ID, uint32_t hello_id, struct sockaddr_in *remote);
+int gp2pp_send_hello_request(int sock, int from_ID, uint32_t hello_id, struct sockaddr_in *remote);
+int gp2pp_send_hello_probe(int sock, int from_ID, uint32_t hello_id, unsigned int size, struct sockaddr_in *remote);
 int gp2pp_send_udp_encap(int sock, int from_ID, int sport, int dport, char *payload, unsigned int length, struct sockaddr_in *remote);
 int gp2pp_request_roominfo(int sock, int my_id, int server_ip, int server_port);
+int gp2pp_send_relay_register(int sock, int from_ID, struct sockaddr_in *relay);
+gp2pp_routes_t *gp2pp_alloc_routes(void);
+void gp2pp_free_routes(gp2pp_routes_t *routes);
+int gp2pp_set_routes(int sock, gp2pp_routes_t *routes);
+int gp2pp_add_route(gp2pp_routes_t *routes, struct sockaddr_in *dest, struct sockaddr_in *relay, int from_ID, int to_ID);
+int gp2pp_del_route(gp2pp_routes_t *routes, struct sockaddr_in *dest);
 
 int gp2pp_do_ip_lookup(int sock, int server_ip, int server_port);
 int gp2pp_register_handler(gp2pp_handtab_t *tab,int msgtype, gp2pp_fun_t *fun, void *privdata);
@@ -160,4 +228,12 @@ void* gp2pp_conn_handler_privdata(gp2pp_handtab_t *tab, int msgtype);
 gp2pp_handtab_t *gp2pp_alloc_handtab (void);
 int gp2pp_new_conn_id(void);
 
+int gp2pp_set_stats(int sock, gp2pp_stats_t *stats);
+
+int gp2pp_parse_impair(const char *spec, gp2pp_impair_t *impair);
+int gp2pp_set_impair(gp2pp_impair_t *impair);
+int gp2pp_impair_next(gtime_t *when);
+void gp2pp_impair_flush(void);
+void gp2pp_impair_purge(int sock);
+
 #endif
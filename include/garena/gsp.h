@@ -111,6 +111,7 @@ typedef struct  {
 
 
 int gsp_open_session(int sock, unsigned char *key, unsigned char *iv); 
+int gsp_accept_session(char *buf, unsigned int length, unsigned char *key, unsigned char *iv);
 
 int gsp_read(int sock, char *buf, unsigned int length);
 int gsp_output(int sock, int type, char *payload, unsigned int length, unsigned char *key, unsigned char *iv);
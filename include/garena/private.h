@@ -1,6 +1,9 @@
 #ifndef GARENA_PRIVATE_H
 #define GARENA_PRIVATE_H 1
 
+#include <garena/ghl.h>
+#include <garena/capture.h>
+#include <garena/trace.h>
 
 int gsp_init();
 void gsp_fini();
@@ -10,4 +13,35 @@ int gp2pp_init();
 void gp2pp_fini();
 int ghl_init();
 void ghl_fini();
+int capture_init();
+void capture_fini();
+
+/* internal, exported for tools/microbench.c */
+int ghl_insert_pkt(ilist_t *list, ghl_ch_pkt_t *pkt);
+void ghl_member_extract(ghl_member_t *dst, gcrp_member_t *src);
+
+/* internal, used by the metrics exporter (metrics.c) */
+unsigned int ghl_num_timers(void);
+int ghl_metrics_fill_fds(ghl_serv_t *serv, fd_set *fds, fd_set *wfds, int max);
+int ghl_metrics_pending(ghl_serv_t *serv);
+void ghl_metrics_process(ghl_serv_t *serv, fd_set *fds, fd_set *wfds);
+
+/* internal, message capture hooks (capture.c), only call them when garena_capture_active is set */
+struct iovec;
+extern int garena_capture_active;
+void garena_capture(int proto, int dir, void *data, unsigned int length, struct sockaddr_in *remote);
+void garena_capture_iov(int proto, int dir, struct iovec *iov, int iovlen, struct sockaddr_in *remote);
+
+/* internal, trace record and replay (trace.c), only call the ghl_trace_* hooks when serv->trace is set */
+extern int garena_replay_active;
+void garena_set_virtual_clock(int enable, gtime_t now);
+int ghl_trace_env(ghl_serv_t *serv);
+void ghl_trace_input(ghl_serv_t *serv, int proto, char *buf, unsigned int length, struct sockaddr_in *remote);
+void ghl_trace_call(ghl_serv_t *serv, int type, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+int ghl_input(ghl_serv_t *serv, int proto, char *buf, unsigned int length, struct sockaddr_in *remote);
+int ghl_run_timers(ghl_serv_t *serv, gtime_t now);
+int ghl_next_timer(gtime_t *when);
+ghl_serv_t *ghl_replay_serv(int server_ip, int gp2pp_lport, int gp2pp_rport, int mtu, struct in_addr internal_ip, int internal_port, unsigned char *key, unsigned char *iv);
+ghl_room_t *ghl_replay_room(ghl_serv_t *serv, unsigned int room_id);
+ghl_ch_t *ghl_conn_connect_id(ghl_serv_t *serv, ghl_member_t *member, int port, unsigned int conn_id);
 #endif
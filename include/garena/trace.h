@@ -0,0 +1,157 @@
+/**
+ * @file trace.h
+ *
+ * The header for the trace module: the input of a server handle (the messages read
+ * from its sockets, the application calls that change its state, and when they happened)
+ * is recorded to a compact binary file, which can later be replayed through the same
+ * code paths as fast as possible, with a virtual clock and without sending anything.
+ * A replay is deterministic, which makes it suited to performance regression tests.
+ *
+ * The file starts with a @ref ghl_trace_hdr_t, followed by the records. Each record is a
+ * @ref ghl_trace_rec_t followed by its payload. The integers are stored in host byte order,
+ * so a trace is only portable between hosts of the same endianness.
+ */
+
+#ifndef GARENA_TRACE_H
+#define GARENA_TRACE_H 1
+
+#include <stdint.h>
+#include <garena/ghl.h>
+
+/**
+ * Environment variable that starts a trace of every server handle created by
+ * ghl_new_serv(). Its value is the trace path, the second server traced this way
+ * uses "path.1", the third one "path.2", and so on.
+ */
+#define GHL_TRACE_ENV "GARENA_TRACE"
+
+/**
+ * Trace file magic
+ */
+#define GHL_TRACE_MAGIC "GHLTRACE"
+/**
+ * Trace format version
+ */
+#define GHL_TRACE_VERSION 2
+/**
+ * Size (bytes) of the trace write buffer
+ */
+#define GHL_TRACE_BUFSIZE 1048576
+
+/**
+ * Record: the server handle state when the trace started (@ref ghl_trace_session_t)
+ */
+#define GHL_TRACE_SESSION 0
+/**
+ * Record: a GSP message read from the main server, still encrypted
+ */
+#define GHL_TRACE_GSP_IN 1
+/**
+ * Record: a GCRP message read from the room server
+ */
+#define GHL_TRACE_GCRP_IN 2
+/**
+ * Record: a GP2PP datagram (@ref ghl_trace_addr_t, followed by the datagram)
+ */
+#define GHL_TRACE_GP2PP_IN 3
+/**
+ * Record: ghl_join_room() succeeded (@ref ghl_trace_call_t, arg[0] is the room ID)
+ */
+#define GHL_TRACE_JOIN 4
+/**
+ * Record: ghl_leave_room() (@ref ghl_trace_call_t, no argument)
+ */
+#define GHL_TRACE_LEAVE 5
+/**
+ * Record: ghl_conn_connect() succeeded (@ref ghl_trace_call_t, arg[] is the member
+ * user ID, the port and the connection ID)
+ */
+#define GHL_TRACE_CONNECT 6
+/**
+ * Record: ghl_conn_send() succeeded (@ref ghl_trace_call_t, arg[] is the connection
+ * ID and the data length, the data itself is not recorded)
+ */
+#define GHL_TRACE_SEND 7
+/**
+ * Record: ghl_conn_close() (@ref ghl_trace_call_t, arg[0] is the connection ID)
+ */
+#define GHL_TRACE_CLOSE 8
+/**
+ * Record: ghl_set_relay() succeeded (@ref ghl_trace_call_t, arg[] is the relay IP
+ * and port)
+ */
+#define GHL_TRACE_RELAY 9
+/**
+ * Number of record types
+ */
+#define GHL_TRACE_NUM 10
+
+/**
+ * Trace file header
+ */
+typedef struct {
+  char magic[8]; /**< @ref GHL_TRACE_MAGIC, not NUL-terminated */
+  uint32_t version; /**< @ref GHL_TRACE_VERSION */
+  uint32_t reserved; /**< Zero */
+} ghl_trace_hdr_t;
+
+/**
+ * Record header
+ */
+typedef struct {
+  uint8_t type; /**< Record type (GHL_TRACE_*) */
+  uint8_t reserved; /**< Zero */
+  uint16_t length; /**< Payload length */
+  uint32_t when; /**< Record time, see @ref garena_now_ms */
+} ghl_trace_rec_t;
+
+/**
+ * Payload of the @ref GHL_TRACE_SESSION record
+ */
+typedef struct {
+  uint32_t server_ip; /**< Main server IP (network byte order) */
+  uint32_t internal_ip; /**< Internal IP (network byte order) */
+  uint16_t internal_port; /**< Internal port */
+  uint16_t gp2pp_lport; /**< GP2PP local port */
+  uint16_t gp2pp_rport; /**< GP2PP remote port */
+  uint16_t mtu; /**< Path MTU */
+  unsigned char key[GSP_KEYSIZE]; /**< GSP session key */
+  unsigned char iv[GSP_IVSIZE]; /**< GSP session IV */
+  uint64_t rng; /**< State of the server random generator (keepalive jitter) */
+} ghl_trace_session_t;
+
+/**
+ * Sender address, at the start of the @ref GHL_TRACE_GP2PP_IN payload
+ */
+typedef struct {
+  uint32_t ip; /**< IP (network byte order) */
+  uint16_t port; /**< Port (network byte order) */
+  uint16_t reserved; /**< Zero */
+} ghl_trace_addr_t;
+
+/**
+ * Payload of the application call records
+ */
+typedef struct {
+  uint32_t arg[3]; /**< Arguments, depending on the record type */
+} ghl_trace_call_t;
+
+/**
+ * Replay results (see @ref ghl_replay)
+ */
+typedef struct {
+  uint64_t records[GHL_TRACE_NUM]; /**< Records replayed, by type */
+  uint64_t skipped; /**< Records that could not be applied (e.g. a connection closed earlier than when recorded) */
+  uint64_t events[GHL_EV_NUM]; /**< Events signaled, by event */
+  uint64_t timer_runs; /**< Times the expired timers were run */
+  gtime_t duration_ms; /**< Virtual time covered by the trace */
+  uint64_t elapsed_ns; /**< Wall-clock duration of the replay */
+  int freed; /**< Was the server handle freed before the end of the trace (see @ref ghl_serv_t::need_free)? */
+  ghl_stats_t stats; /**< Server statistics at the end of the replay (zero if freed) */
+} ghl_replay_stats_t;
+
+int ghl_trace_start(ghl_serv_t *serv, const char *path);
+void ghl_trace_stop(ghl_serv_t *serv);
+int ghl_replay(const char *path, ghl_replay_stats_t *stats);
+
+#endif
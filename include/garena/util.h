@@ -7,7 +7,10 @@
  #define IFDEBUG(x)
 #endif
 
+#include <stddef.h>
+
 #define HASH_SIZE 256
+#define HASH_ITEM_CHUNK 32
 
 typedef struct llist_s *llist_t;
 typedef struct cell_s *cell_t;
@@ -42,5 +45,76 @@ ihashitem_t ihash_iter(ihash_t ihash);
 ihashitem_t ihash_next(ihash_t ihash, ihashitem_t iter);
 void *ihash_val(ihashitem_t item);
 int ihash_is_empty(ihash_t ihash);
+int ihash_reserve(ihash_t ihash, unsigned int num);
+
+/*
+ * Intrusive doubly linked list: the node is embedded in the element, so there is
+ * no allocation on insertion, and removal of a known element is O(1).
+ * The list head is a node too (circular list with a sentinel), an element may only
+ * be on one list per embedded node.
+ */
+typedef struct ilist_node_s {
+  struct ilist_node_s *next;
+  struct ilist_node_s *prev;
+} ilist_node_t;
+
+typedef ilist_node_t ilist_t;
+
+/* get the element containing the node */
+#define ilist_entry(node, type, field) ((type *) ((char *) (node) - offsetof(type, field)))
+
+static inline void ilist_init(ilist_t *list) {
+  list->next = list;
+  list->prev = list;
+}
+
+static inline int ilist_is_empty(ilist_t *list) {
+  return list->next == list;
+}
+
+/* first / last node of the list, NULL if the list is empty */
+static inline ilist_node_t *ilist_head(ilist_t *list) {
+  return (list->next == list) ? NULL : list->next;
+}
+
+static inline ilist_node_t *ilist_tail(ilist_t *list) {
+  return (list->prev == list) ? NULL : list->prev;
+}
+
+/* next / previous node, NULL at the end of the list */
+static inline ilist_node_t *ilist_next(ilist_t *list, ilist_node_t *node) {
+  return (node->next == list) ? NULL : node->next;
+}
+
+static inline ilist_node_t *ilist_prev(ilist_t *list, ilist_node_t *node) {
+  return (node->prev == list) ? NULL : node->prev;
+}
+
+/* insert node right after pos (pos may be the list head) */
+static inline void ilist_add_after(ilist_node_t *pos, ilist_node_t *node) {
+  node->prev = pos;
+  node->next = pos->next;
+  pos->next->prev = node;
+  pos->next = node;
+}
+
+static inline void ilist_add_before(ilist_node_t *pos, ilist_node_t *node) {
+  ilist_add_after(pos->prev, node);
+}
+
+static inline void ilist_add_head(ilist_t *list, ilist_node_t *node) {
+  ilist_add_after(list, node);
+}
+
+static inline void ilist_add_tail(ilist_t *list, ilist_node_t *node) {
+  ilist_add_after(list->prev, node);
+}
+
+static inline void ilist_del(ilist_node_t *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = node;
+  node->prev = node;
+}
 
 #endif
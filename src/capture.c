@@ -0,0 +1,677 @@
+/**
+ * @file
+ *
+ * Message capture: writes the GSP (decrypted), GCRP and GP2PP messages to a pcapng file.
+ * The thread that sends or receives a message (the library one) only copies it, with a
+ * timestamp, into a small set of buffers. A background thread formats the pcapng blocks,
+ * writes them and rotates the files, so the library never waits for the disk: when all
+ * the buffers are full, messages are dropped from the capture instead.
+ * Each protocol is a pcapng interface. Each message is an Enhanced Packet Block, with
+ * its direction in the flags option, and a comment naming the message type, the main
+ * header fields and the peer address.
+ * The GSP messages include the login message, so the files are created with mode 0600.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/gsp.h>
+#include <garena/gcrp.h>
+#include <garena/gp2pp.h>
+#include <garena/capture.h>
+#include <garena/private.h>
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_SHB_USERAPPL 4
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_LINKTYPE_USER0 147
+#define PCAPNG_PAD(n) (((n) + 3) & ~3U)
+
+#define CAPTURE_SNAPLEN 65535
+#define CAPTURE_COMMENT 160
+
+/* largest Enhanced Packet Block for a message of caplen bytes */
+#define CAPTURE_EPB_MAX(caplen) (28 + PCAPNG_PAD(caplen) + 4 + PCAPNG_PAD(CAPTURE_COMMENT) + 8 + 4 + 4)
+#define CAPTURE_OUTSIZE (GARENA_CAPTURE_BUFSIZE + CAPTURE_EPB_MAX(CAPTURE_SNAPLEN))
+#define CAPTURE_REC_PAD(n) (((n) + 7) & ~7U)
+
+typedef struct {
+  char *data;
+  size_t len;
+} capture_buf_t;
+
+/* a captured message, as queued for the writer thread, followed by the captured bytes */
+typedef struct {
+  uint32_t reclen; /* length of the record, captured bytes and padding included */
+  uint8_t proto;
+  uint8_t dir;
+  uint32_t length; /* message length */
+  uint32_t caplen; /* captured length */
+  uint64_t ts; /* usec since the epoch */
+  struct sockaddr_in remote; /* AF_UNSPEC if there is no address */
+} capture_rec_t;
+
+int garena_capture_active = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int stopping;
+static capture_buf_t bufs[GARENA_CAPTURE_BUFFERS];
+static unsigned int buf_first; /* oldest buffer waiting to be written */
+static unsigned int buf_full; /* number of buffers waiting to be written, the next one is being filled */
+static garena_capture_stats_t stats;
+
+/* writer thread state */
+static char *cap_path;
+static uint64_t cap_max_size;
+static unsigned int cap_max_files;
+static unsigned int cap_index;
+static int cap_fd = -1;
+static uint64_t cap_size;
+static size_t cap_header;
+static char *cap_out; /* formatted blocks, not written yet */
+static size_t cap_out_len;
+static uint64_t cap_written;
+static unsigned int cap_snaplen = CAPTURE_SNAPLEN;
+
+static const char *capture_ifnames[GARENA_CAPTURE_NUM] = { "gsp", "gcrp", "gp2pp" };
+
+
+/* appends a pcapng option (the value is padded) */
+static char *pcapng_option(char *p, uint16_t code, const void *value, uint16_t length) {
+  memcpy(p, &code, sizeof(code));
+  memcpy(p + 2, &length, sizeof(length));
+  memcpy(p + 4, value, length);
+  memset(p + 4 + length, 0, PCAPNG_PAD(length) - length);
+  return p + 4 + PCAPNG_PAD(length);
+}
+
+/* closes a block started at start, and ending at p */
+static char *pcapng_close(char *start, char *p) {
+  uint32_t len = p - start + sizeof(uint32_t);
+  memcpy(start + sizeof(uint32_t), &len, sizeof(len));
+  memcpy(p, &len, sizeof(len));
+  return p + sizeof(len);
+}
+
+/* builds the section header and the interface description blocks, returns the length */
+static size_t pcapng_header(char *buf) {
+  char *p = buf;
+  char *start;
+  uint32_t u32;
+  uint16_t u16;
+  int64_t section_len = -1;
+  unsigned int i;
+
+  start = p;
+  u32 = PCAPNG_SHB;
+  memcpy(p, &u32, 4);
+  u32 = PCAPNG_MAGIC;
+  memcpy(p + 8, &u32, 4);
+  u16 = 1;
+  memcpy(p + 12, &u16, 2);
+  u16 = 0;
+  memcpy(p + 14, &u16, 2);
+  memcpy(p + 16, &section_len, 8);
+  p = pcapng_option(p + 24, PCAPNG_SHB_USERAPPL, "libgarena " VERSION, strlen("libgarena " VERSION));
+  u32 = 0;
+  memcpy(p, &u32, 4);
+  p = pcapng_close(start, p + 4);
+
+  for (i = 0; i < GARENA_CAPTURE_NUM; i++) {
+    start = p;
+    u32 = PCAPNG_IDB;
+    memcpy(p, &u32, 4);
+    u16 = PCAPNG_LINKTYPE_USER0 + i;
+    memcpy(p + 8, &u16, 2);
+    u16 = 0;
+    memcpy(p + 10, &u16, 2);
+    u32 = cap_snaplen;
+    memcpy(p + 12, &u32, 4);
+    p = pcapng_option(p + 16, PCAPNG_IF_NAME, capture_ifnames[i], strlen(capture_ifnames[i]));
+    u32 = 0;
+    memcpy(p, &u32, 4);
+    p = pcapng_close(start, p + 4);
+  }
+  return p - buf;
+}
+
+static const char *capture_type_name(int proto, unsigned int type) {
+  switch (proto) {
+    case GARENA_CAPTURE_GSP:
+      switch (type) {
+        case GSP_MSG_LOGIN: return "LOGIN";
+        case GSP_MSG_AUTH_FAIL: return "AUTH_FAIL";
+        case GSP_MSG_LOGIN_REPLY: return "LOGIN_REPLY";
+        case GSP_MSG_SESSION_INIT: return "SESSION_INIT";
+        case GSP_MSG_SESSION_INIT_REPLY: return "SESSION_INIT_REPLY";
+        case GSP_MSG_HELLO: return "HELLO";
+      }
+      break;
+    case GARENA_CAPTURE_GCRP:
+      switch (type) {
+        case GCRP_MSG_JOIN: return "JOIN";
+        case GCRP_MSG_PART: return "PART";
+        case GCRP_MSG_TALK: return "TALK";
+        case GCRP_MSG_MEMBERS: return "MEMBERS";
+        case GCRP_MSG_SYSTEM: return "SYSTEM";
+        case GCRP_MSG_JOIN_FAILED: return "JOIN_FAILED";
+        case GCRP_MSG_STARTVPN: return "STARTVPN";
+        case GCRP_MSG_STOPVPN: return "STOPVPN";
+      }
+      break;
+    case GARENA_CAPTURE_GP2PP:
+      switch (type) {
+        case GP2PP_MSG_UDP_ENCAP: return "UDP_ENCAP";
+        case GP2PP_MSG_HELLO_REQ: return "HELLO_REQ";
+        case GP2PP_MSG_IP_LOOKUP_REPLY: return "IP_LOOKUP_REPLY";
+        case GP2PP_MSG_INITCONN: return "INITCONN";
+        case GP2PP_MSG_CONN_PKT: return "CONN_PKT";
+        case GP2PP_MSG_HELLO_REP: return "HELLO_REP";
+        case GP2PP_MSG_RELAY: return "RELAY";
+        case GP2PP_MSG_ROOMINFO_REPLY: return "ROOMINFO_REPLY";
+      }
+      break;
+  }
+  return "?";
+}
+
+static const char *capture_conn_name(unsigned int subtype) {
+  switch (subtype) {
+    case GP2PP_CONN_MSG_FIN: return "FIN";
+    case GP2PP_CONN_MSG_ACK: return "ACK";
+    case GP2PP_CONN_MSG_DATA: return "DATA";
+  }
+  return "?";
+}
+
+/* describes a message, from its captured bytes (writer thread) */
+static int capture_comment(char *comment, capture_rec_t *rec, unsigned char *msg) {
+  gp2pp_conn_hdr_t conn;
+  gp2pp_hdr_t hdr;
+  uint32_t to_id;
+  char ip[INET_ADDRSTRLEN];
+  char addr[32] = "";
+  unsigned int avail = rec->caplen;
+  unsigned int length = rec->length;
+  unsigned int type;
+
+  if (rec->remote.sin_family == AF_INET) {
+    inet_ntop(AF_INET, &rec->remote.sin_addr, ip, sizeof(ip));
+    snprintf(addr, sizeof(addr), " %s %s:%u", (rec->dir == GARENA_CAPTURE_IN) ? "from" : "to", ip, ntohs(rec->remote.sin_port));
+  }
+  switch (rec->proto) {
+    case GARENA_CAPTURE_GSP:
+      if (avail < sizeof(gsp_hdr_t))
+        break;
+      return snprintf(comment, CAPTURE_COMMENT, "GSP %s (0x%02x) len %u", capture_type_name(rec->proto, msg[0]), msg[0], length);
+    case GARENA_CAPTURE_GCRP:
+      if (avail < sizeof(gcrp_hdr_t))
+        break;
+      type = ((gcrp_hdr_t *) msg)->msgtype;
+      return snprintf(comment, CAPTURE_COMMENT, "GCRP %s (0x%02x) len %u", capture_type_name(rec->proto, type), type, length);
+    case GARENA_CAPTURE_GP2PP:
+      if (avail < 1)
+        break;
+      type = msg[0];
+      if ((type == GP2PP_MSG_CONN_PKT) && (avail >= sizeof(conn))) {
+        memcpy(&conn, msg, sizeof(conn));
+        return snprintf(comment, CAPTURE_COMMENT, "GP2PP CONN_PKT %s (0x%02x) user_id %u conn_id 0x%08x seq1 %u seq2 %u ts_rel %u len %u%s", capture_conn_name(conn.msgsubtype), conn.msgsubtype, ghtonl(conn.user_id), ghtonl(conn.conn_id), ghtonl(conn.seq1), ghtonl(conn.seq2), ghtons(conn.ts_rel), length - (unsigned int) sizeof(conn), addr);
+      } else if ((type == GP2PP_MSG_RELAY) && (avail >= sizeof(hdr) + sizeof(to_id) + 1)) {
+        memcpy(&hdr, msg, sizeof(hdr));
+        memcpy(&to_id, msg + sizeof(hdr), sizeof(to_id));
+        type = msg[sizeof(hdr) + sizeof(to_id)];
+        return snprintf(comment, CAPTURE_COMMENT, "GP2PP RELAY user_id %u to_id %u, inner %s (0x%02x) len %u%s", ghtonl(hdr.user_id), ghtonl(to_id), capture_type_name(rec->proto, type), type, length, addr);
+      } else if ((type != GP2PP_MSG_ROOMINFO_REPLY) && (type != GP2PP_MSG_IP_LOOKUP_REPLY) && (avail >= sizeof(hdr))) {
+        memcpy(&hdr, msg, sizeof(hdr));
+        return snprintf(comment, CAPTURE_COMMENT, "GP2PP %s (0x%02x) user_id %u len %u%s", capture_type_name(rec->proto, type), type, ghtonl(hdr.user_id), length, addr);
+      }
+      return snprintf(comment, CAPTURE_COMMENT, "GP2PP %s (0x%02x) len %u%s", capture_type_name(rec->proto, type), type, length, addr);
+  }
+  return snprintf(comment, CAPTURE_COMMENT, "%s message, len %u%s", capture_ifnames[rec->proto], length, addr);
+}
+
+/* the buffer to append len bytes to, or NULL if they are all full (called with the lock) */
+static capture_buf_t *capture_buf(size_t len) {
+  capture_buf_t *buf;
+  if (buf_full == GARENA_CAPTURE_BUFFERS)
+    return NULL;
+  buf = &bufs[(buf_first + buf_full) % GARENA_CAPTURE_BUFFERS];
+  if (buf->len + len <= GARENA_CAPTURE_BUFSIZE)
+    return buf;
+  if (buf_full + 1 == GARENA_CAPTURE_BUFFERS)
+    return NULL;
+  buf_full++;
+  pthread_cond_signal(&cond);
+  return &bufs[(buf_first + buf_full) % GARENA_CAPTURE_BUFFERS];
+}
+
+/*
+ * Captures a message given as an iovec (internal, see private.h). Only call it when
+ * garena_capture_active is set. Only the message is copied here, the writer thread
+ * formats it.
+ */
+void garena_capture_iov(int proto, int dir, struct iovec *iov, int iovlen, struct sockaddr_in *remote) {
+  capture_rec_t *rec;
+  capture_buf_t *buf;
+  struct timeval tv;
+  unsigned int length = 0;
+  unsigned int caplen;
+  unsigned int n;
+  size_t rlen;
+  char *p;
+  int i;
+
+  for (i = 0; i < iovlen; i++)
+    length += iov[i].iov_len;
+  caplen = (length > cap_snaplen) ? cap_snaplen : length;
+  rlen = CAPTURE_REC_PAD(sizeof(capture_rec_t) + caplen);
+  gettimeofday(&tv, NULL);
+
+  pthread_mutex_lock(&lock);
+  if (!garena_capture_active || ((buf = capture_buf(rlen)) == NULL)) {
+    stats.drops++;
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  rec = (capture_rec_t *) (buf->data + buf->len);
+  rec->reclen = rlen;
+  rec->proto = proto;
+  rec->dir = dir;
+  rec->length = length;
+  rec->caplen = caplen;
+  rec->ts = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+  if (remote)
+    rec->remote = *remote;
+  else
+    rec->remote.sin_family = AF_UNSPEC;
+  p = (char *) (rec + 1);
+  for (i = 0; (i < iovlen) && caplen; i++) {
+    n = (iov[i].iov_len > caplen) ? caplen : iov[i].iov_len;
+    memcpy(p, iov[i].iov_base, n);
+    p += n;
+    caplen -= n;
+  }
+  buf->len += rlen;
+  stats.msgs++;
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Captures a message (internal, see private.h). Only call it when garena_capture_active
+ * is set.
+ */
+void garena_capture(int proto, int dir, void *data, unsigned int length, struct sockaddr_in *remote) {
+  struct iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = length;
+  garena_capture_iov(proto, dir, &iov, 1, remote);
+}
+
+/* builds the Enhanced Packet Block of a captured message, returns its length (writer thread) */
+static size_t pcapng_epb(char *p, capture_rec_t *rec) {
+  char comment[CAPTURE_COMMENT];
+  char *start = p;
+  uint32_t u32;
+  int clen;
+
+  u32 = PCAPNG_EPB;
+  memcpy(p, &u32, 4);
+  u32 = rec->proto;
+  memcpy(p + 8, &u32, 4);
+  u32 = rec->ts >> 32;
+  memcpy(p + 12, &u32, 4);
+  u32 = rec->ts;
+  memcpy(p + 16, &u32, 4);
+  memcpy(p + 20, &rec->caplen, 4);
+  memcpy(p + 24, &rec->length, 4);
+  p += 28;
+  memcpy(p, rec + 1, rec->caplen);
+  memset(p + rec->caplen, 0, PCAPNG_PAD(rec->caplen) - rec->caplen);
+  p += PCAPNG_PAD(rec->caplen);
+  clen = capture_comment(comment, rec, (unsigned char *) (rec + 1));
+  if (clen >= CAPTURE_COMMENT)
+    clen = CAPTURE_COMMENT - 1;
+  p = pcapng_option(p, PCAPNG_OPT_COMMENT, comment, clen);
+  u32 = rec->dir;
+  p = pcapng_option(p, PCAPNG_EPB_FLAGS, &u32, sizeof(u32));
+  u32 = PCAPNG_OPT_END;
+  memcpy(p, &u32, 4);
+  return pcapng_close(start, p + 4) - start;
+}
+
+/* opens the next capture file, and writes its header (writer thread) */
+static int capture_open(void) {
+  char header[512];
+  char *path = cap_path;
+  size_t len;
+
+  if (cap_fd != -1)
+    close(cap_fd);
+  if (cap_max_size) {
+    len = strlen(cap_path) + 16;
+    path = malloc(len);
+    if (path == NULL)
+      return -1;
+    snprintf(path, len, "%s.%u", cap_path, cap_index);
+    cap_index = (cap_index + 1) % cap_max_files;
+  }
+  cap_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (path != cap_path)
+    free(path);
+  if (cap_fd == -1)
+    return -1;
+  len = pcapng_header(header);
+  if (write(cap_fd, header, len) != len) {
+    close(cap_fd);
+    cap_fd = -1;
+    return -1;
+  }
+  cap_size = len;
+  cap_header = len;
+  pthread_mutex_lock(&lock);
+  stats.files++;
+  stats.bytes += len;
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/* writes the formatted blocks (writer thread) */
+static int capture_flush(void) {
+  char *data = cap_out;
+  ssize_t r;
+
+  while (cap_out_len > 0) {
+    r = write(cap_fd, data, cap_out_len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      cap_out_len = 0;
+      return -1;
+    }
+    data += r;
+    cap_out_len -= r;
+    cap_size += r;
+    cap_written += r;
+  }
+  return 0;
+}
+
+/* formats and writes a buffer, rotating the files between two blocks when needed (writer thread) */
+static int capture_write(capture_buf_t *buf) {
+  capture_rec_t *rec;
+  size_t pos;
+  size_t max_len;
+
+  if ((cap_fd == -1) && (capture_open() == -1))
+    return -1;
+  for (pos = 0; pos < buf->len; pos += rec->reclen) {
+    rec = (capture_rec_t *) (buf->data + pos);
+    max_len = CAPTURE_EPB_MAX(rec->caplen);
+    if (cap_out_len + max_len > CAPTURE_OUTSIZE) {
+      if (capture_flush() == -1)
+        return -1;
+    }
+    /* a file holds at least one message, even if it is larger than max_size */
+    if (cap_max_size && (cap_size + cap_out_len + max_len > cap_max_size) && (cap_size + cap_out_len > cap_header)) {
+      if ((capture_flush() == -1) || (capture_open() == -1))
+        return -1;
+    }
+    cap_out_len += pcapng_epb(cap_out + cap_out_len, rec);
+  }
+  return capture_flush();
+}
+
+static void *capture_writer(void *arg) {
+  struct timespec deadline;
+  capture_buf_t *buf;
+  int r;
+
+  pthread_mutex_lock(&lock);
+  while (1) {
+    if (buf_full == 0) {
+      if (stopping && (bufs[buf_first].len == 0))
+        break;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += GARENA_CAPTURE_FLUSH / 1000;
+      deadline.tv_nsec += (GARENA_CAPTURE_FLUSH % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      if (!stopping && (pthread_cond_timedwait(&cond, &lock, &deadline) == 0))
+        continue;
+      /* flush interval elapsed (or stopping): write the partially filled buffer */
+      if (bufs[buf_first].len == 0)
+        continue;
+      buf_full++;
+    }
+    buf = &bufs[buf_first];
+    pthread_mutex_unlock(&lock);
+    r = capture_write(buf);
+    pthread_mutex_lock(&lock);
+    if (r == -1)
+      stats.write_errors++;
+    stats.bytes += cap_written;
+    cap_written = 0;
+    buf->len = 0;
+    buf_first = (buf_first + 1) % GARENA_CAPTURE_BUFFERS;
+    buf_full--;
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+/**
+ * Starts capturing the messages. The first snaplen bytes of each message are captured
+ * (the captured protocol headers are at most 24 bytes long). If max_size is 0, they are 
+ * written to the file path.
+ * Otherwise they are written to a ring of max_files files named path.0, path.1, ...,
+ * each one limited to about max_size bytes: when a file is full the next one is
+ * overwritten. Each file is a complete pcapng file.
+ * The capture can also be started with the GARENA_CAPTURE environment variable, which is
+ * read by garena_init().
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INUSE: A capture is already running
+ * @li GARENA_ERR_INVALID: max_size is not 0 and max_files is 0
+ * @li GARENA_ERR_NORESOURCE: Out of memory
+ * @li GARENA_ERR_LIBC: The first file or the writer thread could not be created
+ *
+ * @param path The file name (or prefix)
+ * @param snaplen Maximum number of bytes captured per message, or 0 for whole messages
+ * @param max_size Maximum size of each file, in bytes, or 0 for a single unlimited file
+ * @param max_files Number of files in the ring
+ * @return 0 for success, -1 for failure
+ */
+int garena_capture_start(const char *path, unsigned int snaplen, uint64_t max_size, unsigned int max_files) {
+  unsigned int i;
+
+  if (garena_capture_active) {
+    garena_errno = GARENA_ERR_INUSE;
+    return -1;
+  }
+  if ((path == NULL) || (max_size && (max_files == 0))) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  memset(&stats, 0, sizeof(stats));
+  cap_path = strdup(path);
+  if (cap_path == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return -1;
+  }
+  cap_snaplen = ((snaplen == 0) || (snaplen > CAPTURE_SNAPLEN)) ? CAPTURE_SNAPLEN : snaplen;
+  cap_max_size = max_size;
+  cap_max_files = max_files;
+  cap_index = 0;
+  buf_first = 0;
+  buf_full = 0;
+  stopping = 0;
+  cap_out_len = 0;
+  cap_written = 0;
+  cap_out = malloc(CAPTURE_OUTSIZE);
+  if (cap_out == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    goto err;
+  }
+  for (i = 0; i < GARENA_CAPTURE_BUFFERS; i++) {
+    bufs[i].len = 0;
+    bufs[i].data = malloc(GARENA_CAPTURE_BUFSIZE);
+    if (bufs[i].data == NULL) {
+      garena_errno = GARENA_ERR_NORESOURCE;
+      goto err;
+    }
+  }
+  /* open the first file now, to report a bad path */
+  if (capture_open() == -1) {
+    garena_errno = GARENA_ERR_LIBC;
+    goto err;
+  }
+  if (pthread_create(&writer, NULL, capture_writer, NULL) != 0) {
+    garena_errno = GARENA_ERR_LIBC;
+    goto err;
+  }
+  garena_capture_active = 1;
+  return 0;
+
+err:
+  if (cap_fd != -1) {
+    close(cap_fd);
+    cap_fd = -1;
+  }
+  for (i = 0; i < GARENA_CAPTURE_BUFFERS; i++) {
+    free(bufs[i].data);
+    bufs[i].data = NULL;
+  }
+  free(cap_out);
+  cap_out = NULL;
+  free(cap_path);
+  cap_path = NULL;
+  return -1;
+}
+
+/**
+ * Stops the capture: the buffered messages are written and the file is closed.
+ */
+void garena_capture_stop(void) {
+  unsigned int i;
+
+  if (!garena_capture_active)
+    return;
+  pthread_mutex_lock(&lock);
+  garena_capture_active = 0;
+  stopping = 1;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+  if (cap_fd != -1) {
+    close(cap_fd);
+    cap_fd = -1;
+  }
+  for (i = 0; i < GARENA_CAPTURE_BUFFERS; i++) {
+    free(bufs[i].data);
+    bufs[i].data = NULL;
+  }
+  free(cap_out);
+  cap_out = NULL;
+  free(cap_path);
+  cap_path = NULL;
+}
+
+/**
+ * Gets the capture counters (of the running capture, or of the last one).
+ *
+ * @param cstats Pointer to the structure to fill
+ * @return 0 for success, -1 for failure
+ */
+int garena_capture_get_stats(garena_capture_stats_t *cstats) {
+  if (cstats == NULL) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  pthread_mutex_lock(&lock);
+  *cstats = stats;
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/* parses GARENA_CAPTURE, and starts the capture (see garena_init()) */
+int capture_init(void) {
+  char *spec = getenv(GARENA_CAPTURE_ENV);
+  char *path;
+  char *opt;
+  char *end;
+  uint64_t max_size = 0;
+  unsigned int max_files = 0;
+  unsigned int snaplen = 0;
+  int r;
+
+  if ((spec == NULL) || (*spec == 0))
+    return 0;
+  path = strdup(spec);
+  if (path == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return -1;
+  }
+  opt = strchr(path, ',');
+  if (opt)
+    *opt++ = 0;
+  while (opt) {
+    if (!strncmp(opt, "size=", 5)) {
+      max_size = strtoull(opt + 5, &end, 10);
+      switch (*end) {
+        case 'G': max_size <<= 10;
+          /* fall through */
+        case 'M': max_size <<= 10;
+          /* fall through */
+        case 'k': max_size <<= 10;
+          end++;
+      }
+    } else if (!strncmp(opt, "files=", 6)) {
+      max_files = strtoul(opt + 6, &end, 10);
+    } else if (!strncmp(opt, "snaplen=", 8)) {
+      snaplen = strtoul(opt + 8, &end, 10);
+    } else {
+      end = opt;
+    }
+    if ((*end != 0) && (*end != ',')) {
+      fprintf(stderr, "Invalid %s specification: %s\n", GARENA_CAPTURE_ENV, spec);
+      free(path);
+      garena_errno = GARENA_ERR_INVALID;
+      return -1;
+    }
+    opt = (*end) ? end + 1 : NULL;
+  }
+  if (max_size && (max_files == 0))
+    max_files = 2;
+  r = garena_capture_start(path, snaplen, max_size, max_files);
+  if (r == -1)
+    fprintf(stderr, "Could not start the capture to %s\n", path);
+  free(path);
+  return r;
+}
+
+void capture_fini(void) {
+  garena_capture_stop();
+}
@@ -46,6 +46,7 @@ FILE *deb;
  * Call this function to free the library memory structures
  */
 void garena_fini() {
+  capture_fini();
   ghl_fini();
   gsp_fini();
   gcrp_fini();
@@ -54,18 +55,81 @@ void garena_fini() {
     fclose(deb);
 }
 
-static struct timeval tv_init;
+static struct timespec ts_init;
+static int clock_virtual = 0;
+static gtime_t clock_virtual_now;
+
+/*
+ * Reads the clock used for every garena timestamp. CLOCK_MONOTONIC is
+ * not affected by NTP steps or by the user changing the system time, so
+ * timers and RTO computations stay consistent. Systems lacking it fall
+ * back to gettimeofday().
+ */
+static void garena_clock(struct timespec *ts) {
+#ifdef CLOCK_MONOTONIC
+  if (clock_gettime(CLOCK_MONOTONIC, ts) == 0)
+    return;
+#endif
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+  }
+}
 
 /**
- * Returns the 1/100th of seconds elapsed since call to garena_init()
+ * Returns the milliseconds elapsed since call to garena_init().
+ * All the library timers, RTT and RTO values use this unit.
+ *
+ * @return time value
+ */
+ 
+gtime_t garena_now_ms() {
+  struct timespec ts_now;
+  if (clock_virtual)
+    return clock_virtual_now;
+  garena_clock(&ts_now);
+  return ((ts_now.tv_sec - ts_init.tv_sec)*1000 + ((ts_now.tv_nsec - ts_init.tv_nsec)/1000000));
+}
+
+/*
+ * Replaces the clock returned by garena_now_ms() with a virtual one, set to now, for replaying
+ * a trace (internal, see private.h). Only garena_now_ns() keeps reading the real clock.
+ */
+void garena_set_virtual_clock(int enable, gtime_t now) {
+  clock_virtual = enable;
+  clock_virtual_now = now;
+}
+
+/**
+ * Returns the nanoseconds elapsed since call to garena_init(), for measuring short
+ * durations (see @ref ghl_prof_enable). On Linux, clock_gettime() is served by the vDSO
+ * and does not enter the kernel.
+ *
+ * @return time value
+ */
+
+uint64_t garena_now_ns() {
+  struct timespec ts_now;
+  garena_clock(&ts_now);
+  return (uint64_t) (ts_now.tv_sec - ts_init.tv_sec) * 1000000000 + ts_now.tv_nsec - ts_init.tv_nsec;
+}
+
+/**
+ * Returns the 1/100th of seconds elapsed since call to garena_init().
+ * Kept for compatibility, use garena_now_ms() for better resolution.
  *
  * @return time value
  */
  
 gtime_t garena_now() {
-  struct timeval tv_now;
-  gettimeofday(&tv_now, NULL);
-  return ((tv_now.tv_sec - tv_init.tv_sec)*100 + ((tv_now.tv_usec - tv_init.tv_usec)/10000));
+  struct timespec ts_now;
+  if (clock_virtual)
+    return clock_virtual_now / 10;
+  garena_clock(&ts_now);
+  /* computed from the full clock value, not from garena_now_ms(), to keep the ~497 days range */
+  return ((ts_now.tv_sec - ts_init.tv_sec)*100 + ((ts_now.tv_nsec - ts_init.tv_nsec)/10000000));
 }
 
 /**
@@ -75,7 +139,7 @@ gtime_t garena_now() {
  */
 int garena_init() {
   char filename[256];
-  gettimeofday(&tv_init, NULL);
+  garena_clock(&ts_init);
   if (gsp_init() == -1) {
     return -1;
   }
@@ -94,6 +158,9 @@ int garena_init() {
     garena_errno = GARENA_ERR_LIBC;
     return -1;
   }
+  if (capture_init() == -1) {
+    return -1;
+  }
 
   signal(SIGPIPE, SIG_IGN);  
   printf("Garena library initialized (version %s)\n", VERSION);
@@ -15,6 +15,7 @@
 #include <garena/gcrp.h>
 #include <garena/error.h>
 #include <garena/util.h>
+#include <garena/private.h>
 
 #include <mhash.h>
 
@@ -103,7 +104,7 @@ int gcrp_read(int sock, char *buf, unsigned int length) {
     return -1;
   }
   toread = ghtonl(hdr->msglen) - 1; 
-  if (toread + sizeof(gcrp_hdr_t) > GCRP_MAX_MSGSIZE) {
+  if ((toread < 0) || (toread + sizeof(gcrp_hdr_t) > GCRP_MAX_MSGSIZE)) {
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
@@ -112,6 +113,8 @@ int gcrp_read(int sock, char *buf, unsigned int length) {
     garena_errno = GARENA_ERR_LIBC;
     return -1;
   }
+  if (garena_capture_active)
+    garena_capture(GARENA_CAPTURE_GCRP, GARENA_CAPTURE_IN, buf, toread + sizeof(gcrp_hdr_t), NULL);
   return (toread + sizeof(gcrp_hdr_t)); 
 }
 
@@ -169,6 +172,10 @@ int gcrp_output(int sock, int type, char *payload, unsigned int length) {
   hdr->msglen = ghtonl(length + 1); /* the msgtype byte is counted in the msglen, as well as the payload */
   hdr->msgtype = type;
   memcpy(buf + sizeof(gcrp_hdr_t), payload, length);
+  if (garena_capture_active)
+    garena_capture(GARENA_CAPTURE_GCRP, GARENA_CAPTURE_OUT, buf, length + sizeof(gcrp_hdr_t), NULL);
+  if (garena_replay_active)
+    return 0;
   if (write(sock, buf, length + sizeof(gcrp_hdr_t)) == -1) {
     garena_errno = GARENA_ERR_LIBC;
     return -1;
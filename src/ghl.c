@@ -22,6 +22,7 @@
 #include <garena/garena.h>
 #include <garena/ghl.h>
 #include <garena/util.h> 
+#include <garena/private.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
 #include <fcntl.h>
@@ -33,24 +34,68 @@
 
 /* static globals */
 
-static llist_t timers;
+static ilist_t timers;
 
 /* static (private) functions declarations */
 static int ghl_free_room(ghl_room_t *rh);
-static int insert_pkt(llist_t list, ghl_ch_pkt_t *pkt);
+static int fill_fds(ghl_serv_t *serv, fd_set *fds, fd_set *wfds);
 static void conn_free(ghl_ch_t *ch);
+static ghl_ch_t *conn_alloc(ghl_serv_t *serv, ghl_member_t *member, unsigned int conn_id);
+static void conn_remote(ghl_ch_t *ch, struct sockaddr_in *remote);
+static void send_ack(ghl_serv_t *serv, ghl_ch_t *ch);
+static int do_delayed_ack(void *privdata);
+static int conn_queue_segment(ghl_serv_t *serv, ghl_ch_t *ch, char *payload, unsigned int length);
+static void conn_queue_pkt(ghl_serv_t *serv, ghl_ch_t *ch, ghl_ch_pkt_t *pkt);
+static ghl_ch_pkt_t *pkt_alloc(unsigned int length);
+static void pkt_free(ghl_ch_pkt_t *pkt);
+static int conn_flush(ghl_serv_t *serv, ghl_ch_t *ch);
+static int do_conn_flush(void *privdata);
 static void xmit_packet(ghl_serv_t *serv, ghl_ch_pkt_t *pkt);
 static void myinfo_pack(gsp_myinfo_t *dst, ghl_myinfo_t *src);
 static void myinfo_extract(ghl_myinfo_t *dst, gsp_myinfo_t *src);
-static void member_extract(ghl_member_t *dst, gcrp_member_t *src);
-static void send_hello(ghl_serv_t *serv, ghl_member_t *cur);
-static void send_hello_to_all(ghl_serv_t *serv);
+static int member_reserve(ghl_room_t *rh, unsigned int num);
+static ghl_member_t *member_new(ghl_room_t *rh, gcrp_member_t *src);
+static int cols_grow(ghl_member_cols_t *cols, unsigned int size);
+static void cols_free(ghl_member_cols_t *cols);
+static unsigned int roominfo_lookup(ghl_roominfo_table_t *table, unsigned int prefix);
+static ghl_roominfo_page_t *roominfo_page(ghl_roominfo_table_t *table, unsigned int prefix);
+static int roominfo_cmp(const void *a, const void *b);
+static void roominfo_expire(ghl_serv_t *serv);
+static void member_sync(ghl_member_t *member);
+static void member_free(ghl_member_t *member);
+static void pmtu_start(ghl_serv_t *serv, ghl_member_t *member);
+static void pmtu_probe(ghl_serv_t *serv, ghl_member_t *member);
+static int do_pmtu_timer(void *privdata);
+static void reach_check_start(ghl_serv_t *serv, ghl_member_t *member);
+static int do_reach_check(void *privdata);
+static uint32_t serv_random(ghl_serv_t *serv);
+static void keepalive_start(ghl_member_t *member);
+static int do_keepalive(void *privdata);
+static void member_vaddr(ghl_serv_t *serv, ghl_member_t *member, struct sockaddr_in *vaddr);
+static int member_is_vaddr(ghl_serv_t *serv, ghl_member_t *member, struct sockaddr_in *addr);
+static int relay_member_start(ghl_serv_t *serv, ghl_member_t *member);
+static void relay_member_stop(ghl_serv_t *serv, ghl_member_t *member);
+static int do_relay_register(void *privdata);
+static int handle_relay_msg(int type, void *payload, unsigned int length, void *privdata, unsigned int user_id, struct sockaddr_in *remote);
+static int send_hello(ghl_serv_t *serv, ghl_member_t *cur);
+static uint32_t hello_new_id(ghl_member_t *member);
 static int handle_servconn_timeout(void *privdata);
 static int do_conn_retrans(void *privdata);
-static void do_fast_retrans(ghl_serv_t *serv, llist_t sendq, int up_to);
-static int do_hello(void *privdata);
+static void do_fast_retrans(ghl_serv_t *serv, ilist_t *sendq, int up_to);
 static int do_roominfo_query(void *privdata);
 static int signal_event(ghl_serv_t *serv, int event, void *eventparam);
+static void *alloc_aligned(size_t size);
+static ghl_serv_t *serv_alloc(int server_ip, int gp2pp_lport, int gp2pp_rport, int mtu);
+static int serv_setup(ghl_serv_t *serv);
+static void serv_abort(ghl_serv_t *serv);
+static ghl_room_t *room_alloc(ghl_serv_t *serv, unsigned int room_id);
+static void room_abort(ghl_room_t *rh);
+static void prof_hist_add(ghl_prof_hist_t *hist, uint64_t ns);
+static void prof_record(ghl_prof_t *prof, ghl_prof_hist_t *hist, uint64_t start, const char *what, int id);
+static ghl_prof_timer_t *prof_timer(ghl_prof_t *prof, ghl_timerfun_t *fun);
+
+/* adds to a virtual connection counter, and to the server total */
+#define CONN_STAT_ADD(ch, field, n) do { (ch)->stats.field += (n); (ch)->serv->stats.conn.field += (n); } while (0)
 static int handle_auth(int type, void *payload, unsigned int length, void *privdata);
 static int handle_ip_lookup(int type, void *payload, unsigned int length, void *privdata, unsigned int user_id, struct sockaddr_in *remote);
 static int handle_roominfo(int type, void *payload, unsigned int length, void *privdata, unsigned int user_id, struct sockaddr_in *remote);
@@ -66,6 +111,8 @@ static void send_hello_to_members(ghl_room_t *rh);
 static int handle_room_join(int type, void *payload, unsigned int length, void *privdata, void *roomdata);
 static int handle_room_activity(int type, void *payload, unsigned int length, void *privdata, void *roomdata);
 static void update_rto(gtime_t rtt, ghl_ch_t *ch);
+static void rtt_sample(ghl_member_t *member, gtime_t rtt);
+static void conn_process_ack(ghl_serv_t *serv, ghl_ch_t *ch, int seq1, int seq2, int explicit, gtime_t ack_delay);
 static int set_nonblock(int sock);
               
 
@@ -80,12 +127,52 @@ static int set_nonblock(int sock);
  * @return Number of users, or -1 for error.
  */
 int ghl_num_members(ghl_serv_t *serv, unsigned int room_id) {
-  int *num_members = ihash_get(serv->roominfo, room_id);
-  if (num_members == NULL) {
+  ghl_roominfo_table_t *table = &serv->roominfo;
+  unsigned int i = roominfo_lookup(table, room_id >> 8);
+  unsigned int suffix = room_id & 0xFF;
+  
+  if ((i == table->num_pages) || (table->pages[i].prefix != (room_id >> 8)) || 
+      !(table->pages[i].known[suffix >> 3] & (1 << (suffix & 7)))) {
     garena_errno = GARENA_ERR_NOTFOUND;
     return -1;
   }
-  return *num_members;
+  return table->pages[i].num_users[suffix];
+}
+
+/**
+ * Gets the user count of the known rooms, sorted by room ID. To walk the whole table,
+ * call it first with first_room_id set to 0, then with the last returned room ID plus one,
+ * until it returns less than max rooms. The table is updated every 
+ * @ref GHL_ROOMINFO_QUERY_INTERVAL milliseconds, use @ref GHL_EV_ROOMINFO to know 
+ * what changed.
+ *
+ * @param serv The server handle
+ * @param first_room_id The lowest room ID to return
+ * @param rooms Array in which to store the rooms
+ * @param max Size of the array
+ * @return The number of stored rooms
+ */
+int ghl_roominfo_snapshot(ghl_serv_t *serv, unsigned int first_room_id, ghl_roominfo_t *rooms, unsigned int max) {
+  ghl_roominfo_table_t *table = &serv->roominfo;
+  ghl_roominfo_page_t *page;
+  unsigned int i;
+  unsigned int suffix;
+  unsigned int num = 0;
+  
+  for (i = roominfo_lookup(table, first_room_id >> 8); i < table->num_pages; i++) {
+    page = &table->pages[i];
+    suffix = (page->prefix == (first_room_id >> 8)) ? (first_room_id & 0xFF) : 0;
+    for (; suffix < 256; suffix++) {
+      if (!(page->known[suffix >> 3] & (1 << (suffix & 7))))
+        continue;
+      if (num == max)
+        return num;
+      rooms[num].room_id = (page->prefix << 8) | suffix;
+      rooms[num].num_users = page->num_users[suffix];
+      num++;
+    }
+  }
+  return num;
 }
 
 /**
@@ -93,8 +180,13 @@ int ghl_num_members(ghl_serv_t *serv, unsigned int room_id) {
  * Called by garena_fini(), should not be called directly.
  */
 void ghl_fini(void) {
-  if (timers != NULL)
-    llist_free_val(timers);
+  ilist_node_t *node;
+  if (timers.next == NULL)
+    return; /* ghl_init() was not called */
+  while ((node = ilist_head(&timers)) != NULL) {
+    ilist_del(node);
+    free(ilist_entry(node, ghl_timer_t, node));
+  }
 }
 
 /**
@@ -104,11 +196,7 @@ void ghl_fini(void) {
  */
 
 int ghl_init(void) {
-  timers = llist_alloc();
-  if (timers == NULL) {
-    garena_errno = GARENA_ERR_NORESOURCE;
-    return -1;
-  }
+  ilist_init(&timers);
   return 0;
 }
 
@@ -135,40 +223,14 @@ int ghl_init(void) {
  */
  
 ghl_serv_t *ghl_new_serv(const char *name, const char *password, int server_ip, int server_port, int gp2pp_lport, int gp2pp_rport, int mtu) {
-  int i;
   unsigned int local_len = sizeof(struct sockaddr_in);
   MHASH mh;
   struct sockaddr_in local;
   struct sockaddr_in fsocket;
-  ghl_serv_t *serv = malloc(sizeof(ghl_serv_t));
-  if (serv == NULL) {
-    garena_errno = GARENA_ERR_NORESOURCE;
+  ghl_serv_t *serv = serv_alloc(server_ip, gp2pp_lport, gp2pp_rport, mtu);
+  if (serv == NULL)
     return NULL;
-  }
-  serv->room = NULL;
-  serv->gp2pp_htab = NULL;
-  serv->gcrp_htab = NULL;
-  serv->gsp_htab = NULL;
-  serv->peersock = -1;
-  serv->gp2pp_lport = gp2pp_lport ? gp2pp_lport : GP2PP_PORT;
-  serv->gp2pp_rport = gp2pp_rport ? gp2pp_rport : GP2PP_PORT;
-  serv->mtu = mtu ? mtu : GP2PP_DEFAULT_MTU;
-  serv->hello_timer = NULL;
-  serv->roominfo_timer = NULL;
-  serv->conn_retrans_timer = NULL;
-  serv->auth_ok = 0;
-  serv->need_free = 0;
-  serv->lookup_ok = 0;
-  serv->connected = 0;
-  serv->server_ip = server_ip;
-  serv->roominfo = NULL;  
   serv->servsock = socket(PF_INET, SOCK_STREAM, 0);
-  memset(&serv->my_info, 0, sizeof(serv->my_info));
-  serv->roominfo = ihash_init();
-  if (serv->roominfo == NULL) {
-    garena_errno = GARENA_ERR_NORESOURCE;
-    goto err;
-  }
   
   if (serv->servsock == -1) {
     garena_errno = GARENA_ERR_LIBC;
@@ -219,6 +281,8 @@ ghl_serv_t *ghl_new_serv(const char *name, const char *password, int server_ip,
     goto err;
   }
   set_nonblock(serv->peersock);
+  if (gp2pp_set_stats(serv->peersock, &serv->stats.gp2pp) == -1)
+    goto err;
 
   fsocket.sin_family = AF_INET;
   fsocket.sin_port = server_port ? htons(server_port) : htons(GSP_PORT);
@@ -232,7 +296,8 @@ ghl_serv_t *ghl_new_serv(const char *name, const char *password, int server_ip,
     goto err;
   if (gsp_send_hello(serv->servsock, serv->session_key, serv->session_iv) == -1)
     goto err;
-  if (gp2pp_do_ip_lookup(serv->peersock, serv->server_ip, GP2PP_PORT) == -1)
+  serv->stats.gsp_tx_msgs += 2;
+  if (gp2pp_do_ip_lookup(serv->peersock, serv->server_ip, serv->gp2pp_rport) == -1)
     goto err;
 
   mh = mhash_init(MHASH_MD5);
@@ -244,83 +309,141 @@ ghl_serv_t *ghl_new_serv(const char *name, const char *password, int server_ip,
   
   if (gsp_send_login(serv->servsock, name, serv->md5pass, serv->session_key, serv->session_iv, serv->my_info.internal_ip.s_addr, serv->my_info.internal_port) == -1)
     goto err;
+  serv->stats.gsp_tx_msgs++;
   
+  if (serv_setup(serv) == -1)
+    goto err;
+  if (ghl_trace_env(serv) == -1)
+    goto err;
+  return serv;
+
+err:
+  serv_abort(serv);
+  return NULL;
+}
+
+/* allocates a server handle and initializes its fields, the sockets are left to the caller */
+static ghl_serv_t *serv_alloc(int server_ip, int gp2pp_lport, int gp2pp_rport, int mtu) {
+  int i;
+  ghl_serv_t *serv = alloc_aligned(sizeof(ghl_serv_t));
+  if (serv == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
   serv->room = NULL;
-  
+  serv->gp2pp_htab = NULL;
+  serv->gcrp_htab = NULL;
+  serv->gsp_htab = NULL;
+  serv->peersock = -1;
+  serv->servsock = -1;
+  serv->gp2pp_lport = gp2pp_lport ? gp2pp_lport : GP2PP_PORT;
+  serv->gp2pp_rport = gp2pp_rport ? gp2pp_rport : GP2PP_PORT;
+  serv->mtu = mtu ? mtu : GP2PP_DEFAULT_MTU;
+  serv->roominfo_timer = NULL;
+  serv->conn_retrans_timer = NULL;
+  serv->servconn_timeout = NULL;
+  serv->relay_enabled = 0;
+  serv->relay_timer = NULL;
+  serv->routes = NULL;
+  serv->auth_ok = 0;
+  serv->need_free = 0;
+  serv->lookup_ok = 0;
+  serv->connected = 0;
+  serv->server_ip = server_ip;
+  memset(&serv->roominfo, 0, sizeof(serv->roominfo));
+  memset(&serv->stats, 0, sizeof(serv->stats));
+  serv->metrics_sock = -1;
+  for (i = 0; i < GHL_METRICS_MAX_CLIENTS; i++) {
+    serv->metrics_clients[i] = -1;
+    serv->metrics_out[i] = NULL;
+  }
+  serv->prof = NULL;
+  serv->trace = NULL;
+  serv->rng = (garena_now_ns() ^ (uintptr_t) serv) | 1; /* xorshift needs a non-zero state */
+  memset(&serv->my_info, 0, sizeof(serv->my_info));
   for (i = 0 ; i < GHL_EV_NUM; i++) {
     serv->ghl_handlers[i].fun = NULL;
     serv->ghl_handlers[i].privdata = NULL;
   }
+  return serv;
+}
+
+/* allocates the protocol handler tables, registers the handlers, and starts the server timers */
+static int serv_setup(ghl_serv_t *serv) {
+  serv->routes = gp2pp_alloc_routes();
+  if ((serv->routes == NULL) || (gp2pp_set_routes(serv->peersock, serv->routes) == -1))
+    return -1;
   serv->gcrp_htab = gcrp_alloc_handtab();
   if (serv->gcrp_htab == NULL)
-    goto err;
+    return -1;
   serv->gp2pp_htab = gp2pp_alloc_handtab();
   if (serv->gp2pp_htab == NULL)
-    goto err;
+    return -1;
   serv->gsp_htab = gsp_alloc_handtab();
   if (serv->gsp_htab == NULL)
-    goto err;
+    return -1;
   
   /* GSP handlers */
   if (gsp_register_handler(serv->gsp_htab, GSP_MSG_LOGIN_REPLY, handle_auth, serv) == -1)
-    goto err;
+    return -1;
   if (gsp_register_handler(serv->gsp_htab, GSP_MSG_AUTH_FAIL, handle_auth, serv) == -1)
-    goto err;
+    return -1;
   
   /* GCRP handlers */
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_SYSTEM, handle_room_activity, serv) == -1)
-    goto err;
+    return -1;
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_MEMBERS, handle_room_join, serv) == -1)
-    goto err;
+    return -1;
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_JOIN, handle_room_activity, serv) == -1)
-    goto err;
+    return -1;
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_PART, handle_room_activity, serv) == -1)
-    goto err;
+    return -1;
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_TALK, handle_room_activity, serv) == -1)
-    goto err;
+    return -1;
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_STARTVPN, handle_room_activity, serv) == -1)
-    goto err;
+    return -1;
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_STOPVPN, handle_room_activity, serv) == -1)
-    goto err;
+    return -1;
   if (gcrp_register_handler(serv->gcrp_htab, GCRP_MSG_JOIN_FAILED, handle_room_join, serv) == -1)
-    goto err;
+    return -1;
     
     /* GP2PP handlers */
   if (gp2pp_register_handler(serv->gp2pp_htab, GP2PP_MSG_UDP_ENCAP, handle_peer_msg, serv) == -1)
-    goto err;
+    return -1;
   if (gp2pp_register_handler(serv->gp2pp_htab, GP2PP_MSG_HELLO_REQ, handle_peer_msg, serv) == -1)
-    goto err;
+    return -1;
   if (gp2pp_register_handler(serv->gp2pp_htab, GP2PP_MSG_HELLO_REP, handle_peer_msg, serv) == -1)
-    goto err;
+    return -1;
+  if (gp2pp_register_handler(serv->gp2pp_htab, GP2PP_MSG_RELAY, handle_relay_msg, serv) == -1)
+    return -1;
   if (gp2pp_register_handler(serv->gp2pp_htab, GP2PP_MSG_INITCONN, handle_initconn_msg, serv) == -1)
-    goto err;
+    return -1;
   if (gp2pp_register_handler(serv->gp2pp_htab, GP2PP_MSG_ROOMINFO_REPLY, handle_roominfo, serv) == -1)
-    goto err;
+    return -1;
   if (gp2pp_register_handler(serv->gp2pp_htab, GP2PP_MSG_IP_LOOKUP_REPLY, handle_ip_lookup, serv) == -1)
-    goto err;
+    return -1;
 
   /* GP2PP CONN handlers */
 
   if (gp2pp_register_conn_handler(serv->gp2pp_htab, GP2PP_CONN_MSG_DATA, handle_conn_data_msg, serv) == -1)
-    goto err;
+    return -1;
   if (gp2pp_register_conn_handler(serv->gp2pp_htab, GP2PP_CONN_MSG_FIN, handle_conn_fin_msg, serv) == -1)
-    goto err;
+    return -1;
   if (gp2pp_register_conn_handler(serv->gp2pp_htab, GP2PP_CONN_MSG_ACK, handle_conn_ack_msg, serv) == -1)
-    goto err;
+    return -1;
 
   /* timers handlers */
-  if ((serv->hello_timer = ghl_new_timer(garena_now() + GP2PP_HELLO_INTERVAL, do_hello, serv)) == NULL)
-    goto err;
-  if ((serv->conn_retrans_timer = ghl_new_timer(garena_now() + GP2PP_CONN_RETRANS_CHECK, do_conn_retrans, serv)) == NULL)
-    goto err;
-  if ((serv->roominfo_timer = ghl_new_timer(garena_now() + GHL_ROOMINFO_QUERY_INTERVAL, do_roominfo_query, serv)) == NULL)
-    goto err;
-  if ((serv->servconn_timeout = ghl_new_timer(garena_now() + GHL_SERVCONN_TIMEOUT, handle_servconn_timeout, serv)) == NULL)
-    goto err;
-    
-  return serv;
+  if ((serv->conn_retrans_timer = ghl_new_timer_ms(garena_now_ms() + GP2PP_CONN_RETRANS_CHECK, do_conn_retrans, serv)) == NULL)
+    return -1;
+  if ((serv->roominfo_timer = ghl_new_timer_ms(garena_now_ms() + GHL_ROOMINFO_QUERY_INTERVAL, do_roominfo_query, serv)) == NULL)
+    return -1;
+  if ((serv->servconn_timeout = ghl_new_timer_ms(garena_now_ms() + GHL_SERVCONN_TIMEOUT, handle_servconn_timeout, serv)) == NULL)
+    return -1;
+  return 0;
+}
 
-err:
+/* frees a server handle that could not be completely set up */
+static void serv_abort(ghl_serv_t *serv) {
   if (serv->gp2pp_htab)
     free(serv->gp2pp_htab);
   if (serv->gcrp_htab)
@@ -329,19 +452,49 @@ err:
     free(serv->gsp_htab);
   if (serv->servsock != -1)
     close(serv->servsock);
-  if (serv->peersock != -1)
+  if (serv->peersock != -1) {
+    gp2pp_set_stats(serv->peersock, NULL);
+    gp2pp_set_routes(serv->peersock, NULL);
     close(serv->peersock);
-  if (serv->hello_timer)
-    ghl_free_timer(serv->hello_timer);
+  }
+  gp2pp_free_routes(serv->routes);
   if (serv->conn_retrans_timer)
     ghl_free_timer(serv->conn_retrans_timer);
   if (serv->roominfo_timer)
     ghl_free_timer(serv->roominfo_timer);
   if (serv->servconn_timeout)
     ghl_free_timer(serv->servconn_timeout);
-  if (serv->roominfo)
-    ihash_free_val(serv->roominfo);
+  free(serv->roominfo.pages);
   free(serv);
+}
+
+/**
+ * Creates a server handle for replaying a trace (internal, see trace.c): the handle has the
+ * state of a server handle just created by ghl_new_serv(), but its sockets are not connected
+ * (nothing is sent while replaying).
+ */
+ghl_serv_t *ghl_replay_serv(int server_ip, int gp2pp_lport, int gp2pp_rport, int mtu, struct in_addr internal_ip, int internal_port, unsigned char *key, unsigned char *iv) {
+  ghl_serv_t *serv = serv_alloc(server_ip, gp2pp_lport, gp2pp_rport, mtu);
+  if (serv == NULL)
+    return NULL;
+  serv->servsock = socket(PF_INET, SOCK_STREAM, 0);
+  serv->peersock = socket(PF_INET, SOCK_DGRAM, 0);
+  if ((serv->servsock == -1) || (serv->peersock == -1)) {
+    garena_errno = GARENA_ERR_LIBC;
+    goto err;
+  }
+  if (gp2pp_set_stats(serv->peersock, &serv->stats.gp2pp) == -1)
+    goto err;
+  serv->my_info.internal_ip = internal_ip;
+  serv->my_info.internal_port = internal_port;
+  memcpy(serv->session_key, key, GSP_KEYSIZE);
+  memcpy(serv->session_iv, iv, GSP_IVSIZE);
+  if (serv_setup(serv) == -1)
+    goto err;
+  return serv;
+
+err:
+  serv_abort(serv);
   return NULL;
 }
 
@@ -380,16 +533,14 @@ ghl_room_t *ghl_join_room(ghl_serv_t *serv, int room_ip, int room_port, unsigned
     garena_errno = GARENA_ERR_INUSE;
     return NULL;
   }
-  rh = malloc(sizeof(ghl_room_t));
-  if (rh == NULL) {
-    garena_errno = GARENA_ERR_NORESOURCE;
+  rh = room_alloc(serv, room_id);
+  if (rh == NULL)
     return NULL;
-  }
   
   rh->roomsock = socket(PF_INET, SOCK_STREAM, 0);
   if (rh->roomsock == -1) {
     garena_errno = GARENA_ERR_LIBC;
-    free(rh);
+    room_abort(rh);
     return NULL;
   }
   
@@ -399,42 +550,94 @@ ghl_room_t *ghl_join_room(ghl_serv_t *serv, int room_ip, int room_port, unsigned
   
   if (connect(rh->roomsock, (struct sockaddr *) &fsocket, sizeof(fsocket)) == -1) {
     garena_errno = GARENA_ERR_LIBC;
-    close(rh->roomsock);
-    free(rh);
+    room_abort(rh);
     return NULL;
   }
   set_nonblock(rh->roomsock);
   myinfo_pack(&join_block, &serv->my_info);
   if (gcrp_send_join(rh->roomsock, room_id, &join_block, serv->md5pass) == -1) {
-    close(rh->roomsock);
-    free(rh);
+    room_abort(rh);
+    return NULL;
+  }
+  rh->stats.tx_msgs++;
+
+  serv->room = rh;
+  fflush(deb);
+  rh->timeout = ghl_new_timer_ms(garena_now_ms() + GHL_JOIN_TIMEOUT, handle_room_join_timeout, rh);
+  if (serv->trace)
+    ghl_trace_call(serv, GHL_TRACE_JOIN, room_id, 0, 0);
+  return(rh);
+}
+
+/*
+ * Creates a room handle for replaying a trace (internal, see private.h): the handle is in the
+ * state of a room just joined with ghl_join_room(), but its socket is not connected.
+ */
+ghl_room_t *ghl_replay_room(ghl_serv_t *serv, unsigned int room_id) {
+  ghl_room_t *rh;
+
+  if (serv->room != NULL) {
+    garena_errno = GARENA_ERR_INUSE;
+    return NULL;
+  }
+  rh = room_alloc(serv, room_id);
+  if (rh == NULL)
+    return NULL;
+  rh->roomsock = socket(PF_INET, SOCK_STREAM, 0);
+  if (rh->roomsock == -1) {
+    garena_errno = GARENA_ERR_LIBC;
+    room_abort(rh);
     return NULL;
   }
+  rh->stats.tx_msgs++;
+  serv->room = rh;
+  rh->timeout = ghl_new_timer_ms(garena_now_ms() + GHL_JOIN_TIMEOUT, handle_room_join_timeout, rh);
+  return rh;
+}
 
+/* allocates a room handle and initializes its fields, the socket is left to the caller */
+static ghl_room_t *room_alloc(ghl_serv_t *serv, unsigned int room_id) {
+  ghl_room_t *rh = alloc_aligned(sizeof(ghl_room_t));
+  if (rh == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
+  memset(&rh->stats, 0, sizeof(rh->stats));
+  rh->roomsock = -1;
   rh->serv = serv;
   rh->joined = 0;
   rh->room_id = room_id;
   rh->me = NULL;
+  rh->member_chunks = NULL;
+  rh->free_members = NULL;
+  rh->num_free_members = 0;
+  rh->conns = NULL;
+  rh->timeout = NULL;
+  memset(&rh->cols, 0, sizeof(rh->cols));
   
   rh->members = ihash_init();
   if (rh->members == NULL) {
     garena_errno = GARENA_ERR_NORESOURCE;
-    close(rh->roomsock);
     free(rh);
     return NULL;
   }
   rh->conns = ihash_init();
   if (rh->conns == NULL) {
     garena_errno = GARENA_ERR_NORESOURCE;
-    close(rh->roomsock);
-    free(rh->members);
+    ihash_free(rh->members);
     free(rh);
     return NULL;
   }
-  serv->room = rh;
-  fflush(deb);
-  rh->timeout = ghl_new_timer(garena_now() + GHL_JOIN_TIMEOUT, handle_room_join_timeout, rh);
-  return(rh);
+  return rh;
+}
+
+/* frees a room handle that could not be joined */
+static void room_abort(ghl_room_t *rh) {
+  if (rh->roomsock != -1)
+    close(rh->roomsock);
+  ihash_free(rh->conns);
+  ihash_free(rh->members);
+  free(rh);
 }
 
 /**
@@ -456,6 +659,79 @@ ghl_member_t *ghl_member_from_id(ghl_room_t *rh, unsigned int user_id) {
   return member;
 }
 
+/**
+ * Get the link quality figures of a member, computed from HELLO replies and from
+ * virtual connections RTT samples.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_NOTFOUND: No RTT sample is available yet for this member
+ *
+ * @param member The member
+ * @param quality Pointer to the structure to fill
+ * @return 0 for success, -1 for failure
+ */
+int ghl_member_get_quality(ghl_member_t *member, ghl_quality_t *quality) {
+  ghl_rtt_stats_t *st = &member->rtt_stats;
+  unsigned int i;
+  unsigned int sum = 0;
+  unsigned int target;
+  unsigned int lo;
+  
+  if (st->samples == 0) {
+    garena_errno = GARENA_ERR_NOTFOUND;
+    return -1;
+  }
+  quality->samples = st->samples;
+  quality->min_rtt = st->min;
+  quality->avg_rtt = st->srtt8 >> 3;
+  quality->jitter = st->jitter16 >> 4;
+  quality->loss = st->hello_sent ? ((st->hello_lost * 1000) / st->hello_sent) : 0;
+  
+  /* p95: find the bucket, then interpolate linearly inside it */
+  target = (st->samples * 95 + 99) / 100;
+  for (i = 0; i < GHL_RTT_BUCKETS - 1; i++) {
+    if (sum + st->hist[i] >= target)
+      break;
+    sum += st->hist[i];
+  }
+  lo = i ? (1 << i) : 0;
+  if (i == GHL_RTT_BUCKETS - 1)
+    quality->p95_rtt = lo;
+  else quality->p95_rtt = lo + (((2 << i) - lo) * (target - sum)) / st->hist[i];
+  return 0;
+}
+
+/**
+ * Selects the room members matching some criteria. This scans the member columns 
+ * (see @ref ghl_member_cols_t), which is much faster than walking the members hashtable.
+ * Our own member is never selected.
+ *
+ * @param rh The room handle
+ * @param flags The criteria (GHL_SELECT_..., ORed together), 0 to select all members
+ * @param members Array in which to store the selected members
+ * @param max Size of the array
+ * @return The number of selected members, which may be greater than max (in which case
+ * only the max first are stored)
+ */
+int ghl_members_select(ghl_room_t *rh, int flags, ghl_member_t **members, unsigned int max) {
+  ghl_member_cols_t *cols = &rh->cols;
+  uint8_t need_vpn = (flags & GHL_SELECT_VPN) ? 1 : 0;
+  uint8_t need_conn = (flags & GHL_SELECT_REACHABLE) ? 2 : 0;
+  uint32_t my_id = rh->serv->my_info.user_id;
+  unsigned int num = 0;
+  unsigned int i;
+  
+  for (i = 0; i < cols->size; i++) {
+    if ((cols->vpn[i] >= need_vpn) && (cols->conn_ok[i] >= need_conn) && cols->member[i] && (cols->user_id[i] != my_id)) {
+      if (num < max)
+        members[num] = cols->member[i];
+      num++;
+    }
+  }
+  return num;
+}
+
 /**
  * Find a virtual connection from the connection ID.
  *
@@ -490,6 +766,8 @@ int ghl_leave_room(ghl_room_t *rh) {
   if (gcrp_send_part(rh->roomsock, rh->serv->my_info.user_id) == -1) {
     return -1;
   }
+  if (rh->serv->trace)
+    ghl_trace_call(rh->serv, GHL_TRACE_LEAVE, 0, 0, 0);
   return ghl_free_room(rh);
 }
 
@@ -507,7 +785,10 @@ int ghl_leave_room(ghl_room_t *rh) {
  */
 
 int ghl_togglevpn(ghl_room_t *rh, int vpn) {
-  return gcrp_send_togglevpn(rh->roomsock, rh->serv->my_info.user_id, vpn);
+  if (gcrp_send_togglevpn(rh->roomsock, rh->serv->my_info.user_id, vpn) == -1)
+    return -1;
+  rh->stats.tx_msgs++;
+  return 0;
 }
 
 /**
@@ -523,7 +804,10 @@ int ghl_togglevpn(ghl_room_t *rh, int vpn) {
  * @return 0 for success, -1 for failure.
  */
 int ghl_talk(ghl_room_t *rh, char *text) {
-  return gcrp_send_talk(rh->roomsock, rh->room_id, rh->serv->my_info.user_id, text);  
+  if (gcrp_send_talk(rh->roomsock, rh->room_id, rh->serv->my_info.user_id, text) == -1)
+    return -1;
+  rh->stats.tx_msgs++;
+  return 0;
 }
 
 /**
@@ -568,6 +852,11 @@ int ghl_udp_encap(ghl_serv_t *serv, ghl_member_t *member, int sport, int dport,
  * @return Max fd for success, -1 for failure
  */
 int ghl_fill_fds(ghl_serv_t *serv, fd_set *fds) {
+  return fill_fds(serv, fds, NULL);
+}
+
+/* also fills wfds (if not NULL) with the sockets that have output pending */
+static int fill_fds(ghl_serv_t *serv, fd_set *fds, fd_set *wfds) {
   int max = -1;
   
   if (serv->room) {
@@ -584,25 +873,53 @@ int ghl_fill_fds(ghl_serv_t *serv, fd_set *fds) {
     if (serv->servsock > max)
       max = serv->servsock;
   }
+  if (serv->metrics_sock != -1)
+    max = ghl_metrics_fill_fds(serv, fds, wfds, max);
   return max;
 }
 
 
+/* number of pending timers, of all the servers (internal, see private.h) */
+unsigned int ghl_num_timers(void) {
+  ilist_node_t *node;
+  unsigned int num = 0;
+  for (node = ilist_head(&timers); node; node = ilist_next(&timers, node))
+    num++;
+  return num;
+}
+
 /**
- * Fills tv with the time remaining until next timer event
+ * Fills tv with the time remaining until next timer event (or until the next message
+ * held back by the impairment layer is due, see gp2pp_set_impair()). While a metrics
+ * response is being sent, the delay is at most GHL_METRICS_POLL.
  *
  * @param tv struct timeval to fill
  * @return 0 if no next timer is found, 1 otherwise
  */
  
 int ghl_fill_tv(ghl_serv_t *serv, struct timeval *tv) {
-  ghl_timer_t *next;
-  int now = garena_now();
+  ilist_node_t *node;
+  gtime_t now = garena_now_ms();
+  gtime_t when;
+  gtime_t delay;
+  int pending = gp2pp_impair_next(&when);
   tv->tv_sec = 0;
   tv->tv_usec = 0;
-  next = llist_head(timers);
-  if (next) {
-    tv->tv_sec = (next->when > now) ? ((next->when) - now) : 0;
+  node = ilist_head(&timers);
+  if (node) {
+    if (!pending || gtime_after_eq(when, ilist_entry(node, ghl_timer_t, node)->when))
+      when = ilist_entry(node, ghl_timer_t, node)->when;
+    pending = 1;
+  }
+  if ((serv->metrics_sock != -1) && ghl_metrics_pending(serv)) {
+    if (!pending || gtime_after_eq(when, now + GHL_METRICS_POLL))
+      when = now + GHL_METRICS_POLL;
+    pending = 1;
+  }
+  if (pending) {
+    delay = gtime_after_eq(now, when) ? 0 : (when - now);
+    tv->tv_sec = delay / 1000;
+    tv->tv_usec = (delay % 1000) * 1000;
     return 1;
   }
   return 0;
@@ -627,45 +944,41 @@ int ghl_process(ghl_serv_t *serv, fd_set *fds) {
   char buf[GCRP_MAX_MSGSIZE];
   int r;
   fd_set myfds;
+  fd_set mywfds;
+  fd_set *wfds = NULL;
   struct sockaddr_in remote;
-  cell_t iter;
   struct timeval tv;
-  int stuff_to_do; 
-  int now = garena_now();
-  ghl_timer_t *cur;
   ghl_room_disc_t room_disc_ev;
   ghl_me_join_t join;  
-  /* process timers */
-  do {
-    stuff_to_do = 0;
-    for (iter = llist_iter(timers); iter; iter = llist_next(iter)) {
-      cur = llist_val(iter);
-      if (now >= cur->when) {
-        if (cur->fun(cur->privdata) == -1) {
-          perror("[GHL/ERR] a timer was not handled correctly");
-        }
-        ghl_free_timer(cur);
-        if (serv->need_free) {
-          garena_errno = GARENA_ERR_PROTOCOL;
-          ghl_free_serv(serv);
-          return -1;
-        }
-        stuff_to_do=1;
-        /* XXX FIXME */
-        break;
-      }
-    }
-  } while (stuff_to_do);
-  
+  uint64_t t_start = 0;
+  uint64_t t_busy = 0;
+  uint64_t t0;
+
+  if (serv->prof) {
+    t_start = garena_now_ns();
+    if (serv->prof->last_ns)
+      prof_record(serv->prof, &serv->prof->gap, serv->prof->last_ns, NULL, 0);
+  }
+  /* send the messages held back by the impairment layer (testing only) */
+  gp2pp_impair_flush();
+  if (ghl_run_timers(serv, garena_now_ms()) == -1)
+    return -1;
 
   /* process network activity */
   if (fds == NULL) {
     fds = &myfds;
+    wfds = &mywfds;
     FD_ZERO(&myfds);
-    r = ghl_fill_fds(serv, &myfds);
+    FD_ZERO(&mywfds);
+    r = fill_fds(serv, &myfds, &mywfds);
+    /* the time spent in select() is not part of the processing time */
+    if (t_start) {
+      t0 = garena_now_ns();
+      t_busy += t0 - t_start;
+    }
     if (ghl_fill_tv(serv, &tv)) {
-      IFDEBUG(printf("[GHL/DEBUG] Going to sleep, wake-up on network activity or at next timer (%u secs)\n", tv.tv_sec));
-      r = select(r+1, &myfds, NULL, NULL, &tv);
+      IFDEBUG(printf("[GHL/DEBUG] Going to sleep, wake-up on network activity or at next timer (%u msecs)\n", tv.tv_sec * 1000 + tv.tv_usec / 1000));
+      r = select(r+1, &myfds, &mywfds, NULL, &tv);
     } else { 
       IFDEBUG(printf("[GHL/DEBUG] Going to sleep, wake-up on network activity\n"));
       if (r == -1) {
@@ -673,7 +986,7 @@ int ghl_process(ghl_serv_t *serv, fd_set *fds) {
         garena_errno = GARENA_ERR_INVALID;
         return -1;
       }
-      r = select(r+1, &myfds, NULL, NULL, NULL);
+      r = select(r+1, &myfds, &mywfds, NULL, NULL);
     }
     if (r == -1) {
       garena_errno = GARENA_ERR_LIBC;
@@ -685,13 +998,16 @@ int ghl_process(ghl_serv_t *serv, fd_set *fds) {
     } else {
       IFDEBUG(printf("[GHL/DEBUG] Wake-up due to network activity\n"));
     }
+    if (t_start)
+      t_start = garena_now_ns();
   }
   
   
   if (serv->room && FD_ISSET(serv->room->roomsock, fds)) {
+    t0 = serv->prof ? garena_now_ns() : 0;
     r = gcrp_read(serv->room->roomsock, buf, GCRP_MAX_MSGSIZE);
     if (r != -1) {
-      gcrp_input(serv->gcrp_htab, buf, r, serv->room);
+      ghl_input(serv, GHL_PROF_INPUT_GCRP, buf, r, NULL);
     } else if ((garena_errno != GARENA_ERR_LIBC) || ((errno != EWOULDBLOCK) && (errno != EINTR))) {
       if (serv->room->joined) {
         room_disc_ev.rh = serv->room;
@@ -707,47 +1023,154 @@ int ghl_process(ghl_serv_t *serv, fd_set *fds) {
         ghl_free_room(serv->room);
       }
     }
+    if (t0 && serv->prof)
+      prof_record(serv->prof, &serv->prof->inputs[GHL_PROF_INPUT_GCRP], t0, "GCRP input", -1);
   }
 
 
   if (FD_ISSET(serv->peersock, fds)) {
+    t0 = serv->prof ? garena_now_ns() : 0;
     r = gp2pp_read(serv->peersock, buf, GCRP_MAX_MSGSIZE, &remote);
     if (r != -1) {
-      gp2pp_input(serv->gp2pp_htab, buf, r, &remote);
+      ghl_input(serv, GHL_PROF_INPUT_GP2PP, buf, r, &remote);
     } 
+    if (t0 && serv->prof)
+      prof_record(serv->prof, &serv->prof->inputs[GHL_PROF_INPUT_GP2PP], t0, "GP2PP input", -1);
   }
+  if (serv->metrics_sock != -1)
+    ghl_metrics_process(serv, fds, wfds);
   if ((serv->servsock != -1) && FD_ISSET(serv->servsock, fds)) {
+    t0 = serv->prof ? garena_now_ns() : 0;
     r = gsp_read(serv->servsock, buf, GSP_MAX_MSGSIZE);
     if (r != -1) {
-      gsp_input(serv->gsp_htab, buf, r, serv->session_key, serv->session_iv);
+      if (ghl_input(serv, GHL_PROF_INPUT_GSP, buf, r, NULL) == -1)
+        return -1;
     } else if ((garena_errno != GARENA_ERR_LIBC) || ((errno != EWOULDBLOCK) && (errno != EINTR))) {
       fprintf(deb, "[WARN/GHL] Disconnected from main server, but we don't care\n");
       fflush(deb);
       close(serv->servsock);
       serv->servsock = -1;
     }
+    if (t0 && serv->prof)
+      prof_record(serv->prof, &serv->prof->inputs[GHL_PROF_INPUT_GSP], t0, "GSP input", -1);
   }
 
+  if (serv->prof) {
+    t0 = garena_now_ns();
+    if (t_start) {
+      t_busy += t0 - t_start;
+      prof_record(serv->prof, &serv->prof->process, t0 - t_busy, "ghl_process()", -1);
+    }
+    serv->prof->last_ns = t0;
+  }
   return 0;
 }
 
 
-
-/**
- * Register a handler to be called on the specified event
- *
- * @par Errors
- *
- * @li GARENA_ERR_INVALID: You attempted to set a handler for an invalid event.
- * @li GARENA_ERR_INUSE: The event has already a handler.
- *
- * @param msgtype The event for which we define a handler
- * @param fun Pointer to handler function
- * @param privdata Pointer to private data (anything you want) that will be supplied to the called function
- * @return 0 for success, -1 for failure
+/*
+ * Runs the expired timers of all the servers (internal, see private.h). Returns -1 if the server
+ * handle was freed by a timer (see ghl_serv_t::need_free).
  */
- 
-int ghl_register_handler(ghl_serv_t *serv, int event, ghl_fun_t *fun, void *privdata) {
+int ghl_run_timers(ghl_serv_t *serv, gtime_t now) {
+  ilist_node_t *node;
+  ghl_timer_t *cur;
+  ghl_timerfun_t *fun;
+  uint64_t t0;
+
+  /* process timers, the list is sorted so the expired ones are at the head */
+  while ((node = ilist_head(&timers)) != NULL) {
+    cur = ilist_entry(node, ghl_timer_t, node);
+    if (!gtime_after_eq(now, cur->when))
+      break;
+    serv->stats.timer_fires++;
+    serv->stats.timer_lag_total += (gtime_t) (now - cur->when);
+    if ((gtime_t) (now - cur->when) > serv->stats.timer_lag_max)
+      serv->stats.timer_lag_max = now - cur->when;
+    fun = cur->fun;
+    t0 = 0;
+    if (serv->prof) {
+      prof_hist_add(&serv->prof->timer_lag, (uint64_t) (gtime_t) (now - cur->when) * 1000000);
+      t0 = garena_now_ns();
+    }
+    if (fun(cur->privdata) == -1) {
+      perror("[GHL/ERR] a timer was not handled correctly");
+    }
+    if (t0 && serv->prof)
+      prof_record(serv->prof, &prof_timer(serv->prof, fun)->hist, t0, "timer", -1);
+    ghl_free_timer(cur);
+    if (serv->need_free) {
+      garena_errno = GARENA_ERR_PROTOCOL;
+      ghl_free_serv(serv);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* returns 1 and the expiration of the next timer, of all the servers, or 0 if there is no timer (internal, see private.h) */
+int ghl_next_timer(gtime_t *when) {
+  ilist_node_t *node = ilist_head(&timers);
+  if (node == NULL)
+    return 0;
+  *when = ilist_entry(node, ghl_timer_t, node)->when;
+  return 1;
+}
+
+/*
+ * Dispatches a message read from one of the server sockets (internal, see private.h), proto
+ * is a GHL_PROF_INPUT_* value, and remote the sender of the GP2PP messages. Returns -1 if
+ * the server handle was freed (see ghl_serv_t::need_free).
+ */
+int ghl_input(ghl_serv_t *serv, int proto, char *buf, unsigned int length, struct sockaddr_in *remote) {
+  unsigned int i;
+
+  if (serv->trace)
+    ghl_trace_input(serv, proto, buf, length, remote);
+  switch (proto) {
+    case GHL_PROF_INPUT_GCRP:
+      if (length >= sizeof(gcrp_hdr_t)) {
+        i = ((gcrp_hdr_t *) buf)->msgtype;
+        if (i > GCRP_MSG_NUM)
+          i = GCRP_MSG_NUM;
+        serv->room->stats.rx_msgs[i]++;
+        serv->room->stats.rx_bytes[i] += length;
+      }
+      gcrp_input(serv->gcrp_htab, buf, length, serv->room);
+      break;
+    case GHL_PROF_INPUT_GP2PP:
+      gp2pp_input(serv->gp2pp_htab, buf, length, remote);
+      break;
+    case GHL_PROF_INPUT_GSP:
+      serv->stats.gsp_rx_msgs++;
+      serv->stats.gsp_rx_bytes += length;
+      gsp_input(serv->gsp_htab, buf, length, serv->session_key, serv->session_iv);
+      if (serv->need_free) {
+        garena_errno = GARENA_ERR_PROTOCOL;
+        ghl_free_serv(serv);
+        return -1;
+      }
+      break;
+  }
+  return 0;
+}
+
+
+
+/**
+ * Register a handler to be called on the specified event
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INVALID: You attempted to set a handler for an invalid event.
+ * @li GARENA_ERR_INUSE: The event has already a handler.
+ *
+ * @param msgtype The event for which we define a handler
+ * @param fun Pointer to handler function
+ * @param privdata Pointer to private data (anything you want) that will be supplied to the called function
+ * @return 0 for success, -1 for failure
+ */
+ 
+int ghl_register_handler(ghl_serv_t *serv, int event, ghl_fun_t *fun, void *privdata) {
   if ((event < 0) || (event >= GHL_EV_NUM)) {
     garena_errno = GARENA_ERR_INVALID;
     return -1;
@@ -764,21 +1187,40 @@ int ghl_register_handler(ghl_serv_t *serv, int event, ghl_fun_t *fun, void *priv
 
 /**
  * Add a new timer.
+ * Kept for compatibility, the timer resolution is 1/100th of seconds. 
+ * Use ghl_new_timer_ms() for a better resolution.
  *
  * @par Errors
  *
  * @li GARENA_ERR_NORESOURCE: A resource allocation faileD.
  *
- * @param when When the timer should expire (in seconds since the Epoch)
+ * @param when When the timer should expire (in 1/100th of seconds, see garena_now())
  * @param fun Pointer to the function to call on timer expiration
  * @param privdata Pointer to private data to pass to the handler function.
  * @return Pointer to the newly allocated timer, or NULL for error.
  *
  */
 ghl_timer_t * ghl_new_timer(int when, ghl_timerfun_t *fun, void *privdata) {
+  return ghl_new_timer_ms(when * 10, fun, privdata);
+}
+
+/**
+ * Add a new timer.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_NORESOURCE: A resource allocation faileD.
+ *
+ * @param when When the timer should expire (in milliseconds, see garena_now_ms())
+ * @param fun Pointer to the function to call on timer expiration
+ * @param privdata Pointer to private data to pass to the handler function.
+ * @return Pointer to the newly allocated timer, or NULL for error.
+ *
+ */
+ghl_timer_t * ghl_new_timer_ms(gtime_t when, ghl_timerfun_t *fun, void *privdata) {
   ghl_timer_t *tmp = malloc(sizeof(ghl_timer_t));
   ghl_timer_t *cur;
-  cell_t iter;
+  ilist_node_t *node;
   
   if (tmp == NULL) {
     garena_errno = GARENA_ERR_NORESOURCE;
@@ -787,16 +1229,13 @@ ghl_timer_t * ghl_new_timer(int when, ghl_timerfun_t *fun, void *privdata) {
   tmp->fun = fun;
   tmp->privdata = privdata;
   tmp->when = when;
-  for (iter = llist_iter(timers); iter; iter = llist_next(iter)) {
-    cur = llist_val(iter);
-    if (cur->when >= tmp->when)
+  /* new timers usually expire after the pending ones, so search from the tail */
+  for (node = ilist_tail(&timers); node; node = ilist_prev(&timers, node)) {
+    cur = ilist_entry(node, ghl_timer_t, node);
+    if (!gtime_after_eq(cur->when, tmp->when))
       break;
   }
-  if (iter) {
-    llist_add_before(timers, cur, tmp);
-  } else {
-    llist_add_tail(timers, tmp);
-  }
+  ilist_add_after(node ? node : &timers, &tmp->node);
   return tmp;
 }
 
@@ -862,7 +1301,7 @@ void* ghl_handler_privdata(ghl_serv_t *serv, int event) {
 void ghl_free_timer(ghl_timer_t *timer) {
   if (timer == NULL)
     return;
-  llist_del_item(timers, timer);
+  ilist_del(&timer->node);
   free(timer);
 }
 
@@ -878,25 +1317,111 @@ void ghl_free_serv(ghl_serv_t *serv) {
   /* free all rooms */
   if (serv->room)
     ghl_free_room(serv->room);
+  ghl_metrics_stop(serv);
+  ghl_prof_disable(serv);
+  ghl_trace_stop(serv);
+  gp2pp_impair_purge(serv->peersock);
+  gp2pp_set_stats(serv->peersock, NULL);
+  gp2pp_set_routes(serv->peersock, NULL);
+  gp2pp_free_routes(serv->routes);
   close(serv->peersock);
   if (serv->servsock != -1)
     close(serv->servsock);
   free(serv->gcrp_htab);
   free(serv->gp2pp_htab);
   free(serv->gsp_htab);
-  if (serv->hello_timer)
-    ghl_free_timer(serv->hello_timer);
   if (serv->conn_retrans_timer)
     ghl_free_timer(serv->conn_retrans_timer);
   if (serv->roominfo_timer)
     ghl_free_timer(serv->roominfo_timer);
   if (serv->servconn_timeout)
     ghl_free_timer(serv->servconn_timeout);
-  if (serv->roominfo)
-    ihash_free_val(serv->roominfo);
+  if (serv->relay_timer)
+    ghl_free_timer(serv->relay_timer);
+  free(serv->roominfo.pages);
   free(serv);
 }
 
+/**
+ * Enables or disables relay mode. In relay mode, the traffic to members that cannot be 
+ * reached directly (e.g. behind a symmetric NAT) is sent through the relay, which forwards 
+ * it to the member. The relay is the garena-relay program (tools/relay.c), libgarena peers
+ * do not forward the traffic of others. Only libgarena peers using the same relay can be
+ * reached this way.
+ * Direct communication is still attempted, and is used as soon as it works.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_NORESOURCE: A resource allocation failed.
+ *
+ * @param serv The server handle
+ * @param relay_ip The relay IP (network byte order), or 0 to disable relay mode
+ * @param relay_port The relay port (if 0, defaults to 1513)
+ * @return 0 for success, -1 for failure
+ */
+int ghl_set_relay(ghl_serv_t *serv, int relay_ip, int relay_port) {
+  ihashitem_t iter;
+  ghl_member_t *member;
+  struct sockaddr_in addr;
+  
+  if (serv->trace)
+    ghl_trace_call(serv, GHL_TRACE_RELAY, relay_ip, relay_port, 0);
+  if (serv->relay_timer) {
+    ghl_free_timer(serv->relay_timer);
+    serv->relay_timer = NULL;
+  }
+  if (relay_ip == 0) {
+    serv->relay_enabled = 0;
+    if (serv->room == NULL)
+      return 0;
+    for (iter = ihash_iter(serv->room->members); iter; iter = ihash_next(serv->room->members, iter)) {
+      member = ihash_val(iter);
+      addr.sin_addr = member->effective_ip;
+      addr.sin_port = htons(member->effective_port);
+      if (member->relayed || member_is_vaddr(serv, member, &addr)) {
+        if (member->relayed)
+          relay_member_stop(serv, member);
+        /* 
+         * the open connections use the effective address: send them to the first
+         * address that the reachability check tries, rather than to the virtual one
+         */
+        member->conn_ok = 0;
+        member->effective_ip.s_addr = member->external_ip.s_addr;
+        member->effective_port = member->external_port;
+        member_sync(member);
+        reach_check_start(serv, member);
+      }
+    }
+    return 0;
+  }
+  
+  serv->relay.sin_family = AF_INET;
+  serv->relay.sin_addr.s_addr = relay_ip;
+  serv->relay.sin_port = htons(relay_port ? relay_port : GP2PP_PORT);
+  serv->relay_enabled = 1;
+  do_relay_register(serv);
+  
+  if (serv->room == NULL)
+    return 0;
+  for (iter = ihash_iter(serv->room->members); iter; iter = ihash_next(serv->room->members, iter)) {
+    member = ihash_val(iter);
+    if (member->relayed) {
+      /* the relay may have changed */
+      member_vaddr(serv, member, &addr);
+      if (gp2pp_add_route(serv->routes, &addr, &serv->relay, serv->my_info.user_id, member->user_id) == -1)
+        return -1;
+      continue;
+    }
+    /* members that we already gave up on */
+    if ((member->user_id == serv->my_info.user_id) || (member->conn_ok == 2) || member->reach_timer)
+      continue;
+    if (relay_member_start(serv, member) == -1)
+      return -1;
+    send_hello(serv, member);
+  }
+  return 0;
+}
+
 /**
  *
  * Opens a virtual connection with a member.
@@ -915,6 +1440,14 @@ void ghl_free_serv(ghl_serv_t *serv) {
  * @return Pointer to the connection handle, or NULL for error.
  */
 ghl_ch_t *ghl_conn_connect(ghl_serv_t *serv, ghl_member_t *member, int port) {
+  ghl_ch_t *ch = ghl_conn_connect_id(serv, member, port, gp2pp_new_conn_id());
+  if ((ch != NULL) && serv->trace)
+    ghl_trace_call(serv, GHL_TRACE_CONNECT, member->user_id, port, ch->conn_id);
+  return ch;
+}
+
+/* opens a virtual connection with the given connection ID (internal, see private.h) */
+ghl_ch_t *ghl_conn_connect_id(ghl_serv_t *serv, ghl_member_t *member, int port, unsigned int conn_id) {
   struct sockaddr_in remote;
   ghl_ch_t *ch;
   ghl_room_t *rh = serv->room;
@@ -929,40 +1462,15 @@ ghl_ch_t *ghl_conn_connect(ghl_serv_t *serv, ghl_member_t *member, int port) {
     return NULL;
   }
   
-  ch = malloc(sizeof(ghl_ch_t));
-  if (ch == NULL) {
-    garena_errno = GARENA_ERR_NORESOURCE;
+  ch = conn_alloc(serv, member, conn_id);
+  if (ch == NULL)
     return NULL;
-  }
-  
-  ch->cstate = GHL_CSTATE_ESTABLISHED;
-  ch->member = member;
-  ch->ts_base = garena_now();
-  ch->sendq = llist_alloc();
-  ch->recvq = llist_alloc();
-  ch->serv = serv;
-  ch->snd_una = 0;
-  ch->snd_next = 0;
-  ch->rcv_next = 0;
-  ch->rto = GP2PP_INIT_RTO;
-  ch->srtt = 0;
-  ch->flightsize = 0;
-  ch->ssthresh = GP2PP_INIT_SSTHRESH;
-  ch->cwnd = (ghl_max_conn_pkt(serv) << 1); 
-  ch->rcv_next_deliver = 0;
-  ch->ts_ack = garena_now();
-  ch->conn_id = gp2pp_new_conn_id();
   ihash_put(rh->conns, ch->conn_id, ch);
   
-
-  remote.sin_family = AF_INET;
-  remote.sin_addr = ch->member->effective_ip;
-  remote.sin_port = htons(ch->member->effective_port);
+  conn_remote(ch, &remote);
   if (gp2pp_send_initconn(serv->peersock, serv->my_info.user_id, ch->conn_id, port, GP2PP_MAGIC_LOCALIP, &remote) == -1) {
-    llist_free(ch->sendq);
-    llist_free(ch->recvq);
     ihash_del(rh->conns, ch->conn_id);
-    free(ch);
+    conn_free(ch);
     return NULL;
   } else return ch;
 }
@@ -970,88 +1478,250 @@ ghl_ch_t *ghl_conn_connect(ghl_serv_t *serv, ghl_member_t *member, int port) {
 
 /**
  * Close a virtual connection. The packets in the send queue will still be retransmitted, and
- * then the resources will be free'd.
+ * then the resources will be free'd. 
+ * The data held back by small-write coalescing is queued first: if it can't be, the 
+ * connection is left open (no FIN is sent), and the close can be retried later.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_AGAIN: The held data could not be queued because the send queue is too large
+ * @li GARENA_ERR_NORESOURCE: A resource allocation failed.
  * 
  * @param serv The server handle
  * @param ch The connection handle to close
+ * @return 0 for success, -1 for failure.
  */
-void ghl_conn_close(ghl_serv_t *serv, ghl_ch_t *ch) {
+int ghl_conn_close(ghl_serv_t *serv, ghl_ch_t *ch) {
   struct sockaddr_in remote;
   int i;
   if (ch->cstate == GHL_CSTATE_CLOSING_OUT)
-    return;
-  remote.sin_family = AF_INET;
-  remote.sin_addr = ch->member->effective_ip;
-  remote.sin_port = htons(ch->member->effective_port);
+    return 0;
+  if (serv->trace)
+    ghl_trace_call(serv, GHL_TRACE_CLOSE, ch->conn_id, 0, 0);
+  if (ch->pending_len && (conn_flush(serv, ch) == -1))
+    return -1;
+  conn_remote(ch, &remote);
   for (i = 0; i < 4; i++) 
     gp2pp_output_conn(serv->peersock, GP2PP_CONN_MSG_FIN, NULL, 0, serv->my_info.user_id, ch->conn_id, ch->rcv_next, ch->rcv_next, 0, &remote);
   ch->cstate = GHL_CSTATE_CLOSING_OUT;
-
+  return 0;
 }
 
 /**
  *
- * Sends a data segment on a virtual connection.
+ * Sends data on a virtual connection.
+ * Data larger than @ref ghl_conn_max_pkt is split in several segments, so that they
+ * don't need IP fragmentation. The data is either accepted entirely, or not at all.
+ * An empty write sends an empty segment, except with small-write coalescing, where
+ * it does nothing.
+ * If small-write coalescing is enabled (see @ref ghl_conn_set_coalesce), the data may 
+ * be held back to be merged with the following writes.
  *
  * @par Errors
  *
  * @li GARENA_ERR_INVALID: The connection is in closing state and will soon be destroyed, you may not send data through it
  * @li GARENA_ERR_AGAIN: The send queue is too large (usually due to network congestion), try again later
+ * @li GARENA_ERR_NORESOURCE: A resource allocation failed.
  * 
  * @parm serv The server handle
  * @param ch The connection handle
- * @param payload The segment payload
- * @param length The segment payload length
+ * @param payload The data
+ * @param length The data length
  * @return 0 for success, -1 for failure.
  */
 int ghl_conn_send(ghl_serv_t *serv, ghl_ch_t *ch, char *payload, unsigned int length) {
+  unsigned int mss = ghl_conn_max_pkt(ch);
+  unsigned int chunk;
+  unsigned int nsegs;
+  unsigned int i;
+  ilist_t segs;
+  ilist_node_t *node;
   ghl_ch_pkt_t *pkt;
-  int now = garena_now();
+  
+  if (serv->trace)
+    ghl_trace_call(serv, GHL_TRACE_SEND, ch->conn_id, length, 0);
   if (ch->cstate == GHL_CSTATE_CLOSING_OUT) {
     garena_errno = GARENA_ERR_INVALID;
     return -1;
   }
   
-  if ((ch->last_xmit + ch->rto) < now) {
-    fprintf(deb, "[CC] Restart after idle...\n");
-    fprintf(deb, "[CC] Mode: SLOW START\n");
-  }
-  
-  fprintf(deb, "[CC] Flight size: %u\n", ch->flightsize);
-  fflush(deb);
-  
-  if ((ch->snd_next - ch->snd_una) >= GP2PP_MAX_SENDQ) {
+  if (ch->coalesce) {
+    /* the path MTU may have decreased since the data was buffered */
+    if ((ch->pending_len >= mss) && (conn_flush(serv, ch) == -1))
+      return -1;
+    nsegs = (ch->pending_len + length) / mss;
+  } else if (length == 0) {
+    nsegs = 1; /* sent as an empty segment */
+  } else nsegs = (length + mss - 1) / mss;
+  if ((ch->snd_next - ch->snd_una) + nsegs > GP2PP_MAX_SENDQ) {
     garena_errno = GARENA_ERR_AGAIN;
     return -1;
   }
   
-  pkt = malloc(sizeof(ghl_ch_pkt_t));
-  pkt->length = length;
-  pkt->payload = malloc(length);
-  pkt->seq = ch->snd_next;
-  pkt->ts_rel = (now - ch->ts_base)*40;
-  pkt->ch = ch;
-  pkt->xmit_ts = 0;
-  pkt->partial = 0;
-  pkt->retrans = 0;
-  pkt->did_fast_retrans = 0;
-  memcpy(pkt->payload, payload, length);
+  /* the write is accepted entirely or not at all: allocate every segment before queuing any */
+  ilist_init(&segs);
+  for (i = 0; i < nsegs; i++) {
+    pkt = pkt_alloc(mss);
+    if (pkt == NULL) {
+      while ((node = ilist_head(&segs)) != NULL) {
+        ilist_del(node);
+        pkt_free(ilist_entry(node, ghl_ch_pkt_t, node));
+      }
+      return -1;
+    }
+    ilist_add_tail(&segs, &pkt->node);
+  }
+  
+  /* MSS-sized segments, the first one starts with the held data */
+  while ((node = ilist_head(&segs)) != NULL) {
+    ilist_del(node);
+    pkt = ilist_entry(node, ghl_ch_pkt_t, node);
+    pkt->length = 0;
+    if (ch->pending_len) {
+      memcpy(pkt->payload, ch->pending, ch->pending_len);
+      pkt->length = ch->pending_len;
+      ch->pending_len = 0;
+      if (ch->flush_timer) {
+        ghl_free_timer(ch->flush_timer);
+        ch->flush_timer = NULL;
+      }
+    }
+    chunk = (length < mss - pkt->length) ? length : (mss - pkt->length);
+    memcpy(pkt->payload + pkt->length, payload, chunk);
+    pkt->length += chunk;
+    payload += chunk;
+    length -= chunk;
+    conn_queue_pkt(serv, ch, pkt);
+  }
   
-  ch->snd_next++;
-  ch->ts_base = now;
-  if (!llist_is_empty(ch->sendq)) {
-    ch->ts_ack = garena_now();
+  if (!ch->coalesce)
+    return 0;
+  
+  memcpy(ch->pending + ch->pending_len, payload, length);
+  ch->pending_len += length;
+  
+  /* Nagle: send right away if nothing is waiting for an ACK */
+  if (ch->pending_len && !ch->corked && ilist_is_empty(&ch->sendq)) {
+    if ((conn_flush(serv, ch) == -1) && (garena_errno != GARENA_ERR_AGAIN))
+      return -1;
   }
-  insert_pkt(ch->sendq, pkt);
-  if ((pkt->seq - ch->snd_una) < GP2PP_MAX_IN_TRANSIT) {
-    /* initial transmit */
-    pkt->rto = ch->rto;
-    pkt->xmit_ts = garena_now();
-    xmit_packet(serv, pkt);
-    pkt->first_trans = garena_now();
-    fprintf(deb, "[GHL] Initial packet transmit: seq=%x snd_una=%x\n", pkt->seq, ch->snd_una); 
-    ch->flightsize += pkt->length;
+  if (ch->pending_len && (ch->flush_timer == NULL)) {
+    ch->flush_timer = ghl_new_timer_ms(garena_now_ms() + ch->coalesce_delay, do_conn_flush, ch);
+    /* 
+     * Without a timer, send now rather than holding the data with no deadline. If the
+     * send queue is full, the next ACK retries the flush (see conn_process_ack()).
+     */
+    if (ch->flush_timer == NULL)
+      conn_flush(serv, ch);
+  }
+  return 0;
+}
+
+/**
+ * Enables or disables small-write coalescing on a virtual connection.
+ * When enabled, small writes made by @ref ghl_conn_send are merged in a single segment
+ * (up to @ref ghl_max_conn_pkt bytes) while previously sent data is not acknowledged yet,
+ * or while the connection is corked. Held data is always sent after at most delay milliseconds.
+ * Disabling coalescing flushes the held data.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_NORESOURCE: A resource allocation failed.
+ * @li GARENA_ERR_AGAIN: The held data could not be flushed because the send queue is too large
+ *
+ * @param serv The server handle
+ * @param ch The connection handle
+ * @param enable 1 to enable coalescing, 0 to disable it
+ * @param delay Maximum time (in milliseconds) small writes may be held back
+ * @return 0 for success, -1 for failure.
+ */
+int ghl_conn_set_coalesce(ghl_serv_t *serv, ghl_ch_t *ch, int enable, gtime_t delay) {
+  if (enable) {
+    if (ch->pending == NULL) {
+      ch->pending = malloc(ghl_max_conn_pkt(serv));
+      if (ch->pending == NULL) {
+        garena_errno = GARENA_ERR_NORESOURCE;
+        return -1;
+      }
+    }
+    ch->coalesce = 1;
+    ch->coalesce_delay = delay;
+    return 0;
+  }
+  if (ch->pending_len && (conn_flush(serv, ch) == -1))
+    return -1;
+  ch->coalesce = 0;
+  ch->corked = 0;
+  return 0;
+}
+
+/**
+ * Corks or uncorks a virtual connection. While corked, writes are only sent as 
+ * full segments, or when the coalescing delay expires. Uncorking flushes the held data.
+ * Small-write coalescing must be enabled (see @ref ghl_conn_set_coalesce).
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INVALID: Small-write coalescing is not enabled on this connection
+ * @li GARENA_ERR_AGAIN: The held data could not be flushed because the send queue is too large
+ *
+ * @param serv The server handle
+ * @param ch The connection handle
+ * @param cork 1 to cork, 0 to uncork
+ * @return 0 for success, -1 for failure.
+ */
+int ghl_conn_cork(ghl_serv_t *serv, ghl_ch_t *ch, int cork) {
+  if (!ch->coalesce) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  ch->corked = cork;
+  if (!cork && ch->pending_len)
+    return conn_flush(serv, ch);
+  return 0;
+}
+
+/**
+ * Sends immediately the data held back by small-write coalescing. 
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_AGAIN: The send queue is too large (usually due to network congestion), try again later
+ *
+ * @param serv The server handle
+ * @param ch The connection handle
+ * @return 0 for success, -1 for failure.
+ */
+int ghl_conn_flush(ghl_serv_t *serv, ghl_ch_t *ch) {
+  if (ch->pending_len == 0)
+    return 0;
+  return conn_flush(serv, ch);
+}
+
+/**
+ * Configures the delayed ACK policy of a virtual connection. An ACK is sent after 
+ * every segs in-order segments received, or when timeout milliseconds have 
+ * elapsed since the first unacknowledged segment, whatever comes first. 
+ * Out-of-order and duplicate segments are always acknowledged immediately.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INVALID: segs is 0
+ *
+ * @param ch The connection handle
+ * @param segs Number of segments to acknowledge at once (1 disables delayed ACK)
+ * @param timeout Maximum ACK delay, in milliseconds
+ * @return 0 for success, -1 for failure.
+ */
+int ghl_conn_set_delack(ghl_ch_t *ch, unsigned int segs, gtime_t timeout) {
+  if (segs == 0) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
   }
+  ch->delack_segs = segs;
+  ch->delack_timeout = timeout;
+  if (ch->ack_pending >= segs)
+    send_ack(ch->serv, ch);
   return 0;
 }
 
@@ -1059,26 +1729,174 @@ int ghl_conn_send(ghl_serv_t *serv, ghl_ch_t *ch, char *payload, unsigned int le
  * Given the link MTU, returns the maximum size of virtual connection segments which may be sent 
  * without needing fragmentation. Depending on the network configuration, trying to send larget
  * segments may lead to lag, packet loss, disconnects, etc.
+ * The actual limit for a given connection depends on the path MTU, see @ref ghl_conn_max_pkt.
  *
  * @param serv The server handle
  * @return Maximum segment size.
  */
-inline unsigned int ghl_max_conn_pkt(ghl_serv_t *serv) {
-  /* FIXME: should query path-MTU */
+unsigned int ghl_max_conn_pkt(ghl_serv_t *serv) {
   return (serv->mtu - sizeof(struct ip) - sizeof(struct udphdr) - sizeof(gp2pp_conn_hdr_t));
 }
 
+/**
+ * Given the path MTU discovered to the peer, returns the maximum size of the segments
+ * which may be sent on a virtual connection without needing fragmentation.
+ * Larger writes are split by @ref ghl_conn_send.
+ *
+ * @param ch The connection handle
+ * @return Maximum segment size.
+ */
+unsigned int ghl_conn_max_pkt(ghl_ch_t *ch) {
+  return (ch->member->pmtu - sizeof(struct ip) - sizeof(struct udphdr) - sizeof(gp2pp_conn_hdr_t));
+}
+
+/* number of packets in a connection queue */
+static unsigned int queue_len(ilist_t *queue) {
+  ilist_node_t *node;
+  unsigned int len = 0;
+  for (node = ilist_head(queue); node; node = ilist_next(queue, node))
+    len++;
+  return len;
+}
+
+/**
+ * Takes a snapshot of the server statistics: the server counters (including the totals 
+ * of the virtual connection counters), the counters of the current room, and the current
+ * depths of the virtual connection queues.
+ * The counters are only updated by the library, so this can be called at any time 
+ * outside of an event handler, as often as needed.
+ *
+ * @param serv The server handle
+ * @param stats Pointer to the structure to fill
+ * @return 0 for success, -1 for failure
+ */
+int ghl_get_stats(ghl_serv_t *serv, ghl_stats_t *stats) {
+  ihashitem_t iter;
+  ghl_ch_t *ch;
+  
+  if ((serv == NULL) || (stats == NULL)) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  stats->serv = serv->stats;
+  stats->num_conns = 0;
+  stats->sendq_pkts = 0;
+  stats->recvq_pkts = 0;
+  if (serv->room == NULL) {
+    memset(&stats->room, 0, sizeof(stats->room));
+    return 0;
+  }
+  stats->room = serv->room->stats;
+  for (iter = ihash_iter(serv->room->conns); iter; iter = ihash_next(serv->room->conns, iter)) {
+    ch = ihash_val(iter);
+    stats->num_conns++;
+    stats->sendq_pkts += queue_len(&ch->sendq);
+    stats->recvq_pkts += queue_len(&ch->recvq);
+  }
+  return 0;
+}
+
+/**
+ * Takes a snapshot of the counters of a virtual connection, and of its queue depths.
+ *
+ * @param ch The connection handle
+ * @param stats Pointer to the structure to fill
+ * @return 0 for success, -1 for failure
+ */
+int ghl_conn_get_stats(ghl_ch_t *ch, ghl_conn_stats_t *stats) {
+  if ((ch == NULL) || (stats == NULL)) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  *stats = ch->stats;
+  stats->sendq_pkts = queue_len(&ch->sendq);
+  stats->recvq_pkts = queue_len(&ch->recvq);
+  return 0;
+}
+
+/**
+ * Enables the event loop profiling of a server: ghl_process() then measures (with 
+ * garena_now_ns()) its own duration, the time between its calls, how late the timers
+ * fire, and the duration of each event handler, timer function and socket input, into 
+ * log2 histograms (see @ref ghl_prof_t). The cost is two clock reads per measured call.
+ * If slow_us is not 0, every handler, timer or input that takes at least slow_us 
+ * microseconds is logged as a warning in the debug log.
+ * If profiling is already enabled, only the threshold is changed.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INVALID: Invalid server handle
+ * @li GARENA_ERR_NORESOURCE: Out of memory
+ *
+ * @param serv The server handle
+ * @param slow_us Slow handler warning threshold, in usec (0 to disable the warnings)
+ * @return 0 for success, -1 for failure
+ */
+int ghl_prof_enable(ghl_serv_t *serv, unsigned int slow_us) {
+  if (serv == NULL) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  if (serv->prof == NULL) {
+    serv->prof = alloc_aligned(sizeof(ghl_prof_t));
+    if (serv->prof == NULL)
+      return -1;
+    memset(serv->prof, 0, sizeof(ghl_prof_t));
+    serv->prof->timers[GHL_PROF_TIMER_FUNS - 1].name = "other";
+  }
+  serv->prof->slow_ns = (uint64_t) slow_us * 1000;
+  return 0;
+}
+
+/**
+ * Disables the event loop profiling of a server, and discards the profile.
+ *
+ * @param serv The server handle
+ */
+void ghl_prof_disable(ghl_serv_t *serv) {
+  free(serv->prof);
+  serv->prof = NULL;
+}
+
+/**
+ * Takes a snapshot of the event loop profile of a server (see @ref ghl_prof_enable).
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INVALID: Invalid server handle, or profiling is not enabled
+ *
+ * @param serv The server handle
+ * @param prof Pointer to the structure to fill
+ * @return 0 for success, -1 for failure
+ */
+int ghl_prof_get(ghl_serv_t *serv, ghl_prof_t *prof) {
+  if ((serv == NULL) || (prof == NULL) || (serv->prof == NULL)) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  *prof = *serv->prof;
+  return 0;
+}
+
 
 /* Static HELPER FUNCTIONS */
 
 
 static void xmit_packet(ghl_serv_t *serv, ghl_ch_pkt_t *pkt) {
   struct sockaddr_in remote;
-  remote.sin_family = AF_INET;
-  remote.sin_addr = pkt->ch->member->effective_ip;
-  remote.sin_port = htons(pkt->ch->member->effective_port);
-  pkt->ch->last_xmit = garena_now();
+  conn_remote(pkt->ch, &remote);
+  pkt->ch->last_xmit = garena_now_ms();
+  CONN_STAT_ADD(pkt->ch, data_tx, 1);
+  CONN_STAT_ADD(pkt->ch, data_tx_bytes, pkt->length);
   gp2pp_output_conn(serv->peersock, GP2PP_CONN_MSG_DATA, pkt->payload, pkt->length, serv->my_info.user_id, pkt->ch->conn_id, pkt->seq, pkt->ch->rcv_next, pkt->ts_rel, &remote);
+  /* the segment carries rcv_next as a cumulative ACK, so a pending delayed ACK is redundant */
+  if (pkt->ch->ack_pending) {
+    pkt->ch->ack_pending = 0;
+    if (pkt->ch->delack_timer) {
+      ghl_free_timer(pkt->ch->delack_timer);
+      pkt->ch->delack_timer = NULL;
+    }
+  }
 }
 
 static void myinfo_pack(gsp_myinfo_t *dst, ghl_myinfo_t *src) {
@@ -1122,7 +1940,8 @@ static void myinfo_extract(ghl_myinfo_t *dst, gsp_myinfo_t *src) {
   dst->unknown4 = src->unknown4;
 }
 
-static void member_extract(ghl_member_t *dst, gcrp_member_t *src) {
+/* fills a member from its GCRP representation (internal, see private.h) */
+void ghl_member_extract(ghl_member_t *dst, gcrp_member_t *src) {
   dst->user_id = ghtonl(src->user_id);
   memcpy(dst->name, src->name, sizeof(src->name));
   memcpy(dst->country, src->country, sizeof(src->country));
@@ -1140,18 +1959,504 @@ static void member_extract(ghl_member_t *dst, gcrp_member_t *src) {
   dst->conn_ok = 0;
 }
 
+/*
+ * Room member arena: members are allocated by chunks (of at least GHL_MEMBER_CHUNK members)
+ * and free members are kept in a free list. The arena is a high-water mark: it never
+ * shrinks, chunks (and the column slots their members own) are only released when the
+ * room is freed, since a chunk that became empty cannot be told apart without moving
+ * live members.
+ */
+struct ghl_member_chunk_s {
+  struct ghl_member_chunk_s *next;
+  ghl_member_t members[0];
+};
+
+/*
+ * Makes sure that num members can be allocated without any further memory allocation.
+ */
+static int member_reserve(ghl_room_t *rh, unsigned int num) {
+  struct ghl_member_chunk_s *chunk;
+  unsigned int i;
+  
+  if (rh->num_free_members >= num)
+    return 0;
+  num -= rh->num_free_members;
+  if (num < GHL_MEMBER_CHUNK)
+    num = GHL_MEMBER_CHUNK;
+  chunk = malloc(sizeof(struct ghl_member_chunk_s) + num * sizeof(ghl_member_t));
+  if (chunk == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return -1;
+  }
+  if (cols_grow(&rh->cols, rh->cols.size + num) == -1) {
+    free(chunk);
+    return -1;
+  }
+  chunk->next = rh->member_chunks;
+  rh->member_chunks = chunk;
+  for (i = num; i > 0; i--) {
+    /* each arena slot owns a column slot for good */
+    chunk->members[i - 1].idx = rh->cols.size - num + i - 1;
+    chunk->members[i - 1].next_free = rh->free_members;
+    rh->free_members = &chunk->members[i - 1];
+  }
+  rh->num_free_members += num;
+  return 0;
+}
+
+static ghl_member_t *member_new(ghl_room_t *rh, gcrp_member_t *src) {
+  ghl_member_t *member;
+  if (member_reserve(rh, 1) == -1)
+    return NULL;
+  member = rh->free_members;
+  rh->free_members = member->next_free;
+  rh->num_free_members--;
+  ghl_member_extract(member, src);
+  member->rh = rh;
+  member->echo_ts = 0;
+  member->ping = 0;
+  member->pmtu = (rh->serv->mtu < GHL_PMTU_BASE) ? rh->serv->mtu : GHL_PMTU_BASE;
+  member->pmtu_lo = member->pmtu;
+  member->pmtu_hi = member->pmtu;
+  member->pmtu_probe = 0;
+  member->pmtu_tries = 0;
+  member->pmtu_hello_id = 0;
+  member->pmtu_timer = NULL;
+  member->hello_seq = 0;
+  member->hello_echo = 0;
+  member->echo_id = 0;
+  member->hello_unanswered = 0;
+  member->reach_timer = NULL;
+  member->reach_tries = 0;
+  member->last_rx = 0;
+  member->ka_interval = GP2PP_HELLO_INTERVAL;
+  member->ka_outstanding = 0;
+  member->ka_timer = NULL;
+  memset(&member->rtt_stats, 0, sizeof(member->rtt_stats));
+  member->relayed = 0;
+  member->conns = NULL;
+  member->num_conns = 0;
+  member_sync(member);
+  return member;
+}
+
+static void member_free(ghl_member_t *member) {
+  if (member->pmtu_timer)
+    ghl_free_timer(member->pmtu_timer);
+  if (member->reach_timer)
+    ghl_free_timer(member->reach_timer);
+  if (member->ka_timer)
+    ghl_free_timer(member->ka_timer);
+  if (member->relayed)
+    relay_member_stop(member->rh->serv, member);
+  member->rh->cols.member[member->idx] = NULL;
+  member->rh->cols.vpn[member->idx] = 0;
+  member->rh->cols.conn_ok[member->idx] = 0;
+  member->next_free = member->rh->free_members;
+  member->rh->free_members = member;
+  member->rh->num_free_members++;
+}
+
+/*
+ * The member columns are resized all together, new slots are free.
+ */
+static int cols_grow(ghl_member_cols_t *cols, unsigned int size) {
+  void *p;
+  
+#define COL_GROW(col) \
+  if ((p = realloc(cols->col, size * sizeof(*cols->col))) == NULL) { \
+    garena_errno = GARENA_ERR_NORESOURCE; \
+    return -1; \
+  } \
+  cols->col = p; \
+  memset(cols->col + cols->size, 0, (size - cols->size) * sizeof(*cols->col));
+  
+  COL_GROW(member);
+  COL_GROW(user_id);
+  COL_GROW(vpn);
+  COL_GROW(conn_ok);
+  COL_GROW(effective_ip);
+  COL_GROW(effective_port);
+  COL_GROW(ping);
+#undef COL_GROW
+  cols->size = size;
+  return 0;
+}
+
+static void cols_free(ghl_member_cols_t *cols) {
+  free(cols->member);
+  free(cols->user_id);
+  free(cols->vpn);
+  free(cols->conn_ok);
+  free(cols->effective_ip);
+  free(cols->effective_port);
+  free(cols->ping);
+  memset(cols, 0, sizeof(*cols));
+}
+
+/*
+ * Returns the index of the first room info page with a prefix greater or equal 
+ * to the given prefix (binary search, the pages are sorted).
+ */
+static unsigned int roominfo_lookup(ghl_roominfo_table_t *table, unsigned int prefix) {
+  unsigned int lo = 0;
+  unsigned int hi = table->num_pages;
+  unsigned int mid;
+  
+  while (lo < hi) {
+    mid = (lo + hi) >> 1;
+    if (table->pages[mid].prefix < prefix)
+      lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Returns the room info page for the given prefix, inserting a new one if needed.
+ */
+static ghl_roominfo_page_t *roominfo_page(ghl_roominfo_table_t *table, unsigned int prefix) {
+  ghl_roominfo_page_t *pages;
+  unsigned int i = roominfo_lookup(table, prefix);
+  unsigned int size;
+  
+  if ((i < table->num_pages) && (table->pages[i].prefix == prefix))
+    return &table->pages[i];
+  
+  if (table->num_pages == table->size) {
+    size = table->size ? (table->size << 1) : 4;
+    pages = realloc(table->pages, size * sizeof(ghl_roominfo_page_t));
+    if (pages == NULL) {
+      garena_errno = GARENA_ERR_NORESOURCE;
+      return NULL;
+    }
+    table->pages = pages;
+    table->size = size;
+  }
+  memmove(&table->pages[i + 1], &table->pages[i], (table->num_pages - i) * sizeof(ghl_roominfo_page_t));
+  table->num_pages++;
+  memset(&table->pages[i], 0, sizeof(ghl_roominfo_page_t));
+  table->pages[i].prefix = prefix;
+  return &table->pages[i];
+}
+
+static int roominfo_cmp(const void *a, const void *b) {
+  const ghl_roominfo_t *ra = a;
+  const ghl_roominfo_t *rb = b;
+  return (ra->room_id > rb->room_id) - (ra->room_id < rb->room_id);
+}
+
+/*
+ * Drops the rooms that were not reported for GHL_ROOMINFO_STALE_TIMEOUT (signaling
+ * them with a user count of 0), then the pages left empty.
+ */
+static void roominfo_expire(ghl_serv_t *serv) {
+  ghl_roominfo_table_t *table = &serv->roominfo;
+  ghl_roominfo_t changed[256];
+  ghl_roominfo_ev_t roominfo_ev;
+  ghl_roominfo_page_t *page;
+  ghl_roominfo_page_t *pages;
+  gtime_t now = garena_now_ms();
+  unsigned int suffix;
+  unsigned int i;
+  unsigned int j;
+  
+  roominfo_ev.rooms = changed;
+  for (i = 0; i < table->num_pages; i++) {
+    page = &table->pages[i];
+    roominfo_ev.num_rooms = 0;
+    for (suffix = 0; suffix < 256; suffix++) {
+      if (!(page->known[suffix >> 3] & (1 << (suffix & 7))))
+        continue;
+      if ((gtime_t) (now - page->seen[suffix]) < GHL_ROOMINFO_STALE_TIMEOUT)
+        continue;
+      page->known[suffix >> 3] &= ~(1 << (suffix & 7));
+      page->num_known--;
+      table->num_rooms--;
+      changed[roominfo_ev.num_rooms].room_id = (page->prefix << 8) | suffix;
+      changed[roominfo_ev.num_rooms].num_users = 0;
+      roominfo_ev.num_rooms++;
+    }
+    if (roominfo_ev.num_rooms)
+      signal_event(serv, GHL_EV_ROOMINFO, &roominfo_ev);
+  }
+  
+  /* compact after signaling, so that the handlers never see a half-moved table */
+  for (i = 0, j = 0; i < table->num_pages; i++) {
+    if (table->pages[i].num_known == 0)
+      continue;
+    if (i != j)
+      table->pages[j] = table->pages[i];
+    j++;
+  }
+  table->num_pages = j;
+  if ((table->size > 4) && (table->num_pages <= (table->size >> 2))) {
+    pages = realloc(table->pages, (table->size >> 1) * sizeof(ghl_roominfo_page_t));
+    if (pages != NULL) {
+      table->pages = pages;
+      table->size >>= 1;
+    }
+  }
+}
+
+/*
+ * Copies the member fields to the room columns. Must be called each time 
+ * one of these fields changes.
+ */
+static void member_sync(ghl_member_t *member) {
+  ghl_member_cols_t *cols = &member->rh->cols;
+  unsigned int i = member->idx;
+  cols->member[i] = member;
+  cols->user_id[i] = member->user_id;
+  cols->vpn[i] = member->vpn;
+  cols->conn_ok[i] = member->conn_ok;
+  cols->effective_ip[i] = member->effective_ip;
+  cols->effective_port[i] = member->effective_port;
+  cols->ping[i] = member->ping;
+}
+
+/*
+ * Reachability check: probes all the candidate addresses of a member right away,
+ * and retries with exponential backoff until one of them answers (the first one
+ * to answer wins, see handle_peer_msg).
+ */
+static void reach_check_start(ghl_serv_t *serv, ghl_member_t *member) {
+  if (member->reach_timer) {
+    ghl_free_timer(member->reach_timer);
+    member->reach_timer = NULL;
+  }
+  member->reach_tries = 0;
+  do_reach_check(member);
+}
+
+static int do_reach_check(void *privdata) {
+  ghl_member_t *member = privdata;
+  ghl_serv_t *serv = member->rh->serv;
+  
+  member->reach_timer = NULL;
+  if (member->conn_ok == 2)
+    return 0;
+  if (member->reach_tries >= GHL_REACH_MAX_TRIES) {
+    /* give up, the keepalive will keep trying at a slower pace */
+    if (serv->relay_enabled && (relay_member_start(serv, member) != -1))
+      send_hello(serv, member);
+    keepalive_start(member);
+    return 0;
+  }
+  send_hello(serv, member);
+  member->reach_timer = ghl_new_timer_ms(garena_now_ms() + (GHL_REACH_RTO << member->reach_tries), do_reach_check, member);
+  member->reach_tries++;
+  return 0;
+}
+
+/*
+ * Relayed members are given their virtual address (which is never seen on the wire) as
+ * effective address, and a gp2pp relay route is set for this address.
+ */
+static void member_vaddr(ghl_serv_t *serv, ghl_member_t *member, struct sockaddr_in *vaddr) {
+  vaddr->sin_family = AF_INET;
+  vaddr->sin_addr.s_addr = inet_addr(GARENA_NETWORK) | htonl(member->virtual_suffix);
+  vaddr->sin_port = htons(serv->gp2pp_rport);
+}
+
+static int member_is_vaddr(ghl_serv_t *serv, ghl_member_t *member, struct sockaddr_in *addr) {
+  struct sockaddr_in vaddr;
+  member_vaddr(serv, member, &vaddr);
+  return (addr->sin_addr.s_addr == vaddr.sin_addr.s_addr) && (addr->sin_port == vaddr.sin_port);
+}
+
+static int relay_member_start(ghl_serv_t *serv, ghl_member_t *member) {
+  struct sockaddr_in vaddr;
+  
+  if (member->relayed)
+    return 0;
+  member_vaddr(serv, member, &vaddr);
+  if (gp2pp_add_route(serv->routes, &vaddr, &serv->relay, serv->my_info.user_id, member->user_id) == -1)
+    return -1;
+  fprintf(deb, "[GHL] Using the relay to talk to %s\n", member->name);
+  fflush(deb);
+  member->relayed = 1;
+  member->effective_ip = vaddr.sin_addr;
+  member->effective_port = serv->gp2pp_rport;
+  if (member->conn_ok == 0)
+    member->conn_ok = 1;
+  /* no path MTU discovery through the relay */
+  if (member->pmtu_timer) {
+    ghl_free_timer(member->pmtu_timer);
+    member->pmtu_timer = NULL;
+  }
+  member->pmtu_probe = 0;
+  member->pmtu_tries = 0;
+  member->pmtu = (serv->mtu < GHL_PMTU_BASE) ? serv->mtu : GHL_PMTU_BASE;
+  member_sync(member);
+  return 0;
+}
+
+static void relay_member_stop(ghl_serv_t *serv, ghl_member_t *member) {
+  struct sockaddr_in vaddr;
+  member_vaddr(serv, member, &vaddr);
+  gp2pp_del_route(serv->routes, &vaddr);
+  member->relayed = 0;
+}
+
+static int do_relay_register(void *privdata) {
+  ghl_serv_t *serv = privdata;
+  if (serv->my_info.user_id != 0)
+    gp2pp_send_relay_register(serv->peersock, serv->my_info.user_id, &serv->relay);
+  serv->relay_timer = ghl_new_timer_ms(garena_now_ms() + GHL_RELAY_REGISTER_INTERVAL, do_relay_register, serv);
+  return 0;
+}
+
+/* xorshift64*, drawn from the server state so that a replay draws the same values */
+static uint32_t serv_random(ghl_serv_t *serv) {
+  serv->rng ^= serv->rng >> 12;
+  serv->rng ^= serv->rng << 25;
+  serv->rng ^= serv->rng >> 27;
+  return (serv->rng * 2685821657736338717ULL) >> 32;
+}
+
+/*
+ * HELLO keepalives are scheduled per member, with some jitter so that they don't
+ * all go out at once in large rooms. They are skipped while we receive traffic
+ * from the member anyway.
+ */
+static void keepalive_start(ghl_member_t *member) {
+  gtime_t delay = member->ka_interval;
+  if (member->ka_timer)
+    ghl_free_timer(member->ka_timer);
+  delay -= serv_random(member->rh->serv) % (delay >> 1); /* first one in [interval/2, interval] */
+  member->ka_timer = ghl_new_timer_ms(garena_now_ms() + delay, do_keepalive, member);
+}
+
+static int do_keepalive(void *privdata) {
+  ghl_member_t *member = privdata;
+  ghl_serv_t *serv = member->rh->serv;
+  gtime_t now = garena_now_ms();
+  gtime_t when;
+  
+  member->ka_timer = NULL;
+  if (member->ka_outstanding && (member->conn_ok == 2)) {
+    member->rtt_stats.hello_lost++;
+    /* no reply since last keepalive: the NAT binding may have expired sooner */
+    member->ka_interval >>= 1;
+    if (member->ka_interval < GHL_KEEPALIVE_MIN)
+      member->ka_interval = GHL_KEEPALIVE_MIN;
+  }
+  member->ka_outstanding = 0;
+  
+  if ((member->conn_ok == 2) && !gtime_after_eq(now, member->last_rx + member->ka_interval)) {
+    /* recent traffic from this member, no need for a keepalive yet */
+    when = member->last_rx + member->ka_interval;
+  } else if (send_hello(serv, member) == -1) {
+    /* a path MTU probe is in flight, and keeps the NAT binding alive */
+    when = now + member->ka_interval;
+  } else {
+    member->ka_outstanding = 1;
+    if (member->conn_ok == 2) {
+      if (member->rtt_stats.hello_sent >= GHL_HELLO_MAX_SAMPLES) {
+        member->rtt_stats.hello_sent >>= 1;
+        member->rtt_stats.hello_lost >>= 1;
+      }
+      member->rtt_stats.hello_sent++;
+    }
+    when = now + member->ka_interval;
+  }
+  when -= serv_random(serv) % ((member->ka_interval >> 3) + 1);
+  member->ka_timer = ghl_new_timer_ms(when, do_keepalive, member);
+  return 0;
+}
+
+/*
+ * Returns the ID of a new HELLO request to the member. Never 0, which is what the
+ * garena clients echo.
+ */
+static uint32_t hello_new_id(ghl_member_t *member) {
+  if (++member->hello_seq == 0)
+    member->hello_seq = 1;
+  return member->hello_seq;
+}
+
+/*
+ * Path MTU discovery (packetization layer, RFC 4821 style): binary search between 
+ * the current path MTU and the link MTU, using padded HELLO requests as probes.
+ * A probe that is not answered after GHL_PMTU_MAX_PROBES tries is too large.
+ * Only the reply echoing the ID of the probe acknowledges it: replies to earlier
+ * HELLOs may still arrive while it is in flight. The garena clients don't echo the
+ * IDs, so the discovery is only done with libgarena peers (see hello_echo).
+ */
+static void pmtu_start(ghl_serv_t *serv, ghl_member_t *member) {
+  member->pmtu_lo = member->pmtu;
+  member->pmtu_hi = serv->mtu;
+  if (member->pmtu_hi > GP2PP_MAX_MSGSIZE + sizeof(struct ip) + sizeof(struct udphdr))
+    member->pmtu_hi = GP2PP_MAX_MSGSIZE + sizeof(struct ip) + sizeof(struct udphdr);
+  member->pmtu_probe = 0;
+  member->pmtu_tries = 0;
+  pmtu_probe(serv, member);
+}
+
+static void pmtu_probe(ghl_serv_t *serv, ghl_member_t *member) {
+  struct sockaddr_in remote;
+  
+  if (member->pmtu_timer) {
+    ghl_free_timer(member->pmtu_timer);
+    member->pmtu_timer = NULL;
+  }
+  remote.sin_family = AF_INET;
+  remote.sin_addr = member->effective_ip;
+  remote.sin_port = htons(member->effective_port);
+  
+  while (member->pmtu_hi >= member->pmtu_lo + GHL_PMTU_STEP) {
+    if (member->pmtu_tries == 0)
+      member->pmtu_probe = (member->pmtu_lo + member->pmtu_hi + 1) >> 1;
+    member->pmtu_tries++;
+    member->pmtu_hello_id = hello_new_id(member);
+    if (gp2pp_send_hello_probe(serv->peersock, serv->my_info.user_id, member->pmtu_hello_id, member->pmtu_probe - sizeof(struct ip) - sizeof(struct udphdr), &remote) != -1) {
+      member->pmtu_timer = ghl_new_timer_ms(garena_now_ms() + GHL_PMTU_PROBE_TIMEOUT, do_pmtu_timer, member);
+      return;
+    }
+    if (errno != EMSGSIZE)
+      break;
+    /* larger than the local link MTU */
+    member->pmtu_hi = member->pmtu_probe - 1;
+    member->pmtu_tries = 0;
+  }
+  
+  /* search done (or failed), try again later in case the path changed */
+  IFDEBUG(printf("[GHL/DEBUG] Path MTU to %s is %u\n", member->name, member->pmtu));
+  member->pmtu_probe = 0;
+  member->pmtu_tries = 0;
+  member->pmtu_timer = ghl_new_timer_ms(garena_now_ms() + GHL_PMTU_RAISE_INTERVAL, do_pmtu_timer, member);
+}
+
+static int do_pmtu_timer(void *privdata) {
+  ghl_member_t *member = privdata;
+  ghl_serv_t *serv = member->rh->serv;
+  
+  member->pmtu_timer = NULL;
+  if (member->pmtu_probe == 0) {
+    if ((member->conn_ok == 2) && member->hello_echo)
+      pmtu_start(serv, member);
+    return 0;
+  }
+  if (member->pmtu_tries >= GHL_PMTU_MAX_PROBES) {
+    member->pmtu_hi = member->pmtu_probe - 1;
+    member->pmtu_tries = 0;
+  }
+  pmtu_probe(serv, member);
+  return 0;
+}
+
 
 
 static int ghl_free_room(ghl_room_t *rh) {
+  struct ghl_member_chunk_s *chunk;
+  unsigned int i;
   ihashitem_t iter;
   ghl_ch_t *ch;
   ghl_conn_fin_t conn_fin_ev;
   close(rh->roomsock);
   
-  for (iter = ihash_iter(rh->members); iter; iter = ihash_next(rh->members, iter)) {
-    free(ihash_val(iter));
-  }
-
+  /* the connections go first, they unlink themselves from their member */
   for (iter = ihash_iter(rh->conns); iter; iter = ihash_next(rh->conns, iter)) {
     ch = ihash_val(iter);
     if (ch->cstate != GHL_CSTATE_CLOSING_OUT) {
@@ -1163,9 +2468,20 @@ static int ghl_free_room(ghl_room_t *rh) {
     conn_free(ch);
     
   }
+
+  for (i = 0; i < rh->cols.size; i++) {
+    if (rh->cols.member[i])
+      member_free(rh->cols.member[i]);
+  }
   
   ihash_free(rh->members);
   ihash_free(rh->conns);
+  while (rh->member_chunks) {
+    chunk = rh->member_chunks;
+    rh->member_chunks = chunk->next;
+    free(chunk);
+  }
+  cols_free(&rh->cols);
   if (rh->timeout)
     ghl_free_timer(rh->timeout);
   rh->serv->room = NULL;
@@ -1173,51 +2489,128 @@ static int ghl_free_room(ghl_room_t *rh) {
   return 0;    
 }
 
-static void send_hello(ghl_serv_t *serv, ghl_member_t *cur) {
+/*
+ * Sends a HELLO request to the member (to all its candidate addresses while it is
+ * not reachable). Returns -1 if nothing was sent because a path MTU probe is in flight.
+ */
+static int send_hello(ghl_serv_t *serv, ghl_member_t *cur) {
   struct sockaddr_in remote;
+  uint32_t id;
+  if (cur->pmtu_probe)
+    return -1; /* the probe in flight is a HELLO request too */
   remote.sin_family = AF_INET;
-  cur->echo_ts = garena_now();
+  id = hello_new_id(cur);
+  cur->echo_ts = garena_now_ms();
+  cur->echo_id = id;
+  cur->hello_unanswered++;
     if (cur->conn_ok > 0) {
       remote.sin_addr = cur->effective_ip;
       remote.sin_port = htons(cur->effective_port);
-      gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, &remote);
-    } else {
+      gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, id, &remote);
+    }
+    if ((cur->conn_ok == 0) || cur->relayed) {
+      /* keep trying the direct path of relayed members */
       remote.sin_addr = cur->external_ip;
       remote.sin_port = htons(cur->external_port);
-      gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, &remote);
+      gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, id, &remote);
       remote.sin_addr = cur->internal_ip;
       remote.sin_port = htons(cur->internal_port);
-      gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, &remote);
+      gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, id, &remote);
       if (cur->external_port != GP2PP_PORT) {
         remote.sin_addr = cur->external_ip;
         remote.sin_port = htons(GP2PP_PORT);
-        gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, &remote);
+        gp2pp_send_hello_request(serv->peersock, serv->my_info.user_id, id, &remote);
       }
     }
-
+  return 0;
 }
 
-static void send_hello_to_all(ghl_serv_t *serv) {
-  ihashitem_t iter2;
-  ghl_member_t *cur;
-  ghl_room_t *rh = serv->room; 
-  if (rh == NULL)
-    return;
-  
-  
-  for (iter2 = ihash_iter(rh->members); iter2 ; iter2 = ihash_next(rh->members, iter2)) {
-    cur = ihash_val(iter2);
-    if (cur->user_id == serv->my_info.user_id)
-      continue;
-    send_hello(serv, cur);
+
+
+
+/* allocates a structure containing cache-line aligned counters */
+static void *alloc_aligned(size_t size) {
+  void *ptr;
+  if (posix_memalign(&ptr, 64, size) != 0) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
   }
+  return ptr;
+}
+
+/* the timer functions of the library, named in the profile */
+static const struct {
+  ghl_timerfun_t *fun;
+  const char *name;
+} prof_timer_names[] = {
+  { do_conn_retrans, "conn_retrans" },
+  { do_delayed_ack, "delayed_ack" },
+  { do_conn_flush, "conn_flush" },
+  { do_roominfo_query, "roominfo_query" },
+  { do_pmtu_timer, "pmtu" },
+  { do_reach_check, "reach_check" },
+  { do_keepalive, "keepalive" },
+  { do_relay_register, "relay_register" },
+  { handle_servconn_timeout, "servconn_timeout" },
+  { handle_room_join_timeout, "room_join_timeout" },
+};
+
+/* adds a sample to a profiling histogram */
+static void prof_hist_add(ghl_prof_hist_t *hist, uint64_t ns) {
+  uint64_t us = ns / 1000;
+  unsigned int bucket = 0;
+  while ((us >>= 1) && (bucket < GHL_PROF_BUCKETS - 1))
+    bucket++;
+  hist->count++;
+  hist->total_ns += ns;
+  if (ns > hist->max_ns)
+    hist->max_ns = ns;
+  hist->hist[bucket]++;
 }
 
+/* records the duration of something that started at start, and warns if it was slow (what is NULL for the samples that are not handlers) */
+static void prof_record(ghl_prof_t *prof, ghl_prof_hist_t *hist, uint64_t start, const char *what, int id) {
+  uint64_t ns = garena_now_ns() - start;
+  prof_hist_add(hist, ns);
+  if ((what == NULL) || (prof->slow_ns == 0) || (ns < prof->slow_ns))
+    return;
+  prof->slow++;
+  if (id >= 0)
+    fprintf(deb, "[WARN/GHL] Slow %s %d: %llu usec\n", what, id, (unsigned long long) ns / 1000);
+  else
+    fprintf(deb, "[WARN/GHL] Slow %s: %llu usec\n", what, (unsigned long long) ns / 1000);
+  fflush(deb);
+}
 
+/* finds (or allocates) the profiling slot of a timer function */
+static ghl_prof_timer_t *prof_timer(ghl_prof_t *prof, ghl_timerfun_t *fun) {
+  unsigned int i, j;
+  for (i = 0; i < GHL_PROF_TIMER_FUNS - 1; i++) {
+    if (prof->timers[i].fun == fun)
+      return &prof->timers[i];
+    if (prof->timers[i].fun == NULL) {
+      prof->timers[i].fun = fun;
+      for (j = 0; j < sizeof(prof_timer_names) / sizeof(prof_timer_names[0]); j++)
+        if (prof_timer_names[j].fun == fun)
+          prof->timers[i].name = prof_timer_names[j].name;
+      return &prof->timers[i];
+    }
+  }
+  return &prof->timers[GHL_PROF_TIMER_FUNS - 1];
+}
 
 static int signal_event(ghl_serv_t *serv, int event, void *eventparam) {
+  uint64_t t0;
+  int r;
+  serv->stats.events++;
   if (serv->ghl_handlers[event].fun) {
-    return serv->ghl_handlers[event].fun(serv, event, eventparam, serv->ghl_handlers[event].privdata);
+    if (serv->prof == NULL)
+      return serv->ghl_handlers[event].fun(serv, event, eventparam, serv->ghl_handlers[event].privdata);
+    t0 = garena_now_ns();
+    r = serv->ghl_handlers[event].fun(serv, event, eventparam, serv->ghl_handlers[event].privdata);
+    if (serv->prof)
+      prof_record(serv->prof, &serv->prof->events[event], t0, "event handler", event);
+    return r;
   } else {
     IFDEBUG(printf("[GHL/DEBUG] Event %x was ignored.\n", event));
     return 0;
@@ -1226,14 +2619,11 @@ static int signal_event(ghl_serv_t *serv, int event, void *eventparam) {
 
 
 static void update_next(ghl_serv_t *serv, ghl_ch_t *ch) {
-  cell_t iter;
+  ilist_node_t *node;
   ghl_ch_pkt_t *pkt;
   
-  if (llist_is_empty(ch->recvq))
-    return;
-   
-  for (iter = llist_iter(ch->recvq); iter; iter = llist_next(iter)) {
-    pkt = llist_val(iter);
+  for (node = ilist_head(&ch->recvq); node; node = ilist_next(&ch->recvq, node)) {
+    pkt = ilist_entry(node, ghl_ch_pkt_t, node);
     if (pkt->seq > ch->rcv_next)
       break;
     if (pkt->seq == ch->rcv_next) {
@@ -1255,26 +2645,18 @@ static int set_nonblock(int sock) {
 
 
 static void try_deliver(ghl_serv_t *serv, ghl_ch_t *ch) {
-  cell_t iter;
+  ilist_node_t *node;
+  ilist_node_t *next;
   ihashitem_t c_iter;
   ghl_conn_recv_t conn_recv_ev;
   ghl_conn_fin_t conn_fin_ev;
   ghl_ch_pkt_t *pkt;
-  ghl_ch_pkt_t *todel = NULL;
   int r;
   
 
-  if (llist_is_empty(ch->recvq))
-    return;
-
-  for (iter = llist_iter(ch->recvq); iter ; iter = llist_next(iter)) {
-    pkt = llist_val(iter);
-    if (todel) {
-      llist_del_item(ch->recvq, todel);
-      free(todel->payload);
-      free(todel);
-      todel = NULL;
-    }
+  for (node = ilist_head(&ch->recvq); node; node = next) {
+    next = ilist_next(&ch->recvq, node);
+    pkt = ilist_entry(node, ghl_ch_pkt_t, node);
       
     if (pkt->seq != ch->rcv_next_deliver)
       break;
@@ -1289,7 +2671,8 @@ static void try_deliver(ghl_serv_t *serv, ghl_ch_t *ch) {
       }
             
       if (r == pkt->length) {
-        todel = pkt;
+        ilist_del(node);
+        pkt_free(pkt);
         ch->rcv_next_deliver++;
       } else if (r != -1) {
         memmove(pkt->payload, pkt->payload + r, pkt->length - r);
@@ -1301,86 +2684,245 @@ static void try_deliver(ghl_serv_t *serv, ghl_ch_t *ch) {
         ch->cstate = GHL_CSTATE_CLOSING_OUT;
         signal_event(serv, GHL_EV_CONN_FIN, &conn_fin_ev);
       }
-      todel = pkt;
+      ilist_del(node);
+      pkt_free(pkt);
       ch->rcv_next_deliver++;
     }
   }
-  if (todel) {
-    llist_del_item(ch->recvq, todel);
-    free(todel->payload);
-    free(todel);
-    todel = NULL;
-  }
-  
 }
 
 
 
 static void send_hello_to_members(ghl_room_t *rh) {
-  ihashitem_t iter2;
   ghl_serv_t *serv = rh->serv;
-  ghl_member_t *cur;
-  struct sockaddr_in remote;
-  
-  remote.sin_family = AF_INET;
+  unsigned int i;
   
-  for (iter2 = ihash_iter(rh->members); iter2 ; iter2 = ihash_next(rh->members, iter2)) {
-    cur = ihash_val(iter2);
-    if (cur->user_id == serv->my_info.user_id)
+  for (i = 0; i < rh->cols.size; i++) {
+    if ((rh->cols.member[i] == NULL) || (rh->cols.user_id[i] == serv->my_info.user_id))
       continue;
     
-    send_hello(serv, cur);
+    reach_check_start(serv, rh->cols.member[i]);
   }
   
 }
 
-static int insert_pkt(llist_t list, ghl_ch_pkt_t *pkt) {
+/* inserts a packet in a seq-sorted queue, returns 0 if it is a duplicate (internal, see private.h) */
+int ghl_insert_pkt(ilist_t *list, ghl_ch_pkt_t *pkt) {
   ghl_ch_pkt_t *cur;
-  cell_t iter;
+  ilist_node_t *node;
   
-  for (iter = llist_iter(list); iter; iter = llist_next(iter)) {
-    cur = llist_val(iter);
+  /* packets mostly arrive in order, so search from the tail */
+  for (node = ilist_tail(list); node; node = ilist_prev(list, node)) {
+    cur = ilist_entry(node, ghl_ch_pkt_t, node);
     if (cur->seq == pkt->seq)
       return 0; /* we already have this packet */
-    if ((cur->seq - pkt->seq) >= 0)
+    if ((cur->seq - pkt->seq) < 0)
       break;
   }
-  if (iter) {
-    llist_add_before(list, cur, pkt);
-  } else {
-    llist_add_tail(list, pkt);
-  }
+  ilist_add_after(node ? node : list, &pkt->node);
   return 1;
 }
 
-static void conn_free(ghl_ch_t *ch) {
-  cell_t iter;
+static ghl_ch_t *conn_alloc(ghl_serv_t *serv, ghl_member_t *member, unsigned int conn_id) {
+  ghl_ch_t *ch = alloc_aligned(sizeof(ghl_ch_t));
+  if (ch == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
+  ilist_init(&ch->sendq);
+  ilist_init(&ch->recvq);
+  memset(&ch->stats, 0, sizeof(ch->stats));
+  ch->conn_id = conn_id;
+  ch->cstate = GHL_CSTATE_ESTABLISHED;
+  ch->member = member;
+  ch->serv = serv;
+  ch->ts_base = garena_now_ms();
+  ch->snd_una = 0;
+  ch->snd_next = 0;
+  ch->rcv_next = 0;
+  ch->rcv_next_deliver = 0;
+  ch->rto = GP2PP_INIT_RTO;
+  ch->srtt = 0;
+  ch->last_xmit = 0;
+  ch->flightsize = 0;
+  ch->ssthresh = GP2PP_INIT_SSTHRESH;
+  ch->cwnd = (ghl_conn_max_pkt(ch) << 1); 
+  ch->ts_ack = garena_now_ms();
+  ch->finseq = 0;
+  ch->delack_segs = GP2PP_DELACK_SEGS;
+  ch->delack_timeout = GP2PP_DELACK_TIMEOUT;
+  ch->ack_pending = 0;
+  ch->ack_seq = 0;
+  ch->ack_seq_rx = 0;
+  ch->delack_timer = NULL;
+  ch->coalesce = 0;
+  ch->corked = 0;
+  ch->coalesce_delay = GP2PP_COALESCE_DELAY;
+  ch->pending = NULL;
+  ch->pending_len = 0;
+  ch->flush_timer = NULL;
+  ch->member_prev = NULL;
+  ch->member_next = member->conns;
+  if (member->conns)
+    member->conns->member_prev = ch;
+  member->conns = ch;
+  member->num_conns++;
+  return ch;
+}
+
+static void conn_remote(ghl_ch_t *ch, struct sockaddr_in *remote) {
+  remote->sin_family = AF_INET;
+  remote->sin_addr = ch->member->effective_ip;
+  remote->sin_port = htons(ch->member->effective_port);
+}
+
+/*
+ * Sends an ACK for everything received so far on the connection, and 
+ * cancels any pending delayed ACK. The timestamp field carries the time the
+ * ACK was held since ack_seq was received, so that the sender can leave it
+ * out of its RTT sample.
+ */
+static void send_ack(ghl_serv_t *serv, ghl_ch_t *ch) {
+  struct sockaddr_in remote;
+  gtime_t held = garena_now_ms() - ch->ack_seq_rx;
+  conn_remote(ch, &remote);
+  ch->ack_pending = 0;
+  if (ch->delack_timer) {
+    ghl_free_timer(ch->delack_timer);
+    ch->delack_timer = NULL;
+  }
+  CONN_STAT_ADD(ch, acks_tx, 1);
+  gp2pp_output_conn(serv->peersock, GP2PP_CONN_MSG_ACK, NULL, 0, serv->my_info.user_id, ch->conn_id, ch->ack_seq, ch->rcv_next, (held < GP2PP_MAX_ACK_DELAY) ? held*4 : 0, &remote);
+}
+
+/*
+ * Allocates a packet and its payload in a single memory block.
+ */
+static ghl_ch_pkt_t *pkt_alloc(unsigned int length) {
+  ghl_ch_pkt_t *pkt = malloc(sizeof(ghl_ch_pkt_t) + length);
+  if (pkt == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
+  pkt->length = length;
+  pkt->payload = (char *) (pkt + 1);
+  return pkt;
+}
+
+static void pkt_free(ghl_ch_pkt_t *pkt) {
+  free(pkt);
+}
+
+/*
+ * Copies a segment and queues it (see conn_queue_pkt()).
+ */
+static int conn_queue_segment(ghl_serv_t *serv, ghl_ch_t *ch, char *payload, unsigned int length) {
   ghl_ch_pkt_t *pkt;
-  for (iter = llist_iter(ch->sendq); iter; iter = llist_next(iter)) {
-    pkt = llist_val(iter);
-    free(pkt->payload);
+  
+  if ((ch->snd_next - ch->snd_una) >= GP2PP_MAX_SENDQ) {
+    garena_errno = GARENA_ERR_AGAIN;
+    return -1;
+  }
+  pkt = pkt_alloc(length);
+  if (pkt == NULL)
+    return -1;
+  memcpy(pkt->payload, payload, length);
+  conn_queue_pkt(serv, ch, pkt);
+  return 0;
+}
+
+/*
+ * Assigns a sequence number to a segment (payload and length already set), queues it 
+ * and transmits it if flow control allows.
+ */
+static void conn_queue_pkt(ghl_serv_t *serv, ghl_ch_t *ch, ghl_ch_pkt_t *pkt) {
+  gtime_t now = garena_now_ms();
+  
+  if (!gtime_after_eq(ch->last_xmit + ch->rto, now)) {
+    fprintf(deb, "[CC] Restart after idle...\n");
+    fprintf(deb, "[CC] Mode: SLOW START\n");
+  }
+  
+  fprintf(deb, "[CC] Flight size: %u\n", ch->flightsize);
+  fflush(deb);
+  
+  pkt->seq = ch->snd_next;
+  pkt->ts_rel = (now - ch->ts_base)*4; /* ts_rel is in 1/4000th of seconds */
+  pkt->ch = ch;
+  pkt->xmit_ts = 0;
+  pkt->partial = 0;
+  pkt->retrans = 0;
+  pkt->did_fast_retrans = 0;
+  
+  ch->snd_next++;
+  ch->ts_base = now;
+  if (!ilist_is_empty(&ch->sendq)) {
+    ch->ts_ack = now;
+  }
+  ghl_insert_pkt(&ch->sendq, pkt);
+  if ((pkt->seq - ch->snd_una) < GP2PP_MAX_IN_TRANSIT) {
+    /* initial transmit */
+    pkt->rto = ch->rto;
+    pkt->xmit_ts = now;
+    xmit_packet(serv, pkt);
+    pkt->first_trans = now;
+    fprintf(deb, "[GHL] Initial packet transmit: seq=%x snd_una=%x\n", pkt->seq, ch->snd_una); 
+    ch->flightsize += pkt->length;
+  }
+}
+
+/*
+ * Sends the data held in the coalescing buffer as a single segment.
+ */
+static int conn_flush(ghl_serv_t *serv, ghl_ch_t *ch) {
+  if (conn_queue_segment(serv, ch, ch->pending, ch->pending_len) == -1)
+    return -1;
+  ch->pending_len = 0;
+  if (ch->flush_timer) {
+    ghl_free_timer(ch->flush_timer);
+    ch->flush_timer = NULL;
   }
-  for (iter = llist_iter(ch->recvq); iter; iter = llist_next(iter)) {
-    pkt = llist_val(iter);
-    free(pkt->payload);
+  return 0;
+}
+
+static void conn_free(ghl_ch_t *ch) {
+  ilist_node_t *node;
+  ilist_node_t *next;
+  if (ch->member_prev)
+    ch->member_prev->member_next = ch->member_next;
+  else ch->member->conns = ch->member_next;
+  if (ch->member_next)
+    ch->member_next->member_prev = ch->member_prev;
+  ch->member->num_conns--;
+  if (ch->delack_timer)
+    ghl_free_timer(ch->delack_timer);
+  if (ch->flush_timer)
+    ghl_free_timer(ch->flush_timer);
+  free(ch->pending);
+  for (node = ilist_head(&ch->sendq); node; node = next) {
+    next = ilist_next(&ch->sendq, node);
+    pkt_free(ilist_entry(node, ghl_ch_pkt_t, node));
+  }
+  for (node = ilist_head(&ch->recvq); node; node = next) {
+    next = ilist_next(&ch->recvq, node);
+    pkt_free(ilist_entry(node, ghl_ch_pkt_t, node));
   }
-  llist_free_val(ch->sendq);
-  llist_free_val(ch->recvq);
   free(ch);
 }
 
-static void do_fast_retrans(ghl_serv_t *serv, llist_t sendq, int up_to) {
-  cell_t iter;
+static void do_fast_retrans(ghl_serv_t *serv, ilist_t *sendq, int up_to) {
+  ilist_node_t *node;
   ghl_ch_pkt_t *pkt;
 
-  for (iter = llist_iter(sendq); iter; iter = llist_next(iter)) {
-    pkt = llist_val(iter);
+  for (node = ilist_head(sendq); node; node = ilist_next(sendq, node)) {
+    pkt = ilist_entry(node, ghl_ch_pkt_t, node);
     if ((pkt->seq - up_to) >= 0)
       break;
     if (pkt->did_fast_retrans == 0) {
       /* fast retransmit */
+      CONN_STAT_ADD(pkt->ch, retrans_fast, 1);
       pkt->retrans = 1;
-      pkt->xmit_ts = garena_now();
+      pkt->xmit_ts = garena_now_ms();
       xmit_packet(serv, pkt);
         fprintf(deb, "[GHL] Fast-retransmitting packet, seq=%x\n", pkt->seq); 
       
@@ -1404,18 +2946,18 @@ static int handle_servconn_timeout(void *privdata) {
 
 static int do_conn_retrans(void *privdata) {
   ghl_serv_t *serv = privdata;
-  cell_t iter2;
+  ilist_node_t *node;
   ihashitem_t iter;
   ghl_ch_t *ch;
   ghl_conn_fin_t conn_fin_ev;
   ghl_ch_pkt_t *pkt;
   ghl_ch_t *todel = NULL;
   ghl_room_t *rh = serv->room;
-  int now = garena_now();
+  gtime_t now = garena_now_ms();
   int retrans;
   
   if (serv->room == NULL) {
-    serv->conn_retrans_timer = ghl_new_timer(garena_now() + GP2PP_CONN_RETRANS_CHECK, do_conn_retrans, privdata);
+    serv->conn_retrans_timer = ghl_new_timer_ms(garena_now_ms() + GP2PP_CONN_RETRANS_CHECK, do_conn_retrans, privdata);
     return 0;
   }
   for (iter = ihash_iter(rh->conns); iter; iter = ihash_next(rh->conns, iter)) {
@@ -1426,25 +2968,44 @@ static int do_conn_retrans(void *privdata) {
     }
 
     ch = ihash_val(iter);
-    for (iter2 = llist_iter(ch->sendq); iter2; iter2 = llist_next(iter2)) {
-      pkt = llist_val(iter2);
+    for (node = ilist_head(&ch->sendq); node; node = ilist_next(&ch->sendq, node)) {
+      pkt = ilist_entry(node, ghl_ch_pkt_t, node);
       if ((pkt->seq - ch->snd_una) > GP2PP_MAX_IN_TRANSIT) {
         fprintf(deb, "[Flow control] Congestion on connection %x\n", ch->conn_id);
         fflush(deb);
         break;
       }
-      if ((pkt->xmit_ts != 0) && ((pkt->xmit_ts + pkt->rto) <= now)) {
+      if ((pkt->xmit_ts != 0) && gtime_after_eq(now, pkt->xmit_ts + pkt->rto)) {
         fprintf(deb, "[GHL] Retransmitting packet, seq=%x after RTO of %u\n", pkt->seq, pkt->rto); 
+        if (pkt->retrans && (ch->member->pmtu > GHL_PMTU_BASE) && 
+            (pkt->length + sizeof(struct ip) + sizeof(struct udphdr) + sizeof(gp2pp_conn_hdr_t) > GHL_PMTU_BASE)) {
+          /* 
+           * Large segment lost twice in a row: maybe a PMTU black hole, fall back to the
+           * base MTU for the new segments. The queued segments keep their size: their 
+           * sequence numbers may already be known to the peer, so they can't be split.
+           * They are sent without DF (see gp2pp_send_hello_probe()), so they still get 
+           * through where the path fragments them. Where it drops the fragments too, 
+           * the connection times out.
+           */
+          fprintf(deb, "[GHL] Path MTU to %s may have decreased, back to %u for the new segments\n", ch->member->name, GHL_PMTU_BASE);
+          ch->member->pmtu = GHL_PMTU_BASE;
+          ch->member->pmtu_probe = 0;
+          ch->member->pmtu_tries = 0;
+          if (ch->member->pmtu_timer)
+            ghl_free_timer(ch->member->pmtu_timer);
+          ch->member->pmtu_timer = ghl_new_timer_ms(now + GHL_PMTU_RAISE_INTERVAL, do_pmtu_timer, ch->member);
+        }
         pkt->rto <<= 1; /* exponential backoff */
         if (ch->rto < pkt->rto)
           ch->rto = pkt->rto;
-        pkt->xmit_ts = garena_now();
+        pkt->xmit_ts = garena_now_ms();
         pkt->retrans = 1;
+        CONN_STAT_ADD(ch, retrans_rto, 1);
         xmit_packet(serv, pkt);
         retrans++;
       }
     }
-    if (!llist_is_empty(ch->sendq) && ((ch->ts_ack + GP2PP_CONN_TIMEOUT) < now)) {
+    if (!ilist_is_empty(&ch->sendq) && !gtime_after_eq(ch->ts_ack + GP2PP_CONN_TIMEOUT, now)) {
         fprintf(deb, "[GHL] Connection ID %x with user %s timed out.\n", ch->conn_id, ch->member->name);
         todel = ch;
         if (ch->cstate != GHL_CSTATE_CLOSING_OUT) {
@@ -1454,7 +3015,7 @@ static int do_conn_retrans(void *privdata) {
         break;
     }
 
-    if (llist_is_empty(ch->sendq) &&  (ch->cstate == GHL_CSTATE_CLOSING_OUT)) {
+    if (ilist_is_empty(&ch->sendq) &&  (ch->cstate == GHL_CSTATE_CLOSING_OUT)) {
       todel = ch;
       continue;
     }
@@ -1466,27 +3027,42 @@ static int do_conn_retrans(void *privdata) {
     todel = NULL;
   }
 
-  serv->conn_retrans_timer = ghl_new_timer(garena_now() + GP2PP_CONN_RETRANS_CHECK, do_conn_retrans, privdata);
+  serv->conn_retrans_timer = ghl_new_timer_ms(garena_now_ms() + GP2PP_CONN_RETRANS_CHECK, do_conn_retrans, privdata);
   return 0;
 }
 
 
-static int do_hello(void *privdata) {
-  ghl_serv_t *serv = privdata;
-  send_hello_to_all(serv);  
-  serv->hello_timer = ghl_new_timer(garena_now() + GP2PP_HELLO_INTERVAL, do_hello, privdata);
+static int do_delayed_ack(void *privdata) {
+  ghl_ch_t *ch = privdata;
+  ch->delack_timer = NULL; /* prevent send_ack from freeing the timer we are currently handling */
+  if (ch->ack_pending)
+    send_ack(ch->serv, ch);
   return 0;
 }
 
+static int do_conn_flush(void *privdata) {
+  ghl_ch_t *ch = privdata;
+  ch->flush_timer = NULL; /* prevent conn_flush from freeing the timer we are currently handling */
+  if (ch->pending_len && (conn_flush(ch->serv, ch) == -1)) {
+    /* if the timer can't be rearmed, the next ACK retries the flush (see conn_process_ack()) */
+    ch->flush_timer = ghl_new_timer_ms(garena_now_ms() + ch->coalesce_delay, do_conn_flush, ch);
+    if (ch->flush_timer == NULL)
+      return -1;
+  }
+  return 0;
+}
+
+
 static int do_roominfo_query(void *privdata) {
   ghl_serv_t *serv = privdata;
   
-  if (serv && serv->connected && gp2pp_request_roominfo(serv->peersock, serv->my_info.user_id, serv->server_ip, GP2PP_PORT) == -1) {
+  if (serv && serv->connected && gp2pp_request_roominfo(serv->peersock, serv->my_info.user_id, serv->server_ip, serv->gp2pp_rport) == -1) {
     fprintf(deb, "[WARN/GHL] Room Info will not be available because the request failed.\n");
     fflush(deb); 
   }
+  roominfo_expire(serv);
 
-  serv->roominfo_timer = ghl_new_timer(garena_now() + GHL_ROOMINFO_QUERY_INTERVAL, do_roominfo_query, privdata);
+  serv->roominfo_timer = ghl_new_timer_ms(garena_now_ms() + GHL_ROOMINFO_QUERY_INTERVAL, do_roominfo_query, privdata);
   return 0;
 }
 
@@ -1497,11 +3073,15 @@ static int handle_auth(int type, void *payload, unsigned int length, void *privd
   ghl_serv_t *serv = privdata;
   switch(type) {
     case GSP_MSG_LOGIN_REPLY:
+      if (length < sizeof(gsp_login_reply_t)) {
+        garena_errno = GARENA_ERR_PROTOCOL;
+        return -1;
+      }
       myinfo_extract(&serv->my_info, &login_reply->my_info);
       fprintf(deb, "[GHL] My user_id is %x\n", serv->my_info.user_id);
       fflush(deb);
       serv->auth_ok = 1;
-      if (gp2pp_request_roominfo(serv->peersock, serv->my_info.user_id, serv->server_ip, GP2PP_PORT) == -1) {
+      if (gp2pp_request_roominfo(serv->peersock, serv->my_info.user_id, serv->server_ip, serv->gp2pp_rport) == -1) {
         fprintf(deb, "[WARN/GHL] Room Info will not be available because the request failed.\n");
         fflush(deb); 
       }
@@ -1525,7 +3105,7 @@ static int handle_auth(int type, void *payload, unsigned int length, void *privd
       serv->servconn_timeout = NULL;
       servconn.result = GHL_EV_RES_FAILURE;
       signal_event(serv, GHL_EV_SERVCONN, &servconn);
-      ghl_free_serv(serv);
+      serv->need_free = 1; /* freed by ghl_process(), we are called from gsp_input() */
       break;
     default:
       garena_errno = GARENA_ERR_INVALID;
@@ -1540,10 +3120,16 @@ static int handle_ip_lookup(int type, void *payload, unsigned int length, void *
   gp2pp_lookup_reply_t *lookup = payload;
   switch(type) {
     case GP2PP_MSG_IP_LOOKUP_REPLY:
+      if (length < sizeof(gp2pp_lookup_reply_t)) {
+        garena_errno = GARENA_ERR_PROTOCOL;
+        return -1;
+      }
       serv->my_info.external_ip = lookup->my_external_ip;
       serv->my_info.external_port = htons(lookup->my_external_port);
       serv->lookup_ok = 1;
       if ((serv->connected = serv->auth_ok)) {
+        ghl_free_timer(serv->servconn_timeout);
+        serv->servconn_timeout = NULL;
         servconn.result = GHL_EV_RES_SUCCESS;
         signal_event(serv, GHL_EV_SERVCONN, &servconn);
       }
@@ -1557,19 +3143,48 @@ static int handle_ip_lookup(int type, void *payload, unsigned int length, void *
 
 static int handle_roominfo(int type, void *payload, unsigned int length, void *privdata, unsigned int user_id, struct sockaddr_in *remote) {
   gp2pp_roominfo_reply_t *roominfo = payload;
+  ghl_roominfo_t changed[256];
+  ghl_roominfo_ev_t roominfo_ev;
+  ghl_roominfo_page_t *page;
+  unsigned int num_rooms;
+  unsigned int prefix;
+  unsigned int suffix;
   unsigned int i;
-  unsigned int *num_users;
-  unsigned int room_id;
+  gtime_t now = garena_now_ms();
   ghl_serv_t *serv = privdata;
   
-  for (i = 0; i < roominfo->num_rooms; i++) {
-    room_id = (ghtonl(roominfo->prefix) << 8) | (ghtonl(roominfo->usernum[i].suffix) & 0xFF);
-    num_users = ihash_get(serv->roominfo, room_id);
-    if (num_users == NULL) {
-      num_users = malloc(sizeof(unsigned int));
-      ihash_put(serv->roominfo, room_id,num_users);
-    } 
-    *num_users = roominfo->usernum[i].num_users;
+  if (length < sizeof(gp2pp_roominfo_reply_t)) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
+  num_rooms = roominfo->num_rooms;
+  if (num_rooms > (length - sizeof(gp2pp_roominfo_reply_t)) / sizeof(gp2pp_room_usernum_t))
+    num_rooms = (length - sizeof(gp2pp_roominfo_reply_t)) / sizeof(gp2pp_room_usernum_t);
+  
+  prefix = ghtons(roominfo->prefix);
+  page = roominfo_page(&serv->roominfo, prefix);
+  if (page == NULL)
+    return -1;
+  
+  roominfo_ev.num_rooms = 0;
+  roominfo_ev.rooms = changed;
+  for (i = 0; i < num_rooms; i++) {
+    suffix = roominfo->usernum[i].suffix;
+    page->seen[suffix] = now;
+    if (!(page->known[suffix >> 3] & (1 << (suffix & 7)))) {
+      page->known[suffix >> 3] |= (1 << (suffix & 7));
+      page->num_known++;
+      serv->roominfo.num_rooms++;
+    } else if (page->num_users[suffix] == roominfo->usernum[i].num_users)
+      continue;
+    page->num_users[suffix] = roominfo->usernum[i].num_users;
+    changed[roominfo_ev.num_rooms].room_id = (prefix << 8) | suffix;
+    changed[roominfo_ev.num_rooms].num_users = roominfo->usernum[i].num_users;
+    roominfo_ev.num_rooms++;
+  }
+  if (roominfo_ev.num_rooms) {
+    qsort(changed, roominfo_ev.num_rooms, sizeof(ghl_roominfo_t), roominfo_cmp);
+    signal_event(serv, GHL_EV_ROOMINFO, &roominfo_ev);
   }
   return 0;
 }
@@ -1577,8 +3192,13 @@ static int handle_roominfo(int type, void *payload, unsigned int length, void *p
 static int handle_initconn_msg(int type, void *payload, unsigned int length, void *privdata, unsigned int user_id, struct sockaddr_in *remote) {
   gp2pp_initconn_t *initconn = payload;
   ghl_conn_incoming_t conn_incoming_ev;
+  ghl_member_t *member;
   ghl_serv_t *serv = privdata;
   ghl_room_t *rh = serv->room;
+  if (length < sizeof(gp2pp_initconn_t)) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
   if (rh == NULL) {
     fprintf(deb,"Received INITCONN, but we are not in a room.\n");
     fflush(deb);  
@@ -1587,31 +3207,16 @@ static int handle_initconn_msg(int type, void *payload, unsigned int length, voi
   }
   fprintf(deb, "Received INITCONN message from %s:%u\n", inet_ntoa(remote->sin_addr), htons(remote->sin_port));
   fflush(deb);
-  conn_incoming_ev.ch = malloc(sizeof(ghl_ch_t));
-  conn_incoming_ev.ch->member = ghl_member_from_id(rh, user_id);
-  if (conn_incoming_ev.ch->member == NULL) {
-    free(conn_incoming_ev.ch);
+  member = ghl_member_from_id(rh, user_id);
+  if (member == NULL) {
+    serv->stats.unknown_user++;
     fprintf(deb, "Received INITCONN from unknown user %x\n", user_id);
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
-  conn_incoming_ev.ch->ts_base = garena_now();
-  conn_incoming_ev.ch->sendq = llist_alloc();
-  conn_incoming_ev.ch->recvq = llist_alloc();
-  conn_incoming_ev.ch->snd_una = 0;
-  conn_incoming_ev.ch->serv = serv;
-  conn_incoming_ev.ch->snd_next = 0;
-  conn_incoming_ev.ch->rcv_next = 0;
-  conn_incoming_ev.ch->srtt = 0;
-  conn_incoming_ev.ch->flightsize = 0;
-  conn_incoming_ev.ch->ssthresh = GP2PP_INIT_SSTHRESH;
-  conn_incoming_ev.ch->cwnd = (ghl_max_conn_pkt(serv)) << 1;
-  conn_incoming_ev.ch->last_xmit = 0;
-  conn_incoming_ev.ch->rto = GP2PP_INIT_RTO;
-  conn_incoming_ev.ch->rcv_next_deliver = 0;
-  conn_incoming_ev.ch->ts_ack = garena_now();
-  conn_incoming_ev.ch->cstate = GHL_CSTATE_ESTABLISHED;
-  conn_incoming_ev.ch->conn_id = ghtonl(initconn->conn_id);
+  conn_incoming_ev.ch = conn_alloc(serv, member, ghtonl(initconn->conn_id));
+  if (conn_incoming_ev.ch == NULL)
+    return -1;
   conn_incoming_ev.dport = ghtons(initconn->dport);
   ihash_put(rh->conns, conn_incoming_ev.ch->conn_id, conn_incoming_ev.ch);
   signal_event(serv, GHL_EV_CONN_INCOMING, &conn_incoming_ev);
@@ -1631,6 +3236,7 @@ static int handle_conn_fin_msg(int subtype, void *payload, unsigned int length,
   
   ch = ghl_conn_from_id(rh, conn_id);
   if (ch == NULL) {
+    serv->stats.alien_conn++;
     fprintf(deb, "Alien conn: %x\n", conn_id);
     fflush(deb);
     garena_errno = GARENA_ERR_PROTOCOL;
@@ -1642,17 +3248,18 @@ static int handle_conn_fin_msg(int subtype, void *payload, unsigned int length,
   /* WTF: CLOSING_IN and CLOSING_OUT states are basically the same, because the FIN packet does not carry a sequence number
    * so the FIN sequence number is set to recv_next, so try_deliver() will set state to CLOSING_OUT immediately.
    * This may change in the future (the linux client should set the SEQ correctly on FIN packet) */
-  pkt = malloc(sizeof(ghl_ch_pkt_t));
-  pkt->length = 0;
+  pkt = pkt_alloc(0);
+  if (pkt == NULL)
+    return -1;
   pkt->did_fast_retrans = 0;
   pkt->xmit_ts = 0;
   pkt->partial = 0;
   pkt->retrans = 0;
-  pkt->payload = NULL;
   pkt->seq = ch->rcv_next; /* wtf is this crappy protocol, the FIN packet does not have a sequence number */
   pkt->ts_rel = ts_rel;
   pkt->ch = ch;
-  insert_pkt(ch->recvq, pkt);
+  if (ghl_insert_pkt(&ch->recvq, pkt) == 0)
+    pkt_free(pkt);
   update_next(serv, ch);
   try_deliver(serv, ch);
   ch->finseq = seq1;
@@ -1663,12 +3270,6 @@ static int handle_conn_ack_msg(int subtype, void *payload, unsigned int length,
   ghl_serv_t *serv = privdata;
   ghl_room_t *rh = serv->room;
   ghl_ch_t *ch;
-  cell_t iter;
-  int now = garena_now();
-  gtime_t rtt;
-  
-  ghl_ch_pkt_t *pkt;
-  ghl_ch_pkt_t *todel = NULL;
   
   if (rh == NULL) {
     garena_errno = GARENA_ERR_PROTOCOL;
@@ -1678,61 +3279,120 @@ static int handle_conn_ack_msg(int subtype, void *payload, unsigned int length,
   fflush(deb);
   ch = ghl_conn_from_id(rh, conn_id);
   if (ch == NULL) {
+    serv->stats.alien_conn++;
     fprintf(deb, "Alien conn: %x\n", conn_id);
     fflush(deb);
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
+  ch->member->last_rx = garena_now_ms();
+  CONN_STAT_ADD(ch, acks_rx, 1);
+  /* ts_rel (1/4000th of seconds) is the time the peer held the ACK, see send_ack() */
+  conn_process_ack(serv, ch, seq1, seq2, 1, (ts_rel >> 2) < GP2PP_MAX_ACK_DELAY ? (ts_rel >> 2) : 0);
+  return 0;
+}
+
+/*
+ * Processes acknowledgement information received from the peer, either from an ACK
+ * message (explicit is set, seq1 is the segment that triggered the ACK) or piggybacked
+ * on a DATA segment (explicit is not set). seq2 is the cumulative ACK. ack_delay is the
+ * time (msec) the peer held the ACK before sending it (delayed ACK).
+ */
+static void conn_process_ack(ghl_serv_t *serv, ghl_ch_t *ch, int seq1, int seq2, int explicit, gtime_t ack_delay) {
+  ilist_node_t *node;
+  ilist_node_t *next;
+  gtime_t now = garena_now_ms();
+  gtime_t rtt;
+  ghl_ch_pkt_t *pkt;
+
   if ((seq2 - ch->snd_una) > 0) {
     ch->snd_una = seq2;
-    ch->ts_ack = garena_now();
-  } else {
+    ch->ts_ack = now;
+  } else if (explicit) {
+    CONN_STAT_ADD(ch, dup_acks, 1);
     if ((seq2 - ch->snd_una) < 0)
-      fprintf(deb, "Duplicate ack %u on connex %x\n", seq2, conn_id);
+      fprintf(deb, "Duplicate ack %u on connex %x\n", seq2, ch->conn_id);
   }
   
-  
-  for (iter=llist_iter(ch->sendq); iter; iter = llist_next(iter)) {
-    if (todel != NULL) { 
-      llist_del_item(ch->sendq, todel); 
-      free(todel->payload);
-      free(todel);
-      todel = NULL;
-    }
-    pkt = llist_val(iter);
-    if ((pkt->seq == seq1) || ((ch->snd_una - pkt->seq) >= 1)) {
-      todel = pkt;
+  for (node = ilist_head(&ch->sendq); node; node = next) {
+    next = ilist_next(&ch->sendq, node);
+    pkt = ilist_entry(node, ghl_ch_pkt_t, node);
+    if ((explicit && (pkt->seq == seq1)) || ((ch->snd_una - pkt->seq) >= 1)) {
       fprintf(deb, "Packet seq %x of conn %x was transmitted after %u msec\n", pkt->seq, ch->conn_id, (now - pkt->first_trans));
       fflush(deb);
       ch->flightsize -= pkt->length;
-      if (pkt->retrans == 0) {
+      /* 
+       * Only sample the segment that triggered an explicit ACK: segments that are only
+       * cumulatively acknowledged may have had their ACK delayed by the receiver.
+       */
+      if (explicit && (pkt->retrans == 0) && (pkt->seq == seq1)) {
         rtt = now - pkt->first_trans;
+        if (ack_delay < rtt)
+          rtt -= ack_delay;
         update_rto(rtt, ch);
       }
-    }
-    if ((pkt->xmit_ts == 0) && ((pkt->seq - ch->snd_una) < GP2PP_MAX_IN_TRANSIT)) {
-     
+      ilist_del(node);
+      pkt_free(pkt);
+    } else if ((pkt->xmit_ts == 0) && ((pkt->seq - ch->snd_una) < GP2PP_MAX_IN_TRANSIT)) {
      /* initial transmit (after flow control) */
       pkt->rto = ch->rto;
-      pkt->xmit_ts = garena_now();
+      pkt->xmit_ts = now;
+      pkt->first_trans = now;
       xmit_packet(serv, pkt);
       ch->flightsize += pkt->length;
     }
   }
-  if (todel != NULL) {
-      llist_del_item(ch->sendq, todel);
-      free(todel->payload);
-      free(todel);
-      todel = NULL;
+  if (explicit)
+    do_fast_retrans(serv, &ch->sendq, seq1);
+  /* 
+   * Nagle: held data can go now that everything was acknowledged. Also retry when no
+   * flush timer could be armed for the held data (see ghl_conn_send(), do_conn_flush()).
+   */
+  if (ch->pending_len && ((!ch->corked && ilist_is_empty(&ch->sendq)) || (ch->flush_timer == NULL)))
+    conn_flush(serv, ch);
+}
+
+/*
+ * Adds a RTT sample to the member statistics. Called for each HELLO reply and
+ * each virtual connection RTT sample, so it must stay cheap.
+ */
+static void rtt_sample(ghl_member_t *member, gtime_t rtt) {
+  ghl_rtt_stats_t *st = &member->rtt_stats;
+  unsigned int b = 0;
+  gtime_t tmp = rtt;
+  gtime_t delta;
+  int i;
+  
+  while ((tmp >>= 1) && (b < GHL_RTT_BUCKETS - 1))
+    b++;
+  if (st->samples >= GHL_RTT_MAX_SAMPLES) {
+    st->samples = 0;
+    for (i = 0; i < GHL_RTT_BUCKETS; i++) {
+      st->hist[i] >>= 1;
+      st->samples += st->hist[i];
+    }
   }
-  do_fast_retrans(serv, ch->sendq, seq1);
-  return 0;
+  st->hist[b]++;
+  if (st->samples == 0) {
+    st->min = rtt;
+    st->srtt8 = rtt << 3;
+    st->jitter16 = 0;
+  } else {
+    if (rtt < st->min)
+      st->min = rtt;
+    st->srtt8 += rtt - (st->srtt8 >> 3); /* srtt += (rtt - srtt) / 8 */
+    delta = (rtt > st->last) ? (rtt - st->last) : (st->last - rtt);
+    st->jitter16 += delta - (st->jitter16 >> 4); /* RFC 3550 style jitter */
+  }
+  st->samples++;
+  st->last = rtt;
 }
 
 static void update_rto(gtime_t rtt, ghl_ch_t *ch) {
   
   if (rtt == 0)
     rtt++;
+  rtt_sample(ch->member, rtt);
   
   if (ch->srtt == 0) {
     ch->srtt = rtt;
@@ -1751,10 +3411,8 @@ static int handle_conn_data_msg(int subtype, void *payload, unsigned int length,
   ghl_ch_t *ch;
   ghl_room_t *rh = serv->room;
   ghl_ch_pkt_t *pkt;
-  cell_t iter;
-  gtime_t rtt;
-  gtime_t now = garena_now();
-  ghl_ch_pkt_t *todel = NULL;
+  gtime_t now = garena_now_ms();
+  int old_next;
   if (rh == NULL) {
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
@@ -1763,46 +3421,23 @@ static int handle_conn_data_msg(int subtype, void *payload, unsigned int length,
 /*  fprintf(deb, "[%x] DATA, this_seq=%u next_expected=%u\n", conn_id, seq1, seq2); */
     
   if (ch == NULL) {
+    serv->stats.alien_conn++;
     fprintf(deb, "Alien conn: %x\n", conn_id);
     fflush(deb);
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
+  ch->member->last_rx = now;
   if (length == 0) {
     return 0;
   }
+  CONN_STAT_ADD(ch, data_rx, 1);
+  CONN_STAT_ADD(ch, data_rx_bytes, length);
     
   if (ch->cstate == GHL_CSTATE_CLOSING_OUT)
     return 0;
-  if ((seq2 - ch->snd_una) > 0) {
-    ch->snd_una = seq2;
-  } 
-
-  for (iter=llist_iter(ch->sendq); iter; iter = llist_next(iter)) {
-    if (todel != NULL) { 
-      llist_del_item(ch->sendq, todel); 
-      free(todel->payload);
-      free(todel);
-      todel = NULL;
-    }
-    pkt = llist_val(iter);
-    if ((ch->snd_una - pkt->seq) >= 1) {
-      todel = pkt;
-      fprintf(deb, "Packet seq %x of conn %x was transmitted after %u msec\n", pkt->seq, ch->conn_id, (now - pkt->first_trans));
-      fflush(deb);
-      ch->flightsize -= pkt->length;
-      if (pkt->retrans == 0) {
-        rtt = now - pkt->first_trans;
-        update_rto(rtt, ch);
-      }
-    }
-  }
-  if (todel != NULL) {
-      llist_del_item(ch->sendq, todel);
-      free(todel->payload);
-      free(todel);
-      todel = NULL;
-  }
+  /* seq2 is a cumulative ACK piggybacked on the data segment */
+  conn_process_ack(serv, ch, seq1, seq2, 0, 0);
 
   if ((ch->cstate == GHL_CSTATE_CLOSING_IN) && ((seq1 - ch->finseq) > 0)) {
     return 0;
@@ -1810,9 +3445,24 @@ static int handle_conn_data_msg(int subtype, void *payload, unsigned int length,
 /*  fprintf(deb, "Received CONN DATA message from %s:%u\n", inet_ntoa(remote->sin_addr), htons(remote->sin_port)); */ 
   fflush(deb);
   
-  pkt = malloc(sizeof(ghl_ch_pkt_t));
-  pkt->length = length;
-  pkt->payload = malloc(length);
+  if ((seq1 - ch->rcv_next) < 0) {
+    /* duplicate, our ACK was probably lost: ACK again immediately */
+    CONN_STAT_ADD(ch, dup_data, 1);
+    ch->ack_seq = seq1;
+    ch->ack_seq_rx = now;
+    send_ack(serv, ch);
+    return 0;
+  }
+  if (((ch->rcv_next - ch->rcv_next_deliver) >= GP2PP_MAX_UNDELIVERED) || ((seq1 - ch->rcv_next) >= GP2PP_MAX_IN_TRANSIT)) {
+    CONN_STAT_ADD(ch, rwin_drops, 1);
+    return 0;
+  }
+  if (seq1 != ch->rcv_next)
+    CONN_STAT_ADD(ch, out_of_order, 1);
+
+  pkt = pkt_alloc(length);
+  if (pkt == NULL)
+    return -1;
   pkt->seq = seq1;
   pkt->ts_rel = ts_rel;
   pkt->ch = ch;
@@ -1821,56 +3471,149 @@ static int handle_conn_data_msg(int subtype, void *payload, unsigned int length,
   pkt->retrans = 0;
   pkt->did_fast_retrans = 0;
   memcpy(pkt->payload, payload, length);
-  if (((seq1 - ch->rcv_next) >= 0) && ((ch->rcv_next - ch->rcv_next_deliver) < GP2PP_MAX_UNDELIVERED) && ((seq1 - ch->rcv_next) < GP2PP_MAX_IN_TRANSIT)) {
-    insert_pkt(ch->recvq, pkt);
-    remote->sin_port = htons(ch->member->external_port);
-    update_next(serv, ch); 
-    gp2pp_output_conn(serv->peersock, GP2PP_CONN_MSG_ACK, NULL, 0, serv->my_info.user_id, conn_id, seq1, ch->rcv_next, 0, remote);
-    try_deliver(serv, ch);
+  old_next = ch->rcv_next;
+  if (ghl_insert_pkt(&ch->recvq, pkt) == 0) {
+    CONN_STAT_ADD(ch, dup_data, 1);
+    pkt_free(pkt);
+  }
+  update_next(serv, ch); 
+  ch->ack_seq = seq1;
+  ch->ack_seq_rx = now;
+  ch->ack_pending++;
+  /* 
+   * ACK immediately on out-of-order segment or when a hole is filled, so that the sender 
+   * can fast-retransmit. Otherwise ACK every delack_segs segments or when the timer expires. 
+   */
+  if ((seq1 != old_next) || ((ch->rcv_next - old_next) != 1) || (ch->ack_pending >= ch->delack_segs)) {
+    send_ack(serv, ch);
+  } else if (ch->delack_timer == NULL) {
+    ch->delack_timer = ghl_new_timer_ms(now + ch->delack_timeout, do_delayed_ack, ch);
+    if (ch->delack_timer == NULL)
+      send_ack(serv, ch);
   }
-  
+  try_deliver(serv, ch);
   
   return 0;
 }
 
 static int handle_peer_msg(int type, void *payload, unsigned int length, void *privdata, unsigned int user_id, struct sockaddr_in *remote) {
   gp2pp_udp_encap_t *udp_encap = payload;
+  gp2pp_hello_req_t *hello_req = payload;
+  gp2pp_hello_rep_t *hello_rep = payload;
+  uint32_t hello_id;
   ghl_serv_t *serv = privdata;
   ghl_room_t *rh = serv->room;
   ghl_udp_encap_t udp_encap_ev;
+  ghl_peer_reachable_t peer_reachable_ev;
   ghl_member_t *member;
+  struct sockaddr_in direct;
   if (rh == NULL) {
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
   member = ghl_member_from_id(rh, user_id);
   if (member == NULL){
+    serv->stats.unknown_user++;
     fprintf(deb, "[GHL/ERR] Received GP2PP message from unknown user_id %x\n", user_id);
     fflush(deb);
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
+  member->last_rx = garena_now_ms();
   switch(type) {
     case GP2PP_MSG_HELLO_REQ:
       IFDEBUG(printf("[GHL/DEBUG] Received HELLO request from %s\n", member->name));
+      hello_id = (length >= sizeof(gp2pp_hello_req_t)) ? ghtonl(hello_req->hello_id) : 0;
       if (user_id != serv->my_info.user_id) {
+        if (member_is_vaddr(serv, member, remote)) {
+          /* came through the relay */
+          if ((member->conn_ok == 2) && !member->relayed) {
+            /* but the direct path works our way */
+            direct.sin_family = AF_INET;
+            direct.sin_addr = member->effective_ip;
+            direct.sin_port = htons(member->effective_port);
+            gp2pp_send_hello_reply(serv->peersock, serv->my_info.user_id, user_id, hello_id, &direct);
+            break;
+          }
+          if (relay_member_start(serv, member) == -1)
+            return -1;
+        } else if (member->relayed) {
+          /* direct path, answer directly but wait for a direct reply before using it */
+          gp2pp_send_hello_reply(serv->peersock, serv->my_info.user_id, user_id, hello_id, remote);
+          break;
+        }
         if (member->conn_ok == 0)
           member->conn_ok = 1;
         member->effective_ip = remote->sin_addr;
         member->effective_port = htons(remote->sin_port);
-        gp2pp_send_hello_reply(serv->peersock, serv->my_info.user_id, user_id, remote);
+        gp2pp_send_hello_reply(serv->peersock, serv->my_info.user_id, user_id, hello_id, remote);
       }
       break;
     case GP2PP_MSG_HELLO_REP:
       if (user_id != serv->my_info.user_id) {
         IFDEBUG(printf("[GHL/DEBUG] Received HELLO reply from %s\n", member->name));
+        hello_id = (length >= sizeof(gp2pp_hello_rep_t)) ? ghtonl(hello_rep->hello_id) : 0;
+        if (hello_id)
+          member->hello_echo = 1;
+        if (member_is_vaddr(serv, member, remote) != member->relayed) {
+          if (member->relayed) {
+            /* the direct path works, stop relaying */
+            fprintf(deb, "[GHL] Direct communication with %s works, not using the relay anymore\n", member->name);
+            fflush(deb);
+            relay_member_stop(serv, member);
+            member->conn_ok = 1;
+          } else break; /* stale reply through the relay */
+        }
+        if ((member->conn_ok == 2) && ((member->effective_ip.s_addr != remote->sin_addr.s_addr) ||
+            (member->effective_port != htons(remote->sin_port)))) {
+          /* late reply to the reachability check, from a losing candidate */
+          break;
+        }
         member->effective_ip = remote->sin_addr;
         member->effective_port = htons(remote->sin_port);
-        member->conn_ok = 2;
-        member->ping = (garena_now() - member->echo_ts) * 10;
+        /* 
+         * Only the reply to the last HELLO gives a RTT sample: identified by its ID with
+         * libgarena peers, otherwise when no earlier HELLO may still be answered. The
+         * probes are not sampled, large packets take longer.
+         */
+        if (hello_id ? (hello_id == member->echo_id) : (member->hello_unanswered == 1)) {
+          member->ping = garena_now_ms() - member->echo_ts;
+          rtt_sample(member, member->ping);
+        }
+        member->hello_unanswered = 0;
+        if (member->ka_outstanding && (!hello_id || (hello_id == member->echo_id))) {
+          member->ka_outstanding = 0;
+          member->ka_interval += member->ka_interval >> 3;
+          if (member->ka_interval > GHL_KEEPALIVE_MAX)
+            member->ka_interval = GHL_KEEPALIVE_MAX;
+        }
+        if (member->pmtu_probe && (hello_id == member->pmtu_hello_id)) {
+          /* the probe made its way through */
+          member->pmtu = member->pmtu_probe;
+          member->pmtu_lo = member->pmtu_probe;
+          member->pmtu_tries = 0;
+          pmtu_probe(serv, member);
+        } else if (member->conn_ok != 2) {
+          member->conn_ok = 2;
+          if (member->reach_timer) {
+            ghl_free_timer(member->reach_timer);
+            member->reach_timer = NULL;
+          }
+          if (!member->relayed && member->hello_echo)
+            pmtu_start(serv, member);
+          keepalive_start(member);
+          member_sync(member);
+          peer_reachable_ev.rh = rh;
+          peer_reachable_ev.member = member;
+          signal_event(serv, GHL_EV_PEER_REACHABLE, &peer_reachable_ev);
+        }
       }
       break;
     case GP2PP_MSG_UDP_ENCAP:
+      if (length < sizeof(gp2pp_udp_encap_t)) {
+        garena_errno = GARENA_ERR_PROTOCOL;
+        return -1;
+      }
       udp_encap_ev.member = member;
       udp_encap_ev.sport = htons(udp_encap->sport);
       udp_encap_ev.dport = htons(udp_encap->dport);
@@ -1884,9 +3627,41 @@ static int handle_peer_msg(int type, void *payload, unsigned int length, void *p
       garena_errno = GARENA_ERR_INVALID;
       return -1;
   }
+  member_sync(member);
   return 0;
 }
 
+/*
+ * Messages forwarded by the relay: unwrap them, and process them as if they came
+ * from the member virtual address. We are not a relay, messages for others are dropped.
+ */
+static int handle_relay_msg(int type, void *payload, unsigned int length, void *privdata, unsigned int user_id, struct sockaddr_in *remote) {
+  ghl_serv_t *serv = privdata;
+  gp2pp_relay_t *relay = payload;
+  gp2pp_hdr_t *inner = (gp2pp_hdr_t *) relay->payload;
+  struct sockaddr_in vaddr;
+  ghl_member_t *member;
+  
+  if ((serv->room == NULL) || !serv->relay_enabled || (remote->sin_addr.s_addr != serv->relay.sin_addr.s_addr) ||
+      (remote->sin_port != serv->relay.sin_port)) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
+  /* the relay only vouches for the outer sender, the inner one must be the same */
+  if ((length < sizeof(gp2pp_relay_t) + sizeof(gp2pp_hdr_t)) || (ghtonl(relay->to_id) != serv->my_info.user_id) ||
+      (inner->msgtype == GP2PP_MSG_RELAY) || (ghtonl(inner->user_id) != user_id)) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
+  member = ghl_member_from_id(serv->room, user_id);
+  if (member == NULL) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
+  member_vaddr(serv, member, &vaddr);
+  return gp2pp_input(serv->gp2pp_htab, relay->payload, length - sizeof(gp2pp_relay_t), &vaddr);
+}
+
 static int handle_room_join_timeout(void *privdata) {
   int err = 0;
   ghl_me_join_t join;
@@ -1909,10 +3684,15 @@ static int handle_room_join(int type, void *payload, unsigned int length, void *
   int err = 0;
   ghl_member_t *member;
   unsigned int i;
+  unsigned int num;
   int joined;
   
   switch(type) {
     case GCRP_MSG_MEMBERS:
+      if (length < sizeof(gcrp_memberlist_t)) {
+        garena_errno = GARENA_ERR_PROTOCOL;
+        return -1;
+      }
       IFDEBUG(printf("[GHL] Received members (%u members).\n", ghtonl(memberlist->num_members)));
       rh = serv->room;
       
@@ -1920,10 +3700,20 @@ static int handle_room_join(int type, void *payload, unsigned int length, void *
         fprintf(stderr, "[GHL/WARN] Joined a room that we didn't ask to join (?!?)\n");
         return 0;
       }
+      
+      /* allocate the member structures and hashtable items in one go */
+      num = ghtonl(memberlist->num_members);
+      if (num > (length - sizeof(gcrp_memberlist_t)) / sizeof(gcrp_member_t))
+        num = (length - sizeof(gcrp_memberlist_t)) / sizeof(gcrp_member_t);
+      if ((member_reserve(rh, num) == -1) || (ihash_reserve(rh->members, num) == -1)) {
+        garena_errno = GARENA_ERR_NORESOURCE;
+        return -1;
+      }
   
-      for (i = 0; i < ghtonl(memberlist->num_members); i++) {
-        member = malloc(sizeof(ghl_member_t));
-        member_extract(member, memberlist->members + i);
+      for (i = 0; i < num; i++) {
+        member = member_new(rh, memberlist->members + i);
+        if (member == NULL)
+          return -1;
         ihash_put(rh->members, member->user_id, member);
 
         IFDEBUG(printf("[GHL] Room member: %s\n", member->name));
@@ -1995,23 +3785,28 @@ static int handle_room_activity(int type, void *payload, unsigned int length, vo
   ghl_talk_t talk_ev;
   ghl_system_t system_ev;
   ghl_part_t part_ev;
-  ihashitem_t iter;
   ghl_conn_fin_t conn_fin_ev;
-  ghl_ch_t *todel;
   ghl_ch_t *conn;
   ghl_join_t join_ev;
   ghl_togglevpn_t togglevpn_ev;
   
+  /* every message starts with (at least) a user or room ID */
+  if ((length < sizeof(uint32_t)) || ((type == GCRP_MSG_JOIN) && (length < sizeof(gcrp_join_t))) ||
+      ((type == GCRP_MSG_TALK) && ((length < sizeof(gcrp_talk_t)) || (talk->length > length - sizeof(gcrp_talk_t))))) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
   switch(type) {
     case GCRP_MSG_JOIN:
       if (ghtonl(join->user_id) != serv->my_info.user_id) {
-        member = malloc(sizeof(ghl_member_t));
-        member_extract(member, join);
+        member = member_new(rh, join);
+        if (member == NULL)
+          return -1;
         ihash_put(rh->members, member->user_id, member);
         join_ev.rh = rh;
         join_ev.member = member;
         signal_event(serv, GHL_EV_JOIN, &join_ev);
-        send_hello(serv, member);
+        reach_check_start(serv, member);
       }
       break;
     case GCRP_MSG_TALK:
@@ -2032,7 +3827,7 @@ static int handle_room_activity(int type, void *payload, unsigned int length, vo
       }
       break;
     case GCRP_MSG_SYSTEM:
-      if (gcrp_tochar(buf, syst->text, GCRP_MAX_MSGSIZE) == -1) {
+      if (gcrp_tochar(buf, syst->text, ((length - sizeof(gcrp_system_t)) >> 1) + 1) == -1) {
         fprintf(stderr, "Failed to convert user message.\n");
       } else {
         system_ev.rh = rh;
@@ -2052,6 +3847,7 @@ static int handle_room_activity(int type, void *payload, unsigned int length, vo
         togglevpn_ev.member = member;
         togglevpn_ev.vpn = 1;
         member->vpn = 1;
+        member_sync(member);
         signal_event(serv, GHL_EV_TOGGLEVPN, &togglevpn_ev);
       break;
     case GCRP_MSG_STOPVPN:
@@ -2067,6 +3863,7 @@ static int handle_room_activity(int type, void *payload, unsigned int length, vo
         togglevpn_ev.member = member;
         togglevpn_ev.vpn = 0;
         member->vpn = 0;
+        member_sync(member);
         signal_event(serv, GHL_EV_TOGGLEVPN, &togglevpn_ev);
       break;
     case GCRP_MSG_PART:
@@ -2081,30 +3878,18 @@ static int handle_room_activity(int type, void *payload, unsigned int length, vo
       part_ev.rh = rh;
       signal_event(serv, GHL_EV_PART, &part_ev);
       ihash_del(rh->members, member->user_id);
-      todel = NULL;
-      for (iter = ihash_iter(rh->conns); iter; iter = ihash_next(rh->conns, iter)) {
-        if (todel) {
-          ihash_del(rh->conns, conn->conn_id);
-          conn_free(conn);
-          todel = NULL;
-        }
-
-        conn = ihash_val(iter);
-        if (conn->member == member) {
-           if (conn->cstate != GHL_CSTATE_CLOSING_OUT) {
-             conn_fin_ev.ch = conn;
-             signal_event(serv, GHL_EV_CONN_FIN, &conn_fin_ev);
-           }
-           todel = conn;
+      while (member->conns) {
+        conn = member->conns;
+        if (conn->cstate != GHL_CSTATE_CLOSING_OUT) {
+          conn->cstate = GHL_CSTATE_CLOSING_OUT;
+          conn_fin_ev.ch = conn;
+          signal_event(serv, GHL_EV_CONN_FIN, &conn_fin_ev);
         }
-      }
-      if (todel) {
         ihash_del(rh->conns, conn->conn_id);
         conn_free(conn);
-        todel = NULL;
       }
       
-      free(member);
+      member_free(member);
       break;
     default:  
       garena_errno = GARENA_ERR_INVALID;
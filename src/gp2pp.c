@@ -6,21 +6,110 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
 
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <time.h>
 #include <garena/garena.h>
 #include <garena/gp2pp.h>
 #include <garena/error.h>
 #include <garena/util.h>
+#include <garena/private.h>
+
+/* socket option setting DF on the datagrams, for the path MTU probes */
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+#define GP2PP_DF_OPT IP_MTU_DISCOVER
+#define GP2PP_DF_ON IP_PMTUDISC_PROBE
+#elif defined(IP_DONTFRAG)
+#define GP2PP_DF_OPT IP_DONTFRAG
+#define GP2PP_DF_ON 1
+#endif
+
+/*
+ * Relay route: messages sent on sock to dest are wrapped in a GP2PP_MSG_RELAY message,
+ * and sent to the relay instead.
+ */
+typedef struct gp2pp_route_s {
+  struct gp2pp_route_s *next; /* next route to the same destination IP */
+  struct sockaddr_in dest;
+  struct sockaddr_in relay;
+  uint32_t from_id;
+  uint32_t to_id;
+} gp2pp_route_t;
+
+struct gp2pp_routes_s {
+  ihash_t index; /* destination IP -> first route to this IP */
+};
+
+/*
+ * Message held back by the impairment layer, until it is due.
+ */
+typedef struct {
+  ilist_node_t node;
+  gtime_t when;
+  int sock;
+  struct sockaddr_in dest;
+  int df; /* send it with DF set */
+  unsigned int length;
+  char data[0];
+} gp2pp_delayed_t;
 
+static gp2pp_impair_t impair;
+static int impair_on = 0;
+static int impair_burst = 0; /* in the burst loss state? */
+static uint64_t impair_rng;
+static uint64_t impair_backlog; /* time needed to drain the bandwidth cap queue, in usecs */
+static gtime_t impair_backlog_time;
+static ilist_t delayed; /* sorted by due time */
+
+/* what the owner of a socket attached to it, indexed by socket */
+typedef struct {
+  gp2pp_stats_t *stats; /* message counters, see gp2pp_set_stats() */
+  gp2pp_routes_t *routes; /* relay routes, see gp2pp_set_routes() */
+} gp2pp_sock_t;
+
+static gp2pp_sock_t *socks = NULL;
+static unsigned int socks_size = 0;
+
+static gp2pp_sock_t *gp2pp_sock(int sock, int grow);
+static gp2pp_route_t *gp2pp_find_route(gp2pp_routes_t *routes, struct sockaddr_in *dest);
+static void gp2pp_unlink_route(gp2pp_routes_t *routes, gp2pp_route_t *route);
+static int gp2pp_send(int sock, struct iovec *iov, int iovlen, int df, struct sockaddr_in *remote);
+static int gp2pp_sendmsg(int sock, struct msghdr *msg, int df);
+static int gp2pp_output_msg(int sock, int type, char *payload, unsigned int length, int user_id, int df, struct sockaddr_in *remote);
+static int gp2pp_impair_output(int sock, struct msghdr *msg, int df);
 
 void gp2pp_fini(void) {
+  ilist_node_t *node;
+  
+  free(socks);
+  socks = NULL;
+  socks_size = 0;
+  impair_on = 0;
+  while ((delayed.next != NULL) && !ilist_is_empty(&delayed)) {
+    node = ilist_head(&delayed);
+    ilist_del(node);
+    free(ilist_entry(node, gp2pp_delayed_t, node));
+  }
 }
 
 int gp2pp_init(void) {
+  gp2pp_impair_t env_impair;
+  char *spec = getenv(GP2PP_IMPAIR_ENV);
+  
+  ilist_init(&delayed);
+  if (spec != NULL) {
+    if (gp2pp_parse_impair(spec, &env_impair) == -1) {
+      fprintf(stderr, "Invalid %s specification: %s\n", GP2PP_IMPAIR_ENV, spec);
+      return -1;
+    }
+    gp2pp_set_impair(&env_impair);
+  }
   return 0;
 }  
 
@@ -46,6 +135,73 @@ gp2pp_handtab_t *gp2pp_alloc_handtab (void) {
 
 
 
+static inline gp2pp_stats_t *gp2pp_stats(int sock) {
+  return ((unsigned int) sock < socks_size) ? socks[sock].stats : NULL;
+}
+
+static inline gp2pp_routes_t *gp2pp_routes(int sock) {
+  return ((unsigned int) sock < socks_size) ? socks[sock].routes : NULL;
+}
+
+static inline void gp2pp_count_tx(int sock, int type, unsigned int length) {
+  gp2pp_stats_t *stats = gp2pp_stats(sock);
+  if (stats) {
+    stats->tx_msgs[GP2PP_STATS_SLOT(type)]++;
+    stats->tx_bytes[GP2PP_STATS_SLOT(type)] += length;
+  }
+}
+
+static inline void gp2pp_count_tx_error(int sock) {
+  gp2pp_stats_t *stats = gp2pp_stats(sock);
+  if (stats)
+    stats->tx_errors++;
+}
+
+/**
+ * Sets the counters updated for the messages sent and received on a socket.
+ * The counters are not reset.
+ *
+ * @param sock The socket
+ * @param stats The counters, or NULL to stop counting
+ * @return 0 for success, -1 for failure
+ */
+int gp2pp_set_stats(int sock, gp2pp_stats_t *stats) {
+  gp2pp_sock_t *state;
+  
+  if (sock < 0) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  state = gp2pp_sock(sock, stats != NULL);
+  if (state == NULL)
+    return (stats == NULL) ? 0 : -1;
+  state->stats = stats;
+  return 0;
+}
+
+/* the state of a socket, the table is grown to hold it if grow is set */
+static gp2pp_sock_t *gp2pp_sock(int sock, int grow) {
+  gp2pp_sock_t *tmp;
+  unsigned int size;
+  
+  if ((unsigned int) sock < socks_size)
+    return &socks[sock];
+  if (!grow)
+    return NULL;
+  size = socks_size ? socks_size : 16;
+  while (size <= (unsigned int) sock)
+    size <<= 1;
+  tmp = realloc(socks, size * sizeof(gp2pp_sock_t));
+  if (tmp == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
+  memset(tmp + socks_size, 0, (size - socks_size) * sizeof(gp2pp_sock_t));
+  socks = tmp;
+  socks_size = size;
+  return &socks[sock];
+}
+
 /**
  * Attempt to read the socket to get a GP2PP message.
  * The read will be blocking if the socket is blocking.
@@ -60,10 +216,17 @@ gp2pp_handtab_t *gp2pp_alloc_handtab (void) {
 int gp2pp_read(int sock, char *buf, unsigned int length, struct sockaddr_in *remote) {
   int r;
   unsigned int fromlen = sizeof(struct sockaddr_in);
+  gp2pp_stats_t *stats;
   if ((r = recvfrom(sock, buf, length, 0, (struct sockaddr*) remote, &fromlen)) == -1) {
     garena_errno = GARENA_ERR_LIBC;
     return -1;
   }
+  if (garena_capture_active)
+    garena_capture(GARENA_CAPTURE_GP2PP, GARENA_CAPTURE_IN, buf, r, remote);
+  if ((r > 0) && ((stats = gp2pp_stats(sock)) != NULL)) {
+    stats->rx_msgs[GP2PP_STATS_SLOT((uint8_t) buf[0])]++;
+    stats->rx_bytes[GP2PP_STATS_SLOT((uint8_t) buf[0])] += r;
+  }
   return r;
 }
 
@@ -75,7 +238,7 @@ static int gp2pp_handle_conn_pkt(gp2pp_handtab_t *htab, char *buf, unsigned int
     IFDEBUG(fprintf(stderr, "[DEBUG/GP2PP] Dropped short message.\n"));
     return -1;
   }
-  if ((pkt->msgsubtype > GP2PP_CONN_MSG_NUM) || (htab->gp2pp_conn_handlers[pkt->msgsubtype].fun == NULL)) {
+  if ((pkt->msgsubtype >= GP2PP_CONN_MSG_NUM) || (htab->gp2pp_conn_handlers[pkt->msgsubtype].fun == NULL)) {
     fprintf(deb, "[DEBUG/GP2PP] Unhandled CONN message of subtype: %x\n", pkt->msgsubtype);
     fflush(deb);
   } else {
@@ -100,11 +263,6 @@ static int gp2pp_handle_conn_pkt(gp2pp_handtab_t *htab, char *buf, unsigned int
 int gp2pp_input(gp2pp_handtab_t *htab, char *buf, unsigned int length, struct sockaddr_in *remote) {
   gp2pp_hdr_t *hdr = (gp2pp_hdr_t *) buf;
 
-/*
-  if ((random() & 0xF) == 0) {
-    return 0;
-  }
-*/
 
   /*
    * Need special handling for type 0x06 and 0x3F packet (ip lookup and room info)
@@ -150,6 +308,510 @@ int gp2pp_input(gp2pp_handtab_t *htab, char *buf, unsigned int length, struct so
 
 
 
+/* called for every message sent, hence the index */
+static gp2pp_route_t *gp2pp_find_route(gp2pp_routes_t *routes, struct sockaddr_in *dest) {
+  gp2pp_route_t *route;
+  for (route = ihash_get(routes->index, dest->sin_addr.s_addr); route; route = route->next) {
+    if (route->dest.sin_port == dest->sin_port)
+      return route;
+  }
+  return NULL;
+}
+
+static void gp2pp_unlink_route(gp2pp_routes_t *routes, gp2pp_route_t *route) {
+  gp2pp_route_t **prev;
+  gp2pp_route_t *head = ihash_get(routes->index, route->dest.sin_addr.s_addr);
+  
+  if (head == route) {
+    /* the freed slot is reused, this does not allocate */
+    ihash_del(routes->index, route->dest.sin_addr.s_addr);
+    if (route->next != NULL)
+      ihash_put(routes->index, route->dest.sin_addr.s_addr, route->next);
+    return;
+  }
+  for (prev = &head->next; *prev != route; prev = &(*prev)->next);
+  *prev = route->next;
+}
+
+/*
+ * Sends a datagram (given as an iovec), through the relay if there is a route 
+ * for the destination. With df set, the datagram is sent with DF set (path MTU probes).
+ */
+static int gp2pp_send(int sock, struct iovec *iov, int iovlen, int df, struct sockaddr_in *remote) {
+  struct iovec riov[4];
+  struct msghdr msg;
+  gp2pp_hdr_t hdr;
+  gp2pp_relay_t relay;
+  gp2pp_routes_t *routes = gp2pp_routes(sock);
+  gp2pp_route_t *route = routes ? gp2pp_find_route(routes, remote) : NULL;
+  unsigned int length = 0;
+  int i;
+  
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  if (route == NULL) {
+    msg.msg_name = remote;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
+  } else {
+    if (iovlen > 2) {
+      garena_errno = GARENA_ERR_INVALID;
+      return -1;
+    }
+    hdr.msgtype = GP2PP_MSG_RELAY;
+    memset(hdr.unknown, 0, sizeof(hdr.unknown));
+    hdr.user_id = ghtonl(route->from_id);
+    relay.to_id = ghtonl(route->to_id);
+    riov[0].iov_base = &hdr;
+    riov[0].iov_len = sizeof(hdr);
+    riov[1].iov_base = &relay;
+    riov[1].iov_len = sizeof(relay);
+    for (i = 0; i < iovlen; i++)
+      riov[i + 2] = iov[i];
+    msg.msg_name = &route->relay;
+    msg.msg_iov = riov;
+    msg.msg_iovlen = iovlen + 2;
+  }
+  for (i = 0; i < msg.msg_iovlen; i++)
+    length += msg.msg_iov[i].iov_len;
+  gp2pp_count_tx(sock, *(uint8_t *) msg.msg_iov[0].iov_base, length);
+  /* the impairment layer captures the messages when it actually sends them */
+  if (garena_capture_active && (garena_replay_active || !impair_on))
+    garena_capture_iov(GARENA_CAPTURE_GP2PP, GARENA_CAPTURE_OUT, msg.msg_iov, msg.msg_iovlen, msg.msg_name);
+  if (garena_replay_active)
+    return 0;
+  if (impair_on)
+    return gp2pp_impair_output(sock, &msg, df);
+  if (gp2pp_sendmsg(sock, &msg, df) == -1) {
+    gp2pp_count_tx_error(sock);
+    garena_errno = GARENA_ERR_LIBC;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * sendmsg(), with DF set if df is set: the socket setting is restored afterwards, so that
+ * the other messages are still fragmented when needed. errno is the one of sendmsg().
+ */
+static int gp2pp_sendmsg(int sock, struct msghdr *msg, int df) {
+#ifdef GP2PP_DF_OPT
+  int df_on = GP2PP_DF_ON;
+  int old_df;
+  socklen_t optlen = sizeof(old_df);
+  int saved_errno;
+  int r;
+  
+  if (!df)
+    return sendmsg(sock, msg, 0);
+  if ((getsockopt(sock, IPPROTO_IP, GP2PP_DF_OPT, &old_df, &optlen) == -1) ||
+      (setsockopt(sock, IPPROTO_IP, GP2PP_DF_OPT, &df_on, sizeof(df_on)) == -1))
+    return -1;
+  r = sendmsg(sock, msg, 0);
+  saved_errno = errno;
+  setsockopt(sock, IPPROTO_IP, GP2PP_DF_OPT, &old_df, sizeof(old_df));
+  errno = saved_errno;
+  return r;
+#else
+  return sendmsg(sock, msg, 0);
+#endif
+}
+
+/**
+ * Allocates an empty relay route table. Attach it to a socket with gp2pp_set_routes().
+ *
+ * @return The route table, or NULL for failure
+ */
+gp2pp_routes_t *gp2pp_alloc_routes(void) {
+  gp2pp_routes_t *routes = malloc(sizeof(gp2pp_routes_t));
+  if (routes == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
+  routes->index = ihash_init();
+  if (routes->index == NULL) {
+    free(routes);
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
+  return routes;
+}
+
+/**
+ * Frees a relay route table and all its routes. It must not be attached to a socket anymore.
+ *
+ * @param routes The route table, or NULL
+ */
+void gp2pp_free_routes(gp2pp_routes_t *routes) {
+  ihashitem_t iter;
+  gp2pp_route_t *route;
+  gp2pp_route_t *next;
+  
+  if (routes == NULL)
+    return;
+  for (iter = ihash_iter(routes->index); iter; iter = ihash_next(routes->index, iter)) {
+    for (route = ihash_val(iter); route; route = next) {
+      next = route->next;
+      free(route);
+    }
+  }
+  ihash_free(routes->index);
+  free(routes);
+}
+
+/**
+ * Sets the relay routes of a socket: the GP2PP messages sent on this socket to a 
+ * destination that has a route are sent to the relay instead.
+ *
+ * @param sock The socket
+ * @param routes The route table, or NULL to send everything directly
+ * @return 0 for success, -1 for failure
+ */
+int gp2pp_set_routes(int sock, gp2pp_routes_t *routes) {
+  gp2pp_sock_t *state;
+  
+  if (sock < 0) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  state = gp2pp_sock(sock, routes != NULL);
+  if (state == NULL)
+    return (routes == NULL) ? 0 : -1;
+  state->routes = routes;
+  return 0;
+}
+
+/**
+ * Adds a relay route: the GP2PP messages sent to the destination (on the sockets using 
+ * this table) will be sent to the relay, wrapped in a GP2PP_MSG_RELAY message. The 
+ * destination address is not used on the wire, it only identifies the route.
+ * If a route already exists for this destination, it is updated.
+ *
+ * @param routes The route table
+ * @param dest The destination address
+ * @param relay The relay address
+ * @param from_ID The originating user ID
+ * @param to_ID The destination user ID
+ * @return 0 for success, -1 for failure
+ */
+int gp2pp_add_route(gp2pp_routes_t *routes, struct sockaddr_in *dest, struct sockaddr_in *relay, int from_ID, int to_ID) {
+  gp2pp_route_t *route = gp2pp_find_route(routes, dest);
+  
+  if (route == NULL) {
+    route = malloc(sizeof(gp2pp_route_t));
+    if (route == NULL) {
+      garena_errno = GARENA_ERR_NORESOURCE;
+      return -1;
+    }
+    route->next = ihash_get(routes->index, dest->sin_addr.s_addr);
+    if (route->next != NULL)
+      ihash_del(routes->index, dest->sin_addr.s_addr);
+    if (ihash_put(routes->index, dest->sin_addr.s_addr, route) == -1) {
+      free(route);
+      garena_errno = GARENA_ERR_NORESOURCE;
+      return -1;
+    }
+  }
+  route->dest = *dest;
+  route->relay = *relay;
+  route->from_id = from_ID;
+  route->to_id = to_ID;
+  return 0;
+}
+
+/**
+ * Deletes a relay route.
+ *
+ * @param routes The route table
+ * @param dest The destination address
+ * @return 0 for success, -1 for failure
+ */
+int gp2pp_del_route(gp2pp_routes_t *routes, struct sockaddr_in *dest) {
+  gp2pp_route_t *route = gp2pp_find_route(routes, dest);
+  if (route == NULL) {
+    garena_errno = GARENA_ERR_NOTFOUND;
+    return -1;
+  }
+  gp2pp_unlink_route(routes, route);
+  free(route);
+  return 0;
+}
+
+/* xorshift64*, so that the decisions only depend on the seed */
+static double gp2pp_impair_random(void) {
+  impair_rng ^= impair_rng >> 12;
+  impair_rng ^= impair_rng << 25;
+  impair_rng ^= impair_rng >> 27;
+  return ((impair_rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void gp2pp_impair_queue(gp2pp_delayed_t *pkt) {
+  ilist_node_t *node;
+  
+  /* most messages are due after the last queued one, so scan from the tail */
+  for (node = ilist_tail(&delayed); node; node = ilist_prev(&delayed, node)) {
+    if (gtime_after_eq(pkt->when, ilist_entry(node, gp2pp_delayed_t, node)->when)) {
+      ilist_add_after(node, &pkt->node);
+      return;
+    }
+  }
+  ilist_add_head(&delayed, &pkt->node);
+}
+
+static int gp2pp_impair_drop(int sock) {
+  gp2pp_stats_t *stats = gp2pp_stats(sock);
+  if (stats)
+    stats->impair_drops++;
+  return 0;
+}
+
+/*
+ * Applies the impairment to an outgoing message: it is dropped, or queued (once or twice)
+ * with its due time. Like on a real network, a dropped message is not an error.
+ */
+static int gp2pp_impair_output(int sock, struct msghdr *msg, int df) {
+  gp2pp_delayed_t *pkt;
+  gtime_t now = garena_now_ms();
+  unsigned int length = 0;
+  unsigned int delay;
+  unsigned int copies;
+  unsigned int i;
+  uint64_t elapsed;
+  
+  if (impair.burst_enter > 0) {
+    if (impair_burst) {
+      if (gp2pp_impair_random() < impair.burst_exit)
+        impair_burst = 0;
+    } else if (gp2pp_impair_random() < impair.burst_enter) {
+      impair_burst = 1;
+    }
+    if (impair_burst)
+      return gp2pp_impair_drop(sock);
+  }
+  if ((impair.loss > 0) && (gp2pp_impair_random() < impair.loss))
+    return gp2pp_impair_drop(sock);
+  
+  for (i = 0; i < msg->msg_iovlen; i++)
+    length += msg->msg_iov[i].iov_len;
+  copies = ((impair.dup > 0) && (gp2pp_impair_random() < impair.dup)) ? 2 : 1;
+  
+  while (copies--) {
+    delay = impair.delay;
+    if (impair.rate) {
+      /* the cap queue drains while we are not sending */
+      elapsed = (uint64_t) (gtime_t) (now - impair_backlog_time) * 1000;
+      impair_backlog = (impair_backlog > elapsed) ? (impair_backlog - elapsed) : 0;
+      impair_backlog_time = now;
+      if (impair_backlog * impair.rate / 1000000 + length > impair.limit)
+        return gp2pp_impair_drop(sock);
+      impair_backlog += (uint64_t) length * 1000000 / impair.rate;
+      delay += (impair_backlog + 999) / 1000;
+    }
+    if (impair.jitter)
+      delay += gp2pp_impair_random() * (impair.jitter + 1);
+    if ((impair.reorder > 0) && (gp2pp_impair_random() < impair.reorder))
+      delay += impair.reorder_delay;
+    
+    pkt = malloc(sizeof(gp2pp_delayed_t) + length);
+    if (pkt == NULL) {
+      garena_errno = GARENA_ERR_NORESOURCE;
+      return -1;
+    }
+    pkt->when = now + delay;
+    pkt->sock = sock;
+    pkt->dest = *(struct sockaddr_in *) msg->msg_name;
+    pkt->df = df;
+    pkt->length = 0;
+    for (i = 0; i < msg->msg_iovlen; i++) {
+      memcpy(pkt->data + pkt->length, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+      pkt->length += msg->msg_iov[i].iov_len;
+    }
+    gp2pp_impair_queue(pkt);
+  }
+  gp2pp_impair_flush();
+  return 0;
+}
+
+/**
+ * Parses an impairment specification: a comma separated list of parameter=value.
+ * The parameters are loss, burst (burst loss entry), burst_exit, reorder, dup (probabilities
+ * in percents), reorder_delay, delay, jitter (milliseconds), rate (bytes per second),
+ * limit (bytes) and seed. Example: "loss=1,delay=40,jitter=10,rate=200000,seed=42".
+ * The unspecified parameters are set to their default (no impairment, except for the
+ * defaults of reorder_delay, limit, and burst_exit which is 25% when burst is given).
+ *
+ * @param spec The specification
+ * @param impair The structure to fill
+ * @return 0 for success, -1 for failure
+ */
+int gp2pp_parse_impair(const char *spec, gp2pp_impair_t *impair) {
+  char param[32];
+  const char *value;
+  const char *end;
+  double val;
+  char *val_end;
+  int burst_exit_set = 0;
+  
+  memset(impair, 0, sizeof(gp2pp_impair_t));
+  impair->reorder_delay = GP2PP_IMPAIR_REORDER_DELAY;
+  impair->limit = GP2PP_IMPAIR_LIMIT;
+  impair->seed = 1;
+  while (*spec) {
+    value = strchr(spec, '=');
+    if ((value == NULL) || (value - spec >= sizeof(param))) {
+      garena_errno = GARENA_ERR_INVALID;
+      return -1;
+    }
+    memcpy(param, spec, value - spec);
+    param[value - spec] = 0;
+    value++;
+    val = strtod(value, &val_end);
+    end = strchr(value, ',');
+    if (end == NULL)
+      end = value + strlen(value);
+    if ((val_end != end) || (val < 0)) {
+      garena_errno = GARENA_ERR_INVALID;
+      return -1;
+    }
+    if (!strcmp(param, "loss")) {
+      impair->loss = val / 100;
+    } else if (!strcmp(param, "burst")) {
+      impair->burst_enter = val / 100;
+    } else if (!strcmp(param, "burst_exit")) {
+      impair->burst_exit = val / 100;
+      burst_exit_set = 1;
+    } else if (!strcmp(param, "reorder")) {
+      impair->reorder = val / 100;
+    } else if (!strcmp(param, "reorder_delay")) {
+      impair->reorder_delay = val;
+    } else if (!strcmp(param, "dup")) {
+      impair->dup = val / 100;
+    } else if (!strcmp(param, "delay")) {
+      impair->delay = val;
+    } else if (!strcmp(param, "jitter")) {
+      impair->jitter = val;
+    } else if (!strcmp(param, "rate")) {
+      impair->rate = val;
+    } else if (!strcmp(param, "limit")) {
+      impair->limit = val;
+    } else if (!strcmp(param, "seed")) {
+      impair->seed = val;
+    } else {
+      garena_errno = GARENA_ERR_INVALID;
+      return -1;
+    }
+    spec = (*end) ? end + 1 : end;
+  }
+  if ((impair->burst_enter > 0) && !burst_exit_set)
+    impair->burst_exit = 0.25;
+  return 0;
+}
+
+/**
+ * Sets (or removes) the egress impairment. The random generator is reseeded.
+ * When the impairment is removed, the held back messages are sent immediately.
+ * The impairment can also be set with the GARENA_IMPAIR environment variable
+ * (see gp2pp_parse_impair() for the syntax), which is read by garena_init().
+ *
+ * @param new_impair The impairment parameters, or NULL to disable the impairment
+ * @return 0 for success, -1 for failure
+ */
+int gp2pp_set_impair(gp2pp_impair_t *new_impair) {
+  ilist_node_t *node;
+  gtime_t now;
+  
+  if (new_impair == NULL) {
+    impair_on = 0;
+    if (delayed.next != NULL) {
+      now = garena_now_ms();
+      for (node = ilist_head(&delayed); node; node = ilist_next(&delayed, node))
+        ilist_entry(node, gp2pp_delayed_t, node)->when = now;
+      gp2pp_impair_flush();
+    }
+    return 0;
+  }
+  if ((new_impair->loss > 1) || (new_impair->burst_enter > 1) || (new_impair->burst_exit > 1) ||
+      (new_impair->reorder > 1) || (new_impair->dup > 1)) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  impair = *new_impair;
+  impair_rng = impair.seed ? impair.seed : 1;
+  impair_burst = 0;
+  impair_backlog = 0;
+  impair_backlog_time = garena_now_ms();
+  impair_on = 1;
+  return 0;
+}
+
+/**
+ * Gets the due time of the next message held back by the impairment layer.
+ *
+ * @param when Pointer to store the due time
+ * @return 1 if there is a held back message, 0 otherwise
+ */
+int gp2pp_impair_next(gtime_t *when) {
+  ilist_node_t *node = (delayed.next != NULL) ? ilist_head(&delayed) : NULL;
+  if (node == NULL)
+    return 0;
+  *when = ilist_entry(node, gp2pp_delayed_t, node)->when;
+  return 1;
+}
+
+/**
+ * Sends the held back messages that are due.
+ */
+void gp2pp_impair_flush(void) {
+  ilist_node_t *node;
+  gp2pp_delayed_t *pkt;
+  gtime_t now = garena_now_ms();
+  struct msghdr msg;
+  struct iovec iov;
+  
+  if (delayed.next == NULL)
+    return;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  while ((node = ilist_head(&delayed)) != NULL) {
+    pkt = ilist_entry(node, gp2pp_delayed_t, node);
+    if (!gtime_after_eq(now, pkt->when))
+      break;
+    ilist_del(node);
+    msg.msg_name = &pkt->dest;
+    iov.iov_base = pkt->data;
+    iov.iov_len = pkt->length;
+    if (garena_capture_active)
+      garena_capture(GARENA_CAPTURE_GP2PP, GARENA_CAPTURE_OUT, pkt->data, pkt->length, &pkt->dest);
+    if (gp2pp_sendmsg(pkt->sock, &msg, pkt->df) == -1)
+      gp2pp_count_tx_error(pkt->sock);
+    free(pkt);
+  }
+}
+
+/**
+ * Drops the held back messages of a socket (before closing it).
+ *
+ * @param sock The socket
+ */
+void gp2pp_impair_purge(int sock) {
+  ilist_node_t *node;
+  ilist_node_t *next;
+  gp2pp_delayed_t *pkt;
+  
+  if (delayed.next == NULL)
+    return;
+  for (node = ilist_head(&delayed); node; node = next) {
+    next = ilist_next(&delayed, node);
+    pkt = ilist_entry(node, gp2pp_delayed_t, node);
+    if (pkt->sock == sock) {
+      ilist_del(node);
+      free(pkt);
+    }
+  }
+}
+
 /**
   * Builds and send a GP2PP message over a socket. 
   *
@@ -161,15 +823,16 @@ int gp2pp_input(gp2pp_handtab_t *htab, char *buf, unsigned int length, struct so
   * @return 0 for success, -1 for failure
   */
 int gp2pp_output(int sock, int type, char *payload, unsigned int length, int user_id, struct sockaddr_in *remote) {
+  return gp2pp_output_msg(sock, type, payload, length, user_id, 0, remote);
+}
+
+/* gp2pp_output(), with DF set if df is set */
+static int gp2pp_output_msg(int sock, int type, char *payload, unsigned int length, int user_id, int df, struct sockaddr_in *remote) {
   char buf[GP2PP_MAX_MSGSIZE];
   gp2pp_hdr_t *hdr = (gp2pp_hdr_t *) buf;
   int hdrsize = sizeof(gp2pp_hdr_t);
+  struct iovec iov;
 
-/*
-  if ((random() & 0xF) == 0) {
-    return 0;
-  }
-*/
   if (length + hdrsize > GP2PP_MAX_MSGSIZE) {
     garena_errno = GARENA_ERR_INVALID;
     return -1;
@@ -180,42 +843,40 @@ int gp2pp_output(int sock, int type, char *payload, unsigned int length, int use
   hdr->user_id = ghtonl(user_id);
   
   memcpy(buf + hdrsize, payload, length);
-  if (sendto(sock, buf, length + hdrsize, 0, (struct sockaddr *) remote, sizeof(struct sockaddr_in)) == -1) {
-    garena_errno = GARENA_ERR_LIBC;
+  iov.iov_base = buf;
+  iov.iov_len = length + hdrsize;
+  if (gp2pp_send(sock, &iov, 1, df, remote) == -1)
     return -1;
-  }
   IFDEBUG(fprintf(stderr, "[DEBUG/GP2PP] Sent a message of type %x (payload length = %x)\n", type, length));
   return 0;
 }
 
 int gp2pp_output_conn(int sock, int subtype, char *payload, unsigned int length, int user_id, unsigned int conn_id, int seq1, int seq2, int ts_rel, struct sockaddr_in *remote) {
-  char buf[GP2PP_MAX_MSGSIZE];
+  gp2pp_conn_hdr_t conn_hdr;
   int type = GP2PP_MSG_CONN_PKT;
-  gp2pp_conn_hdr_t *conn_hdr = (gp2pp_conn_hdr_t *) buf;
-  int hdrsize = sizeof(gp2pp_conn_hdr_t);
-  /*
-  if ((random() & 0xF) == 0) {
-    return 0;
-  }*/
+  struct iovec iov[2];
 
-  if (length + hdrsize > GP2PP_MAX_MSGSIZE) {
+  if (length + sizeof(conn_hdr) > GP2PP_MAX_MSGSIZE) {
     garena_errno = GARENA_ERR_INVALID;
     return -1;
   }
   
-  conn_hdr->msgtype = type;
-  conn_hdr->msgsubtype = subtype;
-  conn_hdr->user_id = ghtonl(user_id);
-  conn_hdr->conn_id = ghtonl(conn_id);
-  conn_hdr->seq1 = ghtonl(seq1);
-  conn_hdr->seq2 = ghtonl(seq2);
-  conn_hdr->ts_rel = ghtons(ts_rel); 
+  conn_hdr.msgtype = type;
+  conn_hdr.msgsubtype = subtype;
+  conn_hdr.user_id = ghtonl(user_id);
+  conn_hdr.conn_id = ghtonl(conn_id);
+  conn_hdr.seq1 = ghtonl(seq1);
+  conn_hdr.seq2 = ghtonl(seq2);
+  conn_hdr.ts_rel = ghtons(ts_rel); 
   
-  memcpy(buf + hdrsize, payload, length);
-  if (sendto(sock, buf, length + hdrsize, 0, (struct sockaddr *) remote, sizeof(struct sockaddr_in)) == -1) {
-    garena_errno = GARENA_ERR_LIBC;
+  /* gather the header and the payload, instead of copying them to a bounce buffer */
+  iov[0].iov_base = &conn_hdr;
+  iov[0].iov_len = sizeof(conn_hdr);
+  iov[1].iov_base = payload;
+  iov[1].iov_len = length;
+  
+  if (gp2pp_send(sock, iov, (length > 0) ? 2 : 1, 0, remote) == -1)
     return -1;
-  }
   IFDEBUG(fprintf(stderr, "[DEBUG/GP2PP] Sent a message of type %x (payload length = %x)\n", type, length));
   return 0;
 }
@@ -236,26 +897,88 @@ int gp2pp_send_initconn(int sock, int from_ID, unsigned int conn_id, int dport,
  * @param sock The socket for sending.
  * @param from_ID the originating user ID 
  * @param to_ID The destination user ID
+ * @param hello_id The ID of the HELLO REQUEST being answered (0 if it had none)
  * @param remote The remote address
  * @return 0 for success, -1 for failure
  */
  
-int gp2pp_send_hello_reply(int sock, int from_ID, int to_ID, struct sockaddr_in *remote) {
+int gp2pp_send_hello_reply(int sock, int from_ID, int to_ID, uint32_t hello_id, struct sockaddr_in *remote) {
   char buf[GP2PP_MAX_MSGSIZE];
   gp2pp_hello_rep_t *hello_rep = (gp2pp_hello_rep_t *) buf;
   hello_rep->user_id = to_ID;
-  hello_rep->mbz = 0;
+  hello_rep->hello_id = ghtonl(hello_id);
   return gp2pp_output(sock, GP2PP_MSG_HELLO_REP, buf, sizeof(gp2pp_hello_rep_t), from_ID, remote);
 }
 
-int gp2pp_send_hello_request(int sock, int from_ID, struct sockaddr_in *remote) {
+/**
+ * Send a GP2PP HELLO REQUEST message. The hello_id is echoed in the reply by 
+ * libgarena peers (garena clients don't), so that the reply can be matched.
+ *
+ * @param sock The socket for sending.
+ * @param from_ID the originating user ID 
+ * @param hello_id The ID of this request, or 0
+ * @param remote The remote address
+ * @return 0 for success, -1 for failure
+ */
+
+int gp2pp_send_hello_request(int sock, int from_ID, uint32_t hello_id, struct sockaddr_in *remote) {
   char buf[GP2PP_MAX_MSGSIZE];
   gp2pp_hello_req_t *hello_req = (gp2pp_hello_req_t *) buf;
   hello_req->mbz = 0;
-  hello_req->mbz2 = 0;
+  hello_req->hello_id = ghtonl(hello_id);
   return gp2pp_output(sock, GP2PP_MSG_HELLO_REQ, buf, sizeof(gp2pp_hello_req_t), from_ID, remote);
 }
 
+/**
+ * Send a GP2PP HELLO REQUEST message, padded with zeroes to the given size. 
+ * Used to probe the path MTU: the peer answers it like a normal HELLO REQUEST
+ * if it made its way through, echoing hello_id if it is a libgarena peer.
+ * The probe is sent with DF set, the socket setting is restored afterwards, so the
+ * other messages (UDP_ENCAP game packets, which can't be resegmented, in particular)
+ * are still fragmented when needed. On failure, errno is EMSGSIZE if the probe is
+ * larger than the local link MTU. With the impairment layer (see gp2pp_set_impair()),
+ * the probe keeps DF when it is sent later, but such a failure is not reported: the
+ * probe is simply lost.
+ *
+ * @param sock The socket for sending.
+ * @param from_ID the originating user ID 
+ * @param hello_id The ID of this probe
+ * @param size The GP2PP message size (GP2PP header included)
+ * @param remote The remote address
+ * @return 0 for success, -1 for failure
+ */
+ 
+int gp2pp_send_hello_probe(int sock, int from_ID, uint32_t hello_id, unsigned int size, struct sockaddr_in *remote) {
+  char buf[GP2PP_MAX_MSGSIZE];
+  gp2pp_hello_req_t *hello_req = (gp2pp_hello_req_t *) buf;
+  
+  if (size < sizeof(gp2pp_hdr_t) + sizeof(gp2pp_hello_req_t))
+    size = sizeof(gp2pp_hdr_t) + sizeof(gp2pp_hello_req_t);
+  if (size > GP2PP_MAX_MSGSIZE) {
+    garena_errno = GARENA_ERR_INVALID;
+    return -1;
+  }
+  memset(buf, 0, size - sizeof(gp2pp_hdr_t));
+  hello_req->hello_id = ghtonl(hello_id);
+  return gp2pp_output_msg(sock, GP2PP_MSG_HELLO_REQ, buf, size - sizeof(gp2pp_hdr_t), from_ID, 1, remote);
+}
+
+/**
+ * Registers with a relay, so that it knows where to forward the messages for us.
+ * Must be sent periodically to keep the NAT binding alive.
+ *
+ * @param sock The socket for sending.
+ * @param from_ID the originating user ID 
+ * @param relay The relay address
+ * @return 0 for success, -1 for failure
+ */
+ 
+int gp2pp_send_relay_register(int sock, int from_ID, struct sockaddr_in *relay) {
+  gp2pp_relay_t reg;
+  reg.to_id = 0;
+  return gp2pp_output(sock, GP2PP_MSG_RELAY, (char *) &reg, sizeof(reg), from_ID, relay);
+}
+
 int gp2pp_send_udp_encap(int sock, int from_ID, int sport, int dport, char *payload, unsigned int length, struct sockaddr_in *remote) {
   char buf[GP2PP_MAX_MSGSIZE];
   gp2pp_udp_encap_t *udp_encap = (gp2pp_udp_encap_t *) buf;
@@ -407,9 +1130,15 @@ int gp2pp_request_roominfo(int sock, int my_id, int server_ip, int server_port)
   fsocket.sin_port = htons(server_port);
 
   memset(buf, 0, sizeof(buf));
-  buf[0] = 2;
+  buf[0] = GP2PP_MSG_ROOMINFO_REQUEST;
   *id = ghtonl(my_id);
+  gp2pp_count_tx(sock, buf[0], 5);
+  if (garena_capture_active)
+    garena_capture(GARENA_CAPTURE_GP2PP, GARENA_CAPTURE_OUT, buf, 5, &fsocket);
+  if (garena_replay_active)
+    return 0;
   if (sendto(sock, buf, 5, 0, (struct sockaddr *) &fsocket, sizeof(fsocket)) == -1) {
+    gp2pp_count_tx_error(sock);
     garena_errno = GARENA_ERR_LIBC;
     return -1;
   }
@@ -425,8 +1154,14 @@ int gp2pp_do_ip_lookup(int sock, int server_ip, int server_port) {
   fsocket.sin_port = htons(server_port);
    
   memset(buf, 0, sizeof(buf));
-  buf[0] = 5;
+  buf[0] = GP2PP_MSG_IP_LOOKUP_REQUEST;
+  gp2pp_count_tx(sock, buf[0], 9);
+  if (garena_capture_active)
+    garena_capture(GARENA_CAPTURE_GP2PP, GARENA_CAPTURE_OUT, buf, 9, &fsocket);
+  if (garena_replay_active)
+    return 0;
   if (sendto(sock, buf, 9, 0, (struct sockaddr *) &fsocket, sizeof(fsocket)) == -1) {
+    gp2pp_count_tx_error(sock);
     garena_errno = GARENA_ERR_LIBC;
     return -1;
   }
@@ -19,6 +19,7 @@
 #include <garena/gsp.h>
 #include <garena/error.h>
 #include <garena/util.h>
+#include <garena/private.h>
 
 
 static char gsp_rsa_private[] =
@@ -50,6 +51,8 @@ static char gsp_rsa_private[] =
 "ioX2ZNntCCPlIti48TeFs0etqcHQgQ5rSLblyde3RIuRcqatQko=\n"
 "-----END RSA PRIVATE KEY-----\n";
 
+static RSA *gsp_load_key(BIO **bio);
+
 void gsp_fini(void) {
 }
 
@@ -139,7 +142,7 @@ int gsp_input(gsp_handtab_t *htab, char *buf, unsigned int length, unsigned char
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
-  if ((length - sizeof(uint32_t)) & 0xF) {
+  if (((length - sizeof(uint32_t)) & 0xF) || (length == sizeof(uint32_t)) || (length - sizeof(uint32_t) > GSP_MAX_MSGSIZE)) {
     garena_errno = GARENA_ERR_PROTOCOL;
     return -1;
   }
@@ -148,6 +151,8 @@ int gsp_input(gsp_handtab_t *htab, char *buf, unsigned int length, unsigned char
   memcpy(tmp_iv, iv, sizeof(tmp_iv));
   
   AES_cbc_encrypt((unsigned char*)buf + sizeof(uint32_t), plaintext, length - sizeof(uint32_t), &aeskey, tmp_iv, AES_DECRYPT);
+  if (garena_capture_active)
+    garena_capture(GARENA_CAPTURE_GSP, GARENA_CAPTURE_IN, plaintext, length - sizeof(uint32_t), NULL);
   
   if ((hdr->msgtype >= GSP_MSG_NUM) || (htab->gsp_handlers[hdr->msgtype].fun == NULL)) {
     fprintf(deb, "[DEBUG/GSP] Unhandled message of type: %x (payload size = %x)\n", hdr->msgtype, ghtonl(*size & 0xFFFFFF));
@@ -156,7 +161,7 @@ int gsp_input(gsp_handtab_t *htab, char *buf, unsigned int length, unsigned char
 /*    fprintf(deb, "[DEBUG/GSP] Handled message of type: %x (payload size = %x)\n", hdr->msgtype, ghtonl(*size & 0xFFFFFF)); */
     fflush(deb);
     
-    if (htab->gsp_handlers[hdr->msgtype].fun(hdr->msgtype, plaintext + sizeof(gsp_hdr_t), length - sizeof(gsp_hdr_t), htab->gsp_handlers[hdr->msgtype].privdata) == -1) {
+    if (htab->gsp_handlers[hdr->msgtype].fun(hdr->msgtype, plaintext + sizeof(gsp_hdr_t), length - sizeof(uint32_t) - sizeof(gsp_hdr_t), htab->gsp_handlers[hdr->msgtype].privdata) == -1) {
 /*       garena_perror("[WARN/GSP] Error while handling message"); */
     }
   }
@@ -194,6 +199,10 @@ int gsp_output(int sock, int type, char *payload, unsigned int length, unsigned
   memset(plaintext, gsp_pad(type), sizeof(plaintext));
   hdr->msgtype = type;
   memcpy(plaintext + sizeof(gsp_hdr_t), payload, length);
+  if (garena_capture_active)
+    garena_capture(GARENA_CAPTURE_GSP, GARENA_CAPTURE_OUT, plaintext, length + sizeof(gsp_hdr_t), NULL);
+  if (garena_replay_active)
+    return 0;
   AES_cbc_encrypt(plaintext, ciphertext + sizeof(uint32_t), GSP_BLOCK_ROUND(length + sizeof(gsp_hdr_t)), &aeskey, tmp_iv, AES_ENCRYPT);
   if (write(sock, ciphertext, sizeof(uint32_t) + GSP_BLOCK_ROUND(length + sizeof(gsp_hdr_t))) == -1) {
     garena_errno = GARENA_ERR_LIBC;
@@ -293,6 +302,28 @@ int gsp_send_hello(int sock, unsigned char *key, unsigned char *iv) {
   return gsp_output(sock, GSP_MSG_HELLO, (char*) &msg, sizeof(msg), key, iv);  
 }
 
+/*
+ * Imports the RSA key. The BIO must be freed along with the key.
+ */
+static RSA *gsp_load_key(BIO **bio) {
+  RSA *rsa;
+  
+  *bio = BIO_new(BIO_s_mem());
+  if (*bio == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return NULL;
+  }
+  
+  BIO_puts(*bio, gsp_rsa_private);
+
+  rsa = PEM_read_bio_RSAPrivateKey(*bio, NULL, NULL, NULL);
+  if (rsa == NULL) {
+    garena_errno = GARENA_ERR_UNKNOWN;
+    fprintf(deb, "[GSP] Failed to import RSA private key\n");
+  }
+  return rsa;
+}
+
 int gsp_open_session(int sock, unsigned char *key, unsigned char *iv) {
   RSA *rsa = NULL;
   BIO *bio = NULL;
@@ -303,21 +334,9 @@ int gsp_open_session(int sock, unsigned char *key, unsigned char *iv) {
   uint16_t *magic;
   gsp_sessionhdr_t hdr;
   
-  bio = BIO_new(BIO_s_mem());
-  
-  if (bio == NULL) {
-    garena_errno = GARENA_ERR_NORESOURCE;
-    goto out;
-  }
-  
-  BIO_puts(bio, gsp_rsa_private);
-
-  rsa = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
-  if (rsa == NULL) {
-    garena_errno = GARENA_ERR_UNKNOWN;
-    fprintf(deb, "[GSP] Failed to import RSA private key\n");
+  rsa = gsp_load_key(&bio);
+  if (rsa == NULL)
     goto out;
-  }
   ciphertext = malloc(RSA_size(rsa));
   if (ciphertext == NULL) {
     garena_errno = GARENA_ERR_NORESOURCE;
@@ -362,3 +381,61 @@ int gsp_open_session(int sock, unsigned char *key, unsigned char *iv) {
      BIO_free(bio);
    return rcode;
 }
+
+/**
+ * Server side of gsp_open_session(): extracts the session key and IV from a
+ * session initialization message.
+ *
+ * @param buf The message (including the size field)
+ * @param length Length of the message
+ * @param key Buffer to store the session key (GSP_KEYSIZE bytes)
+ * @param iv Buffer to store the session IV (GSP_IVSIZE bytes)
+ * @return 0 for success, -1 for failure
+ */
+int gsp_accept_session(char *buf, unsigned int length, unsigned char *key, unsigned char *iv) {
+  RSA *rsa = NULL;
+  BIO *bio = NULL;
+  unsigned char *plaintext = NULL;
+  gsp_sessionhdr_t *hdr = (gsp_sessionhdr_t *) buf;
+  uint16_t *magic;
+  int size;
+  int rcode = -1;
+  
+  if ((length < sizeof(gsp_sessionhdr_t)) || (length - sizeof(uint32_t) != ghtonl(hdr->size)) || 
+      (hdr->magic != GSP_SESSION_MAGIC2)) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
+  
+  rsa = gsp_load_key(&bio);
+  if (rsa == NULL)
+    goto out;
+  plaintext = malloc(RSA_size(rsa));
+  if (plaintext == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    goto out;
+  }
+  
+  size = RSA_public_decrypt(length - sizeof(gsp_sessionhdr_t), (unsigned char *) buf + sizeof(gsp_sessionhdr_t), plaintext, rsa, RSA_PKCS1_PADDING);
+  if (size != GSP_KEYSIZE + GSP_IVSIZE + sizeof(uint16_t)) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    goto out;
+  }
+  magic = (uint16_t *) (plaintext + GSP_KEYSIZE + GSP_IVSIZE);
+  if (*magic != GSP_SESSION_MAGIC) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    goto out;
+  }
+  memcpy(key, plaintext, GSP_KEYSIZE);
+  memcpy(iv, plaintext + GSP_KEYSIZE, GSP_IVSIZE);
+  rcode = 0;
+  
+  out:
+   if (plaintext)
+     free(plaintext);
+   if (rsa) 
+     RSA_free(rsa);
+   if (bio)
+     BIO_free(bio);
+   return rcode;
+}
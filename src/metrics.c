@@ -0,0 +1,489 @@
+/**
+ * @file
+ *
+ * Metrics exporter: serves the server statistics (see ghl_get_stats()) and a few gauges
+ * as OpenMetrics text (the Prometheus exposition format) over HTTP, on a local TCP socket.
+ * The sockets are non-blocking and are processed by ghl_process(), like the protocol
+ * sockets: a scrape never blocks the game traffic. The response is built at once, and
+ * sent as the socket accepts it.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/ghl.h>
+#include <garena/private.h>
+
+#define METRICS_BACKLOG 8
+
+/* growable output buffer */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+  int failed;
+} metrics_buf_t;
+
+static void mbuf_printf(metrics_buf_t *mb, const char *fmt, ...) {
+  va_list ap;
+  char *tmp;
+  int r;
+
+  if (mb->failed)
+    return;
+  while (1) {
+    va_start(ap, fmt);
+    r = vsnprintf(mb->data + mb->len, mb->size - mb->len, fmt, ap);
+    va_end(ap);
+    if (r < 0) {
+      mb->failed = 1;
+      return;
+    }
+    if (mb->len + r < mb->size) {
+      mb->len += r;
+      return;
+    }
+    tmp = realloc(mb->data, mb->size << 1);
+    if (tmp == NULL) {
+      mb->failed = 1;
+      return;
+    }
+    mb->data = tmp;
+    mb->size <<= 1;
+  }
+}
+
+static void metric_header(metrics_buf_t *mb, const char *name, const char *type, const char *help) {
+  mbuf_printf(mb, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void metric_counter(metrics_buf_t *mb, const char *name, const char *help, uint64_t val) {
+  metric_header(mb, name, "counter", help);
+  mbuf_printf(mb, "%s_total %llu\n", name, (unsigned long long) val);
+}
+
+static void metric_gauge(metrics_buf_t *mb, const char *name, const char *help, uint64_t val) {
+  metric_header(mb, name, "gauge", help);
+  mbuf_printf(mb, "%s %llu\n", name, (unsigned long long) val);
+}
+
+/* per-type message counters, only the types that were seen are printed */
+static void metric_by_type(metrics_buf_t *mb, const char *name, const char *dir, uint64_t *vals, unsigned int num) {
+  unsigned int i;
+  for (i = 0; i <= num; i++) {
+    if (vals[i] == 0)
+      continue;
+    if (i == num)
+      mbuf_printf(mb, "%s_total{direction=\"%s\",type=\"other\"} %llu\n", name, dir, (unsigned long long) vals[i]);
+    else
+      mbuf_printf(mb, "%s_total{direction=\"%s\",type=\"0x%02x\"} %llu\n", name, dir, i, (unsigned long long) vals[i]);
+  }
+}
+
+static void metrics_conn(metrics_buf_t *mb, ghl_conn_stats_t *conn) {
+  metric_header(mb, "garena_conn_segments", "counter", "Virtual connection DATA segments, including retransmissions and duplicates");
+  mbuf_printf(mb, "garena_conn_segments_total{direction=\"tx\"} %llu\n", (unsigned long long) conn->data_tx);
+  mbuf_printf(mb, "garena_conn_segments_total{direction=\"rx\"} %llu\n", (unsigned long long) conn->data_rx);
+  metric_header(mb, "garena_conn_payload_bytes", "counter", "Virtual connection payload bytes, including retransmissions and duplicates");
+  mbuf_printf(mb, "garena_conn_payload_bytes_total{direction=\"tx\"} %llu\n", (unsigned long long) conn->data_tx_bytes);
+  mbuf_printf(mb, "garena_conn_payload_bytes_total{direction=\"rx\"} %llu\n", (unsigned long long) conn->data_rx_bytes);
+  metric_header(mb, "garena_conn_retransmits", "counter", "Virtual connection segments retransmitted");
+  mbuf_printf(mb, "garena_conn_retransmits_total{kind=\"rto\"} %llu\n", (unsigned long long) conn->retrans_rto);
+  mbuf_printf(mb, "garena_conn_retransmits_total{kind=\"fast\"} %llu\n", (unsigned long long) conn->retrans_fast);
+  metric_header(mb, "garena_conn_acks", "counter", "Virtual connection ACK messages");
+  mbuf_printf(mb, "garena_conn_acks_total{direction=\"tx\"} %llu\n", (unsigned long long) conn->acks_tx);
+  mbuf_printf(mb, "garena_conn_acks_total{direction=\"rx\"} %llu\n", (unsigned long long) conn->acks_rx);
+  metric_counter(mb, "garena_conn_dup_acks", "ACK messages that did not advance the cumulative ACK", conn->dup_acks);
+  metric_counter(mb, "garena_conn_dup_segments", "DATA segments received more than once", conn->dup_data);
+  metric_counter(mb, "garena_conn_out_of_order_segments", "DATA segments received ahead of the next expected one", conn->out_of_order);
+  metric_counter(mb, "garena_conn_rwin_drops", "DATA segments dropped because the receive window was full", conn->rwin_drops);
+}
+
+/* RTT histogram of all the room members (a gauge histogram, since old samples decay) */
+static void metrics_rtt(metrics_buf_t *mb, ghl_room_t *rh) {
+  unsigned int hist[GHL_RTT_BUCKETS];
+  unsigned int cumul = 0;
+  ihashitem_t iter;
+  ghl_member_t *member;
+  unsigned int i;
+
+  memset(hist, 0, sizeof(hist));
+  if (rh) {
+    for (iter = ihash_iter(rh->members); iter; iter = ihash_next(rh->members, iter)) {
+      member = ihash_val(iter);
+      for (i = 0; i < GHL_RTT_BUCKETS; i++)
+        hist[i] += member->rtt_stats.hist[i];
+    }
+  }
+  metric_header(mb, "garena_member_rtt_milliseconds", "gaugehistogram", "Recent RTT samples of the room members");
+  for (i = 0; i < GHL_RTT_BUCKETS - 1; i++) {
+    cumul += hist[i];
+    mbuf_printf(mb, "garena_member_rtt_milliseconds_bucket{le=\"%u\"} %u\n", (2U << i) - 1, cumul);
+  }
+  cumul += hist[GHL_RTT_BUCKETS - 1];
+  mbuf_printf(mb, "garena_member_rtt_milliseconds_bucket{le=\"+Inf\"} %u\n", cumul);
+  mbuf_printf(mb, "garena_member_rtt_milliseconds_gcount %u\n", cumul);
+}
+
+static void metrics_members(metrics_buf_t *mb, ghl_room_t *rh) {
+  unsigned int direct = 0;
+  unsigned int relayed = 0;
+  unsigned int unreachable = 0;
+  ihashitem_t iter;
+  ghl_member_t *member;
+
+  if (rh) {
+    for (iter = ihash_iter(rh->members); iter; iter = ihash_next(rh->members, iter)) {
+      member = ihash_val(iter);
+      if (member == rh->me)
+        continue;
+      if (!member->conn_ok)
+        unreachable++;
+      else if (member->relayed)
+        relayed++;
+      else direct++;
+    }
+  }
+  metric_header(mb, "garena_room_members", "gauge", "Other members of the current room, by reachability");
+  mbuf_printf(mb, "garena_room_members{path=\"direct\"} %u\n", direct);
+  mbuf_printf(mb, "garena_room_members{path=\"relayed\"} %u\n", relayed);
+  mbuf_printf(mb, "garena_room_members{path=\"none\"} %u\n", unreachable);
+}
+
+/* one series of a profiling histogram (see ghl_prof_enable()), in seconds */
+static void metrics_prof_hist(metrics_buf_t *mb, const char *name, const char *label, ghl_prof_hist_t *hist) {
+  uint64_t cumul = 0;
+  unsigned int i;
+  const char *sep = *label ? "," : "";
+
+  for (i = 0; i < GHL_PROF_BUCKETS - 1; i++) {
+    cumul += hist->hist[i];
+    mbuf_printf(mb, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, sep, (double) (2U << i) / 1e6, (unsigned long long) cumul);
+  }
+  mbuf_printf(mb, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long) hist->count);
+  if (*label) {
+    mbuf_printf(mb, "%s_count{%s} %llu\n", name, label, (unsigned long long) hist->count);
+    mbuf_printf(mb, "%s_sum{%s} %g\n", name, label, (double) hist->total_ns / 1e9);
+  } else {
+    mbuf_printf(mb, "%s_count %llu\n", name, (unsigned long long) hist->count);
+    mbuf_printf(mb, "%s_sum %g\n", name, (double) hist->total_ns / 1e9);
+  }
+}
+
+static void metrics_prof(metrics_buf_t *mb, ghl_prof_t *prof) {
+  static const char *inputs[GHL_PROF_INPUT_NUM] = { "gsp", "gcrp", "gp2pp" };
+  char label[64];
+  unsigned int i;
+
+  metric_header(mb, "garena_process_seconds", "histogram", "ghl_process() durations, select() excluded");
+  metrics_prof_hist(mb, "garena_process_seconds", "", &prof->process);
+  metric_header(mb, "garena_process_gap_seconds", "histogram", "Time between two ghl_process() calls");
+  metrics_prof_hist(mb, "garena_process_gap_seconds", "", &prof->gap);
+  metric_header(mb, "garena_timer_lag_seconds", "histogram", "Delay between the expiration of a timer and its call");
+  metrics_prof_hist(mb, "garena_timer_lag_seconds", "", &prof->timer_lag);
+  metric_header(mb, "garena_event_handler_seconds", "histogram", "Event handler durations, by event");
+  for (i = 0; i < GHL_EV_NUM; i++) {
+    if (prof->events[i].count == 0)
+      continue;
+    snprintf(label, sizeof(label), "event=\"%u\"", i);
+    metrics_prof_hist(mb, "garena_event_handler_seconds", label, &prof->events[i]);
+  }
+  metric_header(mb, "garena_timer_seconds", "histogram", "Timer function durations, by function");
+  for (i = 0; i < GHL_PROF_TIMER_FUNS; i++) {
+    if (prof->timers[i].hist.count == 0)
+      continue;
+    if (prof->timers[i].name)
+      snprintf(label, sizeof(label), "timer=\"%s\"", prof->timers[i].name);
+    else
+      snprintf(label, sizeof(label), "timer=\"%p\"", (void *) prof->timers[i].fun);
+    metrics_prof_hist(mb, "garena_timer_seconds", label, &prof->timers[i].hist);
+  }
+  metric_header(mb, "garena_input_seconds", "histogram", "Socket input durations (read and dispatch), by protocol");
+  for (i = 0; i < GHL_PROF_INPUT_NUM; i++) {
+    snprintf(label, sizeof(label), "protocol=\"%s\"", inputs[i]);
+    metrics_prof_hist(mb, "garena_input_seconds", label, &prof->inputs[i]);
+  }
+  metric_counter(mb, "garena_slow_handlers", "Handlers, timers or inputs slower than the warning threshold", prof->slow);
+}
+
+static void metrics_build(ghl_serv_t *serv, metrics_buf_t *mb) {
+  ghl_stats_t stats;
+
+  ghl_get_stats(serv, &stats);
+  metric_header(mb, "garena_gp2pp_messages", "counter", "GP2PP (peer to peer) messages, by wire message type");
+  metric_by_type(mb, "garena_gp2pp_messages", "rx", stats.serv.gp2pp.rx_msgs, GP2PP_MSG_NUM);
+  metric_by_type(mb, "garena_gp2pp_messages", "tx", stats.serv.gp2pp.tx_msgs, GP2PP_MSG_NUM);
+  metric_header(mb, "garena_gp2pp_bytes", "counter", "GP2PP (peer to peer) bytes, by wire message type");
+  metric_by_type(mb, "garena_gp2pp_bytes", "rx", stats.serv.gp2pp.rx_bytes, GP2PP_MSG_NUM);
+  metric_by_type(mb, "garena_gp2pp_bytes", "tx", stats.serv.gp2pp.tx_bytes, GP2PP_MSG_NUM);
+  metric_counter(mb, "garena_gp2pp_send_errors", "GP2PP messages that could not be sent", stats.serv.gp2pp.tx_errors);
+  metric_counter(mb, "garena_gp2pp_impair_drops", "GP2PP messages dropped by the test impairment layer", stats.serv.gp2pp.impair_drops);
+  metric_header(mb, "garena_gsp_messages", "counter", "GSP (main server) messages");
+  mbuf_printf(mb, "garena_gsp_messages_total{direction=\"rx\"} %llu\n", (unsigned long long) stats.serv.gsp_rx_msgs);
+  mbuf_printf(mb, "garena_gsp_messages_total{direction=\"tx\"} %llu\n", (unsigned long long) stats.serv.gsp_tx_msgs);
+  metric_header(mb, "garena_gcrp_messages", "counter", "GCRP (room server) messages of the current room, received ones by type");
+  metric_by_type(mb, "garena_gcrp_messages", "rx", stats.room.rx_msgs, GCRP_MSG_NUM);
+  mbuf_printf(mb, "garena_gcrp_messages_total{direction=\"tx\",type=\"all\"} %llu\n", (unsigned long long) stats.room.tx_msgs);
+  metric_counter(mb, "garena_alien_conn_drops", "Connection messages dropped because the connection is unknown", stats.serv.alien_conn);
+  metric_counter(mb, "garena_unknown_user_drops", "GP2PP messages dropped because the sender is not in the room", stats.serv.unknown_user);
+  metric_counter(mb, "garena_events", "Events signaled to the application", stats.serv.events);
+  metric_counter(mb, "garena_timer_fires", "Timers fired", stats.serv.timer_fires);
+  metric_header(mb, "garena_timer_lag_milliseconds", "counter", "Sum of the timer firing delays (event loop lag)");
+  mbuf_printf(mb, "# UNIT garena_timer_lag_milliseconds milliseconds\n");
+  mbuf_printf(mb, "garena_timer_lag_milliseconds_total %llu\n", (unsigned long long) stats.serv.timer_lag_total);
+  metric_gauge(mb, "garena_timer_lag_max_milliseconds", "Largest timer firing delay", stats.serv.timer_lag_max);
+  metric_gauge(mb, "garena_timers", "Pending timers", ghl_num_timers());
+  metric_gauge(mb, "garena_connections", "Virtual connections", stats.num_conns);
+  metric_gauge(mb, "garena_conn_sendq_segments", "Segments not acknowledged yet, over all the connections", stats.sendq_pkts);
+  metric_gauge(mb, "garena_conn_recvq_segments", "Segments not delivered yet, over all the connections", stats.recvq_pkts);
+  metrics_conn(mb, &stats.serv.conn);
+  metrics_members(mb, serv->room);
+  metrics_rtt(mb, serv->room);
+  if (serv->prof)
+    metrics_prof(mb, serv->prof);
+  mbuf_printf(mb, "# EOF\n");
+}
+
+static void metrics_client_close(ghl_serv_t *serv, unsigned int i) {
+  close(serv->metrics_clients[i]);
+  serv->metrics_clients[i] = -1;
+  free(serv->metrics_out[i]);
+  serv->metrics_out[i] = NULL;
+}
+
+/* sends what the socket accepts of the response, and closes once it is all sent */
+static void metrics_client_output(ghl_serv_t *serv, unsigned int i) {
+  int r;
+
+  r = send(serv->metrics_clients[i], serv->metrics_out[i] + serv->metrics_out_pos[i],
+           serv->metrics_out_len[i] - serv->metrics_out_pos[i], MSG_NOSIGNAL);
+  if (r == -1) {
+    if ((errno != EWOULDBLOCK) && (errno != EAGAIN) && (errno != EINTR))
+      metrics_client_close(serv, i);
+    return;
+  }
+  serv->metrics_out_pos[i] += r;
+  if (serv->metrics_out_pos[i] == serv->metrics_out_len[i])
+    metrics_client_close(serv, i);
+}
+
+/* the request is complete, queue the metrics */
+static void metrics_respond(ghl_serv_t *serv, unsigned int i) {
+  metrics_buf_t mb;
+  char hdr[256];
+  int hdr_len;
+  char *out;
+
+  mb.size = 16384;
+  mb.len = 0;
+  mb.failed = 0;
+  mb.data = malloc(mb.size);
+  if (mb.data == NULL) {
+    metrics_client_close(serv, i);
+    return;
+  }
+  metrics_build(serv, &mb);
+  if (mb.failed) {
+    hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    mb.len = 0;
+  } else {
+    hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                       "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long) mb.len);
+  }
+  out = malloc(hdr_len + mb.len);
+  if (out == NULL) {
+    free(mb.data);
+    metrics_client_close(serv, i);
+    return;
+  }
+  memcpy(out, hdr, hdr_len);
+  memcpy(out + hdr_len, mb.data, mb.len);
+  free(mb.data);
+  serv->metrics_out[i] = out;
+  serv->metrics_out_len[i] = hdr_len + mb.len;
+  serv->metrics_out_pos[i] = 0;
+  metrics_client_output(serv, i);
+}
+
+static void metrics_client_input(ghl_serv_t *serv, unsigned int i) {
+  static const char eoh[] = "\r\n\r\n";
+  char buf[1024];
+  int r;
+  int j;
+
+  r = recv(serv->metrics_clients[i], buf, sizeof(buf), 0);
+  if (r == -1) {
+    if ((errno != EWOULDBLOCK) && (errno != EAGAIN) && (errno != EINTR))
+      metrics_client_close(serv, i);
+    return;
+  }
+  if (r == 0) {
+    metrics_client_close(serv, i);
+    return;
+  }
+  /* we don't care about the request itself, any request gets the metrics */
+  for (j = 0; j < r; j++) {
+    if (buf[j] == eoh[serv->metrics_eoh[i]])
+      serv->metrics_eoh[i]++;
+    else serv->metrics_eoh[i] = (buf[j] == '\r') ? 1 : 0;
+    if (serv->metrics_eoh[i] == sizeof(eoh) - 1) {
+      metrics_respond(serv, i);
+      return;
+    }
+  }
+}
+
+static void metrics_accept(ghl_serv_t *serv) {
+  unsigned int i;
+  int sock;
+
+  sock = accept(serv->metrics_sock, NULL, NULL);
+  if (sock == -1)
+    return;
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  for (i = 0; i < GHL_METRICS_MAX_CLIENTS; i++) {
+    if (serv->metrics_clients[i] == -1)
+      break;
+  }
+  if (i == GHL_METRICS_MAX_CLIENTS) {
+    /* drop the oldest client (the one in the first slot) */
+    metrics_client_close(serv, 0);
+    for (i = 1; i < GHL_METRICS_MAX_CLIENTS; i++) {
+      serv->metrics_clients[i - 1] = serv->metrics_clients[i];
+      serv->metrics_eoh[i - 1] = serv->metrics_eoh[i];
+      serv->metrics_out[i - 1] = serv->metrics_out[i];
+      serv->metrics_out_len[i - 1] = serv->metrics_out_len[i];
+      serv->metrics_out_pos[i - 1] = serv->metrics_out_pos[i];
+    }
+    i = GHL_METRICS_MAX_CLIENTS - 1;
+  }
+  serv->metrics_clients[i] = sock;
+  serv->metrics_eoh[i] = 0;
+  serv->metrics_out[i] = NULL;
+}
+
+/**
+ * Starts the metrics exporter of a server: metrics are served to any HTTP request on
+ * the given TCP address and port, as OpenMetrics text, by ghl_process().
+ * Bind it to the loopback address unless the metrics may be public.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INUSE: The exporter is already started
+ * @li GARENA_ERR_LIBC: The socket could not be created or bound
+ *
+ * @param serv The server handle
+ * @param addr The local IP address (network byte order), e.g. inet_addr("127.0.0.1")
+ * @param port The TCP port
+ * @return 0 for success, -1 for failure
+ */
+int ghl_metrics_listen(ghl_serv_t *serv, int addr, int port) {
+  struct sockaddr_in local;
+  int one = 1;
+
+  if (serv->metrics_sock != -1) {
+    garena_errno = GARENA_ERR_INUSE;
+    return -1;
+  }
+  serv->metrics_sock = socket(PF_INET, SOCK_STREAM, 0);
+  if (serv->metrics_sock == -1) {
+    garena_errno = GARENA_ERR_LIBC;
+    return -1;
+  }
+  setsockopt(serv->metrics_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = addr;
+  local.sin_port = htons(port);
+  if ((bind(serv->metrics_sock, (struct sockaddr *) &local, sizeof(local)) == -1) ||
+      (listen(serv->metrics_sock, METRICS_BACKLOG) == -1)) {
+    garena_errno = GARENA_ERR_LIBC;
+    close(serv->metrics_sock);
+    serv->metrics_sock = -1;
+    return -1;
+  }
+  fcntl(serv->metrics_sock, F_SETFL, fcntl(serv->metrics_sock, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+/**
+ * Stops the metrics exporter of a server (if it is started).
+ *
+ * @param serv The server handle
+ */
+void ghl_metrics_stop(ghl_serv_t *serv) {
+  unsigned int i;
+
+  if (serv->metrics_sock == -1)
+    return;
+  for (i = 0; i < GHL_METRICS_MAX_CLIENTS; i++) {
+    if (serv->metrics_clients[i] != -1)
+      metrics_client_close(serv, i);
+  }
+  close(serv->metrics_sock);
+  serv->metrics_sock = -1;
+}
+
+/* 
+ * adds the exporter sockets to the sets, the clients that are being answered go to
+ * wfds, or nowhere if wfds is NULL (internal, see private.h)
+ */
+int ghl_metrics_fill_fds(ghl_serv_t *serv, fd_set *fds, fd_set *wfds, int max) {
+  unsigned int i;
+
+  FD_SET(serv->metrics_sock, fds);
+  if (serv->metrics_sock > max)
+    max = serv->metrics_sock;
+  for (i = 0; i < GHL_METRICS_MAX_CLIENTS; i++) {
+    if (serv->metrics_clients[i] == -1)
+      continue;
+    if (serv->metrics_out[i] == NULL)
+      FD_SET(serv->metrics_clients[i], fds);
+    else if (wfds != NULL)
+      FD_SET(serv->metrics_clients[i], wfds);
+    else continue;
+    if (serv->metrics_clients[i] > max)
+      max = serv->metrics_clients[i];
+  }
+  return max;
+}
+
+/* is a response being sent? (internal, see private.h) */
+int ghl_metrics_pending(ghl_serv_t *serv) {
+  unsigned int i;
+
+  for (i = 0; i < GHL_METRICS_MAX_CLIENTS; i++) {
+    if ((serv->metrics_clients[i] != -1) && (serv->metrics_out[i] != NULL))
+      return 1;
+  }
+  return 0;
+}
+
+/* 
+ * processes the exporter sockets activity, if wfds is NULL the pending responses are
+ * tried anyway (internal, see private.h)
+ */
+void ghl_metrics_process(ghl_serv_t *serv, fd_set *fds, fd_set *wfds) {
+  unsigned int i;
+
+  for (i = 0; i < GHL_METRICS_MAX_CLIENTS; i++) {
+    if (serv->metrics_clients[i] == -1)
+      continue;
+    if (serv->metrics_out[i] != NULL) {
+      if ((wfds == NULL) || FD_ISSET(serv->metrics_clients[i], wfds))
+        metrics_client_output(serv, i);
+    } else if (FD_ISSET(serv->metrics_clients[i], fds))
+      metrics_client_input(serv, i);
+  }
+  if (FD_ISSET(serv->metrics_sock, fds))
+    metrics_accept(serv);
+}
@@ -0,0 +1,431 @@
+/**
+ * @file
+ *
+ * Trace record and replay. While a server handle is traced, every message read from its
+ * sockets (the GSP ones still encrypted), and every application call that changes its
+ * state, is appended to a file through a large stdio buffer, with its garena_now_ms()
+ * timestamp. The library code paths are not changed, the hooks only copy the input.
+ *
+ * The replay feeds the records to a server handle built from the session record, through
+ * the same dispatch function as ghl_process(). garena_now_ms() is replaced by a virtual
+ * clock, which jumps from record to record, stopping at the timer expirations in between,
+ * and nothing is sent on the network. Given the same trace, a replay always takes the
+ * same decisions, so it measures the processing cost alone, as fast as the CPU allows.
+ * The trace contains the GSP session key, so the files are created with mode 0600.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/gsp.h>
+#include <garena/gcrp.h>
+#include <garena/gp2pp.h>
+#include <garena/ghl.h>
+#include <garena/trace.h>
+#include <garena/private.h>
+
+struct ghl_trace_s {
+  FILE *f;
+  char *buf;
+};
+
+int garena_replay_active = 0;
+
+static unsigned int env_traces = 0;
+
+/* appends a record made of two parts (the second one may be empty) */
+static void trace_write(ghl_serv_t *serv, int type, void *data, unsigned int length, void *data2, unsigned int length2) {
+  ghl_trace_rec_t rec;
+  FILE *f = serv->trace->f;
+
+  rec.type = type;
+  rec.reserved = 0;
+  rec.length = length + length2;
+  rec.when = garena_now_ms();
+  if ((fwrite(&rec, sizeof(rec), 1, f) != 1) || (length && (fwrite(data, length, 1, f) != 1)) ||
+      (length2 && (fwrite(data2, length2, 1, f) != 1))) {
+    fprintf(deb, "[WARN/GHL] Trace write failed, tracing stopped\n");
+    fflush(deb);
+    ghl_trace_stop(serv);
+  }
+}
+
+/**
+ * Starts recording the input of a server handle to a trace file, which can be replayed with
+ * @ref ghl_replay. Call it right after ghl_new_serv(), before the first ghl_process() call:
+ * the replay starts from the server state at this point. The trace is stopped by
+ * @ref ghl_trace_stop, or when the server handle is freed.
+ * Tracing can also be enabled with the @ref GHL_TRACE_ENV environment variable.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INUSE: The server handle is already traced
+ * @li GARENA_ERR_NORESOURCE: A resource allocation failed
+ * @li GARENA_ERR_LIBC: The file could not be created or written (consult errno for details)
+ *
+ * @param serv The server handle
+ * @param path The trace file path, the file is truncated if it exists
+ * @return 0 for success, -1 for failure
+ */
+int ghl_trace_start(ghl_serv_t *serv, const char *path) {
+  struct ghl_trace_s *trace;
+  ghl_trace_hdr_t hdr;
+  ghl_trace_session_t session;
+  int fd;
+
+  if (serv->trace) {
+    garena_errno = GARENA_ERR_INUSE;
+    return -1;
+  }
+  trace = malloc(sizeof(struct ghl_trace_s));
+  if (trace == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    return -1;
+  }
+  trace->buf = malloc(GHL_TRACE_BUFSIZE);
+  if (trace->buf == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    free(trace);
+    return -1;
+  }
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if ((fd == -1) || ((trace->f = fdopen(fd, "w")) == NULL)) {
+    garena_errno = GARENA_ERR_LIBC;
+    if (fd != -1)
+      close(fd);
+    free(trace->buf);
+    free(trace);
+    return -1;
+  }
+  setvbuf(trace->f, trace->buf, _IOFBF, GHL_TRACE_BUFSIZE);
+
+  memcpy(hdr.magic, GHL_TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = GHL_TRACE_VERSION;
+  hdr.reserved = 0;
+  if (fwrite(&hdr, sizeof(hdr), 1, trace->f) != 1) {
+    garena_errno = GARENA_ERR_LIBC;
+    fclose(trace->f);
+    free(trace->buf);
+    free(trace);
+    return -1;
+  }
+  serv->trace = trace;
+
+  memset(&session, 0, sizeof(session));
+  session.server_ip = serv->server_ip;
+  session.internal_ip = serv->my_info.internal_ip.s_addr;
+  session.internal_port = serv->my_info.internal_port;
+  session.gp2pp_lport = serv->gp2pp_lport;
+  session.gp2pp_rport = serv->gp2pp_rport;
+  session.mtu = serv->mtu;
+  memcpy(session.key, serv->session_key, sizeof(session.key));
+  memcpy(session.iv, serv->session_iv, sizeof(session.iv));
+  session.rng = serv->rng;
+  trace_write(serv, GHL_TRACE_SESSION, &session, sizeof(session), NULL, 0);
+  if (serv->trace == NULL) {
+    garena_errno = GARENA_ERR_LIBC;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Stops recording the input of a server handle, and closes the trace file.
+ * Does nothing if the server handle is not traced.
+ *
+ * @param serv The server handle
+ */
+void ghl_trace_stop(ghl_serv_t *serv) {
+  struct ghl_trace_s *trace = serv->trace;
+
+  if (trace == NULL)
+    return;
+  serv->trace = NULL;
+  if (fclose(trace->f) == EOF) {
+    fprintf(deb, "[WARN/GHL] Trace write failed when closing the file\n");
+    fflush(deb);
+  }
+  free(trace->buf);
+  free(trace);
+}
+
+/* starts tracing a new server handle if GHL_TRACE_ENV is set (internal, see private.h) */
+int ghl_trace_env(ghl_serv_t *serv) {
+  char *path = getenv(GHL_TRACE_ENV);
+  char name[1024];
+
+  if ((path == NULL) || (*path == 0))
+    return 0;
+  if (env_traces)
+    snprintf(name, sizeof(name), "%s.%u", path, env_traces);
+  else snprintf(name, sizeof(name), "%s", path);
+  env_traces++;
+  if (ghl_trace_start(serv, name) == -1) {
+    fprintf(stderr, "Could not start the trace to %s\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+/* records a message read from a server socket, proto is a GHL_PROF_INPUT_* value (internal, see private.h) */
+void ghl_trace_input(ghl_serv_t *serv, int proto, char *buf, unsigned int length, struct sockaddr_in *remote) {
+  ghl_trace_addr_t addr;
+
+  switch (proto) {
+    case GHL_PROF_INPUT_GSP:
+      trace_write(serv, GHL_TRACE_GSP_IN, buf, length, NULL, 0);
+      break;
+    case GHL_PROF_INPUT_GCRP:
+      trace_write(serv, GHL_TRACE_GCRP_IN, buf, length, NULL, 0);
+      break;
+    case GHL_PROF_INPUT_GP2PP:
+      addr.ip = remote->sin_addr.s_addr;
+      addr.port = remote->sin_port;
+      addr.reserved = 0;
+      trace_write(serv, GHL_TRACE_GP2PP_IN, &addr, sizeof(addr), buf, length);
+      break;
+  }
+}
+
+/* records an application call (internal, see private.h) */
+void ghl_trace_call(ghl_serv_t *serv, int type, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+  ghl_trace_call_t call;
+
+  call.arg[0] = arg0;
+  call.arg[1] = arg1;
+  call.arg[2] = arg2;
+  trace_write(serv, type, &call, sizeof(call), NULL, 0);
+}
+
+/* the replay accepts all the connection data, and counts the events */
+static int replay_event(ghl_serv_t *serv, int event, void *event_data, void *privdata) {
+  ghl_replay_stats_t *stats = privdata;
+
+  stats->events[event]++;
+  if (event == GHL_EV_CONN_RECV)
+    return ((ghl_conn_recv_t *) event_data)->length;
+  return 0;
+}
+
+/* runs the timers expiring up to when, at their expiration time. Returns -1 if the server handle was freed */
+static int replay_timers(ghl_serv_t *serv, gtime_t when, ghl_replay_stats_t *stats) {
+  gtime_t next;
+
+  while (ghl_next_timer(&next) && gtime_after_eq(when, next)) {
+    if (gtime_after_eq(next, garena_now_ms()))
+      garena_set_virtual_clock(1, next);
+    stats->timer_runs++;
+    if (ghl_run_timers(serv, garena_now_ms()) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* applies a record, returns 0 if it was applied, 1 if it could not be, -1 if the server handle was freed */
+static int replay_record(ghl_serv_t *serv, ghl_trace_rec_t *rec, char *payload, char *buf, char **data, unsigned int *data_size) {
+  ghl_trace_call_t call;
+  ghl_trace_addr_t addr;
+  struct sockaddr_in remote;
+  ghl_member_t *member;
+  ghl_ch_t *ch;
+
+  switch (rec->type) {
+    case GHL_TRACE_GSP_IN:
+    case GHL_TRACE_GCRP_IN:
+      if (rec->length > GCRP_MAX_MSGSIZE)
+        return 1;
+      if ((rec->type == GHL_TRACE_GCRP_IN) && (serv->room == NULL))
+        return 1;
+      memcpy(buf, payload, rec->length);
+      return ghl_input(serv, (rec->type == GHL_TRACE_GSP_IN) ? GHL_PROF_INPUT_GSP : GHL_PROF_INPUT_GCRP, buf, rec->length, NULL);
+    case GHL_TRACE_GP2PP_IN:
+      if ((rec->length < sizeof(addr)) || (rec->length - sizeof(addr) > GCRP_MAX_MSGSIZE))
+        return 1;
+      memcpy(&addr, payload, sizeof(addr));
+      memset(&remote, 0, sizeof(remote));
+      remote.sin_family = AF_INET;
+      remote.sin_addr.s_addr = addr.ip;
+      remote.sin_port = addr.port;
+      memcpy(buf, payload + sizeof(addr), rec->length - sizeof(addr));
+      return ghl_input(serv, GHL_PROF_INPUT_GP2PP, buf, rec->length - sizeof(addr), &remote);
+  }
+
+  if (rec->length < sizeof(call))
+    return 1;
+  memcpy(&call, payload, sizeof(call));
+  switch (rec->type) {
+    case GHL_TRACE_JOIN:
+      return (ghl_replay_room(serv, call.arg[0]) == NULL);
+    case GHL_TRACE_LEAVE:
+      if (serv->room == NULL)
+        return 1;
+      return (ghl_leave_room(serv->room) == -1);
+    case GHL_TRACE_CONNECT:
+      if (serv->room == NULL)
+        return 1;
+      member = ghl_member_from_id(serv->room, call.arg[0]);
+      if (member == NULL)
+        return 1;
+      return (ghl_conn_connect_id(serv, member, call.arg[1], call.arg[2]) == NULL);
+    case GHL_TRACE_SEND:
+      if ((serv->room == NULL) || ((ch = ghl_conn_from_id(serv->room, call.arg[0])) == NULL))
+        return 1;
+      if (call.arg[1] > *data_size) {
+        free(*data);
+        *data_size = 0;
+        *data = calloc(call.arg[1], 1);
+        if (*data == NULL)
+          return 1;
+        *data_size = call.arg[1];
+      }
+      /* a refused write (e.g. GARENA_ERR_AGAIN) was recorded as well, it is not a divergence */
+      ghl_conn_send(serv, ch, *data, call.arg[1]);
+      return 0;
+    case GHL_TRACE_CLOSE:
+      if ((serv->room == NULL) || ((ch = ghl_conn_from_id(serv->room, call.arg[0])) == NULL))
+        return 1;
+      ghl_conn_close(serv, ch);
+      return 0;
+    case GHL_TRACE_RELAY:
+      return (ghl_set_relay(serv, call.arg[0], call.arg[1]) == -1);
+  }
+  return 1;
+}
+
+/**
+ * Replays a trace recorded by @ref ghl_trace_start, as fast as possible. The messages are
+ * dispatched by the same code as in ghl_process(), the application calls are repeated,
+ * the time is virtual (see @ref garena_now_ms) and nothing is sent. Every event is
+ * accepted (all the virtual connection data is consumed). The whole file is loaded before
+ * the replay starts, so stats->elapsed_ns only measures the processing.
+ * Don't use the library in the meantime (e.g. from another thread): the other server
+ * handles would see the virtual time, and would not send anything.
+ *
+ * @par Errors
+ *
+ * @li GARENA_ERR_INVALID: The file is not a trace, or has an unsupported version
+ * @li GARENA_ERR_NORESOURCE: A resource allocation failed
+ * @li GARENA_ERR_LIBC: The file could not be read (consult errno for details)
+ *
+ * @param path The trace file
+ * @param stats Filled with the replay results
+ * @return 0 for success, -1 for failure
+ */
+int ghl_replay(const char *path, ghl_replay_stats_t *stats) {
+  char buf[GCRP_MAX_MSGSIZE];
+  FILE *f;
+  long size;
+  char *trace;
+  char *data = NULL;
+  unsigned int data_size = 0;
+  size_t pos;
+  ghl_trace_hdr_t hdr;
+  ghl_trace_rec_t rec;
+  ghl_trace_session_t session;
+  struct in_addr internal_ip;
+  ghl_serv_t *serv;
+  gtime_t first;
+  uint64_t start;
+  int i;
+  int r;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    garena_errno = GARENA_ERR_LIBC;
+    return -1;
+  }
+  if ((fseek(f, 0, SEEK_END) == -1) || ((size = ftell(f)) == -1) || (fseek(f, 0, SEEK_SET) == -1)) {
+    garena_errno = GARENA_ERR_LIBC;
+    fclose(f);
+    return -1;
+  }
+  trace = malloc(size ? size : 1);
+  if (trace == NULL) {
+    garena_errno = GARENA_ERR_NORESOURCE;
+    fclose(f);
+    return -1;
+  }
+  if (size && (fread(trace, size, 1, f) != 1)) {
+    garena_errno = GARENA_ERR_LIBC;
+    fclose(f);
+    free(trace);
+    return -1;
+  }
+  fclose(f);
+
+  pos = sizeof(hdr) + sizeof(rec) + sizeof(session);
+  if (size < (long) pos) {
+    garena_errno = GARENA_ERR_INVALID;
+    free(trace);
+    return -1;
+  }
+  memcpy(&hdr, trace, sizeof(hdr));
+  memcpy(&rec, trace + sizeof(hdr), sizeof(rec));
+  memcpy(&session, trace + sizeof(hdr) + sizeof(rec), sizeof(session));
+  if (memcmp(hdr.magic, GHL_TRACE_MAGIC, sizeof(hdr.magic)) || (hdr.version != GHL_TRACE_VERSION) ||
+      (rec.type != GHL_TRACE_SESSION) || (rec.length != sizeof(session))) {
+    garena_errno = GARENA_ERR_INVALID;
+    free(trace);
+    return -1;
+  }
+
+  memset(stats, 0, sizeof(ghl_replay_stats_t));
+  stats->records[GHL_TRACE_SESSION]++;
+  first = rec.when;
+  garena_replay_active = 1;
+  garena_set_virtual_clock(1, first);
+  start = garena_now_ns();
+
+  internal_ip.s_addr = session.internal_ip;
+  serv = ghl_replay_serv(session.server_ip, session.gp2pp_lport, session.gp2pp_rport, session.mtu, internal_ip, session.internal_port, session.key, session.iv);
+  if (serv == NULL) {
+    garena_set_virtual_clock(0, 0);
+    garena_replay_active = 0;
+    free(trace);
+    return -1;
+  }
+  serv->rng = session.rng;
+  for (i = 0; i < GHL_EV_NUM; i++)
+    ghl_register_handler(serv, i, replay_event, stats);
+
+  /* a truncated last record (e.g. the traced program crashed) ends the replay */
+  while (pos + sizeof(rec) <= (size_t) size) {
+    memcpy(&rec, trace + pos, sizeof(rec));
+    if (pos + sizeof(rec) + rec.length > (size_t) size)
+      break;
+    if (replay_timers(serv, rec.when, stats) == -1) {
+      serv = NULL;
+      break;
+    }
+    if (gtime_after_eq(rec.when, garena_now_ms()))
+      garena_set_virtual_clock(1, rec.when);
+    if (rec.type < GHL_TRACE_NUM)
+      stats->records[rec.type]++;
+    r = replay_record(serv, &rec, trace + pos + sizeof(rec), buf, &data, &data_size);
+    if (r == -1) {
+      serv = NULL;
+      break;
+    }
+    stats->skipped += r;
+    pos += sizeof(rec) + rec.length;
+  }
+
+  stats->duration_ms = garena_now_ms() - first;
+  if (serv) {
+    ghl_get_stats(serv, &stats->stats);
+    ghl_free_serv(serv);
+  } else stats->freed = 1;
+  stats->elapsed_ns = garena_now_ns() - start;
+  garena_set_virtual_clock(0, 0);
+  garena_replay_active = 0;
+  free(data);
+  free(trace);
+  return 0;
+}
@@ -24,9 +24,21 @@ struct ihashitem_s {
   struct ihashitem_s *next;
 };
 
+/*
+ * hashtable items are allocated by chunks, and recycled through a free list. The pool
+ * never shrinks: chunks are released by ihash_free() or ihash_free_val() only.
+ */
+struct ihashchunk_s {
+  struct ihashchunk_s *next;
+  struct ihashitem_s items[0];
+};
+
 struct ihash_s {
   unsigned int size;
   struct ihashitem_s **h;
+  struct ihashitem_s *free;
+  unsigned int num_free;
+  struct ihashchunk_s *chunks;
 };
 
 
@@ -224,14 +236,46 @@ int ihash_num(ihash_t ihash) {
   
 }  
 
+/**
+ * Makes sure that the given number of items can be inserted in the hashtable
+ * without any further memory allocation. The reserved items stay allocated
+ * until the hashtable is freed.
+ *
+ * @param ihash The hashtable
+ * @param num The number of items
+ * @return 0 for success, -1 for failure
+ */
+int ihash_reserve(ihash_t ihash, unsigned int num) {
+  struct ihashchunk_s *chunk;
+  unsigned int i;
+  
+  if (ihash->num_free >= num)
+    return 0;
+  num -= ihash->num_free;
+  if (num < HASH_ITEM_CHUNK)
+    num = HASH_ITEM_CHUNK;
+  chunk = malloc(sizeof(struct ihashchunk_s) + num * sizeof(struct ihashitem_s));
+  if (chunk == NULL)
+    return -1;
+  chunk->next = ihash->chunks;
+  ihash->chunks = chunk;
+  for (i = 0; i < num; i++) {
+    chunk->items[i].next = ihash->free;
+    ihash->free = &chunk->items[i];
+  }
+  ihash->num_free += num;
+  return 0;
+}
+
 int ihash_put(ihash_t ihash, ihash_keytype key, void *value) {
   ihashitem_t item;
   unsigned int hv = ihash_func(key) % ihash->size;
 
-  item = malloc(sizeof(struct ihashitem_s));
-  if (item == NULL) {
+  if (ihash_reserve(ihash, 1) == -1)
     return -1;
-  }
+  item = ihash->free;
+  ihash->free = item->next;
+  ihash->num_free--;
    
   item->key = key;
   item->value = value;
@@ -299,7 +343,9 @@ int ihash_del(ihash_t ihash, ihash_keytype key) {
     if (key == item->key)
     {
       *prev = item->next;
-      free(item);
+      item->next = ihash->free;
+      ihash->free = item;
+      ihash->num_free++;
       return 0;  
     } else prev = &item->next;
   }
@@ -307,18 +353,17 @@ int ihash_del(ihash_t ihash, ihash_keytype key) {
   return -1;
 }
 
+static void ihash_free_chunks(ihash_t ihash) {
+  struct ihashchunk_s *chunk;
+  while (ihash->chunks != NULL) {
+    chunk = ihash->chunks;
+    ihash->chunks = chunk->next;
+    free(chunk);
+  }
+}
+
 void ihash_free(ihash_t ihash) {
-  unsigned int i;
-  ihashitem_t item,old;
-  
-  for (i = 0 ; i < ihash->size; i++) {
-    item = ihash->h[i];
-    while(item != NULL) {
-      old = item;
-      item = item->next;
-      free(old);
-    }
-  }  
+  ihash_free_chunks(ihash);
   free(ihash->h);
   free(ihash);   
 }
@@ -333,9 +378,9 @@ void ihash_free_val(ihash_t ihash) {
       old = item;
       item = item->next;
       free(old->value);
-      free(old);
     }
   }  
+  ihash_free_chunks(ihash);
   free(ihash->h);
   free(ihash);   
 }
@@ -353,6 +398,9 @@ ihash_t ihash_init() {
     return (NULL);
   }
   ihash->size = size;
+  ihash->free = NULL;
+  ihash->num_free = 0;
+  ihash->chunks = NULL;
   memset(ihash->h, 0, size*sizeof(struct ihashitem_s*));
   return(ihash);
 }
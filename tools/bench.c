@@ -0,0 +1,388 @@
+/**
+ * @file
+ *
+ * garena-bench: virtual connection throughput and latency benchmark.
+ * Two server handles are created in the same process, and connected to an embedded fake
+ * Garena server (see fakeserv.c) on loopback. They join the same room, then the first one
+ * opens virtual connections to the second one, and sends as much data as the window allows
+ * during the test.
+ *
+ * Reported: throughput (MB/s and segments/s), delivery latency percentiles (from
+ * ghl_conn_send() to GHL_EV_CONN_RECV), and CPU time per byte (both ends included, since
+ * they run in the same process). With -j, the results are printed as a single JSON object,
+ * for regression tracking.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/gp2pp.h>
+#include <garena/ghl.h>
+#include "fakeserv.h"
+
+#define BENCH_ROOM_ID 0x10203
+#define BENCH_SETUP_TIMEOUT 10000
+#define BENCH_DRAIN_TIMEOUT 2000
+#define BENCH_MAX_CONNS 256
+
+/* header of each benchmark segment */
+typedef struct {
+  uint64_t sent_ns;
+  uint32_t conn;
+} __attribute__ ((packed)) bench_hdr_t;
+
+typedef struct {
+  ghl_serv_t *serv;
+  char *name;
+  int connected;
+  int joined;
+  ghl_member_t *peer;
+  int peer_reachable;
+} bench_end_t;
+
+typedef struct {
+  ghl_ch_t *ch;
+  unsigned long sent;
+  unsigned long received;
+} bench_conn_t;
+
+static bench_end_t ends[2];
+static bench_conn_t conns[BENCH_MAX_CONNS];
+static unsigned int num_conns = 1;
+static unsigned int num_incoming = 0;
+static int measuring = 0;
+static unsigned long long bytes = 0;
+static unsigned long long packets = 0;
+static uint32_t *lat = NULL; /* latency samples, in microseconds */
+static unsigned long num_lat = 0;
+static unsigned long lat_size = 0;
+static int bench_port = 21513;
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-s segment_size] [-w window] [-c connections] [-t seconds] [-p base_port] [-i impairment] [-d] [-j]\n", name);
+  fprintf(stderr, "  -s: bytes per ghl_conn_send() call (default: 1024, at most the connection MSS)\n");
+  fprintf(stderr, "  -w: maximum number of undelivered segments per connection (default: 64)\n");
+  fprintf(stderr, "  -c: number of connections (default: 1, max: %u)\n", BENCH_MAX_CONNS);
+  fprintf(stderr, "  -t: test duration (default: 5 seconds)\n");
+  fprintf(stderr, "  -p: first of the 5 UDP/TCP ports used on 127.0.0.1 (default: %u)\n", bench_port);
+  fprintf(stderr, "  -i: impair the network, e.g. \"loss=1,delay=20,seed=7\" (see gp2pp_parse_impair())\n");
+  fprintf(stderr, "  -d: keep the library debug log (slower)\n");
+  fprintf(stderr, "  -j: print the results as JSON\n");
+  exit(-1);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ((uint64_t) ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+         ((uint64_t) ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void lat_add(uint32_t usec) {
+  uint32_t *tmp;
+  if (num_lat == lat_size) {
+    lat_size = lat_size ? (lat_size << 1) : 65536;
+    tmp = realloc(lat, lat_size * sizeof(uint32_t));
+    if (tmp == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(-1);
+    }
+    lat = tmp;
+  }
+  lat[num_lat++] = usec;
+}
+
+static int lat_cmp(const void *a, const void *b) {
+  uint32_t la = *(const uint32_t *) a;
+  uint32_t lb = *(const uint32_t *) b;
+  return (la > lb) - (la < lb);
+}
+
+static int handle_event(ghl_serv_t *serv, int event, void *event_data, void *privdata) {
+  bench_end_t *end = privdata;
+  bench_end_t *other = (end == &ends[0]) ? &ends[1] : &ends[0];
+  ghl_servconn_t *servconn = event_data;
+  ghl_me_join_t *me_join = event_data;
+  ghl_peer_reachable_t *reachable = event_data;
+  ghl_conn_recv_t *conn_recv = event_data;
+  bench_hdr_t hdr;
+
+  switch(event) {
+    case GHL_EV_SERVCONN:
+      if (servconn->result != GHL_EV_RES_SUCCESS) {
+        fprintf(stderr, "%s: server connection failed\n", end->name);
+        exit(-1);
+      }
+      end->connected = 1;
+      if (ghl_join_room(serv, inet_addr("127.0.0.1"), bench_port + 2, BENCH_ROOM_ID) == NULL) {
+        garena_perror("ghl_join_room");
+        exit(-1);
+      }
+      break;
+    case GHL_EV_ME_JOIN:
+      if (me_join->result != GHL_EV_RES_SUCCESS) {
+        fprintf(stderr, "%s: room join failed\n", end->name);
+        exit(-1);
+      }
+      end->joined = 1;
+      break;
+    case GHL_EV_PEER_REACHABLE:
+      if (other->serv && (reachable->member->user_id == other->serv->my_info.user_id)) {
+        end->peer = reachable->member;
+        end->peer_reachable = 1;
+      }
+      break;
+    case GHL_EV_CONN_INCOMING:
+      num_incoming++;
+      break;
+    case GHL_EV_CONN_RECV:
+      if (conn_recv->length < sizeof(hdr))
+        return conn_recv->length;
+      memcpy(&hdr, conn_recv->payload, sizeof(hdr));
+      if (hdr.conn < num_conns)
+        conns[hdr.conn].received++;
+      if (measuring) {
+        bytes += conn_recv->length;
+        packets++;
+        lat_add((now_ns() - hdr.sent_ns) / 1000);
+      }
+      return conn_recv->length;
+    case GHL_EV_CONN_FIN:
+      if (measuring) {
+        fprintf(stderr, "%s: connection closed during the test\n", end->name);
+        exit(-1);
+      }
+      break;
+  }
+  return 0;
+}
+
+/* processes the network and timer events of both ends, waiting at most timeout msec */
+static void bench_step(gtime_t timeout) {
+  struct timeval tv;
+  fd_set fds;
+  int maxfd = -1;
+  int r;
+  int i;
+
+  fakeserv_process(0, -1);
+  FD_ZERO(&fds);
+  for (i = 0; i < 2; i++) {
+    r = ghl_fill_fds(ends[i].serv, &fds);
+    if (r > maxfd)
+      maxfd = r;
+  }
+  if (ghl_fill_tv(ends[0].serv, &tv) && ((tv.tv_sec * 1000 + tv.tv_usec / 1000) < timeout)) {
+    /* keep the timer delay */
+  } else {
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+  }
+  if (select(maxfd + 1, &fds, NULL, NULL, &tv) == -1)
+    FD_ZERO(&fds);
+  for (i = 0; i < 2; i++) {
+    if (ghl_process(ends[i].serv, &fds) == -1) {
+      garena_perror("ghl_process");
+      exit(-1);
+    }
+  }
+}
+
+/* sends on every connection as long as the window allows */
+static void bench_send(unsigned int seg_size, unsigned int window) {
+  char buf[GP2PP_MAX_MSGSIZE];
+  bench_hdr_t hdr;
+  unsigned int i;
+
+  memset(buf, 0, seg_size);
+  for (i = 0; i < num_conns; i++) {
+    while (conns[i].sent - conns[i].received < window) {
+      hdr.sent_ns = now_ns();
+      hdr.conn = i;
+      memcpy(buf, &hdr, sizeof(hdr));
+      if (ghl_conn_send(ends[0].serv, conns[i].ch, buf, seg_size) == -1)
+        break;
+      conns[i].sent++;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned int seg_size = 1024;
+  unsigned int window = 64;
+  unsigned int duration = 5;
+  int keep_log = 0;
+  int json = 0;
+  char *impair_spec = NULL;
+  gp2pp_impair_t impair;
+  gtime_t deadline;
+  uint64_t start_ns, end_ns;
+  uint64_t start_cpu, end_cpu;
+  unsigned long pending;
+  ghl_stats_t snd_stats;
+  ghl_stats_t rcv_stats;
+  double secs;
+  unsigned int i;
+  int c;
+
+  while ((c = getopt(argc, argv, "s:w:c:t:p:i:dj")) != -1) {
+    switch(c) {
+      case 's':
+        seg_size = atoi(optarg);
+        break;
+      case 'w':
+        window = atoi(optarg);
+        break;
+      case 'c':
+        num_conns = atoi(optarg);
+        break;
+      case 't':
+        duration = atoi(optarg);
+        break;
+      case 'p':
+        bench_port = atoi(optarg);
+        break;
+      case 'i':
+        impair_spec = optarg;
+        break;
+      case 'd':
+        keep_log = 1;
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if ((optind != argc) || (seg_size < sizeof(bench_hdr_t)) || (window == 0) || (num_conns == 0) ||
+      (num_conns > BENCH_MAX_CONNS) || (duration == 0))
+    usage(argv[0]);
+
+  if (garena_init() == -1) {
+    garena_perror("garena_init");
+    return -1;
+  }
+  if (!keep_log) {
+    /* the library logs every segment, which would dominate the measurements */
+    fclose(deb);
+    deb = fopen("/dev/null", "w");
+  }
+  if (impair_spec != NULL) {
+    if ((gp2pp_parse_impair(impair_spec, &impair) == -1) || (gp2pp_set_impair(&impair) == -1)) {
+      fprintf(stderr, "Invalid impairment: %s\n", impair_spec);
+      return -1;
+    }
+  }
+  if (fakeserv_open(inet_addr("127.0.0.1"), bench_port, bench_port + 1, bench_port + 2, FAKESERV_MAX_MEMBERS, NULL) == -1)
+    return -1;
+
+  /* setup: connect, join the room, and wait until the ends can talk to each other */
+  ends[0].name = "bench-a";
+  ends[1].name = "bench-b";
+  for (i = 0; i < 2; i++) {
+    ends[i].serv = ghl_new_serv(ends[i].name, "bench", inet_addr("127.0.0.1"), bench_port, bench_port + 3 + i, bench_port + 1, 0);
+    if (ends[i].serv == NULL) {
+      garena_perror("ghl_new_serv");
+      return -1;
+    }
+    for (c = 0; c < GHL_EV_NUM; c++)
+      ghl_register_handler(ends[i].serv, c, handle_event, &ends[i]);
+  }
+  deadline = garena_now_ms() + BENCH_SETUP_TIMEOUT;
+  while (!ends[0].peer_reachable || !ends[1].peer_reachable) {
+    if (gtime_after_eq(garena_now_ms(), deadline)) {
+      fprintf(stderr, "Setup timed out\n");
+      return -1;
+    }
+    bench_step(10);
+  }
+
+  for (i = 0; i < num_conns; i++) {
+    conns[i].ch = ghl_conn_connect(ends[0].serv, ends[0].peer, 1000 + i);
+    if (conns[i].ch == NULL) {
+      garena_perror("ghl_conn_connect");
+      return -1;
+    }
+  }
+  if (seg_size > ghl_conn_max_pkt(conns[0].ch))
+    seg_size = ghl_conn_max_pkt(conns[0].ch);
+  while (num_incoming < num_conns) {
+    if (gtime_after_eq(garena_now_ms(), deadline)) {
+      fprintf(stderr, "Setup timed out\n");
+      return -1;
+    }
+    bench_step(10);
+  }
+
+  /* test */
+  measuring = 1;
+  start_ns = now_ns();
+  start_cpu = cpu_ns();
+  deadline = garena_now_ms() + duration * 1000;
+  while (!gtime_after_eq(garena_now_ms(), deadline)) {
+    bench_send(seg_size, window);
+    bench_step(1);
+  }
+  end_ns = now_ns();
+  end_cpu = cpu_ns();
+  measuring = 0;
+
+  /* let the in-flight segments arrive, so that the connections are not closed with data pending */
+  deadline = garena_now_ms() + BENCH_DRAIN_TIMEOUT;
+  do {
+    pending = 0;
+    for (i = 0; i < num_conns; i++)
+      pending += conns[i].sent - conns[i].received;
+    bench_step(1);
+  } while (pending && !gtime_after_eq(garena_now_ms(), deadline));
+
+  ghl_get_stats(ends[0].serv, &snd_stats);
+  ghl_get_stats(ends[1].serv, &rcv_stats);
+  secs = (end_ns - start_ns) / 1e9;
+  qsort(lat, num_lat, sizeof(uint32_t), lat_cmp);
+  if (json) {
+    printf("{\"segment_size\": %u, \"window\": %u, \"connections\": %u, \"duration_s\": %.3f, "
+           "\"bytes\": %llu, \"segments\": %llu, \"mb_per_s\": %.3f, \"segments_per_s\": %.1f, "
+           "\"latency_p50_us\": %u, \"latency_p99_us\": %u, \"cpu_ns_per_byte\": %.3f, "
+           "\"retrans_rto\": %llu, \"retrans_fast\": %llu, \"dup_acks\": %llu, \"dup_data\": %llu}\n",
+           seg_size, window, num_conns, secs, bytes, packets, bytes / secs / 1e6, packets / secs,
+           num_lat ? lat[num_lat / 2] : 0, num_lat ? lat[(num_lat * 99) / 100] : 0,
+           bytes ? (double) (end_cpu - start_cpu) / bytes : 0.0,
+           (unsigned long long) snd_stats.serv.conn.retrans_rto, (unsigned long long) snd_stats.serv.conn.retrans_fast,
+           (unsigned long long) snd_stats.serv.conn.dup_acks, (unsigned long long) rcv_stats.serv.conn.dup_data);
+  } else {
+    printf("segment size: %u bytes, window: %u segments, %u connection(s), %.3f s\n", seg_size, window, num_conns, secs);
+    printf("throughput: %.3f MB/s, %.1f segments/s (%llu bytes)\n", bytes / secs / 1e6, packets / secs, bytes);
+    printf("latency: p50 %u us, p99 %u us\n", num_lat ? lat[num_lat / 2] : 0, num_lat ? lat[(num_lat * 99) / 100] : 0);
+    printf("cpu: %.3f ns/byte\n", bytes ? (double) (end_cpu - start_cpu) / bytes : 0.0);
+    printf("retransmits: %llu after RTO, %llu fast; duplicate ACKs: %llu, duplicate segments: %llu\n",
+           (unsigned long long) snd_stats.serv.conn.retrans_rto, (unsigned long long) snd_stats.serv.conn.retrans_fast,
+           (unsigned long long) snd_stats.serv.conn.dup_acks, (unsigned long long) rcv_stats.serv.conn.dup_data);
+  }
+
+  for (i = 0; i < num_conns; i++)
+    ghl_conn_close(ends[0].serv, conns[i].ch);
+  for (i = 0; i < 2; i++)
+    ghl_free_serv(ends[i].serv);
+  fakeserv_close();
+  free(lat);
+  garena_fini();
+  return 0;
+}
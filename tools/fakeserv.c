@@ -0,0 +1,677 @@
+/**
+ * @file
+ *
+ * A fake Garena server, to test libgarena clients without the real Garena infrastructure
+ * (e.g. many clients on loopback). It implements, on a single address:
+ *
+ * @li the main server (GSP, TCP): session initialization, and login. Any password is accepted,
+ *     each new user name gets a new user ID.
+ * @li the GP2PP IP lookup and room info (user count) queries (UDP).
+ * @li the room server (GCRP, TCP): any room ID can be joined, the rooms are created on demand.
+ *     The server keeps the member lists, and forwards JOIN, PART, TALK, STARTVPN and STOPVPN
+ *     to the other members of the room.
+ *
+ * It is used by garena-fakeserv, and embedded in garena-bench.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <zlib.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/gsp.h>
+#include <garena/gcrp.h>
+#include <garena/gp2pp.h>
+#include <garena/util.h>
+#include "fakeserv.h"
+
+#define FAKESERV_FIRST_USER_ID 0x1000
+
+#define CLIENT_GSP 0
+#define CLIENT_GCRP 1
+
+struct room_s;
+
+typedef struct {
+  int sock;
+  int type; /* CLIENT_GSP or CLIENT_GCRP */
+  char buf[GCRP_MAX_MSGSIZE]; /* input buffer, holds the partial message */
+  unsigned int len;
+  int closing;
+  ilist_node_t node; /* node in the client list */
+  /* GSP */
+  gsp_handtab_t *gsp_htab;
+  int session_ok;
+  unsigned char key[GSP_KEYSIZE];
+  unsigned char iv[GSP_IVSIZE];
+  /* GCRP */
+  struct room_s *room;
+  gcrp_member_t member;
+  ilist_node_t room_node; /* node in the room member list */
+} client_t;
+
+typedef struct room_s {
+  unsigned int room_id;
+  unsigned int num_members;
+  unsigned int population; /* additional advertised users */
+  ilist_t members;
+  uint8_t used_suffix[256];
+} room_t;
+
+typedef struct {
+  char name[16];
+  unsigned int user_id;
+  int deny;
+} user_t;
+
+static ilist_t clients;
+static ihash_t rooms;
+static user_t *users = NULL;
+static unsigned int num_users = 0;
+static unsigned int max_members = FAKESERV_MAX_MEMBERS;
+static gcrp_handtab_t *gcrp_htab;
+static int gsp_sock = -1;
+static int gp2pp_sock = -1;
+static int gcrp_sock = -1;
+static FILE *evlog;
+static struct pollfd *fds = NULL;
+static unsigned int fds_size = 0;
+
+/* prints an event line on the event log, if any */
+static void event(const char *fmt, ...) {
+  va_list ap;
+
+  if (evlog == NULL)
+    return;
+  va_start(ap, fmt);
+  vfprintf(evlog, fmt, ap);
+  va_end(ap);
+}
+
+static int listen_on(int type, int addr, int port) {
+  struct sockaddr_in local;
+  int sock;
+  int one = 1;
+
+  sock = socket(PF_INET, type, 0);
+  if (sock == -1) {
+    perror("socket");
+    return -1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  local.sin_addr.s_addr = addr;
+  if (bind(sock, (struct sockaddr *) &local, sizeof(local)) == -1) {
+    perror("bind");
+    close(sock);
+    return -1;
+  }
+  if ((type == SOCK_STREAM) && (listen(sock, 128) == -1)) {
+    perror("listen");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static user_t *user_find(char *name) {
+  unsigned int i;
+  for (i = 0; i < num_users; i++) {
+    if (strncmp(users[i].name, name, sizeof(users[i].name)) == 0)
+      return &users[i];
+  }
+  return NULL;
+}
+
+static user_t *user_get(char *name) {
+  user_t *user = user_find(name);
+  user_t *tmp;
+
+  if (user)
+    return user;
+  tmp = realloc(users, (num_users + 1) * sizeof(user_t));
+  if (tmp == NULL)
+    return NULL;
+  users = tmp;
+  user = &users[num_users];
+  memset(user, 0, sizeof(user_t));
+  strncpy(user->name, name, sizeof(user->name) - 1);
+  user->user_id = FAKESERV_FIRST_USER_ID + num_users;
+  num_users++;
+  return user;
+}
+
+/* returns the room, creating it if needed */
+static room_t *room_get(unsigned int room_id) {
+  room_t *room = ihash_get(rooms, room_id);
+
+  if (room)
+    return room;
+  room = calloc(1, sizeof(room_t));
+  if ((room == NULL) || (ihash_put(rooms, room_id, room) == -1)) {
+    free(room);
+    return NULL;
+  }
+  room->room_id = room_id;
+  ilist_init(&room->members);
+  room->used_suffix[0] = room->used_suffix[255] = 1;
+  return room;
+}
+
+/* send a GCRP message to all the members of a room, except one */
+static void room_broadcast(room_t *room, client_t *except, int type, char *payload, unsigned int length) {
+  ilist_node_t *node;
+  client_t *client;
+
+  for (node = ilist_head(&room->members); node; node = ilist_next(&room->members, node)) {
+    client = ilist_entry(node, client_t, room_node);
+    if (client != except)
+      gcrp_output(client->sock, type, payload, length);
+  }
+}
+
+static void room_part(client_t *client) {
+  room_t *room = client->room;
+  gcrp_part_t part;
+
+  if (room == NULL)
+    return;
+  ilist_del(&client->room_node);
+  room->num_members--;
+  room->used_suffix[client->member.virtual_suffix] = 0;
+  client->room = NULL;
+  event("part %x %x\n", room->room_id, ghtonl(client->member.user_id));
+  part.user_id = client->member.user_id;
+  room_broadcast(room, NULL, GCRP_MSG_PART, (char *) &part, sizeof(part));
+}
+
+static void client_free(client_t *client) {
+  room_part(client);
+  ilist_del(&client->node);
+  close(client->sock);
+  free(client->gsp_htab);
+  free(client);
+}
+
+static int handle_login(int type, void *payload, unsigned int length, void *privdata) {
+  client_t *client = privdata;
+  gsp_login_t *login = payload;
+  gsp_login_reply_t reply;
+  char name[sizeof(login->name) + 1];
+  user_t *user;
+
+  if (type != GSP_MSG_LOGIN)
+    return 0;
+  if (length < sizeof(gsp_login_t)) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
+  memcpy(name, login->name, sizeof(login->name));
+  name[sizeof(login->name)] = 0;
+  user = user_get(name);
+  if ((user == NULL) || user->deny) {
+    event("login-denied %s\n", name);
+    return gsp_output(client->sock, GSP_MSG_AUTH_FAIL, NULL, 0, client->key, client->iv);
+  }
+  memset(&reply, 0, sizeof(reply));
+  reply.my_info.user_id = ghtonl(user->user_id);
+  memcpy(reply.my_info.name, user->name, sizeof(reply.my_info.name));
+  memcpy(reply.my_info.country, "EN", 2);
+  event("login %s %x\n", user->name, user->user_id);
+  return gsp_output(client->sock, GSP_MSG_LOGIN_REPLY, (char *) &reply, sizeof(reply), client->key, client->iv);
+}
+
+static int handle_join(int type, void *payload, unsigned int length, void *privdata, void *roomdata) {
+  client_t *client = roomdata;
+  gcrp_me_join_t *join = payload;
+  gsp_myinfo_t info;
+  char buf[GCRP_MAX_MSGSIZE];
+  gcrp_memberlist_t *memberlist = (gcrp_memberlist_t *) buf;
+  ilist_node_t *node;
+  room_t *room;
+  unsigned int room_id;
+  unsigned int i;
+  z_stream strm;
+
+  if ((client->room != NULL) || (length < sizeof(gcrp_me_join_t) + sizeof(gcrp_me_join_suffix_t)))
+    return 0;
+  room_id = ghtonl(join->room_id);
+
+  /* decompress the join block */
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit(&strm) != Z_OK)
+    return -1;
+  strm.next_in = (unsigned char *) payload + sizeof(gcrp_me_join_t);
+  strm.avail_in = length - sizeof(gcrp_me_join_t) - sizeof(gcrp_me_join_suffix_t);
+  strm.next_out = (unsigned char *) &info;
+  strm.avail_out = sizeof(info);
+  i = inflate(&strm, Z_FINISH);
+  inflateEnd(&strm);
+  if (((i != Z_STREAM_END) && (i != Z_OK)) || strm.avail_out) {
+    garena_errno = GARENA_ERR_PROTOCOL;
+    return -1;
+  }
+
+  room = room_get(room_id);
+  if (room == NULL)
+    return -1;
+  if (room->num_members >= max_members) {
+    event("join-failed %x %x\n", room_id, ghtonl(info.user_id));
+    return gcrp_output(client->sock, GCRP_MSG_JOIN_FAILED, (char *) &join->room_id, sizeof(join->room_id));
+  }
+
+  memset(&client->member, 0, sizeof(client->member));
+  client->member.user_id = info.user_id;
+  memcpy(client->member.name, info.name, sizeof(client->member.name));
+  memcpy(client->member.country, info.country, sizeof(client->member.country));
+  client->member.level = info.level;
+  client->member.external_ip = info.external_ip;
+  client->member.external_port = info.external_port;
+  client->member.internal_ip = info.internal_ip;
+  client->member.internal_port = info.internal_port;
+  for (i = 1; (i < 255) && room->used_suffix[i]; i++);
+  if (i == 255) {
+    event("join-failed %x %x\n", room_id, ghtonl(info.user_id));
+    return gcrp_output(client->sock, GCRP_MSG_JOIN_FAILED, (char *) &join->room_id, sizeof(join->room_id));
+  }
+  room->used_suffix[i] = 1;
+  client->member.virtual_suffix = i;
+
+  ilist_add_tail(&room->members, &client->room_node);
+  room->num_members++;
+  client->room = room;
+  event("join %x %x %.16s\n", room_id, ghtonl(info.user_id), info.name);
+
+  memberlist->room_id = join->room_id;
+  memberlist->num_members = ghtonl(room->num_members);
+  i = 0;
+  for (node = ilist_head(&room->members); node; node = ilist_next(&room->members, node))
+    memberlist->members[i++] = ilist_entry(node, client_t, room_node)->member;
+  if (gcrp_output(client->sock, GCRP_MSG_MEMBERS, buf, sizeof(gcrp_memberlist_t) + i * sizeof(gcrp_member_t)) == -1)
+    return -1;
+  room_broadcast(room, client, GCRP_MSG_JOIN, (char *) &client->member, sizeof(gcrp_member_t));
+  return 0;
+}
+
+static int handle_room_msg(int type, void *payload, unsigned int length, void *privdata, void *roomdata) {
+  client_t *client = roomdata;
+  gcrp_talk_t *talk = payload;
+  gcrp_togglevpn_t togglevpn;
+
+  if (client->room == NULL)
+    return 0;
+  switch(type) {
+    case GCRP_MSG_PART:
+      client->closing = 1;
+      break;
+    case GCRP_MSG_TALK:
+      if (length < sizeof(gcrp_talk_t))
+        return 0;
+      talk->user_id = client->member.user_id;
+      event("talk %x %x\n", client->room->room_id, ghtonl(client->member.user_id));
+      room_broadcast(client->room, client, GCRP_MSG_TALK, payload, length);
+      break;
+    case GCRP_MSG_STARTVPN:
+    case GCRP_MSG_STOPVPN:
+      client->member.vpn = (type == GCRP_MSG_STARTVPN);
+      togglevpn.user_id = client->member.user_id;
+      event("vpn %x %x %u\n", client->room->room_id, ghtonl(client->member.user_id), client->member.vpn);
+      room_broadcast(client->room, client, type, (char *) &togglevpn, sizeof(togglevpn));
+      break;
+  }
+  return 0;
+}
+
+/* returns the length of the first complete message in the client buffer, or 0 */
+static unsigned int client_msg_len(client_t *client) {
+  uint32_t size;
+  unsigned int len;
+
+  if (client->len < sizeof(uint32_t))
+    return 0;
+  memcpy(&size, client->buf, sizeof(size));
+  if (client->type == CLIENT_GSP) {
+    len = sizeof(uint32_t) + (ghtonl(size) & 0xFFFFFF);
+  } else {
+    if (client->len < sizeof(gcrp_hdr_t))
+      return 0;
+    len = sizeof(uint32_t) + ghtonl(size);
+  }
+  if (len > sizeof(client->buf)) {
+    client->closing = 1;
+    return 0;
+  }
+  return (client->len >= len) ? len : 0;
+}
+
+static void client_read(client_t *client) {
+  unsigned int len;
+  int r;
+
+  r = recv(client->sock, client->buf + client->len, sizeof(client->buf) - client->len, MSG_DONTWAIT);
+  if (r <= 0) {
+    if ((r == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+      client->closing = 1;
+    return;
+  }
+  client->len += r;
+
+  while (!client->closing && (len = client_msg_len(client))) {
+    if (client->type == CLIENT_GCRP) {
+      gcrp_input(gcrp_htab, client->buf, len, client);
+    } else if (!client->session_ok) {
+      if (gsp_accept_session(client->buf, len, client->key, client->iv) == -1)
+        client->closing = 1;
+      else client->session_ok = 1;
+    } else if (gsp_input(client->gsp_htab, client->buf, len, client->key, client->iv) == -1) {
+      client->closing = 1;
+    }
+    memmove(client->buf, client->buf + len, client->len - len);
+    client->len -= len;
+  }
+}
+
+static void client_accept(int lsock, int type) {
+  client_t *client;
+  int sock;
+
+  sock = accept(lsock, NULL, NULL);
+  if (sock == -1) {
+    perror("accept");
+    return;
+  }
+  client = calloc(1, sizeof(client_t));
+  if ((client == NULL) || ((type == CLIENT_GSP) && ((client->gsp_htab = gsp_alloc_handtab()) == NULL))) {
+    fprintf(stderr, "Out of memory\n");
+    free(client);
+    close(sock);
+    return;
+  }
+  client->sock = sock;
+  client->type = type;
+  if (type == CLIENT_GSP)
+    gsp_register_handler(client->gsp_htab, GSP_MSG_LOGIN, handle_login, client);
+  ilist_add_tail(&clients, &client->node);
+}
+
+static int room_cmp(const void *a, const void *b) {
+  const room_t *ra = *(room_t * const *) a;
+  const room_t *rb = *(room_t * const *) b;
+  return (ra->room_id > rb->room_id) - (ra->room_id < rb->room_id);
+}
+
+static void send_roominfo(int sock, struct sockaddr_in *remote) {
+  char buf[sizeof(uint8_t) + sizeof(gp2pp_roominfo_reply_t) + 255 * sizeof(gp2pp_room_usernum_t)];
+  gp2pp_roominfo_reply_t *reply = (gp2pp_roominfo_reply_t *) (buf + sizeof(uint8_t));
+  room_t **sorted;
+  room_t *room;
+  ihashitem_t iter;
+  unsigned int num = 0;
+  unsigned int i;
+
+  sorted = malloc(ihash_num(rooms) * sizeof(room_t *) + 1);
+  if (sorted == NULL)
+    return;
+  for (iter = ihash_iter(rooms); iter; iter = ihash_next(rooms, iter))
+    sorted[num++] = ihash_val(iter);
+  qsort(sorted, num, sizeof(room_t *), room_cmp);
+
+  /* one reply per room ID prefix */
+  buf[0] = GP2PP_MSG_ROOMINFO_REPLY;
+  reply->num_rooms = 0;
+  for (i = 0; i < num; i++) {
+    room = sorted[i];
+    if (reply->num_rooms && ((ghtons(reply->prefix) != (room->room_id >> 8)) || (reply->num_rooms == 255))) {
+      sendto(sock, buf, sizeof(uint8_t) + sizeof(gp2pp_roominfo_reply_t) + reply->num_rooms * sizeof(gp2pp_room_usernum_t),
+             0, (struct sockaddr *) remote, sizeof(struct sockaddr_in));
+      reply->num_rooms = 0;
+    }
+    reply->prefix = ghtons(room->room_id >> 8);
+    reply->usernum[reply->num_rooms].suffix = room->room_id & 0xFF;
+    reply->usernum[reply->num_rooms].num_users = ((room->num_members + room->population) > 255) ? 255 : (room->num_members + room->population);
+    reply->num_rooms++;
+  }
+  if (reply->num_rooms)
+    sendto(sock, buf, sizeof(uint8_t) + sizeof(gp2pp_roominfo_reply_t) + reply->num_rooms * sizeof(gp2pp_room_usernum_t),
+           0, (struct sockaddr *) remote, sizeof(struct sockaddr_in));
+  free(sorted);
+}
+
+static void handle_udp(int sock) {
+  char buf[GP2PP_MAX_MSGSIZE];
+  gp2pp_lookup_reply_t *lookup = (gp2pp_lookup_reply_t *) (buf + sizeof(uint8_t));
+  struct sockaddr_in remote;
+  socklen_t fromlen = sizeof(remote);
+  int r;
+
+  r = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &remote, &fromlen);
+  if (r < 1)
+    return;
+  switch(buf[0]) {
+    case GP2PP_MSG_IP_LOOKUP_REQUEST:
+      memset(buf, 0, sizeof(buf));
+      buf[0] = GP2PP_MSG_IP_LOOKUP_REPLY;
+      lookup->my_external_ip = remote.sin_addr;
+      lookup->my_external_port = remote.sin_port;
+      sendto(sock, buf, sizeof(uint8_t) + sizeof(gp2pp_lookup_reply_t), 0, (struct sockaddr *) &remote, sizeof(remote));
+      break;
+    case GP2PP_MSG_ROOMINFO_REQUEST:
+      send_roominfo(sock, &remote);
+      break;
+  }
+}
+
+static void list_rooms(void) {
+  ihashitem_t iter;
+  ilist_node_t *node;
+  client_t *client;
+  room_t *room;
+
+  for (iter = ihash_iter(rooms); iter; iter = ihash_next(rooms, iter)) {
+    room = ihash_val(iter);
+    event("room %x members %u population %u\n", room->room_id, room->num_members, room->population);
+    for (node = ilist_head(&room->members); node; node = ilist_next(&room->members, node)) {
+      client = ilist_entry(node, client_t, room_node);
+      event("member %x %x %.16s vpn %u 192.168.29.%u\n", room->room_id, ghtonl(client->member.user_id),
+             client->member.name, client->member.vpn, client->member.virtual_suffix);
+    }
+  }
+}
+
+/**
+ * Runs a command (see garena-fakeserv).
+ *
+ * @param line The command line
+ * @return 0 for success, -1 if the command is "quit"
+ */
+int fakeserv_command(char *line) {
+  char buf[GCRP_MAX_MSGSIZE];
+  gcrp_system_t *syst = (gcrp_system_t *) buf;
+  char arg[256];
+  unsigned int id;
+  unsigned int num;
+  int n = 0;
+  ilist_node_t *node;
+  client_t *client;
+  room_t *room;
+  user_t *user;
+
+  if (sscanf(line, "population %x %u", &id, &num) == 2) {
+    if ((room = room_get(id)))
+      room->population = num;
+  } else if ((sscanf(line, "system %x %n", &id, &n) == 1) && n) {
+    room = ihash_get(rooms, id);
+    if (room == NULL)
+      return 0;
+    line[strcspn(line, "\n")] = 0;
+    syst->room_id = ghtonl(id);
+    gcrp_fromchar(syst->text, line + n, (sizeof(buf) - sizeof(gcrp_system_t)) >> 1);
+    room_broadcast(room, NULL, GCRP_MSG_SYSTEM, buf, sizeof(gcrp_system_t) + ((strlen(line + n) + 1) << 1));
+  } else if (sscanf(line, "kick %x", &id) == 1) {
+    for (node = ilist_head(&clients); node; node = ilist_next(&clients, node)) {
+      client = ilist_entry(node, client_t, node);
+      if (client->room && (ghtonl(client->member.user_id) == id))
+        client->closing = 1;
+    }
+  } else if (sscanf(line, "deny %255s", arg) == 1) {
+    if ((user = user_get(arg)))
+      user->deny = 1;
+  } else if (sscanf(line, "allow %255s", arg) == 1) {
+    if ((user = user_find(arg)))
+      user->deny = 0;
+  } else if (strncmp(line, "list", 4) == 0) {
+    list_rooms();
+  } else if (strncmp(line, "quit", 4) == 0) {
+    return -1;
+  } else if (line[strspn(line, " \t\n")] != 0) {
+    fprintf(stderr, "Unknown command: %s", line);
+  }
+  return 0;
+}
+
+/**
+ * Opens the server sockets.
+ *
+ * @param addr The address to listen on
+ * @param gsp_port The main server (GSP) TCP port
+ * @param gp2pp_port The GP2PP UDP port
+ * @param gcrp_port The room server (GCRP) TCP port
+ * @param max Maximum number of members per room (at most FAKESERV_MAX_MEMBERS)
+ * @param log Where to print the events, or NULL
+ * @return 0 for success, -1 for failure
+ */
+int fakeserv_open(int addr, int gsp_port, int gp2pp_port, int gcrp_port, unsigned int max, FILE *log) {
+  evlog = log;
+  max_members = (max < FAKESERV_MAX_MEMBERS) ? max : FAKESERV_MAX_MEMBERS;
+  ilist_init(&clients);
+  rooms = ihash_init();
+  gcrp_htab = gcrp_alloc_handtab();
+  if ((rooms == NULL) || (gcrp_htab == NULL)) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  gcrp_register_handler(gcrp_htab, GCRP_MSG_JOIN, handle_join, NULL);
+  gcrp_register_handler(gcrp_htab, GCRP_MSG_PART, handle_room_msg, NULL);
+  gcrp_register_handler(gcrp_htab, GCRP_MSG_TALK, handle_room_msg, NULL);
+  gcrp_register_handler(gcrp_htab, GCRP_MSG_STARTVPN, handle_room_msg, NULL);
+  gcrp_register_handler(gcrp_htab, GCRP_MSG_STOPVPN, handle_room_msg, NULL);
+
+  gsp_sock = listen_on(SOCK_STREAM, addr, gsp_port);
+  gp2pp_sock = listen_on(SOCK_DGRAM, addr, gp2pp_port);
+  gcrp_sock = listen_on(SOCK_STREAM, addr, gcrp_port);
+  if ((gsp_sock == -1) || (gp2pp_sock == -1) || (gcrp_sock == -1))
+    return -1;
+  return 0;
+}
+
+/**
+ * Waits for activity on the server sockets, and processes it.
+ *
+ * @param timeout Maximum time to wait, in milliseconds (-1 to wait forever)
+ * @param fd Another file descriptor to wait for (e.g. the standard input), or -1
+ * @return 1 if fd is readable, 0 if not, -1 for failure
+ */
+int fakeserv_process(int timeout, int fd) {
+  struct pollfd *tmp;
+  ilist_node_t *node;
+  ilist_node_t *next;
+  client_t *client;
+  unsigned int num_fds;
+  unsigned int i;
+  int r = 0;
+
+  /* the 4 first entries are the listening sockets and fd, then one per client */
+  num_fds = 4;
+  for (node = ilist_head(&clients); node; node = ilist_next(&clients, node))
+    num_fds++;
+  if (num_fds > fds_size) {
+    tmp = realloc(fds, num_fds * 2 * sizeof(struct pollfd));
+    if (tmp == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    fds = tmp;
+    fds_size = num_fds * 2;
+  }
+  fds[0].fd = gsp_sock;
+  fds[1].fd = gp2pp_sock;
+  fds[2].fd = gcrp_sock;
+  fds[3].fd = fd;
+  i = 4;
+  for (node = ilist_head(&clients); node; node = ilist_next(&clients, node))
+    fds[i++].fd = ilist_entry(node, client_t, node)->sock;
+  for (i = 0; i < num_fds; i++)
+    fds[i].events = POLLIN;
+
+  if (poll(fds, num_fds, timeout) == -1) {
+    if (errno == EINTR)
+      return 0;
+    perror("poll");
+    return -1;
+  }
+
+  i = 4;
+  for (node = ilist_head(&clients); node; node = ilist_next(&clients, node), i++) {
+    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+      client_read(ilist_entry(node, client_t, node));
+  }
+  if (fds[0].revents & POLLIN)
+    client_accept(gsp_sock, CLIENT_GSP);
+  if (fds[1].revents & POLLIN)
+    handle_udp(gp2pp_sock);
+  if (fds[2].revents & POLLIN)
+    client_accept(gcrp_sock, CLIENT_GCRP);
+  if (fds[3].revents & (POLLIN | POLLHUP))
+    r = 1;
+
+  for (node = ilist_head(&clients); node; node = next) {
+    next = ilist_next(&clients, node);
+    client = ilist_entry(node, client_t, node);
+    if (client->closing)
+      client_free(client);
+  }
+  if (evlog)
+    fflush(evlog);
+  return r;
+}
+
+/**
+ * Closes the server sockets, and the client connections.
+ */
+void fakeserv_close(void) {
+  ilist_node_t *node;
+  ilist_node_t *next;
+
+  for (node = ilist_head(&clients); node; node = next) {
+    next = ilist_next(&clients, node);
+    client_free(ilist_entry(node, client_t, node));
+  }
+  if (gsp_sock != -1)
+    close(gsp_sock);
+  if (gp2pp_sock != -1)
+    close(gp2pp_sock);
+  if (gcrp_sock != -1)
+    close(gcrp_sock);
+  gsp_sock = gp2pp_sock = gcrp_sock = -1;
+  if (rooms)
+    ihash_free_val(rooms);
+  rooms = NULL;
+  free(gcrp_htab);
+  gcrp_htab = NULL;
+  free(users);
+  users = NULL;
+  num_users = 0;
+  free(fds);
+  fds = NULL;
+  fds_size = 0;
+}
@@ -0,0 +1,18 @@
+#ifndef GARENA_FAKESERV_H
+#define GARENA_FAKESERV_H 1
+
+#include <stdio.h>
+#include <garena/gcrp.h>
+
+/* the member list of a room must fit in a single GCRP message */
+#define FAKESERV_MAX_LISTED ((GCRP_MAX_MSGSIZE - sizeof(gcrp_hdr_t) - sizeof(gcrp_memberlist_t)) / sizeof(gcrp_member_t))
+/* and each member needs a virtual suffix (0 and 255 are not usable) */
+#define FAKESERV_MAX_SUFFIXES 254
+#define FAKESERV_MAX_MEMBERS ((FAKESERV_MAX_LISTED < FAKESERV_MAX_SUFFIXES) ? FAKESERV_MAX_LISTED : FAKESERV_MAX_SUFFIXES)
+
+int fakeserv_open(int addr, int gsp_port, int gp2pp_port, int gcrp_port, unsigned int max, FILE *log);
+int fakeserv_process(int timeout, int fd);
+int fakeserv_command(char *line);
+void fakeserv_close(void);
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * @file
+ *
+ * garena-fakeserv: runs the fake Garena server (see fakeserv.c), to test libgarena
+ * clients offline.
+ *
+ * The server reads commands on its standard input (one per line), so it can be scripted:
+ *
+ * @li population ROOM_ID NUM: advertise NUM more users in the room info replies
+ * @li system ROOM_ID TEXT: send a system message to a room
+ * @li kick USER_ID: close the room connection of a user
+ * @li deny NAME / allow NAME: make the logins with this user name fail, or succeed again
+ * @li list: print the rooms and their members
+ * @li quit
+ *
+ * The events are printed on the standard output, one per line (login, join, part, talk, vpn).
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/gsp.h>
+#include <garena/gcrp.h>
+#include <garena/gp2pp.h>
+#include "fakeserv.h"
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-a addr] [-g gsp_port] [-u gp2pp_port] [-r gcrp_port] [-m max_members]\n", name);
+  fprintf(stderr, "Defaults: 127.0.0.1, ports %u, %u and %u, %u members\n", GSP_PORT, GP2PP_PORT, GCRP_PORT, (unsigned int) FAKESERV_MAX_MEMBERS);
+  exit(-1);
+}
+
+int main(int argc, char **argv) {
+  char line[1024];
+  int addr = inet_addr("127.0.0.1");
+  int gsp_port = GSP_PORT;
+  int gp2pp_port = GP2PP_PORT;
+  int gcrp_port = GCRP_PORT;
+  unsigned int max_members = FAKESERV_MAX_MEMBERS;
+  int use_stdin = 1;
+  int r;
+  int c;
+
+  while ((c = getopt(argc, argv, "a:g:u:r:m:")) != -1) {
+    switch(c) {
+      case 'a':
+        addr = inet_addr(optarg);
+        break;
+      case 'g':
+        gsp_port = atoi(optarg);
+        break;
+      case 'u':
+        gp2pp_port = atoi(optarg);
+        break;
+      case 'r':
+        gcrp_port = atoi(optarg);
+        break;
+      case 'm':
+        max_members = atoi(optarg);
+        if ((max_members == 0) || (max_members > FAKESERV_MAX_MEMBERS))
+          usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc)
+    usage(argv[0]);
+
+  if (garena_init() == -1) {
+    garena_perror("garena_init");
+    return -1;
+  }
+  if (fakeserv_open(addr, gsp_port, gp2pp_port, gcrp_port, max_members, stdout) == -1)
+    return -1;
+  printf("ready\n");
+  fflush(stdout);
+
+  while (1) {
+    r = fakeserv_process(-1, use_stdin ? 0 : -1);
+    if (r == -1)
+      return -1;
+    if (r == 1) {
+      if (fgets(line, sizeof(line), stdin) == NULL)
+        use_stdin = 0;
+      else if (fakeserv_command(line) == -1)
+        break;
+      fflush(stdout);
+    }
+  }
+
+  fakeserv_close();
+  garena_fini();
+  return 0;
+}
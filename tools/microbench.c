@@ -0,0 +1,379 @@
+/**
+ * @file
+ *
+ * garena-microbench: microbenchmarks of the library containers and codecs, at the sizes
+ * seen in practice (300-member rooms, 1024-packet connection windows).
+ * Each benchmark is run with a doubling number of iterations until it lasts at least the
+ * minimal time, and the time per operation is reported.
+ *
+ * Usage: garena-microbench [-f filter] [-m min_msec] [-j]
+ * With -f, only the benchmarks whose name contains the filter are run. With -j, the
+ * results are printed as JSON (one object per line).
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/util.h>
+#include <garena/gcrp.h>
+#include <garena/gsp.h>
+#include <garena/ghl.h>
+#include <garena/private.h>
+
+#define MB_ROOM_SIZE 300
+#define MB_WINDOW 1024
+#define MB_TALK_LEN 128
+
+typedef struct {
+  const char *name;
+  int (*setup)(void);
+  unsigned long (*run)(unsigned long iters); /* returns the number of operations done */
+} mb_bench_t;
+
+static volatile unsigned long sink; /* keeps the results alive */
+static uint64_t mb_rng = 0x9E3779B97F4A7C15ULL;
+
+static unsigned int user_ids[MB_ROOM_SIZE];
+static ihash_t hash;
+static llist_t list;
+static ghl_ch_pkt_t pkts[MB_WINDOW];
+static int shuffled[MB_WINDOW];
+static gcrp_member_t gcrp_members[MB_ROOM_SIZE];
+static ghl_member_t members[MB_ROOM_SIZE];
+static char talk[(MB_TALK_LEN + 1) * 2];
+static gsp_handtab_t *gsp_htab;
+static unsigned char gsp_key[GSP_KEYSIZE];
+static unsigned char gsp_iv[GSP_IVSIZE];
+static char gsp_small[GSP_MAX_MSGSIZE];
+static char gsp_large[GSP_MAX_MSGSIZE];
+static unsigned int gsp_small_len;
+static unsigned int gsp_large_len;
+
+static uint32_t mb_random(void) {
+  mb_rng ^= mb_rng >> 12;
+  mb_rng ^= mb_rng << 25;
+  mb_rng ^= mb_rng >> 27;
+  return (mb_rng * 2685821657736338717ULL) >> 32;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* containers */
+
+static int setup_ids(void) {
+  unsigned int i;
+  for (i = 0; i < MB_ROOM_SIZE; i++)
+    user_ids[i] = mb_random();
+  return 0;
+}
+
+static unsigned long run_ihash_put_del(unsigned long iters) {
+  unsigned long n;
+  unsigned int i;
+  for (n = 0; n < iters; n++) {
+    for (i = 0; i < MB_ROOM_SIZE; i++)
+      ihash_put(hash, user_ids[i], &user_ids[i]);
+    for (i = 0; i < MB_ROOM_SIZE; i++)
+      ihash_del(hash, user_ids[i]);
+  }
+  return iters * MB_ROOM_SIZE * 2;
+}
+
+static int setup_ihash_get(void) {
+  unsigned int i;
+  for (i = 0; i < MB_ROOM_SIZE; i++) {
+    if (ihash_put(hash, user_ids[i], &user_ids[i]) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static unsigned long run_ihash_get(unsigned long iters) {
+  unsigned long n;
+  unsigned int i;
+  for (n = 0; n < iters; n++) {
+    for (i = 0; i < MB_ROOM_SIZE; i++)
+      sink += (ihash_get(hash, user_ids[i]) != NULL);
+  }
+  return iters * MB_ROOM_SIZE;
+}
+
+static unsigned long run_ihash_iter(unsigned long iters) {
+  unsigned long n;
+  ihashitem_t iter;
+  for (n = 0; n < iters; n++) {
+    for (iter = ihash_iter(hash); iter; iter = ihash_next(hash, iter))
+      sink += *(unsigned int *) ihash_val(iter);
+  }
+  return iters * MB_ROOM_SIZE;
+}
+
+static unsigned long run_llist(unsigned long iters) {
+  unsigned long n;
+  unsigned int i;
+  cell_t iter;
+  for (n = 0; n < iters; n++) {
+    for (i = 0; i < MB_ROOM_SIZE; i++)
+      llist_add_tail(list, &user_ids[i]);
+    for (iter = llist_iter(list); iter; iter = llist_next(iter))
+      sink += *(unsigned int *) llist_val(iter);
+    for (i = 0; i < MB_ROOM_SIZE; i++)
+      llist_del_item(list, &user_ids[i]);
+  }
+  return iters * MB_ROOM_SIZE;
+}
+
+/* connection queues */
+
+static int setup_pkts(void) {
+  unsigned int i;
+  unsigned int j;
+  int tmp;
+  for (i = 0; i < MB_WINDOW; i++) {
+    memset(&pkts[i], 0, sizeof(ghl_ch_pkt_t));
+    pkts[i].seq = i;
+    shuffled[i] = i;
+  }
+  for (i = MB_WINDOW - 1; i > 0; i--) {
+    j = mb_random() % (i + 1);
+    tmp = shuffled[i];
+    shuffled[i] = shuffled[j];
+    shuffled[j] = tmp;
+  }
+  return 0;
+}
+
+static unsigned long run_insert_pkt_order(unsigned long iters, int order) {
+  ilist_t queue;
+  unsigned long n;
+  unsigned int i;
+  for (n = 0; n < iters; n++) {
+    ilist_init(&queue);
+    for (i = 0; i < MB_WINDOW; i++) {
+      if (order == 0)
+        sink += ghl_insert_pkt(&queue, &pkts[i]);
+      else if (order == 1)
+        sink += ghl_insert_pkt(&queue, &pkts[MB_WINDOW - 1 - i]);
+      else
+        sink += ghl_insert_pkt(&queue, &pkts[shuffled[i]]);
+    }
+  }
+  return iters * MB_WINDOW;
+}
+
+static unsigned long run_insert_pkt_in_order(unsigned long iters) {
+  return run_insert_pkt_order(iters, 0);
+}
+
+static unsigned long run_insert_pkt_reverse(unsigned long iters) {
+  return run_insert_pkt_order(iters, 1);
+}
+
+static unsigned long run_insert_pkt_shuffled(unsigned long iters) {
+  return run_insert_pkt_order(iters, 2);
+}
+
+/* codecs */
+
+static int setup_members(void) {
+  unsigned int i;
+  memset(gcrp_members, 0, sizeof(gcrp_members));
+  for (i = 0; i < MB_ROOM_SIZE; i++) {
+    gcrp_members[i].user_id = mb_random();
+    snprintf(gcrp_members[i].name, sizeof(gcrp_members[i].name), "member%u", i);
+    memcpy(gcrp_members[i].country, "FR", 2);
+    gcrp_members[i].level = i % 100;
+    gcrp_members[i].external_port = mb_random();
+    gcrp_members[i].internal_port = mb_random();
+  }
+  return 0;
+}
+
+static unsigned long run_member_extract(unsigned long iters) {
+  unsigned long n;
+  unsigned int i;
+  for (n = 0; n < iters; n++) {
+    for (i = 0; i < MB_ROOM_SIZE; i++)
+      ghl_member_extract(&members[i], &gcrp_members[i]);
+    sink += members[n % MB_ROOM_SIZE].user_id;
+  }
+  return iters * MB_ROOM_SIZE;
+}
+
+static int setup_talk(void) {
+  unsigned int i;
+  memset(talk, 0, sizeof(talk));
+  for (i = 0; i < MB_TALK_LEN; i++)
+    talk[i << 1] = 'a' + (i % 26);
+  return 0;
+}
+
+static unsigned long run_gcrp_tochar(unsigned long iters) {
+  char buf[MB_TALK_LEN + 1];
+  unsigned long n;
+  for (n = 0; n < iters; n++) {
+    gcrp_tochar(buf, talk, sizeof(buf));
+    sink += buf[n % MB_TALK_LEN];
+  }
+  return iters;
+}
+
+static int gsp_nop(int type, void *payload, unsigned int length, void *privdata) {
+  sink += length;
+  return 0;
+}
+
+/* encrypts a message with gsp_output(), through a socket pair */
+static int gsp_encrypt(char *buf, unsigned int payload_len, unsigned int *length) {
+  char payload[GSP_MAX_MSGSIZE];
+  int fds[2];
+  int r;
+
+  memset(payload, 0x5A, payload_len);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    return -1;
+  r = gsp_output(fds[0], GSP_MSG_HELLO, payload, payload_len, gsp_key, gsp_iv);
+  if (r != -1)
+    r = read(fds[1], buf, GSP_MAX_MSGSIZE);
+  close(fds[0]);
+  close(fds[1]);
+  if (r <= 0)
+    return -1;
+  *length = r;
+  return 0;
+}
+
+static int setup_gsp(void) {
+  unsigned int i;
+  if (gsp_htab == NULL) {
+    gsp_htab = gsp_alloc_handtab();
+    if ((gsp_htab == NULL) || (gsp_register_handler(gsp_htab, GSP_MSG_HELLO, gsp_nop, NULL) == -1))
+      return -1;
+  }
+  for (i = 0; i < GSP_KEYSIZE; i++)
+    gsp_key[i] = mb_random();
+  for (i = 0; i < GSP_IVSIZE; i++)
+    gsp_iv[i] = mb_random();
+  if (gsp_encrypt(gsp_small, 64, &gsp_small_len) == -1)
+    return -1;
+  return gsp_encrypt(gsp_large, 1024, &gsp_large_len);
+}
+
+static unsigned long run_gsp_input_small(unsigned long iters) {
+  unsigned long n;
+  for (n = 0; n < iters; n++)
+    gsp_input(gsp_htab, gsp_small, gsp_small_len, gsp_key, gsp_iv);
+  return iters;
+}
+
+static unsigned long run_gsp_input_large(unsigned long iters) {
+  unsigned long n;
+  for (n = 0; n < iters; n++)
+    gsp_input(gsp_htab, gsp_large, gsp_large_len, gsp_key, gsp_iv);
+  return iters;
+}
+
+static mb_bench_t benches[] = {
+  {"ihash_put_del/300", setup_ids, run_ihash_put_del},
+  {"ihash_get/300", setup_ihash_get, run_ihash_get},
+  {"ihash_iter/300", NULL, run_ihash_iter},
+  {"llist_add_iter_del/300", NULL, run_llist},
+  {"insert_pkt/1024/in_order", setup_pkts, run_insert_pkt_in_order},
+  {"insert_pkt/1024/reverse", NULL, run_insert_pkt_reverse},
+  {"insert_pkt/1024/shuffled", NULL, run_insert_pkt_shuffled},
+  {"member_extract/300", setup_members, run_member_extract},
+  {"gcrp_tochar/128", setup_talk, run_gcrp_tochar},
+  {"gsp_input/64", setup_gsp, run_gsp_input_small},
+  {"gsp_input/1024", NULL, run_gsp_input_large},
+};
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-f filter] [-m min_msec] [-j]\n", name);
+  fprintf(stderr, "  -f: only run the benchmarks whose name contains filter\n");
+  fprintf(stderr, "  -m: minimal duration of each benchmark (default: 200 msec)\n");
+  fprintf(stderr, "  -j: print the results as JSON\n");
+  exit(-1);
+}
+
+int main(int argc, char **argv) {
+  char *filter = NULL;
+  unsigned int min_ms = 200;
+  int json = 0;
+  unsigned long iters;
+  unsigned long ops;
+  uint64_t start;
+  uint64_t elapsed;
+  unsigned int i;
+  int c;
+
+  while ((c = getopt(argc, argv, "f:m:j")) != -1) {
+    switch(c) {
+      case 'f':
+        filter = optarg;
+        break;
+      case 'm':
+        min_ms = atoi(optarg);
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc)
+    usage(argv[0]);
+
+  if (garena_init() == -1) {
+    garena_perror("garena_init");
+    return -1;
+  }
+  /* gsp_input() logs every message */
+  fclose(deb);
+  deb = fopen("/dev/null", "w");
+  hash = ihash_init();
+  list = llist_alloc();
+  if ((hash == NULL) || (list == NULL)) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  /* the setups are run in order even for filtered out benchmarks, since some depend on others */
+  for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (benches[i].setup && (benches[i].setup() == -1)) {
+      fprintf(stderr, "%s: setup failed\n", benches[i].name);
+      return -1;
+    }
+    if (filter && (strstr(benches[i].name, filter) == NULL))
+      continue;
+    iters = 1;
+    while (1) {
+      start = now_ns();
+      ops = benches[i].run(iters);
+      elapsed = now_ns() - start;
+      if (elapsed >= (uint64_t) min_ms * 1000000)
+        break;
+      iters <<= 1;
+    }
+    if (json)
+      printf("{\"name\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.2f}\n", benches[i].name, ops, (double) elapsed / ops);
+    else
+      printf("%-28s %12lu ops %10.2f ns/op\n", benches[i].name, ops, (double) elapsed / ops);
+    fflush(stdout);
+  }
+
+  ihash_free(hash);
+  llist_free(list);
+  garena_fini();
+  return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file
+ *
+ * A minimal GP2PP relay, for use with ghl_set_relay().
+ * Peers announce their address with the periodic registrations (GP2PP_MSG_RELAY
+ * messages with a to_id of 0), and the relay forwards the other messages to the peer
+ * designated by their to_id field.
+ * A user_id stays bound to the address that registered it until the registration
+ * expires, and only messages coming from that address are forwarded. This is not
+ * authentication (anyone can register an unused user_id), only protection against
+ * hijacking the user_id of a registered peer.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <garena/garena.h>
+#include <garena/gp2pp.h>
+#include <garena/util.h>
+#include <garena/ghl.h>
+
+/* a registration expires after three missed refreshes */
+#define RELAY_REG_EXPIRE (3 * GHL_RELAY_REGISTER_INTERVAL)
+
+typedef struct {
+  struct sockaddr_in addr;
+  gtime_t last_reg; /* in milliseconds, see garena_now_ms() */
+} relay_peer_t;
+
+static int same_addr(struct sockaddr_in *a, struct sockaddr_in *b) {
+  return (a->sin_addr.s_addr == b->sin_addr.s_addr) && (a->sin_port == b->sin_port);
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [port]\n", name);
+  fprintf(stderr, "Default port: %u\n", GP2PP_PORT);
+  exit(-1);
+}
+
+int main(int argc, char **argv) {
+  char buf[GP2PP_MAX_MSGSIZE];
+  gp2pp_hdr_t *hdr = (gp2pp_hdr_t *) buf;
+  gp2pp_relay_t *relay = (gp2pp_relay_t *) (buf + sizeof(gp2pp_hdr_t));
+  struct sockaddr_in local;
+  struct sockaddr_in remote;
+  relay_peer_t *peer;
+  relay_peer_t *dest;
+  socklen_t fromlen;
+  ihash_t peers;
+  unsigned int from_id;
+  unsigned int to_id;
+  int port = GP2PP_PORT;
+  int sock;
+  int r;
+
+  if (argc > 2)
+    usage(argv[0]);
+  if (argc == 2) {
+    port = atoi(argv[1]);
+    if ((port <= 0) || (port > 65535))
+      usage(argv[0]);
+  }
+
+  peers = ihash_init();
+  if (peers == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  sock = socket(PF_INET, SOCK_DGRAM, 0);
+  if (sock == -1) {
+    perror("socket");
+    return -1;
+  }
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  local.sin_addr.s_addr = INADDR_ANY;
+  if (bind(sock, (struct sockaddr *) &local, sizeof(local)) == -1) {
+    perror("bind");
+    return -1;
+  }
+  printf("Relaying on UDP port %u\n", port);
+
+  while (1) {
+    fromlen = sizeof(remote);
+    r = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &remote, &fromlen);
+    if (r == -1) {
+      perror("recvfrom");
+      continue;
+    }
+    if ((r < sizeof(gp2pp_hdr_t) + sizeof(gp2pp_relay_t)) || (hdr->msgtype != GP2PP_MSG_RELAY))
+      continue;
+    from_id = ghtonl(hdr->user_id);
+    to_id = ghtonl(relay->to_id);
+
+    peer = ihash_get(peers, from_id);
+    if (to_id == 0) {
+      /* registration */
+      if (peer == NULL) {
+        peer = malloc(sizeof(relay_peer_t));
+        if ((peer == NULL) || (ihash_put(peers, from_id, peer) == -1)) {
+          fprintf(stderr, "Out of memory\n");
+          free(peer);
+          continue;
+        }
+        peer->last_reg = 0;
+      } else if (!same_addr(&peer->addr, &remote) && (garena_now_ms() - peer->last_reg < RELAY_REG_EXPIRE)) {
+        printf("Refused registration of user %x from %s:%u, already registered\n", from_id, inet_ntoa(remote.sin_addr), htons(remote.sin_port));
+        fflush(stdout);
+        continue;
+      }
+      if ((peer->last_reg == 0) || !same_addr(&peer->addr, &remote)) {
+        printf("User %x is at %s:%u\n", from_id, inet_ntoa(remote.sin_addr), htons(remote.sin_port));
+        fflush(stdout);
+      }
+      peer->addr = remote;
+      peer->last_reg = garena_now_ms();
+      continue;
+    }
+
+    if ((peer == NULL) || !same_addr(&peer->addr, &remote)) {
+      printf("Dropped message from unregistered user %x at %s:%u\n", from_id, inet_ntoa(remote.sin_addr), htons(remote.sin_port));
+      fflush(stdout);
+      continue;
+    }
+    dest = ihash_get(peers, to_id);
+    if (dest == NULL) {
+      printf("Dropped message from %x to unknown user %x\n", from_id, to_id);
+      fflush(stdout);
+      continue;
+    }
+    if (sendto(sock, buf, r, 0, (struct sockaddr *) &dest->addr, sizeof(struct sockaddr_in)) == -1)
+      perror("sendto");
+  }
+  return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file
+ *
+ * garena-replay: replays a trace recorded with ghl_trace_start() (or the GARENA_TRACE
+ * environment variable), as fast as possible, to measure the library processing cost
+ * on a reproducible input (see trace.c).
+ *
+ * The trace is replayed several times. Reported: records replayed (by type), events
+ * signaled, records that could not be applied, and the processing time per record (best
+ * and mean iteration). The iterations must end in exactly the same state, otherwise the
+ * replay is not deterministic and the exit status is 2. With -j, the results are printed
+ * as a single JSON object, for regression tracking.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <garena/garena.h>
+#include <garena/error.h>
+#include <garena/ghl.h>
+#include <garena/trace.h>
+
+static const char *record_names[GHL_TRACE_NUM] = {
+  "session", "gsp_in", "gcrp_in", "gp2pp_in", "join", "leave", "connect", "send", "close", "relay"
+};
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-n iterations] [-d] [-j] trace\n", name);
+  fprintf(stderr, "  -n: number of replays (default: 5)\n");
+  fprintf(stderr, "  -d: keep the library debug log (slower)\n");
+  fprintf(stderr, "  -j: print the results as JSON\n");
+  exit(-1);
+}
+
+int main(int argc, char **argv) {
+  unsigned int iterations = 5;
+  int keep_log = 0;
+  int json = 0;
+  int deterministic = 1;
+  ghl_replay_stats_t first;
+  ghl_replay_stats_t cur;
+  uint64_t best_ns = 0;
+  uint64_t total_ns = 0;
+  uint64_t records = 0;
+  uint64_t events = 0;
+  unsigned int i;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:dj")) != -1) {
+    switch(c) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      case 'd':
+        keep_log = 1;
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if ((optind != argc - 1) || (iterations == 0))
+    usage(argv[0]);
+
+  if (garena_init() == -1) {
+    garena_perror("garena_init");
+    return -1;
+  }
+  if (!keep_log) {
+    /* the library logs every segment, which would dominate the measurements */
+    fclose(deb);
+    deb = fopen("/dev/null", "w");
+  }
+
+  for (i = 0; i < iterations; i++) {
+    if (ghl_replay(argv[optind], i ? &cur : &first) == -1) {
+      garena_perror(argv[optind]);
+      return -1;
+    }
+    if (i == 0) {
+      best_ns = first.elapsed_ns;
+      total_ns = first.elapsed_ns;
+      continue;
+    }
+    if (cur.elapsed_ns < best_ns)
+      best_ns = cur.elapsed_ns;
+    total_ns += cur.elapsed_ns;
+    cur.elapsed_ns = first.elapsed_ns;
+    if (memcmp(&cur, &first, sizeof(cur)))
+      deterministic = 0;
+  }
+  for (i = 0; i < GHL_TRACE_NUM; i++)
+    records += first.records[i];
+  for (i = 0; i < GHL_EV_NUM; i++)
+    events += first.events[i];
+
+  if (json) {
+    printf("{\"iterations\": %u, \"records\": %llu, \"events\": %llu, \"skipped\": %llu, \"trace_s\": %.3f, "
+           "\"best_ms\": %.3f, \"mean_ms\": %.3f, \"ns_per_record\": %.1f, \"records_per_s\": %.0f, "
+           "\"deterministic\": %s", iterations, (unsigned long long) records, (unsigned long long) events,
+           (unsigned long long) first.skipped, first.duration_ms / 1e3, best_ns / 1e6, total_ns / 1e6 / iterations,
+           records ? (double) best_ns / records : 0.0, best_ns ? records / (best_ns / 1e9) : 0.0,
+           deterministic ? "true" : "false");
+    for (i = 0; i < GHL_TRACE_NUM; i++)
+      printf(", \"%s\": %llu", record_names[i], (unsigned long long) first.records[i]);
+    printf("}\n");
+  } else {
+    printf("records: %llu (", (unsigned long long) records);
+    for (i = 0; i < GHL_TRACE_NUM; i++)
+      printf("%s%s %llu", i ? ", " : "", record_names[i], (unsigned long long) first.records[i]);
+    printf("), %llu skipped\n", (unsigned long long) first.skipped);
+    printf("trace: %.3f s, %llu events, %llu timer runs%s\n", first.duration_ms / 1e3, (unsigned long long) events,
+           (unsigned long long) first.timer_runs, first.freed ? ", server handle freed before the end" : "");
+    printf("replay: best %.3f ms, mean %.3f ms over %u iteration(s)\n", best_ns / 1e6, total_ns / 1e6 / iterations, iterations);
+    printf("cpu: %.1f ns/record, %.0f records/s\n", records ? (double) best_ns / records : 0.0, best_ns ? records / (best_ns / 1e9) : 0.0);
+    printf("deterministic: %s\n", deterministic ? "yes" : "NO, the iterations ended in different states");
+  }
+  garena_fini();
+  return deterministic ? 0 : 2;
+}